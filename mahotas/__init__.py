@@ -17,6 +17,7 @@ try:
     from .labeled import border, borders, bwperim, label, labeled_sum
     from .features.moments import moments
     from .morph import cerode, close, close_holes, get_structuring_elem, dilate, hitmiss, erode, cwatershed, majority_filter, open, regmin, regmax
+    from .parallel import get_num_threads, set_num_threads
     from .resize import imresize
     from .stretch import stretch, as_rgb
     from .thin import thin
@@ -66,6 +67,7 @@ __all__ = [
     'fullhistogram',
     'gaussian_filter',
     'gaussian_filter1d',
+    'get_num_threads',
     'get_structuring_elem',
     'haar',
     'ihaar',
@@ -80,6 +82,7 @@ __all__ = [
     'otsu',
     'rank_filter',
     'rc',
+    'set_num_threads',
     'sobel',
     'stretch',
     'template_match',
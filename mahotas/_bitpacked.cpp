@@ -0,0 +1,416 @@
+// Copyright (C) 2012 Luis Pedro Coelho <luis@luispedro.org>
+//
+// License: MIT (Check COPYING file)
+
+#include <algorithm>
+#include <vector>
+
+#include "_bitpacked.h"
+#include "parallel.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+packed_array::packed_array(const int nd, const npy_intp* dims)
+    :nd_(nd)
+    ,nrows_(1)
+    {
+        std::copy(dims, dims + nd, dims_);
+        for (int d = nd - 2; d >= 0; --d) {
+            row_strides_[d] = nrows_;
+            nrows_ *= dims[d];
+        }
+        const npy_intp n = dims[nd - 1];
+        row_words_ = (n + bitword_bits - 1)/bitword_bits;
+        last_mask_ = (n % bitword_bits ? (bitword(1) << (n % bitword_bits)) - 1 : ~bitword(0));
+        data_.resize(nrows_ * row_words_);
+    }
+
+npy_intp packed_array::byte_offset(PyArrayObject* array, npy_intp r) const {
+    npy_intp offset = 0;
+    for (int d = nd_ - 2; d >= 0; --d) {
+        offset += (r % dims_[d]) * PyArray_STRIDE(array, d);
+        r /= dims_[d];
+    }
+    return offset;
+}
+
+void packed_array::fill(const bool value) {
+    std::fill(data_.begin(), data_.end(), (value ? ~bitword(0) : bitword(0)));
+    if (value && row_words_) {
+        for (npy_intp r = 0; r != nrows_; ++r) row(r)[row_words_ - 1] &= last_mask_;
+    }
+}
+
+bool packed_array::any() const {
+    for (std::vector<bitword>::const_iterator w = data_.begin(), past = data_.end(); w != past; ++w) {
+        if (*w) return true;
+    }
+    return false;
+}
+
+void shift_bits(bitword* dst, const npy_intp dst_words, const bitword* src, const npy_intp src_words, const npy_intp k) {
+    // word i of dst is made of bits from words (i + ws) and (i + ws + 1) of src
+    const npy_intp ws = (k >= 0 ? k / bitword_bits : -((-k + bitword_bits - 1) / bitword_bits));
+    const int bs = int(k - ws * bitword_bits);
+    for (npy_intp i = 0; i != dst_words; ++i) {
+        const npy_intp j = i + ws;
+        const bitword lo = (j >= 0 && j < src_words ? src[j] : 0);
+        bitword word = lo >> bs;
+        if (bs) {
+            const bitword hi = (j + 1 >= 0 && j + 1 < src_words ? src[j + 1] : 0);
+            word |= hi << (bitword_bits - bs);
+        }
+        dst[i] = word;
+    }
+}
+
+namespace {
+
+inline
+bool get_bit(const bitword* row, const npy_intp i) {
+    return (row[i / bitword_bits] >> (i % bitword_bits)) & 1;
+}
+
+inline
+bitword bit_range_mask(const npy_intp a, const npy_intp b) {
+    // bits [a, b) of the word containing a (b is at most the end of that word)
+    const int s = a % bitword_bits;
+    const int len = int(b - a);
+    const bitword ones = (len == bitword_bits ? ~bitword(0) : (bitword(1) << len) - 1);
+    return ones << s;
+}
+
+// Sets bits [a, b) of row to value
+void fill_bits(bitword* row, npy_intp a, const npy_intp b, const bool value) {
+    while (a < b) {
+        const npy_intp e = std::min<npy_intp>(b, (a / bitword_bits + 1) * bitword_bits);
+        const bitword mask = bit_range_mask(a, e);
+        if (value) row[a / bitword_bits] |= mask;
+        else row[a / bitword_bits] &= ~mask;
+        a = e;
+    }
+}
+
+// Whether any of the bits [a, b) of row is set
+bool any_bits(const bitword* row, npy_intp a, const npy_intp b) {
+    while (a < b) {
+        const npy_intp e = std::min<npy_intp>(b, (a / bitword_bits + 1) * bitword_bits);
+        if (row[a / bitword_bits] & bit_range_mask(a, e)) return true;
+        a = e;
+    }
+    return false;
+}
+
+// dst[p] = src[clamp(p + o)]
+void gather_row(bitword* dst, const bitword* src, const npy_intp n, const npy_intp nwords, const bitword mask, const npy_intp o) {
+    shift_bits(dst, nwords, src, nwords, o);
+    if (o > 0) fill_bits(dst, std::max<npy_intp>(0, n - o), n, get_bit(src, n - 1));
+    if (o < 0) fill_bits(dst, 0, std::min<npy_intp>(n, -o), get_bit(src, 0));
+    dst[nwords - 1] &= mask;
+}
+
+// dst[q] = OR of src[p] for all p such that clamp(p + o) == q
+void scatter_row(bitword* dst, const bitword* src, const npy_intp n, const npy_intp nwords, const bitword mask, const npy_intp o) {
+    shift_bits(dst, nwords, src, nwords, -o);
+    if (o > 0 && any_bits(src, std::max<npy_intp>(0, n - 1 - o), n)) fill_bits(dst, n - 1, n, true);
+    if (o < 0 && any_bits(src, 0, std::min<npy_intp>(n, 1 - o))) fill_bits(dst, 0, 1, true);
+    dst[nwords - 1] &= mask;
+}
+
+inline
+npy_intp clamp(const npy_intp p, const npy_intp n) {
+    return (p < 0 ? 0 : (p >= n ? n - 1 : p));
+}
+
+// Splits row index r into its coordinates along the first nd-1 axes
+void row_coordinates(const packed_array& array, npy_intp r, npy_intp* coords) {
+    for (int d = array.ndims() - 2; d >= 0; --d) {
+        coords[d] = r % array.dim(d);
+        r /= array.dim(d);
+    }
+}
+
+npy_intp row_grain(const packed_array& array, const npy_intp cost) {
+    return std::max<npy_intp>(1, 16384/std::max<npy_intp>(1, cost * array.row_words()));
+}
+
+struct erode_into_worker {
+    erode_into_worker(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets)
+        :res_(res)
+        ,array_(array)
+        ,offsets_(offsets)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = array_.ndims();
+        const npy_intp n = array_.dim(nd - 1);
+        const npy_intp nwords = array_.row_words();
+        const npy_intp npoints = offsets_.size() / nd;
+        std::vector<bitword> buffer(nwords);
+        bitword* tmp = &buffer[0];
+        npy_intp coords[NPY_MAXDIMS];
+        for (npy_intp r = start; r != end; ++r) {
+            row_coordinates(array_, r, coords);
+            bitword* out = res_.row(r);
+            for (npy_intp j = 0; j != npoints; ++j) {
+                const npy_intp* offset = &offsets_[j*nd];
+                npy_intp sr = 0;
+                for (int d = 0; d != nd - 1; ++d) {
+                    sr += clamp(coords[d] + offset[d], array_.dim(d)) * array_.row_stride(d);
+                }
+                const bitword* src = array_.row(sr);
+                if (offset[nd - 1]) {
+                    gather_row(tmp, src, n, nwords, array_.last_mask(), offset[nd - 1]);
+                    src = tmp;
+                }
+                for (npy_intp w = 0; w != nwords; ++w) out[w] &= src[w];
+            }
+        }
+    }
+
+    packed_array& res_;
+    const packed_array& array_;
+    const std::vector<npy_intp>& offsets_;
+};
+
+struct dilate_into_worker {
+    dilate_into_worker(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets)
+        :res_(res)
+        ,array_(array)
+        ,offsets_(offsets)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = array_.ndims();
+        const npy_intp n = array_.dim(nd - 1);
+        const npy_intp nwords = array_.row_words();
+        const npy_intp npoints = offsets_.size() / nd;
+        std::vector<bitword> buffer(nwords);
+        bitword* tmp = &buffer[0];
+        npy_intp coords[NPY_MAXDIMS];
+        npy_intp lo[NPY_MAXDIMS];
+        npy_intp hi[NPY_MAXDIMS];
+        npy_intp cur[NPY_MAXDIMS];
+        for (npy_intp r = start; r != end; ++r) {
+            row_coordinates(array_, r, coords);
+            bitword* out = res_.row(r);
+            for (npy_intp j = 0; j != npoints; ++j) {
+                const npy_intp* offset = &offsets_[j*nd];
+                // Along each axis, the source coordinates which are mapped to
+                // coords[d] form the interval [lo[d], hi[d]] (which has more
+                // than one element only at the borders).
+                bool empty = false;
+                for (int d = 0; d != nd - 1; ++d) {
+                    const npy_intp dim = array_.dim(d);
+                    lo[d] = std::max<npy_intp>(0, (coords[d] == 0 ? 0 : coords[d] - offset[d]));
+                    hi[d] = std::min<npy_intp>(dim - 1, (coords[d] == dim - 1 ? dim - 1 : coords[d] - offset[d]));
+                    if (lo[d] > hi[d]) empty = true;
+                    cur[d] = lo[d];
+                }
+                if (empty) continue;
+                while (true) {
+                    npy_intp sr = 0;
+                    for (int d = 0; d != nd - 1; ++d) sr += cur[d] * array_.row_stride(d);
+                    const bitword* src = array_.row(sr);
+                    if (offset[nd - 1]) {
+                        scatter_row(tmp, src, n, nwords, array_.last_mask(), offset[nd - 1]);
+                        src = tmp;
+                    }
+                    for (npy_intp w = 0; w != nwords; ++w) out[w] |= src[w];
+
+                    int d = nd - 2;
+                    while (d >= 0 && cur[d] == hi[d]) {
+                        cur[d] = lo[d];
+                        --d;
+                    }
+                    if (d < 0) break;
+                    ++cur[d];
+                }
+            }
+        }
+    }
+
+    packed_array& res_;
+    const packed_array& array_;
+    const std::vector<npy_intp>& offsets_;
+};
+
+struct and_op {
+    static bitword apply(const bitword a, const bitword b) { return a & b; }
+};
+
+struct or_op {
+    static bitword apply(const bitword a, const bitword b) { return a | b; }
+};
+
+// Along the last axis: doubling on the row extended (with its border values)
+// to cover [first, last] for every position: after step i, bit j of the
+// buffer combines 2^i consecutive bits.
+template <typename Op>
+struct box_row_worker {
+    box_row_worker(packed_array& array, const npy_intp first, const npy_intp last)
+        :array_(array)
+        ,first_(first)
+        ,last_(last)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const npy_intp n = array_.dim(array_.ndims() - 1);
+        const npy_intp nwords = array_.row_words();
+        const npy_intp w = last_ - first_ + 1;
+        const npy_intp m = n + w - 1;
+        const npy_intp mwords = (m + bitword_bits - 1)/bitword_bits;
+        std::vector<bitword> buffer(2*mwords);
+        bitword* extended = &buffer[0];
+        bitword* tmp = &buffer[mwords];
+        for (npy_intp r = start; r != end; ++r) {
+            bitword* row = array_.row(r);
+            // extended[j] = row[clamp(j + first)]
+            shift_bits(extended, mwords, row, nwords, first_);
+            if (first_ < 0) fill_bits(extended, 0, std::min<npy_intp>(m, -first_), get_bit(row, 0));
+            fill_bits(extended, std::max<npy_intp>(0, n - first_), m, get_bit(row, n - 1));
+
+            npy_intp k = 1;
+            while (2*k <= w) {
+                shift_bits(tmp, mwords, extended, mwords, k);
+                for (npy_intp i = 0; i != mwords; ++i) extended[i] = Op::apply(extended[i], tmp[i]);
+                k *= 2;
+            }
+            // k <= w < 2k, so [j, j + w) is covered by [j, j + k) & [j + w - k, j + w)
+            shift_bits(tmp, nwords, extended, mwords, w - k);
+            for (npy_intp i = 0; i != nwords; ++i) row[i] = Op::apply(extended[i], tmp[i]);
+            row[nwords - 1] &= array_.last_mask();
+        }
+    }
+
+    packed_array& array_;
+    const npy_intp first_;
+    const npy_intp last_;
+};
+
+// Along the other axes: van Herk/Gil-Werman on whole rows (in chunks of
+// chunk_words words so that the buffers stay small).
+const npy_intp chunk_words = 8;
+
+template <typename Op>
+struct box_axis_worker {
+    box_axis_worker(packed_array& array, const int axis, const npy_intp first, const npy_intp last)
+        :array_(array)
+        ,axis_(axis)
+        ,first_(first)
+        ,last_(last)
+        ,nchunks_((array.row_words() + chunk_words - 1)/chunk_words)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const npy_intp n = array_.dim(axis_);
+        const npy_intp stride = array_.row_stride(axis_);
+        const npy_intp w = last_ - first_ + 1;
+        const npy_intp m = n + w - 1;
+        std::vector<bitword> buffer(3*m*chunk_words);
+        bitword* extended = &buffer[0];
+        bitword* prefix = &buffer[m*chunk_words];
+        bitword* suffix = &buffer[2*m*chunk_words];
+        for (npy_intp t = start; t != end; ++t) {
+            const npy_intp line = t / nchunks_;
+            const npy_intp w0 = (t % nchunks_) * chunk_words;
+            const npy_intp cw = std::min<npy_intp>(chunk_words, array_.row_words() - w0);
+            const npy_intp r0 = (line / stride) * stride * n + line % stride;
+
+            for (npy_intp j = 0; j != m; ++j) {
+                const bitword* src = array_.row(r0 + clamp(j + first_, n) * stride) + w0;
+                std::copy(src, src + cw, extended + j*chunk_words);
+            }
+            for (npy_intp b = 0; b < m; b += w) {
+                const npy_intp e = std::min(b + w, m);
+                for (npy_intp j = b; j != e; ++j) {
+                    for (npy_intp i = 0; i != cw; ++i) {
+                        const bitword v = extended[j*chunk_words + i];
+                        prefix[j*chunk_words + i] = (j == b ? v : Op::apply(prefix[(j-1)*chunk_words + i], v));
+                    }
+                }
+                for (npy_intp j = e - 1; j >= b; --j) {
+                    for (npy_intp i = 0; i != cw; ++i) {
+                        const bitword v = extended[j*chunk_words + i];
+                        suffix[j*chunk_words + i] = (j == e - 1 ? v : Op::apply(suffix[(j+1)*chunk_words + i], v));
+                    }
+                }
+            }
+            for (npy_intp j = 0; j != n; ++j) {
+                bitword* out = array_.row(r0 + j*stride) + w0;
+                for (npy_intp i = 0; i != cw; ++i) {
+                    out[i] = Op::apply(suffix[j*chunk_words + i], prefix[(j + w - 1)*chunk_words + i]);
+                }
+            }
+        }
+    }
+
+    packed_array& array_;
+    const int axis_;
+    const npy_intp first_;
+    const npy_intp last_;
+    const npy_intp nchunks_;
+};
+
+template <typename Op>
+void box(packed_array& array, const npy_intp* first, const npy_intp* last) {
+    const int nd = array.ndims();
+    if (!array.nrows() || !array.row_words()) return;
+    for (int d = 0; d != nd; ++d) {
+        if (first[d] == 0 && last[d] == 0) continue;
+        if (d == nd - 1) {
+            box_row_worker<Op> worker(array, first[d], last[d]);
+            parallel_for(array.nrows(), worker, row_grain(array, 2));
+        } else {
+            box_axis_worker<Op> worker(array, d, first[d], last[d]);
+            const npy_intp nlines = array.nrows() / array.dim(d);
+            parallel_for(nlines * worker.nchunks_, worker, std::max<npy_intp>(1, 2048/(array.dim(d) * chunk_words)));
+        }
+    }
+}
+
+} // namespace
+
+void erode_into(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets) {
+    if (!array.nrows() || !array.row_words()) return;
+    erode_into_worker worker(res, array, offsets);
+    parallel_for(array.nrows(), worker, row_grain(array, offsets.size()/array.ndims()));
+}
+
+void dilate_into(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets) {
+    if (!array.nrows() || !array.row_words()) return;
+    dilate_into_worker worker(res, array, offsets);
+    parallel_for(array.nrows(), worker, row_grain(array, offsets.size()/array.ndims()));
+}
+
+void erode_box(packed_array& array, const npy_intp* first, const npy_intp* last) {
+    box<and_op>(array, first, last);
+}
+
+void dilate_box(packed_array& array, const npy_intp* first, const npy_intp* last) {
+    box<or_op>(array, first, last);
+}
+
+void clear_border(packed_array& array, const npy_intp* before, const npy_intp* after) {
+    const int nd = array.ndims();
+    const npy_intp n = array.dim(nd - 1);
+    if (!array.row_words()) return;
+    npy_intp coords[NPY_MAXDIMS];
+    for (npy_intp r = 0; r != array.nrows(); ++r) {
+        row_coordinates(array, r, coords);
+        bitword* row = array.row(r);
+        bool border = false;
+        for (int d = 0; d != nd - 1; ++d) {
+            if (coords[d] < before[d] || coords[d] > array.dim(d) - 1 - after[d]) border = true;
+        }
+        if (border) {
+            std::fill(row, row + array.row_words(), bitword(0));
+        } else {
+            fill_bits(row, 0, std::min(n, before[nd - 1]), false);
+            fill_bits(row, std::max<npy_intp>(0, n - after[nd - 1]), n, false);
+        }
+    }
+}
@@ -0,0 +1,205 @@
+#ifndef MAHOTAS_BITPACKED_H_INCLUDE_GUARD_LPC_
+#define MAHOTAS_BITPACKED_H_INCLUDE_GUARD_LPC_
+// Part of mahotas. See LICENSE file for License
+// Copyright 2012 Luis Pedro Coelho <luis@luispedro.org>
+
+// Bit-packed binary arrays
+//
+// A packed_array stores a binary N-D array using one bit per element. The
+// array is seen as a set of rows (the lines along the last axis) and each
+// row starts on a new word. Moving along any axis but the last is, therefore,
+// a matter of moving whole rows, while moving along the last axis is done
+// with shifts, 64 elements at a time.
+//
+// Bits past the end of a row are always zero (all the functions below
+// preserve this).
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "parallel.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+typedef npy_uint64 bitword;
+const int bitword_bits = 64;
+
+struct packed_array {
+    packed_array(const int nd, const npy_intp* dims);
+
+    int ndims() const { return nd_; }
+    npy_intp dim(const int d) const { return dims_[d]; }
+    npy_intp nrows() const { return nrows_; }
+    npy_intp row_words() const { return row_words_; }
+    // Number of rows between consecutive elements along axis d (d < nd-1)
+    npy_intp row_stride(const int d) const { return row_strides_[d]; }
+    // Mask of the valid bits in the last word of each row
+    bitword last_mask() const { return last_mask_; }
+
+    bitword* row(const npy_intp r) { return &data_[r*row_words_]; }
+    const bitword* row(const npy_intp r) const { return &data_[r*row_words_]; }
+
+    // Byte offset of the start of row r in an array of the same shape
+    npy_intp byte_offset(PyArrayObject* array, npy_intp r) const;
+
+    void fill(const bool value);
+    bool any() const;
+
+    private:
+        int nd_;
+        npy_intp dims_[NPY_MAXDIMS];
+        npy_intp row_strides_[NPY_MAXDIMS];
+        npy_intp nrows_;
+        npy_intp row_words_;
+        bitword last_mask_;
+        std::vector<bitword> data_;
+};
+
+// Arrays of 1-byte elements are (un)packed 8 elements at a time
+#if NPY_BYTE_ORDER == NPY_LITTLE_ENDIAN
+#define MAHOTAS_BITPACKED_BYTES
+#endif
+
+// Bits i (0 <= i < 8) of the result are set if p[i] == value
+inline bitword pack_bytes(const char* p, const unsigned char value) {
+    bitword x;
+    std::memcpy(&x, p, sizeof(x));
+    x ^= value * 0x0101010101010101ULL;
+    // the high bit of each byte is set iff that byte is not zero
+    x = ((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x;
+    x = (~x & 0x8080808080808080ULL) >> 7;
+    return (x * 0x0102040810204080ULL) >> 56;
+}
+
+// Sets p[i] to bit i of bits (for 0 <= i < 8)
+inline void unpack_bytes(char* p, const unsigned bits) {
+    bitword x = (bits * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+    x = ((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x;
+    x = (x & 0x8080808080808080ULL) >> 7;
+    std::memcpy(p, &x, sizeof(x));
+}
+
+template <typename T>
+struct pack_worker {
+    pack_worker(packed_array& res, PyArrayObject* array, const T value)
+        :res_(res)
+        ,array_(array)
+        ,value_(value)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = res_.ndims();
+        const npy_intp n = res_.dim(nd - 1);
+        const npy_intp stride = PyArray_STRIDE(array_, nd - 1);
+        const char* data = static_cast<const char*>(PyArray_DATA(array_));
+#ifdef MAHOTAS_BITPACKED_BYTES
+        const bool bytes = (sizeof(T) == 1 && stride == 1);
+#else
+        const bool bytes = false;
+#endif
+        for (npy_intp r = start; r != end; ++r) {
+            const char* pos = data + res_.byte_offset(array_, r);
+            bitword* out = res_.row(r);
+            for (npy_intp w = 0; w != res_.row_words(); ++w) {
+                const npy_intp wend = std::min<npy_intp>(n - w*bitword_bits, bitword_bits);
+                bitword word = 0;
+                npy_intp b = 0;
+                if (bytes) {
+                    for ( ; b + 8 <= wend; b += 8, pos += 8) {
+                        word |= pack_bytes(pos, static_cast<unsigned char>(value_)) << b;
+                    }
+                }
+                for ( ; b != wend; ++b, pos += stride) {
+                    word |= bitword(*reinterpret_cast<const T*>(pos) == value_) << b;
+                }
+                out[w] = word;
+            }
+        }
+    }
+
+    packed_array& res_;
+    PyArrayObject* const array_;
+    const T value_;
+};
+
+template <typename T>
+struct unpack_worker {
+    unpack_worker(const packed_array& array, PyArrayObject* res)
+        :array_(array)
+        ,res_(res)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = array_.ndims();
+        const npy_intp n = array_.dim(nd - 1);
+        const npy_intp stride = PyArray_STRIDE(res_, nd - 1);
+        char* data = static_cast<char*>(PyArray_DATA(res_));
+#ifdef MAHOTAS_BITPACKED_BYTES
+        const bool bytes = (sizeof(T) == 1 && stride == 1);
+#else
+        const bool bytes = false;
+#endif
+        for (npy_intp r = start; r != end; ++r) {
+            char* pos = data + array_.byte_offset(res_, r);
+            const bitword* in = array_.row(r);
+            npy_intp i = 0;
+            if (bytes) {
+                for ( ; i + 8 <= n; i += 8, pos += 8) {
+                    unpack_bytes(pos, unsigned(in[i/bitword_bits] >> (i % bitword_bits)) & 0xff);
+                }
+            }
+            for ( ; i != n; ++i, pos += stride) {
+                *reinterpret_cast<T*>(pos) = T((in[i/bitword_bits] >> (i % bitword_bits)) & 1);
+            }
+        }
+    }
+
+    const packed_array& array_;
+    PyArrayObject* const res_;
+};
+
+// Sets res[p] to (array[p] == value). array must have the same shape as res,
+// but need not be contiguous.
+template <typename T>
+void pack(packed_array& res, PyArrayObject* array, const T value) {
+    pack_worker<T> worker(res, array, value);
+    parallel_for(res.nrows(), worker, std::max<npy_intp>(1, 65536/std::max<npy_intp>(1, res.dim(res.ndims() - 1))));
+}
+
+// Writes array to res (as 0s & 1s)
+template <typename T>
+void unpack(const packed_array& array, PyArrayObject* res) {
+    unpack_worker<T> worker(array, res);
+    parallel_for(array.nrows(), worker, std::max<npy_intp>(1, 65536/std::max<npy_intp>(1, array.dim(array.ndims() - 1))));
+}
+
+// dst[p] = src[p + k] (0 if p + k is out of bounds). k may be negative.
+// dst & src must not overlap. Unlike the functions below, this does not clear
+// the bits past the end of the row (the caller needs to do it).
+void shift_bits(bitword* dst, const npy_intp dst_words, const bitword* src, const npy_intp src_words, const npy_intp k);
+
+// The following functions take a list of offsets (ndims() entries per point)
+// and apply the nearest boundary condition (i.e., offsets which fall outside
+// the array are clamped to its border, as the filter_iterator does with
+// EXTEND_NEAREST).
+
+// res[p] &= array[clamp(p + offset)] for every offset
+void erode_into(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets);
+
+// res[clamp(p + offset)] |= array[p] for every offset
+void dilate_into(packed_array& res, const packed_array& array, const std::vector<npy_intp>& offsets);
+
+// array[p] = AND (resp. OR) of array[clamp(p + o)] for o in [first, last]
+// (the number of word operations grows at most logarithmically with the size
+// of the box).
+void erode_box(packed_array& array, const npy_intp* first, const npy_intp* last);
+void dilate_box(packed_array& array, const npy_intp* first, const npy_intp* last);
+
+// Sets to zero all the elements whose coordinate along any axis d is smaller
+// than before[d] or larger than dim(d) - 1 - after[d].
+void clear_border(packed_array& array, const npy_intp* before, const npy_intp* after);
+
+#endif // MAHOTAS_BITPACKED_H_INCLUDE_GUARD_LPC_
@@ -2,10 +2,14 @@
 //
 // License: MIT (Check COPYING file)
 
+#include <cmath>
+
 #include "numpypp/array.hpp"
 #include "numpypp/dispatch.hpp"
 #include "utils.hpp"
+#include "parallel.hpp"
 #include "_filters.h"
+#include "_fft.h"
 
 extern "C" {
     #include <Python.h>
@@ -23,33 +27,79 @@ const char OutputErrorMsg[] =
 
 
 template<typename T>
-void convolve(numpy::aligned_array<T> array, numpy::aligned_array<T> filter, numpy::aligned_array<T> result, int mode) {
-    gil_release nogil;
-    const int N = array.size();
-    typename numpy::aligned_array<T>::iterator iter = array.begin();
-    filter_iterator<T> fiter(array.raw_array(), filter.raw_array(), ExtendMode(mode), true);
-    const int N2 = fiter.size();
-    T* out = result.data();
-
-    for (int i = 0; i != N; ++i, fiter.iterate_both(iter), ++out) {
-        // The reasons for using double instead of T:
-        //   (1) it is slightly faster (10%)
-        //   (2) it handles over/underflow better
-        //   (3) scipy.ndimage.convolve does it
-        // 
-        // Alternatively, we could have written:
-        // T cur = T();
-        // 
-        // and removed the double cast in double(val)*fiter[j] below.
-        double cur = 0.;
-        for (int j = 0; j != N2; ++j) {
-            T val;
-            if (fiter.retrieve(iter, j, val)) {
-                cur += double(val)*fiter[j];
+struct convolve_worker {
+    convolve_worker(numpy::aligned_array<T>& array, const filter_iterator<T>& filter, T* result)
+        :array_(array)
+        ,filter_(filter)
+        ,result_(result)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = array_.begin();
+        filter_iterator<T> fiter(filter_);
+        fiter.seek(iter, start);
+        const int N2 = fiter.size();
+        T* out = result_ + start;
+        std::vector<double> accumulated;
+
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(fiter.interior_run(iter), end - i);
+            if (run) {
+                // In the interior, loop over the filter on the outside so that the
+                // inner loop is a plain multiply-add along the row (the order of
+                // the summation for each point is the same as below).
+                const T* base = &*iter;
+                const npy_intp step = fiter.row_step(iter);
+                const npy_intp* offsets = fiter.interior_offsets();
+                accumulated.assign(run, 0.);
+                double* acc = &accumulated[0];
+                for (int j = 0; j != N2; ++j) {
+                    const T* p = base + offsets[j];
+                    const double w = fiter[j];
+                    for (npy_intp r = 0; r != run; ++r) {
+                        acc[r] += double(p[r*step])*w;
+                    }
+                }
+                for (npy_intp r = 0; r != run; ++r) out[r] = T(acc[r]);
+                i += run;
+                out += run;
+                fiter.advance(iter, run);
+                continue;
+            }
+            // The reasons for using double instead of T:
+            //   (1) it is slightly faster (10%)
+            //   (2) it handles over/underflow better
+            //   (3) scipy.ndimage.convolve does it
+            // 
+            // Alternatively, we could have written:
+            // T cur = T();
+            // 
+            // and removed the double cast in double(val)*fiter[j] below.
+            double cur = 0.;
+            for (int j = 0; j != N2; ++j) {
+                T val;
+                if (fiter.retrieve(iter, j, val)) {
+                    cur += double(val)*fiter[j];
+                }
             }
+            *out = T(cur);
+            ++i;
+            ++out;
+            fiter.iterate_both(iter);
         }
-        *out = T(cur);
     }
+
+    numpy::aligned_array<T>& array_;
+    const filter_iterator<T>& filter_;
+    T* const result_;
+};
+
+template<typename T>
+void convolve(numpy::aligned_array<T> array, numpy::aligned_array<T> filter, numpy::aligned_array<T> result, int mode) {
+    gil_release nogil;
+    filter_iterator<T> fiter(array.raw_array(), filter.raw_array(), ExtendMode(mode), true);
+    convolve_worker<T> worker(array, fiter, result.data());
+    parallel_for(array.size(), worker, filter_grain(fiter.size()));
 }
 
 
@@ -92,6 +142,485 @@ PyObject* py_convolve(PyObject* self, PyObject* args) {
     return PyArray_Return(output);
 }
 
+// Processing of an array one line (along a given axis) at a time
+//
+// Each line is copied (with the border extension) into a contiguous buffer of
+// doubles, the caller computes the output line from it, and store() writes it
+// back. Lines are handled in blocks of up to max_block neighbours (lines which
+// are next to each other along the last axis): the buffer holds the elements
+// of all the lines in a block interleaved, so that loops over a line are still
+// over contiguous memory, while reading the input (when axis is not the last
+// one) goes along whole cache lines.
+struct line_buffer {
+    enum { max_block = 16 };
+
+    // before & after are the number of extended elements to add at either
+    // side of each line
+    line_buffer(PyArrayObject* array, PyArrayObject* result, const int axis, const ExtendMode mode, const npy_intp before, const npy_intp after)
+        :array_(array)
+        ,result_(result)
+        ,axis_(axis)
+        ,n_(PyArray_DIM(array, axis))
+        ,before_(before)
+        ,after_(after)
+        ,nb_(0)
+        ,data_((before + n_ + after) * max_block)
+        {
+            // border_[k] is the position in the line of the k-th extended
+            // element (the before_ elements before the line & then those
+            // after it)
+            for (npy_intp k = 0; k != before; ++k) {
+                border_.push_back(fix_offset(mode, k - before, n_));
+            }
+            for (npy_intp k = 0; k != after; ++k) {
+                border_.push_back(fix_offset(mode, n_ + k, n_));
+            }
+        }
+
+    // Length of the lines (without the extension)
+    npy_intp length() const { return n_; }
+    // Number of lines in the current block
+    npy_intp block() const { return nb_; }
+    // data()[(before + i)*block() + b] is element i of line b (for
+    // -before <= i < length() + after)
+    double* data() { return &data_[0]; }
+
+    // Loads the block of lines starting with line (but not going past end).
+    // Returns the number of lines loaded
+    template <typename T>
+    npy_intp load(const npy_intp line, const npy_intp end) {
+        const int nd = PyArray_NDIM(array_);
+        const bool blocked = (axis_ != nd - 1);
+        const npy_intp last = PyArray_DIM(array_, nd - 1);
+        nb_ = (blocked ? std::min(std::min<npy_intp>(max_block, end - line), last - line % last) : 1);
+        bstride_ = (blocked ? PyArray_STRIDE(array_, nd - 1) : 0);
+        bostride_ = (blocked ? PyArray_STRIDE(result_, nd - 1) : 0);
+
+        in_ = static_cast<const char*>(PyArray_DATA(array_));
+        out_ = static_cast<char*>(PyArray_DATA(result_));
+        npy_intp pos = line;
+        for (int d = nd - 1; d >= 0; --d) {
+            if (d == axis_) continue;
+            const npy_intp p = pos % PyArray_DIM(array_, d);
+            pos /= PyArray_DIM(array_, d);
+            in_ += p * PyArray_STRIDE(array_, d);
+            out_ += p * PyArray_STRIDE(result_, d);
+        }
+
+        const npy_intp nb = nb_;
+        const npy_intp istride = PyArray_STRIDE(array_, axis_);
+        double* buffer = &data_[0];
+        double* line_start = buffer + before_*nb;
+        for (npy_intp i = 0; i != n_; ++i) {
+            const char* p = in_ + i*istride;
+            for (npy_intp b = 0; b != nb; ++b) {
+                line_start[i*nb + b] = double(*reinterpret_cast<const T*>(p + b*bstride_));
+            }
+        }
+        for (npy_intp k = 0; k != npy_intp(border_.size()); ++k) {
+            const npy_intp p = border_[k];
+            double* dst = (k < before_ ? buffer + k*nb : line_start + (n_ + k - before_)*nb);
+            for (npy_intp b = 0; b != nb; ++b) {
+                dst[b] = (p == border_flag_value ? 0. : line_start[p*nb + b]);
+            }
+        }
+        return nb;
+    }
+
+    // Writes the lines of the current block to the result, where values has
+    // the same layout as data() (without the extension)
+    template <typename T>
+    void store(const double* values) {
+        const npy_intp nb = nb_;
+        const npy_intp ostride = PyArray_STRIDE(result_, axis_);
+        for (npy_intp i = 0; i != n_; ++i) {
+            char* p = out_ + i*ostride;
+            for (npy_intp b = 0; b != nb; ++b) {
+                *reinterpret_cast<T*>(p + b*bostride_) = T(values[i*nb + b]);
+            }
+        }
+    }
+
+    private:
+        PyArrayObject* const array_;
+        PyArrayObject* const result_;
+        const int axis_;
+        const npy_intp n_;
+        const npy_intp before_;
+        const npy_intp after_;
+        npy_intp nb_;
+        npy_intp bstride_;
+        npy_intp bostride_;
+        const char* in_;
+        char* out_;
+        std::vector<npy_intp> border_;
+        std::vector<double> data_;
+};
+
+// Number of lines along axis
+inline npy_intp nr_lines(PyArrayObject* array, const int axis) {
+    const npy_intp n = PyArray_DIM(array, axis);
+    return (n ? PyArray_SIZE(array)/n : 0);
+}
+
+// Convolution along a single axis
+//
+// The filter is applied one tap at a time to the whole line, so that the inner
+// loop is a plain multiply-add over contiguous memory (which the compiler can
+// vectorise). Symmetric & antisymmetric filters (e.g., the gaussian and its
+// derivatives) are folded so that each pair of taps takes a single
+// multiplication.
+template<typename T>
+struct convolve1d_worker {
+    convolve1d_worker(PyArrayObject* array, const std::vector<double>& weights, const int axis, const ExtendMode mode, PyArrayObject* result)
+        :array_(array)
+        ,weights_(weights)
+        ,axis_(axis)
+        ,mode_(mode)
+        ,result_(result)
+        ,symmetric_(true)
+        ,antisymmetric_(true)
+        {
+            const npy_intp nw = weights.size();
+            for (npy_intp k = 0; k != nw; ++k) {
+                if (weights[k] != weights[nw - 1 - k]) symmetric_ = false;
+                if (weights[k] != -weights[nw - 1 - k]) antisymmetric_ = false;
+            }
+        }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const npy_intp nw = weights_.size();
+        const npy_intp before = nw/2;
+        line_buffer lines(array_, result_, axis_, mode_, before, std::max<npy_intp>(nw - 1 - before, 0));
+        const npy_intp n = lines.length();
+        std::vector<double> accumulated(n * line_buffer::max_block);
+        double* acc = &accumulated[0];
+
+        for (npy_intp line = start; line != end; ) {
+            const npy_intp nb = lines.load<T>(line, end);
+            const npy_intp total = n * nb;
+            const double* buffer = lines.data();
+
+            std::fill(acc, acc + total, 0.);
+            if (symmetric_ || antisymmetric_) {
+                for (npy_intp k = 0; k != nw/2; ++k) {
+                    const double w = weights_[k];
+                    if (w == 0.) continue;
+                    const double* a = buffer + k*nb;
+                    const double* c = buffer + (nw - 1 - k)*nb;
+                    if (symmetric_) {
+                        for (npy_intp i = 0; i != total; ++i) acc[i] += w*(a[i] + c[i]);
+                    } else {
+                        for (npy_intp i = 0; i != total; ++i) acc[i] += w*(a[i] - c[i]);
+                    }
+                }
+                if (nw % 2) {
+                    const double w = weights_[nw/2];
+                    const double* a = buffer + (nw/2)*nb;
+                    if (w != 0.) {
+                        for (npy_intp i = 0; i != total; ++i) acc[i] += w*a[i];
+                    }
+                }
+            } else {
+                for (npy_intp k = 0; k != nw; ++k) {
+                    const double w = weights_[k];
+                    if (w == 0.) continue;
+                    const double* a = buffer + k*nb;
+                    for (npy_intp i = 0; i != total; ++i) acc[i] += w*a[i];
+                }
+            }
+            lines.store<T>(acc);
+            line += nb;
+        }
+    }
+
+    PyArrayObject* const array_;
+    const std::vector<double>& weights_;
+    const int axis_;
+    const ExtendMode mode_;
+    PyArrayObject* const result_;
+    bool symmetric_;
+    bool antisymmetric_;
+};
+
+template<typename T>
+void convolve1d(PyArrayObject* array, const numpy::aligned_array<T> filter, PyArrayObject* result, const int axis, const int mode) {
+    gil_release nogil;
+    const npy_intp n = PyArray_DIM(array, axis);
+    if (n == 0) return;
+    std::vector<double> weights;
+    for (npy_intp k = 0; k != filter.size(); ++k) weights.push_back(double(filter.at(k)));
+    convolve1d_worker<T> worker(array, weights, axis, ExtendMode(mode), result);
+    parallel_for(nr_lines(array, axis), worker, std::max<npy_intp>(line_buffer::max_block, filter_grain(weights.size())/n));
+}
+
+PyObject* py_convolve1d(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* filter;
+    PyArrayObject* output;
+    int axis;
+    int mode;
+    if (!PyArg_ParseTuple(args,"OOiOi", &array, &filter, &axis, &output, &mode) ||
+        !PyArray_Check(array) || !PyArray_Check(filter) || !PyArray_Check(output) ||
+        PyArray_TYPE(array) != PyArray_TYPE(filter) ||
+        PyArray_TYPE(array) != PyArray_TYPE(output) ||
+        PyArray_NDIM(filter) != 1 ||
+        PyArray_NDIM(array) != PyArray_NDIM(output) ||
+        axis < 0 || axis >= PyArray_NDIM(array) ||
+        !PyArray_ISCARRAY(output)) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    for (int d = 0; d != PyArray_NDIM(array); ++d) {
+        if (PyArray_DIM(array, d) != PyArray_DIM(output, d)) {
+            PyErr_SetString(PyExc_RuntimeError, OutputErrorMsg);
+            return NULL;
+        }
+    }
+    if (mode < 0 || mode > EXTEND_LAST) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    holdref r(output);
+
+#define HANDLE(type) \
+    convolve1d<type>(array, numpy::aligned_array<type>(filter), output, axis, mode);
+    SAFE_SWITCH_ON_TYPES_OF(array, true)
+#undef HANDLE
+
+    Py_INCREF(output);
+    return PyArray_Return(output);
+}
+
+// Recursive gaussian filter (Deriche, 1993)
+//
+// The gaussian (or its first derivative) is approximated by a sum of two
+// exponentially damped sinusoids, which is applied by a fourth order causal
+// recursive filter plus the corresponding anti-causal one, so that the cost
+// does not depend on sigma. Higher derivatives are computed by applying the
+// first derivative several times (with a smaller sigma, as the derivative of
+// order k of a gaussian with sigma s is k times that of the first derivative
+// of a gaussian with sigma s/sqrt(k)).
+struct deriche_filter {
+    // order must be 0 or 1
+    deriche_filter(const double sigma, const int order) {
+        static const double coefficients[2][8] = {
+            //  a0       a1      b0      b1      w0      w1       c0       c1
+            {  1.680,  3.735, 1.783, 1.723, .6318, 1.997, -.6803, -.2598 },
+            { -.6472, -4.531, 1.527, 1.516, .6719, 2.072,  .6494,  .9557 },
+        };
+        const double* c = coefficients[order];
+        // h(k) = sum_j (A[j] cos(W[j] k) + B[j] sin(W[j] k)) R[j]^k
+        const double A[2] = { c[0], c[6] };
+        const double B[2] = { c[1], c[7] };
+        const double W[2] = { c[4]/sigma, c[5]/sigma };
+        const double R[2] = { std::exp(-c[2]/sigma), std::exp(-c[3]/sigma) };
+
+        // The z-transform of the causal part is n(z)/d(z), with
+        // d = d_0 d_1, n = n_0 d_1 + n_1 d_0 & (for each term j)
+        //     d_j(z) = 1 - 2 R cos(W) z^-1 + R^2 z^-2
+        //     n_j(z) = A + R (B sin(W) - A cos(W)) z^-1
+        double dj[2][3], nj[2][2];
+        for (int j = 0; j != 2; ++j) {
+            dj[j][0] = 1.;
+            dj[j][1] = -2.*R[j]*std::cos(W[j]);
+            dj[j][2] = R[j]*R[j];
+            nj[j][0] = A[j];
+            nj[j][1] = R[j]*(B[j]*std::sin(W[j]) - A[j]*std::cos(W[j]));
+        }
+        std::fill(n_, n_ + 5, 0.);
+        std::fill(d_, d_ + 5, 0.);
+        for (int i = 0; i != 3; ++i) {
+            for (int k = 0; k != 3; ++k) d_[i + k] += dj[0][i]*dj[1][k];
+            for (int k = 0; k != 2; ++k) n_[i + k] += dj[1][i]*nj[0][k] + dj[0][i]*nj[1][k];
+        }
+        // The anti-causal part is the mirror image of the causal one without
+        // its first tap (h(0)), negated for odd orders
+        const double h0 = n_[0];
+        const double sign = (order ? -1. : 1.);
+        m_[0] = 0.;
+        for (int k = 1; k != 5; ++k) m_[k] = sign*(n_[k] - h0*d_[k]);
+
+        // The result is normalised so that it has the same moment as the
+        // FIR filter (sum of the weights for the gaussian & first moment for
+        // its derivative), which is computed from the impulse response
+        // (correlation weights: K(-k) = h(k) & K(k) = sign h(k), for k >= 0).
+        // For the derivative, the centre tap (which should be zero) is
+        // removed.
+        const npy_intp kmax = npy_intp(30.*sigma) + 50;
+        double sum = h0;
+        double moment = 0.;
+        for (npy_intp k = 1; k != kmax; ++k) {
+            double hk = 0.;
+            for (int j = 0; j != 2; ++j) {
+                hk += (A[j]*std::cos(W[j]*k) + B[j]*std::sin(W[j]*k)) * std::pow(R[j], double(k));
+            }
+            sum += (1. + sign)*hk;
+            moment += (sign - 1.)*k*hk;
+        }
+        centre_ = (order ? -h0 : 0.);
+        scale_ = (order ? -1./moment : 1./sum);
+
+        // Response of either half to a constant (unit) input
+        double nsum = 0., msum = 0., dsum = 0.;
+        for (int k = 0; k != 5; ++k) {
+            nsum += n_[k];
+            msum += m_[k];
+            dsum += d_[k];
+        }
+        causal_steady_ = nsum/dsum;
+        anticausal_steady_ = msum/dsum;
+    }
+
+    // Filters (in place) the nb interleaved lines of length len in x (see
+    // line_buffer), using causal & anticausal (of the same size) as
+    // temporary storage. Outside of the lines, the input is taken to be
+    // constant.
+    void apply(double* x, double* causal, double* anticausal, const npy_intp len, const npy_intp nb) const {
+        for (npy_intp i = 0; i != len; ++i) {
+            double* cur = causal + i*nb;
+            const double* xi = x + i*nb;
+            if (i >= 4) {
+                for (npy_intp b = 0; b != nb; ++b) {
+                    cur[b] = n_[0]*xi[b] + n_[1]*xi[b - nb] + n_[2]*xi[b - 2*nb] + n_[3]*xi[b - 3*nb]
+                            - d_[1]*cur[b - nb] - d_[2]*cur[b - 2*nb] - d_[3]*cur[b - 3*nb] - d_[4]*cur[b - 4*nb];
+                }
+            } else {
+                for (npy_intp b = 0; b != nb; ++b) {
+                    const double steady = causal_steady_*x[b];
+                    double v = 0.;
+                    for (npy_intp k = 0; k != 5; ++k) {
+                        if (k < 4) v += n_[k]*(k <= i ? xi[b - k*nb] : x[b]);
+                        if (k) v -= d_[k]*(k <= i ? cur[b - k*nb] : steady);
+                    }
+                    cur[b] = v;
+                }
+            }
+        }
+        const double* xlast = x + (len - 1)*nb;
+        for (npy_intp i = len - 1; i >= 0; --i) {
+            double* cur = anticausal + i*nb;
+            const double* xi = x + i*nb;
+            if (i < len - 4) {
+                for (npy_intp b = 0; b != nb; ++b) {
+                    cur[b] = m_[1]*xi[b + nb] + m_[2]*xi[b + 2*nb] + m_[3]*xi[b + 3*nb] + m_[4]*xi[b + 4*nb]
+                            - d_[1]*cur[b + nb] - d_[2]*cur[b + 2*nb] - d_[3]*cur[b + 3*nb] - d_[4]*cur[b + 4*nb];
+                }
+            } else {
+                for (npy_intp b = 0; b != nb; ++b) {
+                    const double steady = anticausal_steady_*xlast[b];
+                    double v = 0.;
+                    for (npy_intp k = 1; k != 5; ++k) {
+                        const bool inside = (i + k < len);
+                        v += m_[k]*(inside ? xi[b + k*nb] : xlast[b]);
+                        v -= d_[k]*(inside ? cur[b + k*nb] : steady);
+                    }
+                    cur[b] = v;
+                }
+            }
+        }
+        const npy_intp total = len*nb;
+        for (npy_intp i = 0; i != total; ++i) {
+            x[i] = scale_*(causal[i] + anticausal[i] + centre_*x[i]);
+        }
+    }
+
+    private:
+        double n_[5];
+        double m_[5];
+        double d_[5];
+        double centre_;
+        double scale_;
+        double causal_steady_;
+        double anticausal_steady_;
+};
+
+// The lines are extended by about 6 sigma on each side, so that the result
+// reflects the border mode (the impulse response decays by a factor of about
+// exp(1.5) every sigma elements).
+template<typename T>
+struct gaussian_iir_worker {
+    gaussian_iir_worker(PyArrayObject* array, PyArrayObject* result, const int axis, const ExtendMode mode, const double sigma, const int order)
+        :array_(array)
+        ,result_(result)
+        ,axis_(axis)
+        ,mode_(mode)
+        ,passes_(order ? order : 1)
+        ,margin_(npy_intp(6.*sigma + .5) + 4)
+        ,filter_(order ? sigma/std::sqrt(double(order)) : sigma, order ? 1 : 0)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        line_buffer lines(array_, result_, axis_, mode_, margin_, margin_);
+        const npy_intp len = lines.length() + 2*margin_;
+        std::vector<double> causal(len * line_buffer::max_block);
+        std::vector<double> anticausal(len * line_buffer::max_block);
+
+        for (npy_intp line = start; line != end; ) {
+            const npy_intp nb = lines.load<T>(line, end);
+            double* x = lines.data();
+            for (int p = 0; p != passes_; ++p) {
+                filter_.apply(x, &causal[0], &anticausal[0], len, nb);
+            }
+            lines.store<T>(x + margin_*nb);
+            line += nb;
+        }
+    }
+
+    PyArrayObject* const array_;
+    PyArrayObject* const result_;
+    const int axis_;
+    const ExtendMode mode_;
+    const int passes_;
+    const npy_intp margin_;
+    const deriche_filter filter_;
+};
+
+template<typename T>
+void gaussian_iir1d(PyArrayObject* array, PyArrayObject* result, const int axis, const double sigma, const int order, const int mode) {
+    gil_release nogil;
+    const npy_intp n = PyArray_DIM(array, axis);
+    if (n == 0) return;
+    gaussian_iir_worker<T> worker(array, result, axis, ExtendMode(mode), sigma, order);
+    parallel_for(nr_lines(array, axis), worker, std::max<npy_intp>(line_buffer::max_block, 8192/n));
+}
+
+PyObject* py_gaussian_iir1d(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* output;
+    int axis;
+    double sigma;
+    int order;
+    int mode;
+    if (!PyArg_ParseTuple(args,"OiOdii", &array, &axis, &output, &sigma, &order, &mode) ||
+        !PyArray_Check(array) || !PyArray_Check(output) ||
+        PyArray_TYPE(array) != PyArray_TYPE(output) ||
+        PyArray_NDIM(array) != PyArray_NDIM(output) ||
+        axis < 0 || axis >= PyArray_NDIM(array) ||
+        !PyArray_ISCARRAY(output) ||
+        sigma < .5 ||
+        order < 0 || order > 3 ||
+        mode < 0 || mode > EXTEND_LAST) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    for (int d = 0; d != PyArray_NDIM(array); ++d) {
+        if (PyArray_DIM(array, d) != PyArray_DIM(output, d)) {
+            PyErr_SetString(PyExc_RuntimeError, OutputErrorMsg);
+            return NULL;
+        }
+    }
+    holdref r(output);
+
+#define HANDLE(type) \
+    gaussian_iir1d<type>(array, output, axis, sigma, order, mode);
+    SAFE_SWITCH_ON_FLOAT_TYPES_OF(array, true)
+#undef HANDLE
+
+    Py_INCREF(output);
+    return PyArray_Return(output);
+}
+
 template <typename T>
 void haar(numpy::aligned_array<T> array) {
     gil_release nogil;
@@ -417,35 +946,250 @@ PyObject* py_ihaar(PyObject* self, PyObject* args) {
     return PyArray_Return(array);
 }
 
+template<typename T>
+struct rank_filter_worker {
+    rank_filter_worker(numpy::aligned_array<T>& array, const filter_iterator<T>& filter, T* result, const int rank)
+        :array_(array)
+        ,filter_(filter)
+        ,result_(result)
+        ,rank_(rank)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = array_.begin();
+        filter_iterator<T> fiter(filter_);
+        fiter.seek(iter, start);
+        const int N2 = fiter.size();
+        const int rank = rank_;
+        // T* is a fine iterator type.
+        T* rpos = result_ + start;
+        T* neighbours = new T[N2];
+
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(fiter.interior_run(iter), end - i);
+            if (run) {
+                const T* base = &*iter;
+                const npy_intp step = fiter.row_step(iter);
+                const npy_intp* offsets = fiter.interior_offsets();
+                for (npy_intp r = 0; r != run; ++r, ++rpos) {
+                    const T* p = base + r*step;
+                    for (int j = 0; j != N2; ++j) neighbours[j] = p[offsets[j]];
+                    std::nth_element(neighbours, neighbours + rank, neighbours + N2);
+                    *rpos = neighbours[rank];
+                }
+                i += run;
+                fiter.advance(iter, run);
+                continue;
+            }
+            int n = 0;
+            for (int j = 0; j != N2; ++j) {
+                T val;
+                if (fiter.retrieve(iter, j, val)) neighbours[n++] = val;
+            }
+            int currank = rank;
+            if (n != N2) {
+                currank = int(n * rank/float(N2));
+            }
+            std::nth_element(neighbours, neighbours + currank, neighbours + n);
+            *rpos = neighbours[rank];
+            ++i;
+            ++rpos;
+            fiter.iterate_both(iter);
+        }
+        delete [] neighbours;
+    }
+
+    numpy::aligned_array<T>& array_;
+    const filter_iterator<T>& filter_;
+    T* const result_;
+    const int rank_;
+};
+
+// Rank filters of 8 & 16 bit images with a rectangular window (i.e., a 2-D
+// structuring element which is all ones) are computed with sliding
+// histograms, so that the cost per pixel is (nearly) independent of the size
+// of the window:
+//
+//  - 8 bits: Perreault & Hebert's algorithm. One histogram is kept for each
+//    column (covering the height of the window) and moved down one row at a
+//    time. Along a row, the histogram of the window is updated by adding and
+//    removing whole column histograms.
+//  - 16 bits: Huang's algorithm (the histogram of the window is updated with
+//    the pixels which enter and leave it as it moves along a row). The
+//    histogram has two levels (high byte & full value), so that finding the
+//    rank only needs to look at 2x256 bins.
+//
+// Pixels outside the image are mapped with fix_offset(), which gives the same
+// values as the filter_iterator (for every mode but EXTEND_CONSTANT).
+template<typename T>
+struct histogram_rank_worker {
+    histogram_rank_worker(numpy::aligned_array<T>& array, T* result, const int rank, const ExtendMode mode, const npy_intp fh, const npy_intp fw)
+        :data_(reinterpret_cast<const char*>(array.raw_array()->data))
+        ,stride0_(PyArray_STRIDE(array.raw_array(), 0))
+        ,stride1_(PyArray_STRIDE(array.raw_array(), 1))
+        ,h_(array.dim(0))
+        ,w_(array.dim(1))
+        ,fh_(fh)
+        ,fw_(fw)
+        ,result_(result)
+        ,rank_(rank)
+        {
+            // row_map_[k] & col_map_[k] are the rows and columns of the image
+            // which correspond to k - fh/2 and k - fw/2
+            for (npy_intp k = 0; k != h_ + fh - 1; ++k) row_map_.push_back(fix_offset(mode, k - fh/2, h_));
+            for (npy_intp k = 0; k != w_ + fw - 1; ++k) col_map_.push_back(fix_offset(mode, k - fw/2, w_));
+        }
+
+    T at(const npy_intp r, const npy_intp c) const {
+        return *reinterpret_cast<const T*>(data_ + r*stride0_ + c*stride1_);
+    }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        if (sizeof(T) == 1) rows_8bit(start, end);
+        else rows_16bit(start, end);
+    }
+
+    void rows_8bit(const npy_intp start, const npy_intp end) {
+        const int nbins = 256;
+        const npy_intp ncols = w_ + fw_ - 1;
+        std::vector<int> columns(ncols * nbins);
+        std::vector<int> window(nbins);
+        for (npy_intp y = start; y != end; ++y) {
+            if (y == start) {
+                for (npy_intp j = 0; j != fh_; ++j) {
+                    const npy_intp r = row_map_[y + j];
+                    for (npy_intp k = 0; k != ncols; ++k) ++columns[k*nbins + at(r, col_map_[k])];
+                }
+            } else {
+                const npy_intp rold = row_map_[y - 1];
+                const npy_intp rnew = row_map_[y + fh_ - 1];
+                for (npy_intp k = 0; k != ncols; ++k) {
+                    --columns[k*nbins + at(rold, col_map_[k])];
+                    ++columns[k*nbins + at(rnew, col_map_[k])];
+                }
+            }
+            std::fill(window.begin(), window.end(), 0);
+            for (npy_intp k = 0; k != fw_; ++k) {
+                const int* column = &columns[k*nbins];
+                for (int b = 0; b != nbins; ++b) window[b] += column[b];
+            }
+            T* out = result_ + y*w_;
+            for (npy_intp x = 0; x != w_; ++x) {
+                if (x) {
+                    const int* removed = &columns[(x - 1)*nbins];
+                    const int* added = &columns[(x + fw_ - 1)*nbins];
+                    for (int b = 0; b != nbins; ++b) window[b] += added[b] - removed[b];
+                }
+                int b = 0;
+                int seen = window[0];
+                while (seen <= rank_) seen += window[++b];
+                out[x] = T(b);
+            }
+        }
+    }
+
+    void rows_16bit(const npy_intp start, const npy_intp end) {
+        std::vector<int> coarse(256);
+        std::vector<int> fine(65536);
+        for (npy_intp y = start; y != end; ++y) {
+            std::fill(coarse.begin(), coarse.end(), 0);
+            std::fill(fine.begin(), fine.end(), 0);
+            for (npy_intp j = 0; j != fh_; ++j) {
+                const npy_intp r = row_map_[y + j];
+                for (npy_intp k = 0; k != fw_; ++k) {
+                    const int v = at(r, col_map_[k]);
+                    ++coarse[v >> 8];
+                    ++fine[v];
+                }
+            }
+            T* out = result_ + y*w_;
+            for (npy_intp x = 0; x != w_; ++x) {
+                if (x) {
+                    const npy_intp cold = col_map_[x - 1];
+                    const npy_intp cnew = col_map_[x + fw_ - 1];
+                    for (npy_intp j = 0; j != fh_; ++j) {
+                        const npy_intp r = row_map_[y + j];
+                        const int vold = at(r, cold);
+                        const int vnew = at(r, cnew);
+                        --coarse[vold >> 8];
+                        --fine[vold];
+                        ++coarse[vnew >> 8];
+                        ++fine[vnew];
+                    }
+                }
+                int c = 0;
+                int seen = coarse[0];
+                while (seen <= rank_) seen += coarse[++c];
+                seen -= coarse[c];
+                int b = c << 8;
+                seen += fine[b];
+                while (seen <= rank_) seen += fine[++b];
+                out[x] = T(b);
+            }
+        }
+    }
+
+    const char* const data_;
+    const npy_intp stride0_;
+    const npy_intp stride1_;
+    const npy_intp h_;
+    const npy_intp w_;
+    const npy_intp fh_;
+    const npy_intp fw_;
+    T* const result_;
+    const int rank_;
+    std::vector<npy_intp> row_map_;
+    std::vector<npy_intp> col_map_;
+};
+
+// histogram_rank_worker is only instantiated for unsigned 8 & 16 bit types
+template <bool use_histogram>
+struct histogram_rank_filter {
+    template<typename T>
+    static bool run(numpy::aligned_array<T>&, numpy::aligned_array<T>&, numpy::aligned_array<T>&, const int, const int) {
+        return false;
+    }
+};
+
+template <>
+struct histogram_rank_filter<true> {
+    template<typename T>
+    static bool run(numpy::aligned_array<T>& res, numpy::aligned_array<T>& array, numpy::aligned_array<T>& Bc, const int rank, const int mode) {
+        if (array.ndims() != 2 || ExtendMode(mode) == EXTEND_CONSTANT || !res.size()) return false;
+        const npy_intp N2 = Bc.size();
+        typename numpy::aligned_array<T>::iterator biter = Bc.begin();
+        for (npy_intp i = 0; i != N2; ++i, ++biter) {
+            if (!*biter) return false;
+        }
+        // Below these sizes, std::nth_element is faster
+        if (N2 < (sizeof(T) == 1 ? 16 : 9)) return false;
+
+        histogram_rank_worker<T> worker(array, res.data(), rank, ExtendMode(mode), Bc.dim(0), Bc.dim(1));
+        // For 8 bits, each task starts by building the column histograms, so
+        // it should cover a good number of rows
+        const npy_intp grain = (sizeof(T) == 1 ? std::max<npy_intp>(32, 2*Bc.dim(0)) : 1);
+        parallel_for(array.dim(0), worker, grain);
+        return true;
+    }
+};
+
 template<typename T>
 void rank_filter(numpy::aligned_array<T> res, numpy::aligned_array<T> array, numpy::aligned_array<T> Bc, const int rank, const int mode) {
     gil_release nogil;
-    const int N = res.size();
-    typename numpy::aligned_array<T>::iterator iter = array.begin();
     filter_iterator<T> fiter(array.raw_array(), Bc.raw_array(), ExtendMode(mode), true);
     const int N2 = fiter.size();
     if (rank < 0 || rank >= N2) {
         return;
     }
-    // T* is a fine iterator type.
-    T* rpos = res.data();
-    T* neighbours = new T[N2];
-
-    for (int i = 0; i != N; ++i, ++rpos, fiter.iterate_both(iter)) {
-        int n = 0;
-        for (int j = 0; j != N2; ++j) {
-            T val;
-            if (fiter.retrieve(iter, j, val)) neighbours[n++] = val;
-        }
-        int currank = rank;
-        if (n != N2) {
-            currank = int(n * rank/float(N2));
-        }
-        std::nth_element(neighbours, neighbours + currank, neighbours + n);
-        *rpos = neighbours[rank];
-    }
-    delete [] neighbours;
+    if (histogram_rank_filter<
+                std::numeric_limits<T>::is_integer &&
+                !std::numeric_limits<T>::is_signed &&
+                (std::numeric_limits<T>::digits == 8 || std::numeric_limits<T>::digits == 16)
+            >::run(res, array, Bc, rank, mode)) return;
+    rank_filter_worker<T> worker(array, fiter, res.data(), rank);
+    parallel_for(res.size(), worker, filter_grain(N2));
 }
+
 PyObject* py_rank_filter(PyObject* self, PyObject* args) {
     PyArrayObject* array;
     PyArrayObject* Bc;
@@ -472,27 +1216,70 @@ PyObject* py_rank_filter(PyObject* self, PyObject* args) {
 }
 
 template <typename T>
-void template_match(numpy::aligned_array<T> res, numpy::aligned_array<T> f, numpy::aligned_array<T> t, int mode) {
-    gil_release nogil;
-    const int N = res.size();
-    typename numpy::aligned_array<T>::iterator iter = f.begin();
-    filter_iterator<T> fiter(f.raw_array(), t.raw_array(), ExtendMode(mode), false);
-    const int N2 = fiter.size();
-    // T* is a fine iterator type.
-    T* rpos = res.data();
-
-    for (int i = 0; i != N; ++i, ++rpos, fiter.iterate_both(iter)) {
-        T diff2 = T(0);
-        for (int j = 0; j != N2; ++j) {
-            T val;
-            if (fiter.retrieve(iter, j, val)) {
-                const T tj = fiter[j];
-                const T delta = (val > tj ? val - tj : tj - val);
-                diff2 += delta*delta;
+struct template_match_worker {
+    template_match_worker(numpy::aligned_array<T>& f, const filter_iterator<T>& filter, T* result)
+        :f_(f)
+        ,filter_(filter)
+        ,result_(result)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = f_.begin();
+        filter_iterator<T> fiter(filter_);
+        fiter.seek(iter, start);
+        const int N2 = fiter.size();
+        // T* is a fine iterator type.
+        T* rpos = result_ + start;
+
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(fiter.interior_run(iter), end - i);
+            if (run) {
+                const T* base = &*iter;
+                const npy_intp step = fiter.row_step(iter);
+                const npy_intp* offsets = fiter.interior_offsets();
+                const T* tdata = fiter.filter_data();
+                std::fill(rpos, rpos + run, T(0));
+                for (int j = 0; j != N2; ++j) {
+                    const T* p = base + offsets[j];
+                    const T tj = tdata[j];
+                    for (npy_intp r = 0; r != run; ++r) {
+                        const T val = p[r*step];
+                        const T delta = (val > tj ? val - tj : tj - val);
+                        rpos[r] += delta*delta;
+                    }
+                }
+                i += run;
+                rpos += run;
+                fiter.advance(iter, run);
+                continue;
+            }
+            T diff2 = T(0);
+            for (int j = 0; j != N2; ++j) {
+                T val;
+                if (fiter.retrieve(iter, j, val)) {
+                    const T tj = fiter[j];
+                    const T delta = (val > tj ? val - tj : tj - val);
+                    diff2 += delta*delta;
+                }
             }
+            *rpos = diff2;
+            ++i;
+            ++rpos;
+            fiter.iterate_both(iter);
         }
-        *rpos = diff2;
     }
+
+    numpy::aligned_array<T>& f_;
+    const filter_iterator<T>& filter_;
+    T* const result_;
+};
+
+template <typename T>
+void template_match(numpy::aligned_array<T> res, numpy::aligned_array<T> f, numpy::aligned_array<T> t, int mode) {
+    gil_release nogil;
+    filter_iterator<T> fiter(f.raw_array(), t.raw_array(), ExtendMode(mode), false);
+    template_match_worker<T> worker(f, fiter, res.data());
+    parallel_for(res.size(), worker, filter_grain(fiter.size()));
 }
 
 PyObject* py_template_match(PyObject* self, PyObject* args) {
@@ -519,8 +1306,380 @@ PyObject* py_template_match(PyObject* self, PyObject* args) {
     return PyArray_Return(output);
 }
 
+// FFT-based correlation (for large filters)
+//
+// The input is extended by the size of the filter (according to mode) and
+// copied into an array whose dimensions are fast FFT sizes. As both the input
+// and the filter are real, they are transformed together (as the real &
+// imaginary parts of a single complex array). The product of their transforms
+// is Hermitian, so only half of it needs to be computed.
+//
+// Only the part of the (circular) result which does not wrap around is used,
+// so the output is the same as that of the direct method, up to rounding.
+struct fft_correlation {
+    fft_correlation(PyArrayObject* array, PyArrayObject* filter, const ExtendMode mode)
+        :nd(PyArray_NDIM(array))
+        ,mode(mode)
+        ,size(1)
+        {
+            for (int d = 0; d != nd; ++d) {
+                n[d] = PyArray_DIM(array, d);
+                k[d] = PyArray_DIM(filter, d);
+                padded[d] = n[d] + k[d] - 1;
+                dims[d] = fft_size(padded[d]);
+                size *= dims[d];
+                // maps[d][q] is the position in the input of the q-th
+                // element of the extended input along axis d
+                for (npy_intp q = 0; q != padded[d]; ++q) {
+                    maps[d].push_back(fix_offset(mode, q - k[d]/2, n[d]));
+                }
+            }
+            data.resize(size);
+        }
+
+    // Flat index (in data) of the point with coordinates c
+    npy_intp index(const npy_intp* c) const {
+        npy_intp i = 0;
+        for (int d = 0; d != nd; ++d) i = i*dims[d] + c[d];
+        return i;
+    }
+
+    const int nd;
+    const ExtendMode mode;
+    npy_intp n[NPY_MAXDIMS];
+    npy_intp k[NPY_MAXDIMS];
+    npy_intp padded[NPY_MAXDIMS];
+    npy_intp dims[NPY_MAXDIMS];
+    npy_intp size;
+    std::vector<npy_intp> maps[NPY_MAXDIMS];
+    std::vector<complex_t> data;
+};
+
+// Sets coordinates to those of row r of an array of shape dims (where the
+// rows are the lines along the last axis)
+inline void row_coordinates(npy_intp r, const int nd, const npy_intp* dims, npy_intp* coordinates) {
+    coordinates[nd - 1] = 0;
+    for (int d = nd - 2; d >= 0; --d) {
+        coordinates[d] = r % dims[d];
+        r /= dims[d];
+    }
+}
+
+inline npy_intp nrows(const int nd, const npy_intp* dims) {
+    npy_intp r = 1;
+    for (int d = 0; d != nd - 1; ++d) r *= dims[d];
+    return r;
+}
+
+// Copies the extended input to the real part of corr.data. If squares is not
+// NULL, the squares of the extended input are written to it (as an array of
+// shape corr.padded + 1, leaving the first element along each axis alone)
+template <typename T>
+struct fft_input_worker {
+    fft_input_worker(fft_correlation& corr, PyArrayObject* array, double* squares)
+        :corr_(corr)
+        ,array_(array)
+        ,squares_(squares)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = corr_.nd;
+        const npy_intp* padded = corr_.padded;
+        npy_intp c[NPY_MAXDIMS];
+        for (npy_intp r = start; r != end; ++r) {
+            row_coordinates(r, nd, padded, c);
+            bool outside = false;
+            const char* base = static_cast<const char*>(PyArray_DATA(array_));
+            npy_intp sq = 0;
+            for (int d = 0; d != nd - 1; ++d) {
+                const npy_intp p = corr_.maps[d][c[d]];
+                if (p == border_flag_value) outside = true;
+                else base += p * PyArray_STRIDE(array_, d);
+                sq = sq*(padded[d] + 1) + c[d] + 1;
+            }
+            sq = sq*(padded[nd - 1] + 1) + 1;
+            complex_t* out = &corr_.data[corr_.index(c)];
+            const std::vector<npy_intp>& map = corr_.maps[nd - 1];
+            const npy_intp stride = PyArray_STRIDE(array_, nd - 1);
+            for (npy_intp i = 0; i != padded[nd - 1]; ++i) {
+                double v = 0.;
+                if (!outside && map[i] != border_flag_value) {
+                    v = double(*reinterpret_cast<const T*>(base + map[i]*stride));
+                }
+                out[i] = complex_t(v, 0.);
+                if (squares_) squares_[sq + i] = v*v;
+            }
+        }
+    }
+
+    fft_correlation& corr_;
+    PyArrayObject* const array_;
+    double* const squares_;
+};
+
+// Replaces the transform of (input + i filter) by the product of the
+// transforms of the input and of the filter. Each pair of positions (p, -p)
+// is handled by the row which contains the first of them.
+struct fft_product_worker {
+    explicit fft_product_worker(fft_correlation& corr)
+        :corr_(corr)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = corr_.nd;
+        const npy_intp* dims = corr_.dims;
+        const npy_intp last = dims[nd - 1];
+        npy_intp c[NPY_MAXDIMS];
+        npy_intp m[NPY_MAXDIMS];
+        for (npy_intp r = start; r != end; ++r) {
+            row_coordinates(r, nd, dims, c);
+            for (int d = 0; d != nd; ++d) m[d] = (dims[d] - c[d]) % dims[d];
+            const npy_intp row = corr_.index(c);
+            const npy_intp mirror_row = corr_.index(m);
+            for (npy_intp i = 0; i != last; ++i) {
+                const npy_intp p = row + i;
+                const npy_intp mp = mirror_row + (last - i) % last;
+                if (mp < p) continue;
+                const complex_t z = corr_.data[p];
+                const complex_t zm = std::conj(corr_.data[mp]);
+                const complex_t input = (z + zm) * .5;
+                const complex_t diff = (z - zm) * .5;
+                // filter = diff / i
+                const complex_t filter(diff.imag(), -diff.real());
+                const complex_t product = multiply(input, filter);
+                corr_.data[p] = product;
+                corr_.data[mp] = std::conj(product);
+            }
+        }
+    }
+
+    fft_correlation& corr_;
+};
+
+// Computes the correlation of array & filter (in corr.data, so that the
+// result for position p is at position p + k - 1, scaled by corr.size).
+// filter holds the values of the filter (in C order). If squares is not NULL,
+// see fft_input_worker.
+template <typename T>
+void fft_correlate(fft_correlation& corr, PyArrayObject* array, const std::vector<double>& filter, double* squares) {
+    const int nd = corr.nd;
+    fft_input_worker<T> input(corr, array, squares);
+    parallel_for(nrows(nd, corr.padded), input, std::max<npy_intp>(1, 65536/corr.padded[nd - 1]));
+
+    // The filter is reversed (so that the product computes a correlation)
+    npy_intp c[NPY_MAXDIMS];
+    for (npy_intp i = 0; i != npy_intp(filter.size()); ++i) {
+        npy_intp pos = i;
+        for (int d = nd - 1; d >= 0; --d) {
+            c[d] = corr.k[d] - 1 - pos % corr.k[d];
+            pos /= corr.k[d];
+        }
+        complex_t& z = corr.data[corr.index(c)];
+        z = complex_t(z.real(), filter[i]);
+    }
+
+    fft_nd(&corr.data[0], nd, corr.dims, false);
+    fft_product_worker product(corr);
+    parallel_for(nrows(nd, corr.dims), product, std::max<npy_intp>(1, 65536/corr.dims[nd - 1]));
+    fft_nd(&corr.data[0], nd, corr.dims, true);
+}
+
+// In place cumulative sums along all axes
+void cumulative_sum(double* data, const int nd, const npy_intp* dims) {
+    npy_intp size = 1;
+    for (int d = 0; d != nd; ++d) size *= dims[d];
+    npy_intp stride = size;
+    for (int d = 0; d != nd; ++d) {
+        stride /= dims[d];
+        for (npy_intp i = 0; i != size; ++i) {
+            if ((i / stride) % dims[d]) data[i] += data[i - stride];
+        }
+    }
+}
+
+// Sum of the elements in the box [lo, hi) of the array whose cumulative sums
+// (with an extra 0 at the start of each axis) are in cumsum
+double box_sum(const double* cumsum, const int nd, const npy_intp* dims, const npy_intp* lo, const npy_intp* hi) {
+    double sum = 0.;
+    for (unsigned corner = 0; corner != (1u << nd); ++corner) {
+        npy_intp i = 0;
+        int sign = 1;
+        for (int d = 0; d != nd; ++d) {
+            const bool high = (corner >> d) & 1;
+            if (!high) sign = -sign;
+            i = i*(dims[d] + 1) + (high ? hi[d] : lo[d]);
+        }
+        sum += sign * cumsum[i];
+    }
+    return sum;
+}
+
+template <typename T>
+struct fft_output_worker {
+    fft_output_worker(const fft_correlation& corr, T* result, const double* squares, const double* template_squares, const double template_sum)
+        :corr_(corr)
+        ,result_(result)
+        ,squares_(squares)
+        ,template_squares_(template_squares)
+        ,template_sum_(template_sum)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = corr_.nd;
+        const npy_intp* n = corr_.n;
+        const npy_intp* k = corr_.k;
+        const npy_intp last = n[nd - 1];
+        const double scale = 1./corr_.size;
+        npy_intp c[NPY_MAXDIMS];
+        npy_intp lo[NPY_MAXDIMS], hi[NPY_MAXDIMS];
+        npy_intp tlo[NPY_MAXDIMS], thi[NPY_MAXDIMS];
+        for (npy_intp r = start; r != end; ++r) {
+            row_coordinates(r, nd, n, c);
+            T* out = result_ + r*last;
+            for (int d = 0; d != nd; ++d) c[d] += k[d] - 1;
+            const complex_t* row = &corr_.data[corr_.index(c)];
+            for (int d = 0; d != nd; ++d) c[d] -= k[d] - 1;
+            for (npy_intp i = 0; i != last; ++i) {
+                const double cross = row[i].real() * scale;
+                if (!squares_) {
+                    out[i] = T(cross);
+                    continue;
+                }
+                c[nd - 1] = i;
+                double tsum = template_sum_;
+                for (int d = 0; d != nd; ++d) {
+                    lo[d] = c[d];
+                    hi[d] = c[d] + k[d];
+                    // The template points which fall inside the array
+                    tlo[d] = std::max<npy_intp>(0, k[d]/2 - c[d]);
+                    thi[d] = std::min<npy_intp>(k[d], n[d] + k[d]/2 - c[d]);
+                }
+                if (template_squares_) tsum = box_sum(template_squares_, nd, k, tlo, thi);
+                const double diff2 = box_sum(squares_, nd, corr_.padded, lo, hi) - 2.*cross + tsum;
+                out[i] = T(std::max(diff2, 0.));
+            }
+        }
+    }
+
+    const fft_correlation& corr_;
+    T* const result_;
+    const double* const squares_;
+    const double* const template_squares_;
+    const double template_sum_;
+};
+
+template <typename T>
+void fft_filter(PyArrayObject* array, PyArrayObject* filter, PyArrayObject* result, const int mode, const bool match) {
+    std::vector<double> fvalues;
+    {
+        numpy::aligned_array<T> farray(filter);
+        typename numpy::aligned_array<T>::iterator fiter = farray.begin();
+        for (npy_intp i = 0; i != farray.size(); ++i, ++fiter) fvalues.push_back(double(*fiter));
+    }
+    gil_release nogil;
+    fft_correlation corr(array, filter, ExtendMode(mode));
+    const int nd = corr.nd;
+
+    // For template matching, the result is
+    //
+    //      sum (f - t)^2 = sum f^2 - 2 sum f t + sum t^2
+    //
+    // where the first & last sums are over the points of the template which
+    // are used (with the constant mode, those that fall outside the array
+    // are skipped). They are computed from cumulative sums.
+    std::vector<double> squares;
+    std::vector<double> template_squares;
+    double template_sum = 0.;
+    if (match) {
+        npy_intp ssize = 1;
+        npy_intp sdims[NPY_MAXDIMS];
+        npy_intp tsize = 1;
+        npy_intp tdims[NPY_MAXDIMS];
+        for (int d = 0; d != nd; ++d) {
+            sdims[d] = corr.padded[d] + 1;
+            ssize *= sdims[d];
+            tdims[d] = corr.k[d] + 1;
+            tsize *= tdims[d];
+        }
+        for (npy_intp i = 0; i != npy_intp(fvalues.size()); ++i) template_sum += fvalues[i]*fvalues[i];
+        if (corr.mode == EXTEND_CONSTANT) {
+            template_squares.resize(tsize);
+            for (npy_intp i = 0; i != npy_intp(fvalues.size()); ++i) {
+                npy_intp pos = i;
+                npy_intp ti = 0;
+                npy_intp tstride = 1;
+                for (int d = nd - 1; d >= 0; --d) {
+                    ti += (pos % corr.k[d] + 1) * tstride;
+                    pos /= corr.k[d];
+                    tstride *= tdims[d];
+                }
+                template_squares[ti] = fvalues[i]*fvalues[i];
+            }
+            cumulative_sum(&template_squares[0], nd, tdims);
+        }
+        squares.resize(ssize);
+        fft_correlate<T>(corr, array, fvalues, &squares[0]);
+        cumulative_sum(&squares[0], nd, sdims);
+    } else {
+        fft_correlate<T>(corr, array, fvalues, 0);
+    }
+
+    fft_output_worker<T> output(corr,
+                        static_cast<T*>(PyArray_DATA(result)),
+                        (match ? &squares[0] : 0),
+                        (template_squares.empty() ? 0 : &template_squares[0]),
+                        template_sum);
+    parallel_for(nrows(nd, corr.n), output, std::max<npy_intp>(1, 65536/corr.n[nd - 1]));
+}
+
+PyObject* py_fft_filter(PyObject* args, const bool match) {
+    PyArrayObject* array;
+    PyArrayObject* filter;
+    PyArrayObject* output;
+    int mode;
+    if (!PyArg_ParseTuple(args, "OOOi", &array, &filter, &output, &mode) ||
+        !PyArray_Check(array) || !PyArray_Check(filter) || !PyArray_Check(output) ||
+        PyArray_TYPE(array) != PyArray_TYPE(filter) ||
+        PyArray_TYPE(array) != PyArray_TYPE(output) ||
+        PyArray_NDIM(array) != PyArray_NDIM(filter) ||
+        PyArray_NDIM(array) != PyArray_NDIM(output) ||
+        PyArray_NDIM(array) == 0 ||
+        PyArray_SIZE(array) == 0 ||
+        PyArray_SIZE(filter) == 0 ||
+        !PyArray_ISCARRAY(output) ||
+        mode < 0 || mode > EXTEND_LAST) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    for (int d = 0; d != PyArray_NDIM(array); ++d) {
+        if (PyArray_DIM(array, d) != PyArray_DIM(output, d)) {
+            PyErr_SetString(PyExc_RuntimeError, OutputErrorMsg);
+            return NULL;
+        }
+    }
+    holdref r(output);
+
+#define HANDLE(type) \
+    fft_filter<type>(array, filter, output, mode, match);
+    SAFE_SWITCH_ON_FLOAT_TYPES_OF(array, true)
+#undef HANDLE
+
+    Py_INCREF(output);
+    return PyArray_Return(output);
+}
+
+PyObject* py_convolve_fft(PyObject* self, PyObject* args) {
+    return py_fft_filter(args, false);
+}
+
+PyObject* py_template_match_fft(PyObject* self, PyObject* args) {
+    return py_fft_filter(args, true);
+}
+
 PyMethodDef methods[] = {
   {"convolve",(PyCFunction)py_convolve, METH_VARARGS, NULL},
+  {"convolve1d",(PyCFunction)py_convolve1d, METH_VARARGS, NULL},
+  {"gaussian_iir1d",(PyCFunction)py_gaussian_iir1d, METH_VARARGS, NULL},
   {"wavelet",(PyCFunction)py_wavelet, METH_VARARGS, NULL},
   {"iwavelet",(PyCFunction)py_iwavelet, METH_VARARGS, NULL},
   {"daubechies",(PyCFunction)py_daubechies, METH_VARARGS, NULL},
@@ -529,6 +1688,8 @@ PyMethodDef methods[] = {
   {"ihaar",(PyCFunction)py_ihaar, METH_VARARGS, NULL},
   {"rank_filter",(PyCFunction)py_rank_filter, METH_VARARGS, NULL},
   {"template_match",(PyCFunction)py_template_match, METH_VARARGS, NULL},
+  {"convolve_fft",(PyCFunction)py_convolve_fft, METH_VARARGS, NULL},
+  {"template_match_fft",(PyCFunction)py_template_match_fft, METH_VARARGS, NULL},
   {NULL, NULL,0,NULL},
 };
 
@@ -2,14 +2,15 @@
 //
 // License: MIT (see COPYING file)
 
+#include <algorithm>
 #include <limits>
-#include <memory>
-#include <iostream>
+#include <vector>
 #include <assert.h>
 
 #include "numpypp/array.hpp"
 #include "numpypp/dispatch.hpp"
 #include "utils.hpp"
+#include "parallel.hpp"
 
 extern "C" {
     #include <Python.h>
@@ -26,8 +27,16 @@ const char TypeErrorMsg[] =
 template<typename BaseType>
 inline BaseType square(BaseType x) { return x * x; }
 
-template<typename BaseType>
-void dist_transform(BaseType* Df, BaseType* f, const int n, const int stride, double* z, int* v, int* orig, int* ot, const int ostride) {
+// One dimensional distance transform (Felzenszwalb & Huttenlocher):
+//
+//      Df[q] = min_p w (q - p)**2 + f[p]
+//
+// (w is the squared spacing between elements) is computed as the lower
+// envelope of the parabolas rooted at each p. The result is written back to
+// f. If orig is not null, orig[q] is also set to orig[p] for the minimising p
+// (which is how the feature transform is computed).
+template<typename BaseType, typename LabelType>
+void dist_transform(BaseType* Df, BaseType* f, const int n, const npy_intp stride, const double w, double* z, int* v, LabelType* orig, LabelType* ot, const npy_intp ostride) {
     const double inf = std::numeric_limits<double>::infinity();
     const double minus_inf = -std::numeric_limits<double>::infinity();
     v[0] = 0;
@@ -35,10 +44,10 @@ void dist_transform(BaseType* Df, BaseType* f, const int n, const int stride, do
     z[1] = inf;
     int k = 0;
     for (int q = 1; q != n; ++q) {
-        BaseType s;
+        double s;
         do {
             assert(k >= 0);
-            s = ( (f[q*stride] + q*q) - (f[v[k]*stride] + v[k]*v[k])) / 2./ (q-v[k]);
+            s = ( (f[q*stride] + w*q*q) - (f[v[k]*stride] + w*v[k]*v[k])) / 2. / w / (q-v[k]);
             if (s > z[k]) break;
             --k;
         } while (true);
@@ -50,7 +59,7 @@ void dist_transform(BaseType* Df, BaseType* f, const int n, const int stride, do
     k = 0;
     for (int q = 0; q != n; ++q) {
         while (z[k+1] < q) ++k;
-        Df[q] = square(q-v[k]) + f[v[k]*stride];
+        Df[q] = w*square(q-v[k]) + f[v[k]*stride];
         if (orig) ot[q] = orig[v[k]*ostride];
     }
     for (int q = 0; q != n; ++q) {
@@ -59,88 +68,280 @@ void dist_transform(BaseType* Df, BaseType* f, const int n, const int stride, do
     }
 }
 
+// An array seen as a pointer & byte strides (this is also used for arrays
+// which are not numpy arrays, see gvoronoi)
+struct dt_array {
+    dt_array()
+        :data(0)
+        { }
+    explicit dt_array(PyArrayObject* array)
+        :data(static_cast<char*>(PyArray_DATA(array)))
+        {
+            std::copy(PyArray_STRIDES(array), PyArray_STRIDES(array) + PyArray_NDIM(array), strides);
+        }
+    // C-contiguous array of elements of the given size
+    dt_array(char* d, const int nd, const npy_intp* dims, const npy_intp itemsize)
+        :data(d)
+        {
+            npy_intp stride = itemsize;
+            for (int k = nd - 1; k >= 0; --k) {
+                strides[k] = stride;
+                stride *= dims[k];
+            }
+        }
+
+    // Byte offset of the start of line (along axis)
+    npy_intp line_offset(const int nd, const npy_intp* dims, const int axis, npy_intp line) const {
+        npy_intp offset = 0;
+        for (int d = nd - 1; d >= 0; --d) {
+            if (d == axis) continue;
+            offset += (line % dims[d]) * strides[d];
+            line /= dims[d];
+        }
+        return offset;
+    }
+
+    char* data;
+    npy_intp strides[NPY_MAXDIMS];
+};
+
+// The N-D transform is computed by applying the 1-D one along each axis in
+// turn (the squared euclidean distance is a sum over the axes).
+//
+// Along each axis, the lines are transformed in parallel. Along any axis but
+// the last, up to max_block neighbouring lines (along the last axis) are
+// copied at once into a contiguous tile (where element i of line b is at
+// i*nb + b), so that reading & writing the array goes along whole cache
+// lines rather than jumping by a full row for each element.
+template<typename BaseType, typename LabelType>
+struct dt_worker {
+    enum { max_block = 16 };
+
+    dt_worker(const int nd, const npy_intp* dims, const dt_array& f, const dt_array& orig, const int axis, const double w)
+        :nd_(nd)
+        ,dims_(dims)
+        ,f_(f)
+        ,orig_(orig)
+        ,axis_(axis)
+        ,w_(w)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int nd = nd_;
+        const npy_intp n = dims_[axis_];
+        const npy_intp last = dims_[nd - 1];
+        const bool blocked = (axis_ != nd - 1);
+        const bool has_orig = (orig_.data != 0);
+        const npy_intp fstride = f_.strides[axis_];
+        const npy_intp fbstride = f_.strides[nd - 1];
+        const npy_intp ostride = (has_orig ? orig_.strides[axis_] : 0);
+        const npy_intp obstride = (has_orig ? orig_.strides[nd - 1] : 0);
+
+        std::vector<BaseType> tile(n * max_block);
+        std::vector<BaseType> Df(n);
+        std::vector<double> z(n + 1);
+        std::vector<int> v(n);
+        std::vector<LabelType> otile(has_orig ? n * max_block : 0);
+        std::vector<LabelType> ot(has_orig ? n : 0);
+
+        for (npy_intp line = start; line != end; ) {
+            const npy_intp nb = (blocked ? std::min(std::min<npy_intp>(max_block, end - line), last - line % last) : 1);
+            char* fbase = f_.data + f_.line_offset(nd, dims_, axis_, line);
+            char* obase = (has_orig ? orig_.data + orig_.line_offset(nd, dims_, axis_, line) : 0);
+            for (npy_intp i = 0; i != n; ++i) {
+                const char* p = fbase + i*fstride;
+                for (npy_intp b = 0; b != nb; ++b) tile[i*nb + b] = *reinterpret_cast<const BaseType*>(p + b*fbstride);
+                if (has_orig) {
+                    const char* op = obase + i*ostride;
+                    for (npy_intp b = 0; b != nb; ++b) otile[i*nb + b] = *reinterpret_cast<const LabelType*>(op + b*obstride);
+                }
+            }
+            for (npy_intp b = 0; b != nb; ++b) {
+                dist_transform<BaseType, LabelType>(&Df[0], &tile[b], n, nb, w_, &z[0], &v[0], (has_orig ? &otile[b] : 0), (has_orig ? &ot[0] : 0), nb);
+            }
+            for (npy_intp i = 0; i != n; ++i) {
+                char* p = fbase + i*fstride;
+                for (npy_intp b = 0; b != nb; ++b) *reinterpret_cast<BaseType*>(p + b*fbstride) = tile[i*nb + b];
+                if (has_orig) {
+                    char* op = obase + i*ostride;
+                    for (npy_intp b = 0; b != nb; ++b) *reinterpret_cast<LabelType*>(op + b*obstride) = otile[i*nb + b];
+                }
+            }
+            line += nb;
+        }
+    }
+
+    const int nd_;
+    const npy_intp* const dims_;
+    const dt_array f_;
+    const dt_array orig_;
+    const int axis_;
+    const double w_;
+};
+
+// Must be called without the GIL
+template<typename BaseType, typename LabelType>
+void dt_nd(const int nd, const npy_intp* dims, const dt_array& f, const dt_array& orig, const double* spacing) {
+    npy_intp size = 1;
+    for (int k = 0; k != nd; ++k) size *= dims[k];
+    if (!size) return;
+    for (int k = 0; k != nd; ++k) {
+        dt_worker<BaseType, LabelType> worker(nd, dims, f, orig, k, spacing[k]*spacing[k]);
+        parallel_for(size/dims[k], worker, std::max<npy_intp>(dt_worker<BaseType, LabelType>::max_block, 16384/dims[k]));
+    }
+}
+
+template<typename BaseType>
+void dt(PyArrayObject* f, PyArrayObject* orig, const double* spacing) {
+    gil_release nogil;
+    dt_nd<BaseType, int>(PyArray_NDIM(f), PyArray_DIMS(f), dt_array(f), (orig ? dt_array(orig) : dt_array()), spacing);
+}
 
 PyObject* py_dt(PyObject* self, PyObject* args) {
     PyArrayObject* f;
     PyArrayObject* orig;
-    if (!PyArg_ParseTuple(args, "OO", &f, &orig) ||
-            !PyArray_Check(f)
+    PyArrayObject* sampling;
+    if (!PyArg_ParseTuple(args, "OOO", &f, &orig, &sampling) ||
+            !PyArray_Check(f) ||
+            !PyArray_Check(sampling) ||
+            !PyArray_EquivTypenums(PyArray_TYPE(sampling), NPY_DOUBLE) ||
+            !PyArray_ISCARRAY_RO(sampling) ||
+            PyArray_SIZE(sampling) != PyArray_NDIM(f)
             ) {
         PyErr_SetString(PyExc_RuntimeError, "Bad arguments to internal function.");
         return NULL;
     }
     if (PyArray_Check(orig)) {
-        if (!PyArray_EquivTypenums(PyArray_TYPE(orig), NPY_INT)) {
+        if (!PyArray_EquivTypenums(PyArray_TYPE(orig), NPY_INT) ||
+            PyArray_NDIM(orig) != PyArray_NDIM(f)) {
             PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
             return NULL;
         }
-        Py_INCREF(orig);
+        for (int k = 0; k != PyArray_NDIM(f); ++k) {
+            if (PyArray_DIM(orig, k) != PyArray_DIM(f, k)) {
+                PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+                return NULL;
+            }
+        }
     } else {
         orig = 0;
     }
+    const double* spacing = static_cast<const double*>(PyArray_DATA(sampling));
+
+#define HANDLE(type) \
+    dt<type>(f, orig, spacing);
+    SAFE_SWITCH_ON_FLOAT_TYPES_OF(f, true);
+#undef HANDLE
+
     Py_INCREF(f);
-    int* orig_i = (orig? static_cast<int*>(PyArray_DATA(orig)) : 0);
-    npy_intp* ostrides = (orig ? PyArray_STRIDES(orig) : 0);
-    double* z = 0;
-    int* v = 0;
-    void* Df = 0;
-    int* ot = 0;
-    const int ndims = PyArray_NDIM(f);
-    const int size = PyArray_SIZE(f);
-    const npy_intp* strides = PyArray_STRIDES(f);
-    npy_intp max_size = 0;
-    void* const data = PyArray_DATA(f);
-
-    if (ndims != 2) {
-        PyErr_SetString(PyExc_RuntimeError, "_distance only implemented for 2-d arrays.");
-        goto exit;
+    return PyArray_Return(f);
+}
+
+// Generalised Voronoi transform
+//
+// This is the feature transform, except that the labels themselves (rather
+// than the indices of the nearest object pixels) are carried along the
+// passes, directly in the output. The squared distances are computed in the
+// float32 array the caller wants them in or, if the caller does not want
+// them, in a temporary double buffer (so that ties between objects far from
+// a pixel are resolved exactly).
+// std::vector<bool> cannot be used for the tiles in dt_worker
+template<typename T>
+struct dt_label { typedef T type; };
+
+template<>
+struct dt_label<bool> { typedef unsigned char type; };
+
+template<typename T, typename D>
+void gvoronoi(PyArrayObject* labeled, PyArrayObject* result, D* distances, const double* spacing) {
+    const int nd = PyArray_NDIM(labeled);
+    const npy_intp* dims = PyArray_DIMS(labeled);
+    const npy_intp size = PyArray_SIZE(labeled);
+    T* out = static_cast<T*>(PyArray_DATA(result));
+    if (nd == 0) {
+        const T v = *static_cast<const T*>(PyArray_DATA(labeled));
+        out[0] = v;
+        distances[0] = (v != T() ? D(0) : std::numeric_limits<D>::infinity());
+        return;
     }
-    try {
-        for (int k = 0; k != ndims; ++k) {
-            npy_intp cur = PyArray_DIM(f, k);
-            if (cur > max_size) max_size = cur;
-        }
-        z = new double[max_size + 1];
-        v = new int[max_size];
-        Df = operator new(PyArray_ITEMSIZE(f) * max_size);
-        ot = (orig ? new int[max_size] : 0);
-
-        for (int k = 0; k != ndims; ++k) {
-            const int n = PyArray_DIM(f, k);
-            const int outer_n = size/n;
-            for (int start = 0; start != outer_n; ++start) {
-                int* orig_start = (orig_i ? orig_i + start * ostrides[1-k]/sizeof(int) : 0);
-                int ostride = (orig_i ? ostrides[k]/sizeof(int) : 0);
-                switch(PyArray_TYPE(f)) {
-#define HANDLE(type) { \
-                        type* typed_data = static_cast<type*>(data); \
-                        const int offset = start*strides[1-k]/sizeof(type); \
-                        dist_transform<type>(static_cast<type*>(Df), typed_data + offset, n, strides[k]/sizeof(type), z, v, orig_start, ot, ostride); \
-                    }
-
-                    HANDLE_FLOAT_TYPES();
-#undef HANDLE
-                }
-            }
+    // larger than any distance in the array
+    double big = 1.;
+    for (int k = 0; k != nd; ++k) big += (dims[k]*spacing[k])*(dims[k]*spacing[k]);
+
+    const dt_array input(labeled);
+    const npy_intp n = dims[nd - 1];
+    const npy_intp stride = input.strides[nd - 1];
+    for (npy_intp line = 0, i = 0; i != size; ++line) {
+        const char* p = input.data + input.line_offset(nd, dims, nd - 1, line);
+        for (npy_intp j = 0; j != n; ++j, ++i, p += stride) {
+            const T v = *reinterpret_cast<const T*>(p);
+            out[i] = v;
+            distances[i] = (v != T() ? D(0) : D(big));
         }
-    } catch (const std::bad_alloc&) {
-        PyErr_NoMemory();
     }
-    exit:
-    delete [] z;
-    delete [] v;
-    delete [] ot;
-    operator delete(Df);
-    Py_XDECREF(orig);
-    if (PyErr_Occurred()) {
-        Py_DECREF(f);
+    dt_nd<D, typename dt_label<T>::type>(nd, dims,
+            dt_array(reinterpret_cast<char*>(distances), nd, dims, sizeof(D)),
+            dt_array(result),
+            spacing);
+}
+
+template<typename T>
+void gvoronoi(PyArrayObject* labeled, PyArrayObject* result, float* distances, const double* spacing) {
+    gil_release nogil;
+    if (distances) {
+        gvoronoi<T, float>(labeled, result, distances, spacing);
+    } else {
+        std::vector<double> buffer(std::max<npy_intp>(PyArray_SIZE(labeled), 1));
+        gvoronoi<T, double>(labeled, result, &buffer[0], spacing);
+    }
+}
+
+PyObject* py_gvoronoi(PyObject* self, PyObject* args) {
+    PyArrayObject* labeled;
+    PyArrayObject* output;
+    PyObject* distances_obj;
+    PyArrayObject* sampling;
+    if (!PyArg_ParseTuple(args, "OOOO", &labeled, &output, &distances_obj, &sampling) ||
+            !PyArray_Check(labeled) ||
+            !PyArray_Check(output) ||
+            !PyArray_Check(sampling) ||
+            !PyArray_EquivTypenums(PyArray_TYPE(labeled), PyArray_TYPE(output)) ||
+            !numpy::same_shape(labeled, output) ||
+            !PyArray_ISCARRAY(output) ||
+            !PyArray_EquivTypenums(PyArray_TYPE(sampling), NPY_DOUBLE) ||
+            !PyArray_ISCARRAY_RO(sampling) ||
+            PyArray_SIZE(sampling) != PyArray_NDIM(labeled)
+            ) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
         return NULL;
     }
-    return PyArray_Return(f);
+    float* distances = 0;
+    if (distances_obj != Py_None) {
+        PyArrayObject* darray = reinterpret_cast<PyArrayObject*>(distances_obj);
+        if (!PyArray_Check(darray) ||
+            !PyArray_EquivTypenums(PyArray_TYPE(darray), NPY_FLOAT) ||
+            !numpy::same_shape(labeled, darray) ||
+            !PyArray_ISCARRAY(darray)) {
+            PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+            return NULL;
+        }
+        distances = static_cast<float*>(PyArray_DATA(darray));
+    }
+    const double* spacing = static_cast<const double*>(PyArray_DATA(sampling));
+    holdref r(output);
+
+#define HANDLE(type) \
+    gvoronoi<type>(labeled, output, distances, spacing);
+    SAFE_SWITCH_ON_TYPES_OF(labeled, true);
+#undef HANDLE
+
+    Py_INCREF(output);
+    return PyArray_Return(output);
 }
 
 PyMethodDef methods[] = {
   {"dt", (PyCFunction)py_dt, METH_VARARGS, "Internal function. DO NOT CALL DIRECTLY!"},
+  {"gvoronoi", (PyCFunction)py_gvoronoi, METH_VARARGS, "Internal function. DO NOT CALL DIRECTLY!"},
   {NULL, NULL,0,NULL},
 };
 
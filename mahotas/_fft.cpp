@@ -0,0 +1,215 @@
+// Copyright (C) 2012 Luis Pedro Coelho <luis@luispedro.org>
+//
+// License: MIT (Check COPYING file)
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "_fft.h"
+#include "parallel.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+namespace {
+
+const int max_radix = 5;
+const double pi = 3.14159265358979323846;
+const double sin60 = 0.86602540378443864676;
+const double cos72 = 0.30901699437494742410;
+const double sin72 = 0.95105651629515357212;
+const double cos144 = -0.80901699437494742410;
+const double sin144 = 0.58778525229247312917;
+
+inline complex_t minus_i(const complex_t& z) {
+    return complex_t(z.imag(), -z.real());
+}
+
+inline complex_t conj_if(const complex_t& z, const bool conjugate) {
+    return (conjugate ? std::conj(z) : z);
+}
+
+}
+
+npy_intp fft_size(const npy_intp n) {
+    if (n <= 1) return 1;
+    npy_intp best = 1;
+    while (best < n) best *= 2;
+    for (npy_intp p5 = 1; p5 < best; p5 *= 5) {
+        for (npy_intp p35 = p5; p35 < best; p35 *= 3) {
+            npy_intp s = p35;
+            while (s < n) s *= 2;
+            if (s < best) best = s;
+        }
+    }
+    return best;
+}
+
+fft_plan::fft_plan(const npy_intp n)
+    :n_(n)
+    {
+        npy_intp left = n;
+        while (left % 4 == 0) { factors_.push_back(4); left /= 4; }
+        const int radices[] = { 2, 3, 5 };
+        for (int r = 0; r != 3; ++r) {
+            while (left % radices[r] == 0) { factors_.push_back(radices[r]); left /= radices[r]; }
+        }
+        assert(left == 1);
+        twiddles_.resize(n);
+        for (npy_intp j = 0; j != n; ++j) {
+            const double angle = -2. * pi * double(j) / double(n);
+            twiddles_[j] = complex_t(std::cos(angle), std::sin(angle));
+        }
+    }
+
+void fft_plan::forward(const complex_t* in, const npy_intp stride, complex_t* out) const {
+    transform(in, stride, out, n_, 0);
+}
+
+// The DFT of size n = r*m is computed from the DFTs of size m of the r
+// subsequences in[q + j*r] (q < r), which are written to out[q*m : (q+1)*m]:
+//
+//     out[k + m*k2] = sum_q w_n^(qk) w_r^(q k2) sub_q[k]
+//
+// For each k, this reads & writes the same r positions of out, so it can be
+// done in place.
+void fft_plan::transform(const complex_t* in, const npy_intp stride, complex_t* out, const npy_intp n, const unsigned level) const {
+    if (n == 1) {
+        out[0] = in[0];
+        return;
+    }
+    const int r = factors_[level];
+    const npy_intp m = n / r;
+    if (m == 1) {
+        for (int q = 0; q != r; ++q) out[q] = in[q*stride];
+    } else {
+        for (int q = 0; q != r; ++q) transform(in + q*stride, stride*r, out + q*m, m, level + 1);
+    }
+
+    // w_n^j == twiddles_[j*tstep]
+    const npy_intp tstep = n_ / n;
+    complex_t y[max_radix];
+    for (npy_intp k = 0; k != m; ++k) {
+        y[0] = out[k];
+        for (int q = 1; q != r; ++q) y[q] = multiply(out[q*m + k], twiddles_[q*k*tstep]);
+        switch (r) {
+            case 2:
+                out[k] = y[0] + y[1];
+                out[k + m] = y[0] - y[1];
+                break;
+            case 4: {
+                const complex_t a = y[0] + y[2];
+                const complex_t b = y[0] - y[2];
+                const complex_t c = y[1] + y[3];
+                const complex_t d = minus_i(y[1] - y[3]);
+                out[k] = a + c;
+                out[k + m] = b + d;
+                out[k + 2*m] = a - c;
+                out[k + 3*m] = b - d;
+                break;
+            }
+            case 3: {
+                const complex_t a = y[1] + y[2];
+                const complex_t b = y[0] - a * .5;
+                const complex_t c = minus_i(y[1] - y[2]) * sin60;
+                out[k] = y[0] + a;
+                out[k + m] = b + c;
+                out[k + 2*m] = b - c;
+                break;
+            }
+            case 5: {
+                const complex_t a1 = y[1] + y[4];
+                const complex_t a2 = y[2] + y[3];
+                const complex_t b1 = y[1] - y[4];
+                const complex_t b2 = y[2] - y[3];
+                const complex_t t1 = y[0] + a1 * cos72 + a2 * cos144;
+                const complex_t t2 = y[0] + a1 * cos144 + a2 * cos72;
+                const complex_t u1 = minus_i(b1 * sin72 + b2 * sin144);
+                const complex_t u2 = minus_i(b1 * sin144 - b2 * sin72);
+                out[k] = y[0] + a1 + a2;
+                out[k + m] = t1 + u1;
+                out[k + 2*m] = t2 + u2;
+                out[k + 3*m] = t2 - u2;
+                out[k + 4*m] = t1 - u1;
+                break;
+            }
+        }
+    }
+}
+
+namespace {
+
+struct fft_axis_worker {
+    fft_axis_worker(complex_t* data, const int nd, const npy_intp* dims, const int axis, const fft_plan& plan, const bool inverse)
+        :data_(data)
+        ,nd_(nd)
+        ,dims_(dims)
+        ,axis_(axis)
+        ,plan_(plan)
+        ,inverse_(inverse)
+        { }
+
+    // Along any axis but the last, several neighbouring lines are copied at
+    // once (so that whole cache lines are read).
+    enum { max_block = 8 };
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const npy_intp n = dims_[axis_];
+        const npy_intp last = dims_[nd_ - 1];
+        const bool blocked = (axis_ != nd_ - 1);
+        npy_intp astride = 1;
+        for (int d = nd_ - 1; d > axis_; --d) astride *= dims_[d];
+        std::vector<complex_t> buffer(n * max_block);
+        std::vector<complex_t> out(n);
+
+        for (npy_intp line = start; line != end; ) {
+            const npy_intp nb = (blocked ? std::min(std::min<npy_intp>(max_block, end - line), last - line % last) : 1);
+            complex_t* base = data_;
+            npy_intp pos = line;
+            npy_intp dstride = 1;
+            for (int d = nd_ - 1; d >= 0; --d) {
+                if (d != axis_) {
+                    base += (pos % dims_[d]) * dstride;
+                    pos /= dims_[d];
+                }
+                dstride *= dims_[d];
+            }
+            for (npy_intp i = 0; i != n; ++i) {
+                const complex_t* p = base + i*astride;
+                for (npy_intp b = 0; b != nb; ++b) buffer[b*n + i] = conj_if(p[b], inverse_);
+            }
+            for (npy_intp b = 0; b != nb; ++b) {
+                plan_.forward(&buffer[b*n], 1, &out[0]);
+                complex_t* p = base + b;
+                for (npy_intp i = 0; i != n; ++i) p[i*astride] = conj_if(out[i], inverse_);
+            }
+            line += nb;
+        }
+    }
+
+    complex_t* const data_;
+    const int nd_;
+    const npy_intp* const dims_;
+    const int axis_;
+    const fft_plan& plan_;
+    const bool inverse_;
+};
+
+}
+
+void fft_nd(complex_t* data, const int nd, const npy_intp* dims, const bool inverse) {
+    npy_intp total = 1;
+    for (int d = 0; d != nd; ++d) total *= dims[d];
+    if (total == 0) return;
+    for (int d = 0; d != nd; ++d) {
+        const npy_intp n = dims[d];
+        if (n == 1) continue;
+        fft_plan plan(n);
+        fft_axis_worker worker(data, nd, dims, d, plan, inverse);
+        parallel_for(total / n, worker, std::max<npy_intp>(fft_axis_worker::max_block, 16384/n));
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef MAHOTAS_FFT_H_INCLUDE_GUARD_LPC_
+#define MAHOTAS_FFT_H_INCLUDE_GUARD_LPC_
+// Part of mahotas. See LICENSE file for License
+// Copyright 2012 Luis Pedro Coelho <luis@luispedro.org>
+
+// Fast Fourier transforms
+//
+// This is a plain mixed-radix (2, 3, 4 & 5) decimation in time FFT. It only
+// handles sizes with no prime factors other than 2, 3 & 5 (fft_size() returns
+// the smallest such size which is not smaller than its argument): the callers
+// pad their input to one of these sizes anyway.
+
+#include <complex>
+#include <vector>
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+typedef std::complex<double> complex_t;
+
+// Plain complex multiplication (operator* also handles infinities & NaNs,
+// which makes it much slower)
+inline complex_t multiply(const complex_t& a, const complex_t& b) {
+    return complex_t(a.real()*b.real() - a.imag()*b.imag(), a.real()*b.imag() + a.imag()*b.real());
+}
+
+// Smallest n' >= n whose only prime factors are 2, 3 & 5
+npy_intp fft_size(const npy_intp n);
+
+struct fft_plan {
+    // n must be a valid size (see fft_size)
+    explicit fft_plan(const npy_intp n);
+
+    npy_intp size() const { return n_; }
+
+    // out[k] = sum_j in[j*stride] exp(-2 pi i jk/n)
+    // in & out must not overlap
+    void forward(const complex_t* in, const npy_intp stride, complex_t* out) const;
+
+    private:
+        void transform(const complex_t* in, const npy_intp stride, complex_t* out, const npy_intp n, const unsigned level) const;
+
+        npy_intp n_;
+        std::vector<int> factors_;
+        // twiddles_[j] = exp(-2 pi i j/n)
+        std::vector<complex_t> twiddles_;
+};
+
+// Computes the N-D DFT of data (a C-contiguous array of shape dims) in place.
+// The inverse transform is not normalised (i.e., the result is multiplied by
+// the number of elements of the array). This runs in parallel.
+void fft_nd(complex_t* data, const int nd, const npy_intp* dims, const bool inverse);
+
+#endif // MAHOTAS_FFT_H_INCLUDE_GUARD_LPC_
@@ -36,6 +36,12 @@ void init_filter_iterator(const int rank, const npy_intp *fshape,
                     npy_intp* strides, npy_intp* backstrides,
                     npy_intp* minbound, npy_intp* maxbound);
 
+// Minimum number of points to process in each task when a filter is run in
+// parallel (so that the overhead of splitting the work is negligible).
+inline npy_intp filter_grain(const npy_intp filter_size) {
+    return std::max<npy_intp>(1024, 65536/std::max<npy_intp>(filter_size, 1));
+}
+
 template <typename T>
 struct filter_iterator {
     /* Move to the next point in an array, possible changing the pointer
@@ -57,7 +63,8 @@ struct filter_iterator {
             }
         }
         size_ = init_filter_offsets(array, footprint, PyArray_DIMS(filter), 0,
-                    mode, offsets_, 0);
+                    mode, own_offsets_, 0);
+        offsets_ = &own_offsets_;
         if (compress) {
             int j = 0;
             T* new_filter_data = new T[size_];
@@ -76,11 +83,63 @@ struct filter_iterator {
             PyArray_DIMS(array), /*origins*/0,
             this->strides_, this->backstrides_,
             this->minbound_, this->maxbound_);
-        cur_offsets_idx_ = this->offsets_.begin();
+        cur_offsets_idx_ = this->offsets_->begin();
+
+        // The interior is the region where the filter fits entirely inside
+        // the array. It only exists if the array is at least as large as the
+        // filter along every dimension.
+        has_interior_ = (nd_ > 0 && size_ > 0);
+        npy_intp interior_idx = 0;
+        for (int d = 0; d != nd_; ++d) {
+            if (this->minbound_[d] > this->maxbound_[d]) has_interior_ = false;
+            interior_idx += this->minbound_[d] * this->strides_[d];
+        }
+        interior_offsets_idx_ = (has_interior_ ? this->offsets_->begin() + interior_idx : this->offsets_->end());
     }
+    // Copies share the filter data and offsets with the original (which must
+    // outlive them). This is meant for creating one filter_iterator per
+    // thread (see seek()).
+    filter_iterator(const filter_iterator& other)
+        :filter_data_(other.filter_data_)
+        ,own_filter_data_(false)
+        ,cur_offsets_idx_(other.cur_offsets_idx_)
+        ,interior_offsets_idx_(other.interior_offsets_idx_)
+        ,has_interior_(other.has_interior_)
+        ,size_(other.size_)
+        ,nd_(other.nd_)
+        ,offsets_(other.offsets_)
+        {
+            std::copy(other.strides_, other.strides_ + nd_, strides_);
+            std::copy(other.backstrides_, other.backstrides_ + nd_, backstrides_);
+            std::copy(other.minbound_, other.minbound_ + nd_, minbound_);
+            std::copy(other.maxbound_, other.maxbound_ + nd_, maxbound_);
+        }
+
     ~filter_iterator() {
         if (own_filter_data_) delete [] filter_data_;
     }
+
+    // Moves both this filter_iterator and iterator (which must both be at
+    // the start of the array) to the point with flat index pos.
+    template <typename OtherIterator>
+    void seek(OtherIterator& iterator, npy_intp pos) {
+        assert(this->cur_offsets_idx_ == this->offsets_->begin());
+        npy_intp stride = 0;
+        for (int d = 0; d != nd_; ++d) {
+            const npy_intp dim = iterator.dimensions_[d];
+            const npy_intp p = pos % dim;
+            pos /= dim;
+            // see iterator_base's constructor for how steps_ are computed
+            stride += iterator.steps_[d];
+            iterator.position_.position_[d] = p;
+            iterator.data_ += p * stride;
+            stride *= dim;
+
+            const npy_intp region = std::min(p, this->minbound_[d])
+                        + std::max<npy_intp>(0, p - std::max(this->minbound_[d], this->maxbound_[d]));
+            this->cur_offsets_idx_ += region * this->strides_[d];
+        }
+    }
     template <typename OtherIterator>
     void iterate_both(OtherIterator& iterator) {
         for (int d = 0; d < nd_; ++d) {
@@ -92,12 +151,64 @@ struct filter_iterator {
                 break;
             }
             this->cur_offsets_idx_ -= this->backstrides_[d];
-            assert(this->cur_offsets_idx_ >= this->offsets_.begin());
-            assert(this->cur_offsets_idx_ < this->offsets_.end());
+            assert(this->cur_offsets_idx_ >= this->offsets_->begin());
+            assert(this->cur_offsets_idx_ < this->offsets_->end());
         }
         ++iterator;
     }
 
+    /* Fast path for the interior of the array.
+     *
+     * In the interior, the offsets are the same for every point and are never
+     * border_flag_value, so a kernel can use interior_offsets() directly
+     * (with pointer arithmetic) instead of calling retrieve() for each point.
+     * The typical loop looks like:
+     *
+     *     const npy_intp run = fiter.interior_run(iter);
+     *     if (run) {
+     *         const T* p = &*iter;
+     *         const npy_intp step = fiter.row_step(iter);
+     *         // process p[r*step + offsets[j]] for r in [0, run)
+     *         fiter.advance(iter, run);
+     *     } else {
+     *         // generic (border) code using retrieve()
+     *         fiter.iterate_both(iter);
+     *     }
+     */
+
+    // Number of points, starting at the current one and moving along the
+    // last axis, which are all in the interior (0 if the current point is on
+    // the border).
+    template <typename OtherIterator>
+    npy_intp interior_run(const OtherIterator& iterator) const {
+        if (!has_interior_ || this->cur_offsets_idx_ != this->interior_offsets_idx_) return 0;
+        return this->maxbound_[0] - iterator.index_rev(0) + 1;
+    }
+
+    // Offsets (in units of T) valid for every point in the interior
+    const npy_intp* interior_offsets() const {
+        assert(has_interior_);
+        return &*this->interior_offsets_idx_;
+    }
+
+    // Distance (in units of T) between two consecutive points along the last
+    // axis
+    template <typename OtherIterator>
+    npy_intp row_step(const OtherIterator& iterator) const {
+        return iterator.steps_[0];
+    }
+
+    // Equivalent to calling iterate_both(iterator) n times.
+    // n must be at most interior_run(iterator)
+    template <typename OtherIterator>
+    void advance(OtherIterator& iterator, const npy_intp n) {
+        assert(n > 0);
+        assert(n <= interior_run(iterator));
+        iterator.data_ += (n - 1) * iterator.steps_[0];
+        iterator.position_.position_[0] += (n - 1);
+        this->iterate_both(iterator);
+    }
+
     template <typename OtherIterator>
     bool retrieve(const OtherIterator& iterator, const npy_intp j, T& array_val) {
         if (this->cur_offsets_idx_[j] == border_flag_value) return false;
@@ -112,14 +223,20 @@ struct filter_iterator {
     }
 
     const T& operator [] (const npy_intp j) const { assert(j < size_); return filter_data_[j]; }
+    const T* filter_data() const { return filter_data_; }
     npy_intp size() const { return size_; }
     private:
+        filter_iterator& operator = (const filter_iterator&);
+
         const T* filter_data_;
         bool own_filter_data_;
         std::vector<npy_intp>::const_iterator cur_offsets_idx_;
+        std::vector<npy_intp>::const_iterator interior_offsets_idx_;
+        bool has_interior_;
         npy_intp size_;
         const npy_intp nd_;
-        std::vector<npy_intp> offsets_;
+        std::vector<npy_intp> own_offsets_;
+        const std::vector<npy_intp>* offsets_;
         npy_intp strides_[NPY_MAXDIMS];
         npy_intp backstrides_[NPY_MAXDIMS];
         npy_intp minbound_[NPY_MAXDIMS];
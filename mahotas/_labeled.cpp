@@ -1,13 +1,16 @@
 // Copyright (C) 2010-2012  Luis Pedro Coelho <luis@luispedro.org>
 //
 // License: MIT (see COPYING file)
-#include <map>
+#include <algorithm>
 #include <functional>
+#include <limits>
+#include <vector>
 
 #include "numpypp/array.hpp"
 #include "numpypp/numpy.hpp"
 #include "numpypp/dispatch.hpp"
 #include "utils.hpp"
+#include "parallel.hpp"
 #include "_filters.h"
 
 extern "C" {
@@ -22,89 +25,428 @@ const char TypeErrorMsg[] =
     "This is caused by either a direct call to _labeled (which is dangerous: types are not checked!) or a bug in labeled.py.\n";
 
 
-// This is a standard union-find structure
-int find(int* data, int i) {
-    if (data[i] == i) return i;
-    int j = find(data, data[i]);
-    data[i] = j;
+// Connected component labeling
+//
+// This is the classical two-pass algorithm: the array is scanned in order &
+// each pixel is given the label of one of its neighbours which come before it
+// (or a new provisional label, if there are none). Whenever two different
+// provisional labels meet, they are merged in a union-find structure (which
+// always keeps the smallest label as the root). A second pass replaces the
+// provisional labels by the final ones.
+//
+// As the root of each component is the provisional label of its first pixel,
+// the final labels are numbered by order of first appearance.
+
+// This is a standard union-find structure (on a flat array, where parent[i] <= i)
+int find(std::vector<int>& parent, int i) {
+    int root = i;
+    while (parent[root] != root) root = parent[root];
+    while (parent[i] != root) {
+        const int next = parent[i];
+        parent[i] = root;
+        i = next;
+    }
+    return root;
+}
+
+// Merges the sets of i & j and returns the root of the result
+int join(std::vector<int>& parent, int i, int j) {
+    i = find(parent, i);
+    j = find(parent, j);
+    if (i < j) std::swap(i, j);
+    parent[i] = j;
     return j;
 }
-void compress(int* data, int i) {
-    find(data,i);
+
+inline int new_label(std::vector<int>& parent) {
+    const int label = parent.size();
+    parent.push_back(label);
+    return label;
+}
+
+// Neighbours which come before the current pixel in scan order
+struct causal_neighbourhood {
+    // For each neighbour, delta[n*nd + d] is its offset along axis d
+    std::vector<npy_intp> delta;
+    std::vector<npy_intp> offsets;
+    int size() const { return offsets.size(); }
+};
+
+// Two pixels are neighbours if their difference (or its opposite) is in Bc
+// (so that non-symmetric structuring elements are handled as before).
+causal_neighbourhood causal_neighbours(const numpy::aligned_array<int>& labeled, numpy::aligned_array<int>& Bc) {
+    const int nd = labeled.ndims();
+    std::vector<npy_intp> candidates;
+    numpy::aligned_array<int>::iterator biter = Bc.begin();
+    for (npy_intp i = 0; i != Bc.size(); ++i, ++biter) {
+        if (!*biter) continue;
+        npy_intp pos[NPY_MAXDIMS];
+        npy_intp left = i;
+        for (int d = nd - 1; d >= 0; --d) {
+            pos[d] = left % Bc.dim(d) - Bc.dim(d)/2;
+            left /= Bc.dim(d);
+        }
+        int first = 0;
+        while (first != nd && !pos[first]) ++first;
+        if (first == nd) continue;
+        // Keep the one of pos & -pos which comes first in scan order
+        const npy_intp sign = (pos[first] < 0 ? 1 : -1);
+        for (int d = 0; d != nd; ++d) candidates.push_back(sign * pos[d]);
+    }
+
+    causal_neighbourhood res;
+    const npy_intp nc = candidates.size()/std::max(nd, 1);
+    for (npy_intp c = 0; c != nc; ++c) {
+        const npy_intp* cur = &candidates[c*nd];
+        bool seen = false;
+        for (int n = 0; n != res.size() && !seen; ++n) {
+            seen = std::equal(cur, cur + nd, &res.delta[n*nd]);
+        }
+        if (seen) continue;
+        npy_intp offset = 0;
+        for (int d = 0; d != nd; ++d) offset = offset*labeled.dim(d) + cur[d];
+        res.delta.insert(res.delta.end(), cur, cur + nd);
+        res.offsets.push_back(offset);
+    }
+    return res;
+}
+
+// 2-D labeling with the 4 or 8 neighbourhood, which only needs to look at the
+// previous row & pixel. With the 8 neighbourhood, the neighbours are checked
+// in the order of a decision tree (Wu, Otoo & Suzuki, 2005), which skips
+// those which are known to already have the same label:
+//
+//      a b c
+//      d x
+//
+// Only rows [y0, y1) are labeled (the rows before y0 are ignored).
+void label_2d(int* data, const npy_intp y0, const npy_intp y1, const npy_intp w, const bool eight, std::vector<int>& parent) {
+    for (npy_intp y = y0; y != y1; ++y) {
+        int* row = data + y*w;
+        const int* up = row - w;
+        const bool has_up = (y != y0);
+        for (npy_intp x = 0; x != w; ++x) {
+            if (!row[x]) continue;
+            const int b = (has_up ? up[x] : 0);
+            const int d = (x ? row[x - 1] : 0);
+            int label;
+            if (!eight) {
+                if (b) {
+                    label = b;
+                    if (d && d != b) join(parent, b, d);
+                } else if (d) {
+                    label = d;
+                } else {
+                    label = new_label(parent);
+                }
+            } else {
+                const int a = (has_up && x ? up[x - 1] : 0);
+                const int c = (has_up && x + 1 != w ? up[x + 1] : 0);
+                if (b) {
+                    label = b;
+                } else if (c) {
+                    label = c;
+                    if (a && a != c) join(parent, c, a);
+                    else if (d && d != c) join(parent, c, d);
+                } else if (a) {
+                    label = a;
+                } else if (d) {
+                    label = d;
+                } else {
+                    label = new_label(parent);
+                }
+            }
+            row[x] = label;
+        }
+    }
 }
 
+// Labels the elements whose first coordinate is in [first, last) (the
+// elements before first are ignored)
+void label_nd(int* data, const npy_intp* dims, const int nd, const causal_neighbourhood& neighbours, const npy_intp first, const npy_intp last, std::vector<int>& parent) {
+    const int nn = neighbours.size();
+    const npy_intp w = dims[nd - 1];
+    npy_intp slab_rows = 1;
+    for (int d = 1; d < nd - 1; ++d) slab_rows *= dims[d];
+    const npy_intp row_start = (nd > 1 ? first*slab_rows : 0);
+    const npy_intp row_end = (nd > 1 ? last*slab_rows : 1);
+
+    // For each row, the neighbours which are inside the array (given the
+    // coordinates of the row) & the range of x for which they are
+    std::vector<npy_intp> active_offsets(nn);
+    std::vector<npy_intp> xstart(nn);
+    std::vector<npy_intp> xend(nn);
+    npy_intp coords[NPY_MAXDIMS] = { 0 };
+    coords[0] = first;
+    for (npy_intp r = row_start; r != row_end; ++r) {
+        int na = 0;
+        for (int n = 0; n != nn; ++n) {
+            const npy_intp* delta = &neighbours.delta[n*nd];
+            bool inside = true;
+            for (int d = 0; d != nd - 1; ++d) {
+                const npy_intp c = coords[d] + delta[d];
+                inside &= (c >= (d ? 0 : first) && c < dims[d]);
+            }
+            const npy_intp dx = delta[nd - 1];
+            if (!inside || dx >= w || -dx >= w) continue;
+            active_offsets[na] = neighbours.offsets[n];
+            xstart[na] = std::max<npy_intp>(0, -dx);
+            xend[na] = std::min<npy_intp>(w, w - dx);
+            ++na;
+        }
 
-void join(int* data, int i, int j) {
-    i = find(data, i);
-    j = find(data, j);
-    assert(i >= 0);
-    assert(j >= 0);
-    data[i] = j;
+        int* row = data + r*w;
+        for (npy_intp x = 0; x != w; ++x) {
+            if (!row[x]) continue;
+            int label = 0;
+            for (int n = 0; n != na; ++n) {
+                if (x < xstart[n] || x >= xend[n]) continue;
+                const int other = row[x + active_offsets[n]];
+                if (!other || other == label) continue;
+                if (!label) label = other;
+                else label = join(parent, label, other);
+            }
+            row[x] = (label ? label : new_label(parent));
+        }
+
+        for (int d = nd - 2; d >= 0; --d) {
+            if (++coords[d] != dims[d]) break;
+            coords[d] = 0;
+        }
+    }
+}
+
+// The array is cut into strips along the first axis, which are labeled
+// independently (in parallel), each with its own provisional labels. The
+// provisional labels of strip k are then offset by the number of labels in
+// the strips before it, so that they are still in scan order, and the
+// components which cross the strip boundaries are merged (serially: only the
+// first rows of each strip need to be looked at). Therefore, the result is
+// exactly the same as if the whole array was a single strip.
+struct label_strip {
+    npy_intp first;
+    npy_intp last;
+    int offset;
+    std::vector<int> parent;
+};
+
+struct label_strips_worker {
+    label_strips_worker(int* data, const npy_intp* dims, const int nd, const causal_neighbourhood& neighbours, const int special, std::vector<label_strip>& strips)
+        :data_(data)
+        ,dims_(dims)
+        ,nd_(nd)
+        ,neighbours_(neighbours)
+        ,special_(special)
+        ,strips_(strips)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        for (npy_intp s = start; s != end; ++s) {
+            label_strip& strip = strips_[s];
+            // parent[0] is not used (0 is the background)
+            strip.parent.assign(1, 0);
+            if (special_) label_2d(data_, strip.first, strip.last, dims_[1], special_ == 8, strip.parent);
+            else label_nd(data_, dims_, nd_, neighbours_, strip.first, strip.last, strip.parent);
+        }
+    }
+
+    int* const data_;
+    const npy_intp* const dims_;
+    const int nd_;
+    const causal_neighbourhood& neighbours_;
+    const int special_;
+    std::vector<label_strip>& strips_;
+};
+
+struct relabel_strips_worker {
+    relabel_strips_worker(int* data, const npy_intp slab, const std::vector<label_strip>& strips, const std::vector<int>& final)
+        :data_(data)
+        ,slab_(slab)
+        ,strips_(strips)
+        ,final_(final)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        for (npy_intp s = start; s != end; ++s) {
+            const label_strip& strip = strips_[s];
+            const int* final = &final_[strip.offset];
+            int* p = data_ + strip.first*slab_;
+            int* const pend = data_ + strip.last*slab_;
+            // final[0] belongs to the previous strip, so the background is
+            // handled separately (without a branch, as it is often mixed
+            // with the objects)
+            for ( ; p != pend; ++p) *p = final[*p] * (*p != 0);
+        }
+    }
+
+    int* const data_;
+    const npy_intp slab_;
+    const std::vector<label_strip>& strips_;
+    const std::vector<int>& final_;
+};
+
+// Merges, in the global union-find structure parent, the components of strip
+// k with those of the strips before it
+void merge_strip(const int* data, const npy_intp* dims, const int nd, const causal_neighbourhood& neighbours, const std::vector<label_strip>& strips, const npy_intp k, std::vector<int>& parent) {
+    const label_strip& strip = strips[k];
+    npy_intp slab = 1;
+    for (int d = 1; d != nd; ++d) slab *= dims[d];
+    npy_intp reach = 0;
+    for (int n = 0; n != neighbours.size(); ++n) reach = std::max<npy_intp>(reach, -neighbours.delta[n*nd]);
+    const npy_intp last = std::min<npy_intp>(strip.last, strip.first + reach);
+
+    npy_intp coords[NPY_MAXDIMS];
+    for (npy_intp i = strip.first*slab; i != last*slab; ++i) {
+        if (!data[i]) continue;
+        npy_intp left = i;
+        for (int d = nd - 1; d >= 0; --d) {
+            coords[d] = left % dims[d];
+            left /= dims[d];
+        }
+        const int label = strip.offset + data[i];
+        for (int n = 0; n != neighbours.size(); ++n) {
+            const npy_intp* delta = &neighbours.delta[n*nd];
+            const npy_intp c0 = coords[0] + delta[0];
+            if (c0 >= strip.first || c0 < 0) continue;
+            bool inside = true;
+            for (int d = 1; d != nd; ++d) {
+                const npy_intp c = coords[d] + delta[d];
+                inside &= (c >= 0 && c < dims[d]);
+            }
+            if (!inside) continue;
+            const int other = data[i + neighbours.offsets[n]];
+            if (!other) continue;
+            npy_intp os = k - 1;
+            while (strips[os].first > c0) --os;
+            join(parent, label, strips[os].offset + other);
+        }
+    }
 }
 
 int label(numpy::aligned_array<int> labeled, numpy::aligned_array<int> Bc) {
     gil_release nogil;
     const int N = labeled.size();
+    if (!N) return 0;
     int* data = labeled.data();
-    for (int i = 0; i != N; ++i) {
-        data[i] = (data[i] ? i : -1);
-    }
-    numpy::aligned_array<int>::iterator iter = labeled.begin();
-    filter_iterator<int> filter(labeled.raw_array(), Bc.raw_array());
-    const int N2 = filter.size();
-    for (int i = 0; i != N; ++i, filter.iterate_both(iter)) {
-        if (*iter != -1) {
-            for (int j = 0; j != N2; ++j) {
-                int arr_val = false;
-                filter.retrieve(iter, j, arr_val);
-                if (arr_val != -1) {
-                    join(data, i, arr_val);
-                }
-            }
+    const int nd = labeled.ndims();
+    if (nd == 0) {
+        data[0] = (data[0] ? 1 : 0);
+        return data[0];
+    }
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = labeled.dim(d);
+
+    const causal_neighbourhood neighbours = causal_neighbours(labeled, Bc);
+    // special is 4 or 8 for the 2-D 4 & 8 neighbourhoods (in the order they
+    // are generated by causal_neighbours), 0 otherwise
+    int special = 0;
+    if (nd == 2 && (neighbours.size() == 2 || neighbours.size() == 4)) {
+        static const npy_intp four[] = { -1, 0,  0, -1 };
+        static const npy_intp eight[] = { -1, -1,  -1, 0,  -1, 1,  0, -1 };
+        const bool is_eight = (neighbours.size() == 4);
+        if (std::equal(neighbours.delta.begin(), neighbours.delta.end(), (is_eight ? eight : four))) {
+            special = (is_eight ? 8 : 4);
         }
     }
-    for (int i = 0; i != N; ++i) {
-        if (data[i] != -1) compress(data, i);
+
+    // Strips of at least label_strip_size elements
+    enum { label_strip_size = 1 << 18 };
+    const npy_intp slab = N / dims[0];
+    const npy_intp strip_rows = (nd > 1 ? std::max<npy_intp>(1, label_strip_size / std::max<npy_intp>(slab, 1)) : dims[0]);
+    std::vector<label_strip> strips;
+    for (npy_intp first = 0; first < dims[0]; first += strip_rows) {
+        label_strip strip;
+        strip.first = first;
+        strip.last = std::min<npy_intp>(dims[0], first + strip_rows);
+        strips.push_back(strip);
+    }
+    const npy_intp nstrips = strips.size();
+    label_strips_worker worker(data, dims, nd, neighbours, special, strips);
+    parallel_for(nstrips, worker);
+
+    // Global union-find structure
+    std::vector<int> parent(1, 0);
+    for (npy_intp s = 0; s != nstrips; ++s) {
+        label_strip& strip = strips[s];
+        strip.offset = parent.size() - 1;
+        for (unsigned l = 1; l != strip.parent.size(); ++l) parent.push_back(strip.offset + strip.parent[l]);
+        std::vector<int>().swap(strip.parent);
     }
+    for (npy_intp s = 1; s < nstrips; ++s) merge_strip(data, dims, nd, neighbours, strips, s, parent);
+
+    // As parent[i] < i for every non-root, final[parent[i]] is always known
+    // by the time final[i] is needed
+    const int nlabels = parent.size();
+    std::vector<int> final(nlabels);
     int next = 1;
-    std::map<int, int> seen;
-    seen[-1] = 0;
-    for (int i = 0; i != N; ++i) {
-        const int val = data[i];
-        std::map<int, int>::iterator where = seen.find(val);
-        if (where == seen.end()) {
-            data[i] = next;
-            seen[val] = next;
-            ++next;
-        } else {
-            data[i] = where->second;
-        }
+    final[0] = 0;
+    for (int i = 1; i != nlabels; ++i) {
+        final[i] = (parent[i] == i ? next++ : final[parent[i]]);
     }
+    relabel_strips_worker relabel(data, slab, strips, final);
+    parallel_for(nstrips, relabel);
     return (next - 1);
 }
 
 
+template<typename T>
+struct borders_worker {
+    borders_worker(numpy::aligned_array<T>& array, const filter_iterator<T>& filter, bool* result)
+        :array_(array)
+        ,filter_(filter)
+        ,result_(result)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = array_.begin();
+        filter_iterator<T> fiter(filter_);
+        fiter.seek(iter, start);
+        const int N2 = fiter.size();
+        bool* out = result_ + start;
 
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(fiter.interior_run(iter), end - i);
+            if (run) {
+                const T* base = &*iter;
+                const npy_intp step = fiter.row_step(iter);
+                const npy_intp* offsets = fiter.interior_offsets();
+                for (npy_intp r = 0; r != run; ++r) {
+                    const T* p = base + r*step;
+                    const T cur = *p;
+                    bool is_border = false;
+                    for (int j = 0; j != N2; ++j) is_border |= (p[offsets[j]] != cur);
+                    if (is_border) out[r] = true;
+                }
+                i += run;
+                out += run;
+                fiter.advance(iter, run);
+                continue;
+            }
+            const T cur = *iter;
+            for (int j = 0; j != N2; ++j) {
+                T val ;
+                if (fiter.retrieve(iter, j, val) && (val != cur)) {
+                    *out = true;
+                    break; // goto next i
+                }
+            }
+            ++i;
+            ++out;
+            fiter.iterate_both(iter);
+        }
+    }
+
+    numpy::aligned_array<T>& array_;
+    const filter_iterator<T>& filter_;
+    bool* const result_;
+};
 
 template<typename T>
 void borders(numpy::aligned_array<T> array, numpy::aligned_array<T> filter, numpy::aligned_array<bool> result) {
     gil_release nogil;
-    const int N = array.size();
-    typename numpy::aligned_array<T>::iterator iter = array.begin();
     filter_iterator<T> fiter(array.raw_array(), filter.raw_array(), EXTEND_CONSTANT, true);
-    const int N2 = fiter.size();
-    bool* out = result.data();
-
-    for (int i = 0; i != N; ++i, fiter.iterate_both(iter), ++out) {
-        const T cur = *iter;
-        for (int j = 0; j != N2; ++j) {
-            T val ;
-            if (fiter.retrieve(iter, j, val) && (val != cur)) {
-                *out = true;
-                break; // goto next i
-            }
-        }
-    }
+    borders_worker<T> worker(array, fiter, result.data());
+    parallel_for(array.size(), worker, filter_grain(fiter.size()));
 }
 
 template<typename T>
@@ -117,12 +459,41 @@ bool border(numpy::aligned_array<T> array, numpy::aligned_array<T> filter, numpy
     bool* out = result.data();
     bool any = false;
 
-    for (int ii = 0; ii != N; ++ii, fiter.iterate_both(iter), ++out) {
+    for (int ii = 0; ii != N; ) {
+        const npy_intp run = fiter.interior_run(iter);
+        if (run) {
+            const T* base = &*iter;
+            const npy_intp step = fiter.row_step(iter);
+            const npy_intp* offsets = fiter.interior_offsets();
+            for (npy_intp r = 0; r != run; ++r) {
+                const T* p = base + r*step;
+                const T cur = *p;
+                T other;
+                if (cur == i) other = j;
+                else if (cur == j) other = i;
+                else continue;
+                bool found = false;
+                for (int k = 0; k != N2; ++k) found |= (p[offsets[k]] == other);
+                if (found) {
+                    out[r] = true;
+                    any = true;
+                }
+            }
+            ii += run;
+            out += run;
+            fiter.advance(iter, run);
+            continue;
+        }
         const T cur = *iter;
         T other;
         if (cur == i) other = j;
         else if (cur == j) other = i;
-        else continue;
+        else {
+            ++ii;
+            ++out;
+            fiter.iterate_both(iter);
+            continue;
+        }
         for (int j = 0; j != N2; ++j) {
             T val ;
             if (fiter.retrieve(iter, j, val) && (val == other)) {
@@ -130,6 +501,9 @@ bool border(numpy::aligned_array<T> array, numpy::aligned_array<T> filter, numpy
                 any = true;
             }
         }
+        ++ii;
+        ++out;
+        fiter.iterate_both(iter);
     }
     return any;
 }
@@ -168,6 +542,231 @@ void labeled_min(numpy::aligned_array<T> array, numpy::aligned_array<int> labele
 }
 
 
+// Region properties
+//
+// All the properties are accumulated in a single pass over the array,
+// directly in the rows of the output (one row of doubles per label). The
+// columns are (nd being the number of dimensions):
+//
+//      area                    1
+//      bbox                    2*nd    (min0, max0 + 1, min1, max1 + 1, ...)
+//      centroid                nd
+//      moments                 4**nd   (the raw moments, sum of prod_d c_d**e_d,
+//                                       for e_0 + e_1 + ... <= 3, with the
+//                                       exponents as a C-ordered 4x4...x4 array)
+//
+// and, if there is an intensity image
+//
+//      weighted_centroid       nd
+//      sum, min, max, mean, var
+//
+// (labeled.py builds the corresponding structured dtype).
+//
+// The variance is computed with Welford's algorithm (which, unlike computing
+// it from the sums of values & squares, does not lose precision when the
+// mean is much larger than the standard deviation).
+int regionprops_columns(const int nd, const bool has_intensity) {
+    int moments = 1;
+    for (int d = 0; d != nd; ++d) moments *= 4;
+    return 1 + 2*nd + nd + moments + (has_intensity ? nd + 5 : 0);
+}
+
+template <typename T>
+void regionprops(numpy::aligned_array<int> labeled, const T* intensity, double* result, const npy_intp nlabels) {
+    gil_release nogil;
+    const int nd = labeled.ndims();
+    const int ncols = regionprops_columns(nd, intensity != 0);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double inf = std::numeric_limits<double>::infinity();
+
+    // Exponents of the moments (as flat indices into the 4**nd block)
+    std::vector<int> exponents;
+    std::vector<int> moment_index;
+    const int nmoments = regionprops_columns(nd, false) - 1 - 3*nd;
+    for (int m = 0; m != nmoments; ++m) {
+        int total = 0;
+        int left = m;
+        for (int d = 0; d != nd; ++d) {
+            total += left % 4;
+            left /= 4;
+        }
+        if (total > 3) continue;
+        left = m;
+        for (int d = nd - 1; d >= 0; --d) {
+            exponents.push_back(left % 4);
+            left /= 4;
+        }
+        std::reverse(exponents.end() - nd, exponents.end());
+        moment_index.push_back(m);
+    }
+    const int nm = moment_index.size();
+
+    const int c_bbox = 1;
+    const int c_centroid = c_bbox + 2*nd;
+    const int c_moments = c_centroid + nd;
+    const int c_wcentroid = c_moments + nmoments;
+    const int c_sum = c_wcentroid + nd;
+    const int c_min = c_sum + 1;
+    const int c_max = c_min + 1;
+    const int c_mean = c_max + 1;
+    const int c_var = c_mean + 1;
+
+    std::fill(result, result + nlabels*ncols, 0.);
+    for (npy_intp i = 0; i != nlabels; ++i) {
+        double* row = result + i*ncols;
+        for (int d = 0; d != nd; ++d) row[c_bbox + 2*d] = inf;
+        if (intensity) {
+            row[c_min] = inf;
+            row[c_max] = -inf;
+        }
+    }
+
+    const int* labels = labeled.data();
+    const npy_intp N = labeled.size();
+    npy_intp coords[NPY_MAXDIMS] = { 0 };
+    double powers[NPY_MAXDIMS][4];
+    for (npy_intp i = 0; i != N; ++i) {
+        const int label = labels[i];
+        if (label >= 0 && label < nlabels) {
+            double* row = result + label*ncols;
+            const double n = (row[0] += 1.);
+            for (int d = 0; d != nd; ++d) {
+                const double c = double(coords[d]);
+                row[c_bbox + 2*d] = std::min(row[c_bbox + 2*d], c);
+                row[c_bbox + 2*d + 1] = std::max(row[c_bbox + 2*d + 1], c + 1.);
+                row[c_centroid + d] += c;
+                powers[d][0] = 1.;
+                powers[d][1] = c;
+                powers[d][2] = c*c;
+                powers[d][3] = c*c*c;
+            }
+            const int* e = &exponents[0];
+            for (int m = 0; m != nm; ++m, e += nd) {
+                double v = 1.;
+                for (int d = 0; d != nd; ++d) v *= powers[d][e[d]];
+                row[c_moments + moment_index[m]] += v;
+            }
+            if (intensity) {
+                const double v = double(intensity[i]);
+                for (int d = 0; d != nd; ++d) row[c_wcentroid + d] += v*coords[d];
+                row[c_sum] += v;
+                row[c_min] = std::min(row[c_min], v);
+                row[c_max] = std::max(row[c_max], v);
+                const double delta = v - row[c_mean];
+                row[c_mean] += delta/n;
+                row[c_var] += delta*(v - row[c_mean]);
+            }
+        }
+        for (int d = nd - 1; d >= 0; --d) {
+            if (++coords[d] != labeled.dim(d)) break;
+            coords[d] = 0;
+        }
+    }
+
+    for (npy_intp i = 0; i != nlabels; ++i) {
+        double* row = result + i*ncols;
+        const double n = row[0];
+        if (n == 0.) {
+            for (int d = 0; d != nd; ++d) {
+                row[c_bbox + 2*d] = 0.;
+                row[c_centroid + d] = nan;
+            }
+            if (intensity) {
+                for (int d = 0; d != nd; ++d) row[c_wcentroid + d] = nan;
+                row[c_min] = row[c_max] = row[c_mean] = row[c_var] = nan;
+            }
+            continue;
+        }
+        for (int d = 0; d != nd; ++d) row[c_centroid + d] /= n;
+        if (intensity) {
+            for (int d = 0; d != nd; ++d) row[c_wcentroid + d] /= row[c_sum];
+            row[c_var] /= n;
+        }
+    }
+}
+
+
+// Label tables
+//
+// remove_bordering, relabel & the label filters (see labeled.py) are all
+// written as a first pass which gathers information per label (the sizes or
+// the labels touching the border), from which a table old label -> new label
+// is built, & a second pass which applies that table.
+
+// Labels are used as indices into the tables, so they must not be larger
+// than NPY_MAX_INTP (which only unsigned 64 bit labels can be)
+template <typename T>
+inline bool is_valid_label(const T v) {
+    return npy_uintp(v) <= npy_uintp(NPY_MAX_INTP);
+}
+
+const char LabelTooLargeMsg[] = "mahotas.labeled: labels must not be larger than the maximum array index (2**63 - 1 on 64 bit systems)";
+
+// Counts the number of elements with each (non-negative) label
+template <typename T>
+void label_counts(numpy::aligned_array<T> array, std::vector<npy_intp>& counts) {
+    gil_release nogil;
+    typename numpy::aligned_array<T>::iterator iter = array.begin();
+    const npy_intp N = array.size();
+    for (npy_intp i = 0; i != N; ++i, ++iter) {
+        const T v = *iter;
+        if (v < T()) continue;
+        if (!is_valid_label(v)) throw PythonException(PyExc_ValueError, LabelTooLargeMsg);
+        const npy_intp label = npy_intp(v);
+        if (label >= npy_intp(counts.size())) counts.resize(label + 1, 0);
+        ++counts[label];
+    }
+}
+
+// Sets seen[v] for every (non-negative) label v at a distance smaller than
+// rsize from the border (along any axis)
+template <typename T>
+void border_labels(numpy::aligned_array<T> array, const npy_intp rsize, std::vector<bool>& seen) {
+    gil_release nogil;
+    const int nd = array.ndims();
+    const npy_intp N = array.size();
+    if (!N || rsize <= 0) return;
+    const npy_intp w = array.dim(nd - 1);
+    const npy_intp nrows = N / w;
+    const T* data = array.data();
+    npy_intp coords[NPY_MAXDIMS] = { 0 };
+    for (npy_intp r = 0; r != nrows; ++r) {
+        bool shell = false;
+        for (int d = 0; d != nd - 1; ++d) {
+            shell |= (coords[d] < rsize || coords[d] >= array.dim(d) - rsize);
+        }
+        const T* row = data + r*w;
+        for (npy_intp x = 0; x != w; ++x) {
+            // Inside the shell, only the ends of the row are needed
+            if (!shell && x == rsize && w - rsize > x) x = w - rsize;
+            const T v = row[x];
+            if (v < T()) continue;
+            if (!is_valid_label(v)) throw PythonException(PyExc_ValueError, LabelTooLargeMsg);
+            const npy_intp label = npy_intp(v);
+            if (label >= npy_intp(seen.size())) seen.resize(label + 1, false);
+            seen[label] = true;
+        }
+        for (int d = nd - 2; d >= 0; --d) {
+            if (++coords[d] != array.dim(d)) break;
+            coords[d] = 0;
+        }
+    }
+}
+
+// result[p] = table[array[p]] (array[p] if it is not a valid index into
+// table). result may be the same as array.
+template <typename T>
+void apply_table(numpy::aligned_array<T> array, const npy_intp* table, const npy_intp ntable, T* result) {
+    gil_release nogil;
+    typename numpy::aligned_array<T>::iterator iter = array.begin();
+    const npy_intp N = array.size();
+    for (npy_intp i = 0; i != N; ++i, ++iter) {
+        const T v = *iter;
+        result[i] = ((v < T() || !is_valid_label(v) || npy_intp(v) >= ntable) ? v : T(table[npy_intp(v)]));
+    }
+}
+
+
 PyObject* py_label(PyObject* self, PyObject* args) {
     PyArrayObject* array;
     PyArrayObject* filter;
@@ -319,12 +918,149 @@ PyObject* py_labeled_max_min(PyObject* self, PyObject* args) {
     Py_RETURN_NONE;
 }
 
+PyObject* py_regionprops(PyObject* self, PyObject* args) {
+    PyArrayObject* labeled;
+    PyObject* intensity_obj;
+    PyArrayObject* output;
+    if (!PyArg_ParseTuple(args,"OOO", &labeled, &intensity_obj, &output)) return NULL;
+    const bool has_intensity = (intensity_obj != Py_None);
+    PyArrayObject* intensity = reinterpret_cast<PyArrayObject*>(intensity_obj);
+    if (!numpy::are_arrays(labeled, output) ||
+        !numpy::check_type<int>(labeled) ||
+        !numpy::check_type<double>(output) ||
+        !PyArray_ISCARRAY(labeled) ||
+        !PyArray_ISCARRAY(output) ||
+        PyArray_NDIM(output) != 2 ||
+        PyArray_DIM(output, 1) != regionprops_columns(PyArray_NDIM(labeled), has_intensity) ||
+        (has_intensity &&
+            (!PyArray_Check(intensity) ||
+            !numpy::same_shape(labeled, intensity) ||
+            !PyArray_ISCARRAY(intensity)))) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    double* odata = static_cast<double*>(PyArray_DATA(output));
+    const npy_intp nlabels = PyArray_DIM(output, 0);
+    if (!has_intensity) {
+        regionprops<bool>(numpy::aligned_array<int>(labeled), 0, odata, nlabels);
+        Py_RETURN_NONE;
+    }
+
+#define HANDLE(type) \
+    regionprops<type>( \
+            numpy::aligned_array<int>(labeled), \
+            static_cast<const type*>(PyArray_DATA(intensity)), \
+            odata, \
+            nlabels);
+    SAFE_SWITCH_ON_TYPES_OF(intensity, true);
+#undef HANDLE
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject* intp_vector_to_array(const std::vector<npy_intp>& values) {
+    npy_intp dims[1];
+    dims[0] = values.size();
+    PyArrayObject* res = reinterpret_cast<PyArrayObject*>(PyArray_SimpleNew(1, dims, NPY_INTP));
+    if (!res) return NULL;
+    std::copy(values.begin(), values.end(), static_cast<npy_intp*>(PyArray_DATA(res)));
+    return PyArray_Return(res);
+}
+
+// The label table functions also handle long long labels (which is what
+// np.int64 is on some platforms)
+#define SAFE_SWITCH_ON_LABEL_TYPES_OF(array) \
+    try { \
+        switch(PyArray_TYPE(array)) { \
+                HANDLE_INTEGER_TYPES(); \
+                case NPY_LONGLONG: HANDLE(npy_longlong); break; \
+                case NPY_ULONGLONG: HANDLE(npy_ulonglong); break; \
+                default: \
+                PyErr_SetString(PyExc_RuntimeError, "Dispatch on types failed!"); \
+                return NULL; \
+        } \
+    } \
+    CATCH_PYTHON_EXCEPTIONS(true)
+
+PyObject* py_label_counts(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    if (!PyArg_ParseTuple(args,"O", &array)) return NULL;
+    if (!PyArray_Check(array)) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    std::vector<npy_intp> counts;
+#define HANDLE(type) \
+    label_counts<type>(numpy::aligned_array<type>(array), counts);
+    SAFE_SWITCH_ON_LABEL_TYPES_OF(array);
+#undef HANDLE
+    return intp_vector_to_array(counts);
+}
+
+PyObject* py_border_labels(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    int rsize;
+    if (!PyArg_ParseTuple(args,"Oi", &array, &rsize)) return NULL;
+    if (!PyArray_Check(array) ||
+        !PyArray_ISCARRAY_RO(array) ||
+        PyArray_NDIM(array) == 0) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    std::vector<bool> seen;
+#define HANDLE(type) \
+    border_labels<type>(numpy::aligned_array<type>(array), rsize, seen);
+    SAFE_SWITCH_ON_LABEL_TYPES_OF(array);
+#undef HANDLE
+    std::vector<npy_intp> labels;
+    for (npy_intp i = 0; i != npy_intp(seen.size()); ++i) {
+        if (seen[i]) labels.push_back(i);
+    }
+    return intp_vector_to_array(labels);
+}
+
+PyObject* py_apply_table(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* table;
+    PyArrayObject* output;
+    if (!PyArg_ParseTuple(args,"OOO", &array, &table, &output)) return NULL;
+    if (!numpy::are_arrays(array, table, output) ||
+        !numpy::equiv_typenums(array, output) ||
+        !numpy::same_shape(array, output) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(table), NPY_INTP) ||
+        PyArray_NDIM(table) != 1 ||
+        !PyArray_ISCARRAY(table) ||
+        !PyArray_ISCARRAY(output)) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    holdref r(output);
+
+#define HANDLE(type) \
+    apply_table<type>( \
+            numpy::aligned_array<type>(array), \
+            static_cast<const npy_intp*>(PyArray_DATA(table)), \
+            PyArray_DIM(table, 0), \
+            static_cast<type*>(PyArray_DATA(output)));
+    SAFE_SWITCH_ON_LABEL_TYPES_OF(array);
+#undef HANDLE
+
+    Py_INCREF(output);
+    return PyArray_Return(output);
+}
+
+
 PyMethodDef methods[] = {
   {"label",(PyCFunction)py_label, METH_VARARGS, NULL},
   {"borders",(PyCFunction)py_borders, METH_VARARGS, NULL},
   {"border",(PyCFunction)py_border, METH_VARARGS, NULL},
   {"labeled_sum",(PyCFunction)py_labeled_sum, METH_VARARGS, NULL},
   {"labeled_max_min",(PyCFunction)py_labeled_max_min, METH_VARARGS, NULL},
+  {"regionprops",(PyCFunction)py_regionprops, METH_VARARGS, NULL},
+  {"label_counts",(PyCFunction)py_label_counts, METH_VARARGS, NULL},
+  {"border_labels",(PyCFunction)py_border_labels, METH_VARARGS, NULL},
+  {"apply_table",(PyCFunction)py_apply_table, METH_VARARGS, NULL},
   {NULL, NULL,0,NULL},
 };
 
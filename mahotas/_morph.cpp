@@ -13,7 +13,9 @@
 #include "numpypp/array.hpp"
 #include "numpypp/dispatch.hpp"
 #include "utils.hpp"
+#include "parallel.hpp"
 
+#include "_bitpacked.h"
 #include "_filters.h"
 
 extern "C" {
@@ -79,25 +81,289 @@ bool erode_sub<bool>(bool a, bool b) {
 template<typename T> bool is_bool(T) { return false; }
 template<> bool is_bool<bool>(bool) { return true; }
 
+// Checks whether Bc is a flat box: the points which are part of the
+// structuring element (those which are not the minimum value of T) form a
+// (hyper-)rectangle and all have the same value.
+// If so, first[d] & last[d] are set to the extent of the rectangle (as offsets
+// from the centre) and value to the common value.
+template<typename T>
+bool flat_box(numpy::aligned_array<T>& Bc, npy_intp* first, npy_intp* last, T& value) {
+    const int nd = Bc.ndims();
+    if (nd == 0) return false;
+    std::fill(first, first + nd, std::numeric_limits<npy_intp>::max());
+    std::fill(last, last + nd, std::numeric_limits<npy_intp>::min());
+    npy_intp count = 0;
+    typename numpy::aligned_array<T>::iterator iter = Bc.begin();
+    for (int i = 0, N = Bc.size(); i != N; ++i, ++iter) {
+        const T v = *iter;
+        if (v == std::numeric_limits<T>::min()) continue;
+        if (count == 0) value = v;
+        else if (v != value) return false;
+        ++count;
+        for (int d = 0; d != nd; ++d) {
+            const npy_intp p = iter.index(d) - Bc.dim(d)/2;
+            first[d] = std::min(first[d], p);
+            last[d] = std::max(last[d], p);
+        }
+    }
+    if (count == 0) return false;
+    npy_intp size = 1;
+    for (int d = 0; d != nd; ++d) size *= (last[d] - first[d] + 1);
+    return (size == count);
+}
+
+template <typename T>
+struct min_op {
+    static T apply(const T a, const T b) { return std::min<T>(a, b); }
+};
+
+template <typename T>
+struct max_op {
+    static T apply(const T a, const T b) { return std::max<T>(a, b); }
+};
+
+// van Herk/Gil-Werman algorithm
+//
+// Replaces line[i] by the minimum (or maximum, depending on Op) of
+// line[i+first], ..., line[i+last] (with nearest extension at the borders)
+// using 3 comparisons per element, independently of the size of the window.
+//
+// buffer must have space for 3*(n + last - first) elements
+template <typename T, typename Op>
+void running_extreme(T* line, const npy_intp n, const npy_intp stride, const npy_intp first, const npy_intp last, T* buffer) {
+    const npy_intp w = last - first + 1;
+    const npy_intp m = n + w - 1;
+    T* extended = buffer;
+    T* prefix = buffer + m;
+    T* suffix = buffer + 2*m;
+    for (npy_intp j = 0; j != m; ++j) {
+        const npy_intp src = std::min<npy_intp>(std::max<npy_intp>(j + first, 0), n - 1);
+        extended[j] = line[src*stride];
+    }
+    for (npy_intp start = 0; start < m; start += w) {
+        const npy_intp end = std::min(start + w, m);
+        prefix[start] = extended[start];
+        for (npy_intp j = start + 1; j < end; ++j) prefix[j] = Op::apply(prefix[j-1], extended[j]);
+        suffix[end-1] = extended[end-1];
+        for (npy_intp j = end - 2; j >= start; --j) suffix[j] = Op::apply(suffix[j+1], extended[j]);
+    }
+    for (npy_intp i = 0; i != n; ++i) {
+        line[i*stride] = Op::apply(suffix[i], prefix[i + w - 1]);
+    }
+}
+
+template <typename T, typename Op>
+struct running_extreme_worker {
+    running_extreme_worker(T* data, const npy_intp dim, const npy_intp inner, const npy_intp first, const npy_intp last)
+        :data_(data)
+        ,dim_(dim)
+        ,inner_(inner)
+        ,first_(first)
+        ,last_(last)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        T* buffer = new T[3*(dim_ + last_ - first_)];
+        for (npy_intp i = start; i != end; ++i) {
+            T* line = data_ + (i / inner_) * dim_ * inner_ + (i % inner_);
+            running_extreme<T, Op>(line, dim_, inner_, first_, last_, buffer);
+        }
+        delete [] buffer;
+    }
+
+    T* const data_;
+    const npy_intp dim_;
+    const npy_intp inner_;
+    const npy_intp first_;
+    const npy_intp last_;
+};
+
+// Applies running_extreme along every axis of the (C-contiguous) array res,
+// which computes the minimum (or maximum) over the box [first, last].
+template <typename T, typename Op>
+void box_extreme(numpy::aligned_array<T>& res, const npy_intp* first, const npy_intp* last) {
+    const npy_intp N = res.size();
+    npy_intp inner = N;
+    for (int d = 0; d != res.ndims(); ++d) {
+        const npy_intp dim = res.dim(d);
+        inner /= dim;
+        if (first[d] == last[d] && first[d] == 0) continue;
+        running_extreme_worker<T, Op> worker(res.data(), dim, inner, first[d], last[d]);
+        parallel_for(N/dim, worker, std::max<npy_intp>(1, 16384/dim));
+    }
+}
+
+// Using box_extreme is only worth it if the structuring element is not tiny
+bool large_box(const int nd, const npy_intp* first, const npy_intp* last) {
+    npy_intp size = 1;
+    for (int d = 0; d != nd; ++d) size *= (last[d] - first[d] + 1);
+    return size > 9;
+}
+
+// Offsets (from the centre) of the points of Bc which are equal to value,
+// in the format used by the functions in _bitpacked.h
+template<typename T>
+std::vector<npy_intp> offsets_of(const numpy::aligned_array<T>& Bc, const T value) {
+    const int nd = Bc.ndims();
+    std::vector<npy_intp> res;
+    typename numpy::aligned_array<T>::const_iterator iter = Bc.begin();
+    for (int i = 0, N = Bc.size(); i != N; ++i, ++iter) {
+        if (*iter != value) continue;
+        for (int d = 0; d != nd; ++d) res.push_back(iter.index(d) - Bc.dim(d)/2);
+    }
+    return res;
+}
+
+// Binary erosion & dilation are performed on bit-packed copies of the input
+// (see _bitpacked.h). For other types, these do nothing and return false.
+template<typename T>
+bool packed_erode(numpy::aligned_array<T>&, numpy::aligned_array<T>&, numpy::aligned_array<T>&) {
+    return false;
+}
+
+template<>
+bool packed_erode<bool>(numpy::aligned_array<bool>& res, numpy::aligned_array<bool>& array, numpy::aligned_array<bool>& Bc) {
+    const int nd = array.ndims();
+    if (nd == 0 || !res.size()) return false;
+    packed_array input(nd, array.raw_dims());
+    pack<bool>(input, array.raw_array(), true);
+    npy_intp first[NPY_MAXDIMS];
+    npy_intp last[NPY_MAXDIMS];
+    bool value;
+    if (flat_box(Bc, first, last, value)) {
+        erode_box(input, first, last);
+        unpack<bool>(input, res.raw_array());
+        return true;
+    }
+    packed_array output(nd, array.raw_dims());
+    output.fill(true);
+    erode_into(output, input, offsets_of(Bc, true));
+    unpack<bool>(output, res.raw_array());
+    return true;
+}
+
+template<typename T>
+bool packed_dilate(numpy::aligned_array<T>&, numpy::array<T>&, numpy::aligned_array<T>&) {
+    return false;
+}
+
+template<>
+bool packed_dilate<bool>(numpy::aligned_array<bool>& res, numpy::array<bool>& array, numpy::aligned_array<bool>& Bc) {
+    const int nd = array.ndims();
+    if (nd == 0 || !res.size()) return false;
+    packed_array input(nd, array.raw_dims());
+    pack<bool>(input, array.raw_array(), true);
+    npy_intp first[NPY_MAXDIMS];
+    npy_intp last[NPY_MAXDIMS];
+    bool value;
+    if (flat_box(Bc, first, last, value)) {
+        // See the comment in dilate()
+        npy_intp rfirst[NPY_MAXDIMS];
+        npy_intp rlast[NPY_MAXDIMS];
+        bool contains_centre = true;
+        for (int d = 0; d != nd; ++d) {
+            if (first[d] > 0 || last[d] < 0) contains_centre = false;
+            rfirst[d] = -last[d];
+            rlast[d] = -first[d];
+        }
+        if (contains_centre) {
+            dilate_box(input, rfirst, rlast);
+            unpack<bool>(input, res.raw_array());
+            return true;
+        }
+    }
+    packed_array output(nd, array.raw_dims());
+    output.fill(false);
+    dilate_into(output, input, offsets_of(Bc, true));
+    unpack<bool>(output, res.raw_array());
+    return true;
+}
+
+template<typename T>
+struct erode_worker {
+    erode_worker(numpy::aligned_array<T>& array, const filter_iterator<T>& filter, T* result)
+        :array_(array)
+        ,filter_(filter)
+        ,result_(result)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = array_.begin();
+        filter_iterator<T> filter(filter_);
+        filter.seek(iter, start);
+        const int N2 = filter.size();
+        T* rpos = result_ + start;
+
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(filter.interior_run(iter), end - i);
+            if (run) {
+                // Process the whole run one structuring element position at a
+                // time, accumulating directly in the output.
+                const T* base = &*iter;
+                const npy_intp step = filter.row_step(iter);
+                const npy_intp* offsets = filter.interior_offsets();
+                std::fill(rpos, rpos + run, std::numeric_limits<T>::max());
+                for (int j = 0; j != N2; ++j) {
+                    const T* p = base + offsets[j];
+                    const T b = filter[j];
+                    if (!is_bool(T()) && b == std::numeric_limits<T>::min()) {
+                        // erode_sub(x, b) is max() for all x
+                        continue;
+                    }
+                    for (npy_intp r = 0; r != run; ++r) {
+                        rpos[r] = std::min<T>(rpos[r], erode_sub(p[r*step], b));
+                    }
+                }
+                i += run;
+                rpos += run;
+                filter.advance(iter, run);
+                continue;
+            }
+            T value = std::numeric_limits<T>::max();
+            for (int j = 0; j != N2; ++j) {
+                T arr_val = T();
+                filter.retrieve(iter, j, arr_val);
+                value = std::min<T>(value, erode_sub(arr_val, filter[j]));
+                if (value == std::numeric_limits<T>::min()) break;
+            }
+            *rpos = value;
+            ++i;
+            ++rpos;
+            filter.iterate_both(iter);
+        }
+    }
+
+    numpy::aligned_array<T>& array_;
+    const filter_iterator<T>& filter_;
+    T* const result_;
+};
+
 template<typename T>
 void erode(numpy::aligned_array<T> res, numpy::aligned_array<T> array, numpy::aligned_array<T> Bc) {
     gil_release nogil;
-    const int N = res.size();
-    typename numpy::aligned_array<T>::iterator iter = array.begin();
-    filter_iterator<T> filter(array.raw_array(), Bc.raw_array(), EXTEND_NEAREST, is_bool(T()));
-    const int N2 = filter.size();
-    T* rpos = res.data();
-
-    for (int i = 0; i != N; ++i, ++rpos, filter.iterate_both(iter)) {
-        T value = std::numeric_limits<T>::max();
-        for (int j = 0; j != N2; ++j) {
-            T arr_val = T();
-            filter.retrieve(iter, j, arr_val);
-            value = std::min<T>(value, erode_sub(arr_val, filter[j]));
-            if (value == std::numeric_limits<T>::min()) break;
+    if (packed_erode(res, array, Bc)) return;
+    const int nd = array.ndims();
+    npy_intp first[NPY_MAXDIMS];
+    npy_intp last[NPY_MAXDIMS];
+    T value;
+    // erode_sub(., value) is monotonous (for value >= 0), so the erosion by a
+    // flat box is erode_sub(min(box), value)
+    if (res.size() &&
+            flat_box(Bc, first, last, value) &&
+            large_box(nd, first, last) &&
+            (is_bool(T()) || value >= T(0))) {
+        typename numpy::aligned_array<T>::iterator iter = array.begin();
+        T* rpos = res.data();
+        for (int i = 0, N = res.size(); i != N; ++i, ++iter) rpos[i] = *iter;
+        box_extreme<T, min_op<T> >(res, first, last);
+        if (!is_bool(T())) {
+            for (int i = 0, N = res.size(); i != N; ++i) rpos[i] = erode_sub(rpos[i], value);
         }
-        *rpos = value;
+        return;
     }
+    filter_iterator<T> filter(array.raw_array(), Bc.raw_array(), EXTEND_NEAREST, is_bool(T()));
+    erode_worker<T> worker(array, filter, res.data());
+    parallel_for(res.size(), worker, filter_grain(filter.size()));
 }
 
 
@@ -125,28 +391,73 @@ PyObject* py_erode(PyObject* self, PyObject* args) {
 }
 
 template<typename T>
-void locmin_max(numpy::aligned_array<bool> res, numpy::aligned_array<T> array, numpy::aligned_array<T> Bc, bool is_min) {
-    gil_release nogil;
-    const int N = res.size();
-    typename numpy::aligned_array<T>::iterator iter = array.begin();
-    filter_iterator<T> filter(res.raw_array(), Bc.raw_array(), EXTEND_NEAREST, true);
-    const int N2 = filter.size();
-    bool* rpos = res.data();
+struct locmin_max_worker {
+    locmin_max_worker(numpy::aligned_array<T>& array, const filter_iterator<T>& filter, bool* result, const bool is_min)
+        :array_(array)
+        ,filter_(filter)
+        ,result_(result)
+        ,is_min_(is_min)
+        { }
 
-    for (int i = 0; i != N; ++i, ++rpos, filter.iterate_both(iter)) {
-        T cur = *iter;
-        for (int j = 0; j != N2; ++j) {
-            T arr_val = T();
-            filter.retrieve(iter, j, arr_val);
-            if (( is_min && (arr_val < cur)) ||
-                (!is_min && (arr_val > cur))) {
-                    goto skip_to_next;
+    void operator()(const npy_intp start, const npy_intp end) {
+        typename numpy::aligned_array<T>::iterator iter = array_.begin();
+        filter_iterator<T> filter(filter_);
+        filter.seek(iter, start);
+        const int N2 = filter.size();
+        const bool is_min = is_min_;
+        bool* rpos = result_ + start;
+
+        for (npy_intp i = start; i != end; ) {
+            const npy_intp run = std::min(filter.interior_run(iter), end - i);
+            if (run) {
+                const T* base = &*iter;
+                const npy_intp step = filter.row_step(iter);
+                const npy_intp* offsets = filter.interior_offsets();
+                for (npy_intp r = 0; r != run; ++r) {
+                    const T* p = base + r*step;
+                    const T cur = *p;
+                    int j = 0;
+                    if (is_min) {
+                        while (j != N2 && !(p[offsets[j]] < cur)) ++j;
+                    } else {
+                        while (j != N2 && !(p[offsets[j]] > cur)) ++j;
+                    }
+                    rpos[r] = (j == N2);
                 }
+                i += run;
+                rpos += run;
+                filter.advance(iter, run);
+                continue;
+            }
+            const T cur = *iter;
+            for (int j = 0; j != N2; ++j) {
+                T arr_val = T();
+                filter.retrieve(iter, j, arr_val);
+                if (( is_min && (arr_val < cur)) ||
+                    (!is_min && (arr_val > cur))) {
+                        goto skip_to_next;
+                    }
+            }
+            *rpos = true;
+            skip_to_next:
+            ++i;
+            ++rpos;
+            filter.iterate_both(iter);
         }
-        *rpos = true;
-        skip_to_next:
-            ;
     }
+
+    numpy::aligned_array<T>& array_;
+    const filter_iterator<T>& filter_;
+    bool* const result_;
+    const bool is_min_;
+};
+
+template<typename T>
+void locmin_max(numpy::aligned_array<bool> res, numpy::aligned_array<T> array, numpy::aligned_array<T> Bc, bool is_min) {
+    gil_release nogil;
+    filter_iterator<T> filter(res.raw_array(), Bc.raw_array(), EXTEND_NEAREST, true);
+    locmin_max_worker<T> worker(array, filter, res.data(), is_min);
+    parallel_for(res.size(), worker, filter_grain(filter.size()));
 }
 
 PyObject* py_locminmax(PyObject* self, PyObject* args) {
@@ -176,46 +487,140 @@ PyObject* py_locminmax(PyObject* self, PyObject* args) {
     return PyArray_Return(output);
 }
 
-template <typename T>
-void remove_fake_regmin_max(numpy::aligned_array<bool> regmin, numpy::aligned_array<T> f, numpy::aligned_array<T> Bc, bool is_min) {
-    const int N = f.size();
-    numpy::aligned_array<bool>::iterator riter = regmin.begin();
+// Neighbourhoods for the algorithms which visit the pixels in an arbitrary
+// order (rather than with a filter_iterator)
+struct symmetric_neighbourhood {
+    // The neighbours which come before the centre in scan order. Those which
+    // come after it are their opposites (Bc is symmetrised).
+    // For each neighbour, delta[n*nd + d] is its offset along axis d
+    std::vector<npy_intp> delta;
+    std::vector<npy_intp> offsets;
+    // largest offset along any axis
+    npy_intp reach;
+    int size() const { return offsets.size(); }
+};
+
+template<typename T>
+symmetric_neighbourhood symmetric_neighbours(const numpy::aligned_array<T>& res, const numpy::aligned_array<T>& Bc) {
+    const int nd = res.ndims();
     const std::vector<numpy::position> Bc_neighbours = neighbours(Bc);
-    typedef std::vector<numpy::position>::const_iterator Bc_iter;
-    const int N2 = Bc_neighbours.size();
-
-    for (int i = 0; i != N; ++i, ++riter) {
-        if (!*riter) continue;
-        const numpy::position pos = riter.position();
-        const T val = f.at(pos);
-        for (int j = 0; j != N2; ++j) {
-            numpy::position npos = pos + Bc_neighbours[j];
-            if (f.validposition(npos) &&
-                    !regmin.at(npos) &&
-                            (   (is_min && f.at(npos) <= val) ||
-                                (!is_min && f.at(npos) >= val)
-                            )) {
-                numpy::position_stack stack(f.ndims());
-                assert(regmin.at(pos));
-                regmin.at(pos) = false;
-                stack.push(pos);
-                while (!stack.empty()) {
-                    numpy::position p = stack.top_pop();
-                    for (Bc_iter first = Bc_neighbours.begin(), past = Bc_neighbours.end();
-                                first != past;
-                                ++first) {
-                        numpy::position npos = p + *first;
-                        if (regmin.validposition(npos) && regmin.at(npos)) {
-                            regmin.at(npos) = false;
-                            assert(!regmin.at(npos));
-                            stack.push(npos);
-                        }
-                    }
-                }
-                // we are done with this position
-                break;
+    symmetric_neighbourhood nb;
+    nb.reach = 0;
+    for (unsigned j = 0; j != Bc_neighbours.size(); ++j) {
+        npy_intp cur[NPY_MAXDIMS];
+        int first = 0;
+        while (first != nd && !Bc_neighbours[j][first]) ++first;
+        if (first == nd) continue;
+        const npy_intp sign = (Bc_neighbours[j][first] < 0 ? 1 : -1);
+        for (int d = 0; d != nd; ++d) cur[d] = sign * Bc_neighbours[j][d];
+        bool seen = false;
+        for (int n = 0; n != nb.size() && !seen; ++n) {
+            seen = std::equal(cur, cur + nd, &nb.delta[n*nd]);
+        }
+        if (seen) continue;
+        npy_intp offset = 0;
+        for (int d = 0; d != nd; ++d) {
+            offset = offset*res.dim(d) + cur[d];
+            nb.reach = std::max<npy_intp>(nb.reach, std::abs(cur[d]));
+        }
+        nb.delta.insert(nb.delta.end(), cur, cur + nd);
+        nb.offsets.push_back(offset);
+    }
+    return nb;
+}
+
+// Whether pos + sign*delta is inside the array
+inline bool valid_neighbour(const npy_intp* pos, const npy_intp* delta, const npy_intp sign, const int nd, const npy_intp* dims) {
+    for (int d = 0; d != nd; ++d) {
+        const npy_intp p = pos[d] + sign*delta[d];
+        if (p < 0 || p >= dims[d]) return false;
+    }
+    return true;
+}
+
+inline npy_intp border_margin(const npy_intp* pos, const int nd, const npy_intp* dims) {
+    npy_intp margin = std::numeric_limits<npy_intp>::max();
+    for (int d = 0; d != nd; ++d) {
+        margin = std::min(margin, pos[d]);
+        margin = std::min(margin, dims[d] - 1 - pos[d]);
+    }
+    return margin;
+}
+
+inline void flat_to_position(npy_intp p, const int nd, const npy_intp* dims, npy_intp* pos) {
+    for (int d = nd - 1; d >= 0; --d) {
+        pos[d] = p % dims[d];
+        p /= dims[d];
+    }
+}
+
+// Regional minima (or maxima)
+//
+// A single raster sweep joins the pixels of each plateau (connected set of
+// pixels of equal value) with union-find and flags the pixels which have a
+// strictly lower (resp. higher) neighbour. A plateau is a regional minimum
+// (maximum) if none of its pixels is flagged.
+inline npy_intp plateau_find(std::vector<npy_intp>& parent, npy_intp p) {
+    while (parent[p] != p) {
+        parent[p] = parent[parent[p]];
+        p = parent[p];
+    }
+    return p;
+}
+
+inline void plateau_join(std::vector<npy_intp>& parent, npy_intp a, npy_intp b) {
+    a = plateau_find(parent, a);
+    b = plateau_find(parent, b);
+    if (a < b) parent[b] = a;
+    else parent[a] = b;
+}
+
+template <typename T>
+void regmin_max(numpy::aligned_array<bool> res, numpy::aligned_array<T> array, numpy::aligned_array<T> Bc, const bool is_min) {
+    gil_release nogil;
+    const int nd = array.ndims();
+    const npy_intp N = array.size();
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = array.dim(d);
+    const symmetric_neighbourhood nb = symmetric_neighbours(array, Bc);
+    const int N2 = nb.size();
+    const T* f = array.data();
+    bool* rpos = res.data();
+    if (!N) return;
+
+    std::vector<npy_intp> parent(N);
+    // flagged[p]: p has a neighbour which is strictly lower (resp. higher)
+    std::vector<bool> flagged(N);
+    npy_intp pos[NPY_MAXDIMS];
+    std::fill(pos, pos + nd, 0);
+    for (npy_intp p = 0; p != N; ++p) {
+        parent[p] = p;
+        const bool interior = (border_margin(pos, nd, dims) >= nb.reach);
+        const T value = f[p];
+        for (int n = 0; n != N2; ++n) {
+            if (!interior && !valid_neighbour(pos, &nb.delta[n*nd], +1, nd, dims)) continue;
+            const npy_intp q = p + nb.offsets[n];
+            const T nvalue = f[q];
+            if (nvalue == value) {
+                plateau_join(parent, p, q);
+            } else if ((nvalue < value) == is_min) {
+                flagged[p] = true;
+            } else {
+                flagged[q] = true;
             }
         }
+        for (int d = nd - 1; d >= 0; --d) {
+            if (++pos[d] != dims[d]) break;
+            pos[d] = 0;
+        }
+    }
+    for (npy_intp p = 0; p != N; ++p) {
+        const npy_intp r = plateau_find(parent, p);
+        parent[p] = r;
+        if (flagged[p]) flagged[r] = true;
+    }
+    for (npy_intp p = 0; p != N; ++p) {
+        rpos[p] = !flagged[parent[p]];
     }
 }
 
@@ -229,6 +634,7 @@ PyObject* py_regminmax(PyObject* self, PyObject* args) {
         !PyArray_EquivTypenums(PyArray_TYPE(array), PyArray_TYPE(Bc)) ||
         !PyArray_EquivTypenums(NPY_BOOL, PyArray_TYPE(output)) ||
         PyArray_NDIM(array) != PyArray_NDIM(Bc) ||
+        !PyArray_ISCARRAY_RO(array) ||
         !PyArray_ISCARRAY(output)
     ) {
         PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
@@ -238,8 +644,7 @@ PyObject* py_regminmax(PyObject* self, PyObject* args) {
     PyArray_FILLWBYTE(output, 0);
 
 #define HANDLE(type) \
-    locmin_max<type>(numpy::aligned_array<bool>(output), numpy::aligned_array<type>(array), numpy::aligned_array<type>(Bc), bool(is_min)); \
-    remove_fake_regmin_max<type>(numpy::aligned_array<bool>(output), numpy::aligned_array<type>(array), numpy::aligned_array<type>(Bc), bool(is_min));
+    regmin_max<type>(numpy::aligned_array<bool>(output), numpy::aligned_array<type>(array), numpy::aligned_array<type>(Bc), bool(is_min));
 
     SAFE_SWITCH_ON_INTEGER_TYPES_OF(array, true);
 #undef HANDLE
@@ -268,6 +673,38 @@ bool dilate_add(bool a, bool b) {
 template<typename T>
 void dilate(numpy::aligned_array<T> res, numpy::array<T> array, numpy::aligned_array<T> Bc) {
     gil_release nogil;
+    if (packed_dilate(res, array, Bc)) return;
+    const int nd = array.ndims();
+    npy_intp first[NPY_MAXDIMS];
+    npy_intp last[NPY_MAXDIMS];
+    T value;
+    // For unsigned types, dilate_add(., value) is monotonous, so the dilation
+    // by a flat box is dilate_add(max(reflected box), value). If the box does
+    // not contain the centre, the handling of the borders is different, so we
+    // use the generic code.
+    if (res.size() &&
+            !std::numeric_limits<T>::is_signed &&
+            flat_box(Bc, first, last, value) &&
+            large_box(nd, first, last)) {
+        npy_intp rfirst[NPY_MAXDIMS];
+        npy_intp rlast[NPY_MAXDIMS];
+        bool contains_centre = true;
+        for (int d = 0; d != nd; ++d) {
+            if (first[d] > 0 || last[d] < 0) contains_centre = false;
+            rfirst[d] = -last[d];
+            rlast[d] = -first[d];
+        }
+        if (contains_centre) {
+            typename numpy::array<T>::iterator iter = array.begin();
+            T* rpos = res.data();
+            for (int i = 0, N = res.size(); i != N; ++i, ++iter) rpos[i] = *iter;
+            box_extreme<T, max_op<T> >(res, rfirst, rlast);
+            if (!is_bool(T())) {
+                for (int i = 0, N = res.size(); i != N; ++i) rpos[i] = dilate_add(rpos[i], value);
+            }
+            return;
+        }
+    }
     const int N = res.size();
     typename numpy::array<T>::iterator iter = array.begin();
     filter_iterator<T> filter(res.raw_array(), Bc.raw_array(), EXTEND_NEAREST, is_bool(T()));
@@ -276,15 +713,37 @@ void dilate(numpy::aligned_array<T> res, numpy::array<T> array, numpy::aligned_a
     T* rpos = res.data();
     std::fill(rpos, rpos + res.size(), std::numeric_limits<T>::min());
 
-    for (int i = 0; i != N; ++i, ++rpos, filter.iterate_both(iter)) {
+    for (int i = 0; i != N; ) {
+        const npy_intp run = filter.interior_run(iter);
+        if (run) {
+            const npy_intp* offsets = filter.interior_offsets();
+            for (npy_intp r = 0; r != run; ++r, ++rpos) {
+                const T value = *iter;
+                if (r != run - 1) ++iter;
+                if (value == std::numeric_limits<T>::min()) continue;
+                for (int j = 0; j != N2; ++j) {
+                    const T nval = dilate_add(value, filter[j]);
+                    T& out = rpos[offsets[j]];
+                    if (nval > out) out = nval;
+                }
+            }
+            i += run;
+            // iter is now at the last point of the run
+            filter.iterate_both(iter);
+            continue;
+        }
         const T value = *iter;
-        if (value == std::numeric_limits<T>::min()) continue;
-        for (int j = 0; j != N2; ++j) {
-            const T nval = dilate_add(value, filter[j]);
-            T arr_val = T();
-            filter.retrieve(rpos, j, arr_val);
-            if (nval > arr_val) filter.set(rpos, j, nval);
+        if (value != std::numeric_limits<T>::min()) {
+            for (int j = 0; j != N2; ++j) {
+                const T nval = dilate_add(value, filter[j]);
+                T arr_val = T();
+                filter.retrieve(rpos, j, arr_val);
+                if (nval > arr_val) filter.set(rpos, j, nval);
+            }
         }
+        ++i;
+        ++rpos;
+        filter.iterate_both(iter);
     }
 }
 
@@ -312,54 +771,50 @@ PyObject* py_dilate(PyObject* self, PyObject* args) {
     return PyArray_Return(output);
 }
 
+// The holes are the connected components of the background which do not
+// touch the border of the array. The background is labeled with a single
+// raster sweep of union-find (as in regmin_max), noting which components
+// contain a border pixel.
 void close_holes(numpy::aligned_array<bool> ref, numpy::aligned_array<bool> f, numpy::aligned_array<bool> Bc) {
-    std::fill_n(f.data(), f.size(), false);
-
-    numpy::position_stack stack(ref.ndim());
-    const int N = ref.size();
-    const std::vector<numpy::position> Bc_neighbours = neighbours(Bc);
-    const int N2 = Bc_neighbours.size();
-    for (int d = 0; d != ref.ndims(); ++d) {
-        if (ref.dim(d) == 0) continue;
-        numpy::position pos;
-        pos.nd_ = ref.ndims();
-        for (int di = 0; di != ref.ndims(); ++di) pos.position_[di] = 0;
-
-        for (int i = 0; i != N/ref.dim(d); ++i) {
-            pos.position_[d] = 0;
-            if (!ref.at(pos) && !f.at(pos)) {
-                f.at(pos) = true;
-                stack.push(pos);
-            }
-            pos.position_[d] = ref.dim(d) - 1;
-            if (!ref.at(pos) && !f.at(pos)) {
-                f.at(pos) = true;
-                stack.push(pos);
-            }
-
-            for (int j = 0; j != ref.ndims() - 1; ++j) {
-                if (j == d) ++j;
-                if (pos.position_[j] < int(ref.dim(j))) {
-                    ++pos.position_[j];
-                    break;
-                }
-                pos.position_[j] = 0;
+    gil_release nogil;
+    const int nd = ref.ndims();
+    const npy_intp N = ref.size();
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = ref.dim(d);
+    const symmetric_neighbourhood nb = symmetric_neighbours(ref, Bc);
+    const int N2 = nb.size();
+    const bool* rpos = ref.data();
+    bool* fpos = f.data();
+    if (!N) return;
+
+    std::vector<npy_intp> parent(N);
+    std::vector<bool> on_border(N);
+    npy_intp pos[NPY_MAXDIMS];
+    std::fill(pos, pos + nd, 0);
+    for (npy_intp p = 0; p != N; ++p) {
+        if (!rpos[p]) {
+            parent[p] = p;
+            const npy_intp margin = border_margin(pos, nd, dims);
+            on_border[p] = (margin == 0);
+            for (int n = 0; n != N2; ++n) {
+                if (margin < nb.reach && !valid_neighbour(pos, &nb.delta[n*nd], +1, nd, dims)) continue;
+                const npy_intp q = p + nb.offsets[n];
+                if (!rpos[q]) plateau_join(parent, p, q);
             }
         }
-    }
-    while (!stack.empty()) {
-        numpy::position pos = stack.top_pop();
-        std::vector<numpy::position>::const_iterator startc = Bc_neighbours.begin();
-        for (int j = 0; j != N2; ++j, ++startc) {
-            numpy::position npos = pos + *startc;
-            if (ref.validposition(npos) && !ref.at(npos) && !f.at(npos)) {
-                f.at(npos) = true;
-                stack.push(npos);
-            }
+        for (int d = nd - 1; d >= 0; --d) {
+            if (++pos[d] != dims[d]) break;
+            pos[d] = 0;
         }
     }
-    for (bool* start = f.data(), *past = f.data() + f.size(); start != past; ++ start) {
-        *start = !*start;
+    for (npy_intp p = 0; p != N; ++p) {
+        if (rpos[p]) continue;
+        const npy_intp r = plateau_find(parent, p);
+        parent[p] = r;
+        if (on_border[p]) on_border[r] = true;
+    }
+    for (npy_intp p = 0; p != N; ++p) {
+        fpos[p] = (rpos[p] || !on_border[parent[p]]);
     }
 }
 
@@ -369,11 +824,13 @@ PyObject* py_close_holes(PyObject* self, PyObject* args) {
     if (!PyArg_ParseTuple(args,"OO", &ref, &Bc)) return NULL;
     if (!numpy::are_arrays(ref, Bc) ||
         !numpy::equiv_typenums(ref, Bc) ||
-        !PyArray_EquivTypenums(PyArray_TYPE(ref), NPY_BOOL)) {
+        !PyArray_EquivTypenums(PyArray_TYPE(ref), NPY_BOOL) ||
+        PyArray_NDIM(ref) != PyArray_NDIM(Bc) ||
+        !PyArray_ISCARRAY_RO(ref)) {
         PyErr_SetString(PyExc_RuntimeError,TypeErrorMsg);
         return NULL;
     }
-    PyArrayObject* res_a = (PyArrayObject*)PyArray_SimpleNew(ref->nd,ref->dimensions,PyArray_TYPE(ref));
+    PyArrayObject* res_a = (PyArrayObject*)PyArray_SimpleNew(PyArray_NDIM(ref), PyArray_DIMS(ref), PyArray_TYPE(ref));
     if (!res_a) return NULL;
     try {
         close_holes(numpy::aligned_array<bool>(ref), numpy::aligned_array<bool>(res_a), numpy::aligned_array<bool>(Bc));
@@ -386,6 +843,444 @@ PyObject* py_close_holes(PyObject* self, PyObject* args) {
     return PyArray_Return(res_a);
 }
 
+// Morphological reconstruction
+//
+// This is the hybrid algorithm of Vincent (1993): a raster scan and an
+// anti-raster scan (where each pixel only looks at the neighbours which were
+// already visited in that scan) followed by propagation with a FIFO, which
+// starts from the pixels which could still change one of their neighbours
+// after the two scans. Usually, only a small fraction of the pixels ever
+// enter the queue, so this takes a few linear passes over the image.
+
+// Reconstruction by dilation (Op = max_op) or by erosion (Op = min_op):
+// "better" values are those which are larger (resp. smaller).
+template <typename T, typename Op>
+struct reconstruct_ops {
+    static T sup(const T a, const T b) { return Op::apply(a, b); }
+    static T inf(const T a, const T b) { return (Op::apply(a, b) == a ? b : a); }
+    static bool better(const T a, const T b) { return (a != b && Op::apply(a, b) == a); }
+};
+
+// res (the marker) is replaced by its reconstruction under mask. Both must be
+// C-contiguous.
+template<typename T, typename Op>
+void reconstruct(numpy::aligned_array<T> res, numpy::aligned_array<T> mask, numpy::aligned_array<T> Bc) {
+    gil_release nogil;
+    typedef reconstruct_ops<T, Op> ops;
+    const int nd = res.ndims();
+    const npy_intp N = res.size();
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = res.dim(d);
+    const symmetric_neighbourhood nb = symmetric_neighbours(res, Bc);
+    const int N2 = nb.size();
+    T* rpos = res.data();
+    const T* mpos = mask.data();
+    if (!N) return;
+
+    for (npy_intp i = 0; i != N; ++i) rpos[i] = ops::inf(rpos[i], mpos[i]);
+
+    npy_intp pos[NPY_MAXDIMS];
+    std::fill(pos, pos + nd, 0);
+    for (npy_intp i = 0; i != N; ++i) {
+        const bool interior = (border_margin(pos, nd, dims) >= nb.reach);
+        T value = rpos[i];
+        for (int n = 0; n != N2; ++n) {
+            if (interior || valid_neighbour(pos, &nb.delta[n*nd], +1, nd, dims)) {
+                value = ops::sup(value, rpos[i + nb.offsets[n]]);
+            }
+        }
+        rpos[i] = ops::inf(value, mpos[i]);
+        for (int d = nd - 1; d >= 0; --d) {
+            if (++pos[d] != dims[d]) break;
+            pos[d] = 0;
+        }
+    }
+
+    std::queue<npy_intp> fifo;
+    for (int d = 0; d != nd; ++d) pos[d] = dims[d] - 1;
+    for (npy_intp i = N - 1; i >= 0; --i) {
+        const bool interior = (border_margin(pos, nd, dims) >= nb.reach);
+        T value = rpos[i];
+        for (int n = 0; n != N2; ++n) {
+            if (interior || valid_neighbour(pos, &nb.delta[n*nd], -1, nd, dims)) {
+                value = ops::sup(value, rpos[i - nb.offsets[n]]);
+            }
+        }
+        value = ops::inf(value, mpos[i]);
+        rpos[i] = value;
+        for (int n = 0; n != N2; ++n) {
+            if (interior || valid_neighbour(pos, &nb.delta[n*nd], -1, nd, dims)) {
+                const npy_intp q = i - nb.offsets[n];
+                if (ops::better(value, rpos[q]) && ops::better(mpos[q], rpos[q])) {
+                    fifo.push(i);
+                    break;
+                }
+            }
+        }
+        for (int d = nd - 1; d >= 0; --d) {
+            if (pos[d]-- != 0) break;
+            pos[d] = dims[d] - 1;
+        }
+    }
+
+    while (!fifo.empty()) {
+        const npy_intp p = fifo.front();
+        fifo.pop();
+        flat_to_position(p, nd, dims, pos);
+        const bool interior = (border_margin(pos, nd, dims) >= nb.reach);
+        const T value = rpos[p];
+        for (int n = 0; n != 2*N2; ++n) {
+            const npy_intp sign = (n < N2 ? +1 : -1);
+            const int nn = (n < N2 ? n : n - N2);
+            if (!interior && !valid_neighbour(pos, &nb.delta[nn*nd], sign, nd, dims)) continue;
+            const npy_intp q = p + sign*nb.offsets[nn];
+            if (ops::better(value, rpos[q]) && mpos[q] != rpos[q]) {
+                rpos[q] = ops::inf(value, mpos[q]);
+                fifo.push(q);
+            }
+        }
+    }
+}
+
+PyObject* py_reconstruct(PyObject* self, PyObject* args) {
+    PyArrayObject* marker;
+    PyArrayObject* mask;
+    PyArrayObject* Bc;
+    int is_erosion;
+    if (!PyArg_ParseTuple(args,"OOOi", &marker, &mask, &Bc, &is_erosion)) return NULL;
+    if (!numpy::are_arrays(marker, mask, Bc) ||
+        !numpy::same_shape(marker, mask) ||
+        !numpy::equiv_typenums(marker, mask, Bc) ||
+        PyArray_NDIM(marker) != PyArray_NDIM(Bc) ||
+        !PyArray_ISCARRAY(marker) ||
+        !PyArray_ISCARRAY_RO(mask)
+    ) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    holdref r_o(marker);
+#define HANDLE(type) \
+    if (is_erosion) { \
+        reconstruct<type, min_op<type> >(numpy::aligned_array<type>(marker), numpy::aligned_array<type>(mask), numpy::aligned_array<type>(Bc)); \
+    } else { \
+        reconstruct<type, max_op<type> >(numpy::aligned_array<type>(marker), numpy::aligned_array<type>(mask), numpy::aligned_array<type>(Bc)); \
+    }
+    SAFE_SWITCH_ON_INTEGER_TYPES_OF(marker, true);
+#undef HANDLE
+
+    Py_XINCREF(marker);
+    return PyArray_Return(marker);
+}
+
+// Max-tree & min-tree (component trees)
+//
+// The tree is stored in two flat arrays: parent[p] is the parent of pixel p
+// and order lists all the pixels so that each one comes after its parent
+// (i.e., from the root to the leaves). Each node is represented by its
+// canonical pixel: p is canonical if it is the root (parent[p] == p) or if
+// f[parent[p]] != f[p]. The other pixels of a node point to its canonical
+// pixel.
+//
+// If the image is not connected (with respect to Bc), this is a forest (with
+// one root per connected component).
+//
+// The tree is built with union-find, processing the pixels from the highest
+// to the lowest (for the min-tree, from the lowest to the highest), following
+// Berger et al. (2007). Pixels with 1 or 2 byte values are sorted with a
+// counting sort.
+
+template <typename T>
+struct tree_compare {
+    tree_compare(const T* f, const bool is_min)
+        :f_(f)
+        ,is_min_(is_min)
+        { }
+    bool operator()(const npy_intp a, const npy_intp b) const {
+        if (f_[a] != f_[b]) return (is_min_ ? f_[a] > f_[b] : f_[a] < f_[b]);
+        return a < b;
+    }
+    const T* const f_;
+    const bool is_min_;
+};
+
+// Sets order to the pixels sorted from the root level (the lowest for the
+// max-tree, the highest for the min-tree) to the leaves
+template <typename T>
+void tree_sort(const T* f, const npy_intp N, const bool is_min, npy_intp* order) {
+    if (sizeof(T) <= 2) {
+        const npy_intp nkeys = npy_intp(1) << (8*sizeof(T));
+        std::vector<npy_intp> start(nkeys + 1);
+        for (npy_intp i = 0; i != N; ++i) {
+            npy_intp key = npy_intp(f[i]) - npy_intp(std::numeric_limits<T>::min());
+            if (is_min) key = nkeys - 1 - key;
+            ++start[key + 1];
+        }
+        for (npy_intp k = 0; k != nkeys; ++k) start[k + 1] += start[k];
+        for (npy_intp i = 0; i != N; ++i) {
+            npy_intp key = npy_intp(f[i]) - npy_intp(std::numeric_limits<T>::min());
+            if (is_min) key = nkeys - 1 - key;
+            order[start[key]++] = i;
+        }
+        return;
+    }
+    for (npy_intp i = 0; i != N; ++i) order[i] = i;
+    std::sort(order, order + N, tree_compare<T>(f, is_min));
+}
+
+inline npy_intp tree_find(std::vector<npy_intp>& zpar, npy_intp p) {
+    while (zpar[p] != p) {
+        zpar[p] = zpar[zpar[p]];
+        p = zpar[p];
+    }
+    return p;
+}
+
+template<typename T>
+void build_tree(numpy::aligned_array<T> array, numpy::aligned_array<T> Bc, npy_intp* parent, npy_intp* order, const bool is_min) {
+    gil_release nogil;
+    const int nd = array.ndims();
+    const npy_intp N = array.size();
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = array.dim(d);
+    const symmetric_neighbourhood nb = symmetric_neighbours(array, Bc);
+    const int N2 = nb.size();
+    const T* f = array.data();
+    if (!N) return;
+
+    tree_sort(f, N, is_min, order);
+    // zpar[p] == -1 marks the pixels which were not processed yet
+    std::vector<npy_intp> zpar(N, -1);
+    npy_intp pos[NPY_MAXDIMS];
+    for (npy_intp k = N - 1; k >= 0; --k) {
+        const npy_intp p = order[k];
+        parent[p] = p;
+        zpar[p] = p;
+        flat_to_position(p, nd, dims, pos);
+        const bool interior = (border_margin(pos, nd, dims) >= nb.reach);
+        for (int n = 0; n != 2*N2; ++n) {
+            const npy_intp sign = (n < N2 ? +1 : -1);
+            const int nn = (n < N2 ? n : n - N2);
+            if (!interior && !valid_neighbour(pos, &nb.delta[nn*nd], sign, nd, dims)) continue;
+            const npy_intp q = p + sign*nb.offsets[nn];
+            if (zpar[q] == -1) continue;
+            const npy_intp r = tree_find(zpar, q);
+            if (r != p) {
+                parent[r] = p;
+                zpar[r] = p;
+            }
+        }
+    }
+    // Make every pixel point to the canonical pixel of its parent node
+    for (npy_intp k = 0; k != N; ++k) {
+        const npy_intp p = order[k];
+        const npy_intp q = parent[p];
+        if (f[parent[q]] == f[q]) parent[p] = parent[q];
+    }
+}
+
+PyObject* py_build_tree(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* Bc;
+    PyArrayObject* parent;
+    PyArrayObject* order;
+    int is_min;
+    if (!PyArg_ParseTuple(args,"OOOOi", &array, &Bc, &parent, &order, &is_min)) return NULL;
+    if (!numpy::are_arrays(array, Bc, parent, order) ||
+        !numpy::equiv_typenums(array, Bc) ||
+        PyArray_NDIM(array) != PyArray_NDIM(Bc) ||
+        !PyArray_ISCARRAY_RO(array) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(parent), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(order), NPY_INTP) ||
+        !PyArray_ISCARRAY(parent) ||
+        !PyArray_ISCARRAY(order) ||
+        PyArray_SIZE(parent) != PyArray_SIZE(array) ||
+        PyArray_SIZE(order) != PyArray_SIZE(array)
+    ) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    npy_intp* pparent = static_cast<npy_intp*>(PyArray_DATA(parent));
+    npy_intp* porder = static_cast<npy_intp*>(PyArray_DATA(order));
+#define HANDLE(type) \
+    build_tree<type>(numpy::aligned_array<type>(array), numpy::aligned_array<type>(Bc), pparent, porder, bool(is_min));
+    SAFE_SWITCH_ON_INTEGER_TYPES_OF(array, true);
+#undef HANDLE
+
+    Py_RETURN_NONE;
+}
+
+// Attributes of the nodes of a component tree. All of them are increasing
+// (a node's value is at least that of any of its children).
+enum tree_attribute_type {
+    // number of pixels
+    tree_area = 0,
+    // largest side of the bounding box
+    tree_extent = 1,
+    // difference between the most extreme value in the node & the level
+    // of its parent
+    tree_height = 2
+};
+
+// Sets attr[p] to the attribute of the node of p (for all pixels)
+template<typename T>
+void tree_attribute(numpy::aligned_array<T> array, const npy_intp* parent, const npy_intp* order, const int attribute, npy_intp* attr) {
+    gil_release nogil;
+    const int nd = array.ndims();
+    const npy_intp N = array.size();
+    npy_intp dims[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) dims[d] = array.dim(d);
+    const T* f = array.data();
+    if (!N) return;
+
+    if (attribute == tree_area) {
+        std::fill(attr, attr + N, 1);
+        for (npy_intp k = N - 1; k >= 0; --k) {
+            const npy_intp p = order[k];
+            if (parent[p] != p) attr[parent[p]] += attr[p];
+        }
+    } else if (attribute == tree_extent) {
+        std::vector<npy_intp> first(N*nd);
+        std::vector<npy_intp> last(N*nd);
+        for (npy_intp p = 0; p != N; ++p) {
+            flat_to_position(p, nd, dims, &first[p*nd]);
+            std::copy(&first[p*nd], &first[p*nd] + nd, &last[p*nd]);
+        }
+        for (npy_intp k = N - 1; k >= 0; --k) {
+            const npy_intp p = order[k];
+            const npy_intp q = parent[p];
+            if (q == p) continue;
+            for (int d = 0; d != nd; ++d) {
+                first[q*nd + d] = std::min(first[q*nd + d], first[p*nd + d]);
+                last[q*nd + d] = std::max(last[q*nd + d], last[p*nd + d]);
+            }
+        }
+        for (npy_intp p = 0; p != N; ++p) {
+            npy_intp extent = 1;
+            for (int d = 0; d != nd; ++d) extent = std::max(extent, last[p*nd + d] - first[p*nd + d] + 1);
+            attr[p] = extent;
+        }
+    } else {
+        // One of smallest & largest is the level of the node itself (which
+        // one depends on whether this is a max-tree or a min-tree)
+        std::vector<T> smallest(f, f + N);
+        std::vector<T> largest(f, f + N);
+        for (npy_intp k = N - 1; k >= 0; --k) {
+            const npy_intp p = order[k];
+            const npy_intp q = parent[p];
+            if (q == p) continue;
+            smallest[q] = std::min<T>(smallest[q], smallest[p]);
+            largest[q] = std::max<T>(largest[q], largest[p]);
+        }
+        for (npy_intp p = 0; p != N; ++p) {
+            const npy_intp level = npy_intp(f[parent[p]]);
+            attr[p] = std::max<npy_intp>(npy_intp(largest[p]) - level, level - npy_intp(smallest[p]));
+        }
+    }
+    // The non-canonical pixels get the attribute of their node
+    for (npy_intp k = 0; k != N; ++k) {
+        const npy_intp p = order[k];
+        const npy_intp q = parent[p];
+        if (q != p && f[q] == f[p]) attr[p] = attr[q];
+    }
+}
+
+PyObject* py_tree_attribute(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* parent;
+    PyArrayObject* order;
+    int attribute;
+    PyArrayObject* output;
+    if (!PyArg_ParseTuple(args,"OOOiO", &array, &parent, &order, &attribute, &output)) return NULL;
+    if (!numpy::are_arrays(array, parent, order, output) ||
+        !PyArray_ISCARRAY_RO(array) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(parent), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(order), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(output), NPY_INTP) ||
+        !PyArray_ISCARRAY_RO(parent) ||
+        !PyArray_ISCARRAY_RO(order) ||
+        !PyArray_ISCARRAY(output) ||
+        PyArray_SIZE(parent) != PyArray_SIZE(array) ||
+        PyArray_SIZE(order) != PyArray_SIZE(array) ||
+        PyArray_SIZE(output) != PyArray_SIZE(array) ||
+        attribute < tree_area || attribute > tree_height
+    ) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    holdref r_o(output);
+    const npy_intp* pparent = static_cast<const npy_intp*>(PyArray_DATA(parent));
+    const npy_intp* porder = static_cast<const npy_intp*>(PyArray_DATA(order));
+    npy_intp* pout = static_cast<npy_intp*>(PyArray_DATA(output));
+#define HANDLE(type) \
+    tree_attribute<type>(numpy::aligned_array<type>(array), pparent, porder, attribute, pout);
+    SAFE_SWITCH_ON_INTEGER_TYPES_OF(array, true);
+#undef HANDLE
+
+    Py_XINCREF(output);
+    return PyArray_Return(output);
+}
+
+// Removes the nodes whose attribute is smaller than threshold: their pixels
+// take the level of the closest ancestor which is kept (the root is always
+// kept). As the attributes are increasing, this is an opening (for the
+// max-tree) or a closing (for the min-tree).
+template<typename T>
+void tree_filter(numpy::aligned_array<T> array, const npy_intp* parent, const npy_intp* order, const npy_intp* attr, const npy_intp threshold, T* out) {
+    gil_release nogil;
+    const npy_intp N = array.size();
+    const T* f = array.data();
+    for (npy_intp k = 0; k != N; ++k) {
+        const npy_intp p = order[k];
+        const npy_intp q = parent[p];
+        if (q == p || (f[q] != f[p] && attr[p] >= threshold)) {
+            out[p] = f[p];
+        } else {
+            out[p] = out[q];
+        }
+    }
+}
+
+PyObject* py_tree_filter(PyObject* self, PyObject* args) {
+    PyArrayObject* array;
+    PyArrayObject* parent;
+    PyArrayObject* order;
+    PyArrayObject* attr;
+    Py_ssize_t threshold;
+    PyArrayObject* output;
+    if (!PyArg_ParseTuple(args,"OOOOnO", &array, &parent, &order, &attr, &threshold, &output)) return NULL;
+    if (!numpy::are_arrays(array, parent, order, attr) ||
+        !PyArray_Check(output) ||
+        !numpy::equiv_typenums(array, output) ||
+        !PyArray_ISCARRAY_RO(array) ||
+        !PyArray_ISCARRAY(output) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(parent), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(order), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(attr), NPY_INTP) ||
+        !PyArray_ISCARRAY_RO(parent) ||
+        !PyArray_ISCARRAY_RO(order) ||
+        !PyArray_ISCARRAY_RO(attr) ||
+        PyArray_SIZE(parent) != PyArray_SIZE(array) ||
+        PyArray_SIZE(order) != PyArray_SIZE(array) ||
+        PyArray_SIZE(attr) != PyArray_SIZE(array) ||
+        PyArray_SIZE(output) != PyArray_SIZE(array) ||
+        PyArray_DATA(output) == PyArray_DATA(array)
+    ) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    holdref r_o(output);
+    const npy_intp* pparent = static_cast<const npy_intp*>(PyArray_DATA(parent));
+    const npy_intp* porder = static_cast<const npy_intp*>(PyArray_DATA(order));
+    const npy_intp* pattr = static_cast<const npy_intp*>(PyArray_DATA(attr));
+#define HANDLE(type) \
+    tree_filter<type>(numpy::aligned_array<type>(array), pparent, porder, pattr, threshold, static_cast<type*>(PyArray_DATA(output)));
+    SAFE_SWITCH_ON_INTEGER_TYPES_OF(array, true);
+#undef HANDLE
+
+    Py_XINCREF(output);
+    return PyArray_Return(output);
+}
+
 struct MarkerInfo {
     int cost;
     int idx;
@@ -416,12 +1311,8 @@ struct NeighbourElem {
 };
 
 template<typename BaseType>
-void cwatershed(numpy::aligned_array<BaseType> res, numpy::aligned_array<bool>* lines, numpy::aligned_array<BaseType> array, numpy::aligned_array<BaseType> markers, numpy::aligned_array<BaseType> Bc) {
-    gil_release nogil;
-    const int N = res.size();
+std::vector<NeighbourElem> watershed_neighbours(numpy::aligned_array<BaseType>& Bc, numpy::aligned_array<BaseType>& markers) {
     const int N2 = Bc.size();
-    assert(res.is_carray());
-    BaseType* rdata = res.data();
     std::vector<NeighbourElem> neighbours;
     const numpy::position centre = central_position(Bc);
     typename numpy::aligned_array<BaseType>::iterator Bi = Bc.begin();
@@ -437,6 +1328,166 @@ void cwatershed(numpy::aligned_array<BaseType> res, numpy::aligned_array<bool>*
             neighbours.push_back(NeighbourElem(delta, margin, npos));
         }
     }
+    return neighbours;
+}
+
+// Priority queue for cwatershed on surfaces with few grey levels: one FIFO
+// per grey level (so that, within a level, elements come out in the order in
+// which they were pushed, just as with the idx field of MarkerInfo).
+// The FIFOs are linked lists threaded through next (one entry per pixel).
+// The non-empty levels are tracked in a two-level bitmap, so finding the
+// lowest one takes a couple of word operations.
+struct bucket_queue {
+    bucket_queue(const int nlevels, std::vector<int>& next)
+        :head_(nlevels, -1)
+        ,tail_(nlevels, -1)
+        ,occupied_((nlevels + 63)/64, 0)
+        ,summary_((occupied_.size() + 63)/64, 0)
+        ,next_(next)
+        ,size_(0)
+        { }
+
+    bool empty() const { return !size_; }
+
+    void push(const int level, const int position) {
+        next_[position] = -1;
+        if (tail_[level] == -1) {
+            head_[level] = position;
+            occupied_[level/64] |= npy_uint64(1) << (level % 64);
+            summary_[level/4096] |= npy_uint64(1) << ((level/64) % 64);
+        } else {
+            next_[tail_[level]] = position;
+        }
+        tail_[level] = position;
+        ++size_;
+    }
+
+    // Removes and returns the first position in the lowest level
+    int pop() {
+        int s = 0;
+        while (!summary_[s]) ++s;
+        const int w = s*64 + lowest_bit(summary_[s]);
+        const int level = w*64 + lowest_bit(occupied_[w]);
+        const int position = head_[level];
+        head_[level] = next_[position];
+        if (head_[level] == -1) {
+            tail_[level] = -1;
+            occupied_[w] &= ~(npy_uint64(1) << (level % 64));
+            if (!occupied_[w]) summary_[s] &= ~(npy_uint64(1) << (w % 64));
+        }
+        --size_;
+        return position;
+    }
+
+    private:
+        static int lowest_bit(npy_uint64 v) {
+#ifdef __GNUC__
+            return __builtin_ctzll(v);
+#else
+            int r = 0;
+            while (!(v & 1)) {
+                v >>= 1;
+                ++r;
+            }
+            return r;
+#endif
+        }
+
+        std::vector<int> head_;
+        std::vector<int> tail_;
+        std::vector<npy_uint64> occupied_;
+        std::vector<npy_uint64> summary_;
+        std::vector<int>& next_;
+        int size_;
+};
+
+// Same algorithm as cwatershed() below, using a bucket_queue. The state of
+// each pixel is kept in the output and in the links of the queue:
+//
+//     - not yet reached: res is zero (markers are never zero)
+//     - in the queue: res is set (next holds the link to the next pixel)
+//     - done: next is done_mark
+//
+// The margin of each pixel is saved when it is pushed (saturating at 255,
+// which is still a valid lower bound).
+template<typename BaseType>
+void cwatershed_buckets(numpy::aligned_array<BaseType>& res, numpy::aligned_array<bool>* lines, numpy::aligned_array<BaseType>& array, numpy::aligned_array<BaseType>& markers, numpy::aligned_array<BaseType>& Bc) {
+    const int N = res.size();
+    assert(res.is_carray());
+    BaseType* rdata = res.data();
+    const std::vector<NeighbourElem> neighbours = watershed_neighbours(Bc, markers);
+    const BaseType min_level = std::numeric_limits<BaseType>::min();
+    const BaseType max_level = std::numeric_limits<BaseType>::max();
+    const int done_mark = -2;
+
+    std::vector<int> next(N, -1);
+    std::vector<unsigned char> margins(N);
+    bucket_queue queue(int(max_level) - int(min_level) + 1, next);
+
+    typename numpy::aligned_array<BaseType>::iterator miter = markers.begin();
+    for (int i = 0; i != N; ++i, ++miter) {
+        if (*miter) {
+            const numpy::position mpos = miter.position();
+            const int position = markers.pos_to_flat(mpos);
+            margins[position] = std::min<numpy::index_type>(margin_of(mpos, markers), 255);
+            queue.push(int(array.at(mpos)) - int(min_level), position);
+            res.at(mpos) = *miter;
+        }
+    }
+
+    while (!queue.empty()) {
+        const int position = queue.pop();
+        next[position] = done_mark;
+        for (std::vector<NeighbourElem>::const_iterator neighbour = neighbours.begin(), past = neighbours.end(); neighbour != past; ++neighbour) {
+            const numpy::index_type npos = position + neighbour->delta;
+            int nmargin = margins[position] - neighbour->margin;
+            if (nmargin < 0) {
+                numpy::position pos = markers.flat_to_pos(position);
+                numpy::position long_pos = pos + neighbour->delta_position;
+                nmargin = margin_of(long_pos, markers);
+                if (nmargin < 0) continue;
+            }
+            if (next[npos] == done_mark) continue;
+            const BaseType ncost = array.at_flat(npos);
+            // Pixels at the maximum level are never reached (as in cwatershed)
+            if (!rdata[npos] && ncost != max_level) {
+                rdata[npos] = rdata[position];
+                margins[npos] = std::min(nmargin, 255);
+                queue.push(int(ncost) - int(min_level), npos);
+            } else if (lines && rdata[position] != rdata[npos] && !lines->at_flat(npos)) {
+                lines->at_flat(npos) = true;
+            }
+        }
+    }
+}
+
+// cwatershed_buckets is only used (and only instantiated) for types with at
+// most 16 bits
+template <bool use_buckets>
+struct watershed_buckets {
+    template<typename BaseType>
+    static bool run(numpy::aligned_array<BaseType>&, numpy::aligned_array<bool>*, numpy::aligned_array<BaseType>&, numpy::aligned_array<BaseType>&, numpy::aligned_array<BaseType>&) {
+        return false;
+    }
+};
+
+template <>
+struct watershed_buckets<true> {
+    template<typename BaseType>
+    static bool run(numpy::aligned_array<BaseType>& res, numpy::aligned_array<bool>* lines, numpy::aligned_array<BaseType>& array, numpy::aligned_array<BaseType>& markers, numpy::aligned_array<BaseType>& Bc) {
+        cwatershed_buckets<BaseType>(res, lines, array, markers, Bc);
+        return true;
+    }
+};
+
+template<typename BaseType>
+void cwatershed(numpy::aligned_array<BaseType> res, numpy::aligned_array<bool>* lines, numpy::aligned_array<BaseType> array, numpy::aligned_array<BaseType> markers, numpy::aligned_array<BaseType> Bc) {
+    gil_release nogil;
+    if (watershed_buckets<(std::numeric_limits<BaseType>::digits <= 16)>::run(res, lines, array, markers, Bc)) return;
+    const int N = res.size();
+    assert(res.is_carray());
+    BaseType* rdata = res.data();
+    const std::vector<NeighbourElem> neighbours = watershed_neighbours(Bc, markers);
     int idx = 0;
 
     std::vector<BaseType> cost(array.size());
@@ -511,11 +1562,13 @@ PyObject* py_cwatershed(PyObject* self, PyObject* args) {
     }
     PyArrayObject* res_a = (PyArrayObject*)PyArray_SimpleNew(array->nd,array->dimensions,PyArray_TYPE(array));
     if (!res_a) return NULL;
+    PyArray_FILLWBYTE(res_a, 0);
     PyArrayObject* lines =  0;
     numpy::aligned_array<bool>* lines_a = 0;
     if (return_lines) {
         lines = (PyArrayObject*)PyArray_SimpleNew(array->nd, array->dimensions, NPY_BOOL);
         if (!lines) return NULL;
+        PyArray_FILLWBYTE(lines, 0);
         lines_a = new numpy::aligned_array<bool>(lines);
     }
 #define HANDLE(type) \
@@ -541,9 +1594,48 @@ struct HitMissNeighbour {
     int value;
 };
 
+// If all the values in Bc are 0, 1, or 2, the hit & miss transform is the
+// intersection of the erosions of (input == 1) by the 1s in Bc and of
+// (input == 0) by the 0s, which can be computed on bit-packed arrays.
+template <typename T>
+bool packed_hitmiss(numpy::aligned_array<T>& res, const numpy::aligned_array<T>& input, const numpy::aligned_array<T>& Bc) {
+    const int nd = input.ndims();
+    if (nd == 0 || Bc.ndims() != nd || !res.size()) return false;
+    typename numpy::aligned_array<T>::const_iterator iter = Bc.begin();
+    for (int i = 0, N = Bc.size(); i != N; ++i, ++iter) {
+        if (*iter != T(0) && *iter != T(1) && *iter != T(2)) return false;
+    }
+    const std::vector<npy_intp> hits = offsets_of(Bc, T(1));
+    const std::vector<npy_intp> misses = offsets_of(Bc, T(0));
+    packed_array output(nd, input.raw_dims());
+    output.fill(true);
+    if (!hits.empty()) {
+        packed_array ones(nd, input.raw_dims());
+        pack<T>(ones, input.raw_array(), T(1));
+        erode_into(output, ones, hits);
+    }
+    if (!misses.empty()) {
+        packed_array zeros(nd, input.raw_dims());
+        pack<T>(zeros, input.raw_array(), T(0));
+        erode_into(output, zeros, misses);
+    }
+    // The border is set to zero, as in the generic code below. This includes
+    // its handling of even-sized templates along the last axis, where the
+    // last position of each row is kept (if there are any positions left).
+    npy_intp before[NPY_MAXDIMS];
+    npy_intp after[NPY_MAXDIMS];
+    for (int d = 0; d != nd; ++d) before[d] = after[d] = Bc.dim(d)/2;
+    const npy_intp h = Bc.dim(nd - 1)/2;
+    if (Bc.dim(nd - 1) % 2 == 0 && input.dim(nd - 1) >= 2*h + 1) after[nd - 1] = h - 1;
+    clear_border(output, before, after);
+    unpack<T>(output, res.raw_array());
+    return true;
+}
+
 template <typename T>
 void hitmiss(numpy::aligned_array<T> res, const numpy::aligned_array<T>& input, const numpy::aligned_array<T>& Bc) {
     gil_release nogil;
+    if (packed_hitmiss(res, input, Bc)) return;
     typedef typename numpy::aligned_array<T>::iterator iterator;
     typedef typename numpy::aligned_array<T>::const_iterator const_iterator;
     const numpy::index_type N = input.size();
@@ -665,6 +1757,10 @@ PyMethodDef methods[] = {
   {"dilate",(PyCFunction)py_dilate, METH_VARARGS, NULL},
   {"erode",(PyCFunction)py_erode, METH_VARARGS, NULL},
   {"close_holes",(PyCFunction)py_close_holes, METH_VARARGS, NULL},
+  {"reconstruct",(PyCFunction)py_reconstruct, METH_VARARGS, NULL},
+  {"build_tree",(PyCFunction)py_build_tree, METH_VARARGS, NULL},
+  {"tree_attribute",(PyCFunction)py_tree_attribute, METH_VARARGS, NULL},
+  {"tree_filter",(PyCFunction)py_tree_filter, METH_VARARGS, NULL},
   {"cwatershed",(PyCFunction)py_cwatershed, METH_VARARGS, NULL},
   {"locmin_max",(PyCFunction)py_locminmax, METH_VARARGS, NULL},
   {"regmin_max",(PyCFunction)py_regminmax, METH_VARARGS, NULL},
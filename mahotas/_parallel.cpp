@@ -0,0 +1,396 @@
+// Copyright (C) 2012 Luis Pedro Coelho <luis@luispedro.org>
+//
+// License: MIT (Check COPYING file)
+
+// The thread pool shared by all the mahotas modules (see parallel.hpp)
+//
+// Each call to run() splits the input into one contiguous range per thread.
+// A thread processes its own range from the front, `grain` elements at a time
+// and, once it is done, steals the back half of the range of another
+// thread. Only one call uses the pool at a time: if it is busy (because
+// another Python thread is using it or because of a nested call), the work
+// is done in the calling thread.
+
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+#ifndef _WIN32
+#define MAHOTAS_HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MAHOTAS_PARALLEL_IMPLEMENTATION
+#include "parallel.hpp"
+#include "utils.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+namespace {
+
+const char TypeErrorMsg[] =
+    "Type not understood. "
+    "This is caused by either a direct call to _parallel (which is dangerous: types are not checked!) or a bug in parallel.py.\n";
+
+int default_num_threads() {
+    const char* env = std::getenv("MAHOTAS_NUM_THREADS");
+    if (env) {
+        const int n = std::atoi(env);
+        if (n > 0) return n;
+    }
+#ifdef MAHOTAS_HAVE_PTHREADS
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0) return int(ncpus);
+#endif
+    return 1;
+}
+
+#ifdef MAHOTAS_HAVE_PTHREADS
+
+struct work_range {
+    pthread_mutex_t mutex;
+    npy_intp start;
+    npy_intp end;
+};
+
+struct thread_pool {
+    thread_pool()
+        :nthreads_(default_num_threads())
+        ,ranges_(0)
+        ,generation_(0)
+        ,running_(0)
+        ,stop_(false)
+        {
+            pthread_mutex_init(&job_mutex_, 0);
+            pthread_mutex_init(&nthreads_mutex_, 0);
+            init_sync();
+            allocate_ranges();
+        }
+
+    int num_threads() {
+        pthread_mutex_lock(&nthreads_mutex_);
+        const int n = nthreads_;
+        pthread_mutex_unlock(&nthreads_mutex_);
+        return n;
+    }
+
+    void set_num_threads(const int n) {
+        pthread_mutex_lock(&job_mutex_);
+        stop_workers();
+        delete_ranges();
+        pthread_mutex_lock(&nthreads_mutex_);
+        nthreads_ = n;
+        pthread_mutex_unlock(&nthreads_mutex_);
+        allocate_ranges();
+        pthread_mutex_unlock(&job_mutex_);
+    }
+
+    int run(const npy_intp n, const npy_intp grain, parallel_task task, void* closure, PyObject** error_type, const char** error_message) {
+        if (n <= grain || pthread_mutex_trylock(&job_mutex_) != 0) {
+            return task(closure, 0, n, error_type, error_message);
+        }
+        if (nthreads_ <= 1) {
+            pthread_mutex_unlock(&job_mutex_);
+            return task(closure, 0, n, error_type, error_message);
+        }
+        start_workers();
+        const int nworkers = workers_.size() + 1;
+        for (int i = 0; i != nworkers; ++i) {
+            ranges_[i].start = n/nworkers * i;
+            ranges_[i].end = (i == nworkers - 1 ? n : n/nworkers * (i + 1));
+        }
+
+        pthread_mutex_lock(&mutex_);
+        task_ = task;
+        closure_ = closure;
+        grain_ = (grain > 0 ? grain : 1);
+        nworkers_ = nworkers;
+        failed_ = false;
+        running_ = nworkers - 1;
+        ++generation_;
+        pthread_cond_broadcast(&start_);
+        pthread_mutex_unlock(&mutex_);
+
+        work(0);
+
+        pthread_mutex_lock(&mutex_);
+        while (running_) pthread_cond_wait(&done_, &mutex_);
+        const bool failed = failed_;
+        if (failed) {
+            *error_type = error_type_;
+            *error_message = error_message_;
+        }
+        pthread_mutex_unlock(&mutex_);
+        pthread_mutex_unlock(&job_mutex_);
+        return failed;
+    }
+
+    // fork() only duplicates the calling thread, so the child starts without
+    // any workers (they are restarted on demand).
+    void prepare_fork() {
+        pthread_mutex_lock(&job_mutex_);
+    }
+    void after_fork_parent() {
+        pthread_mutex_unlock(&job_mutex_);
+    }
+    void after_fork_child() {
+        pthread_mutex_init(&job_mutex_, 0);
+        pthread_mutex_init(&nthreads_mutex_, 0);
+        init_sync();
+        for (int i = 0; i != nthreads_; ++i) pthread_mutex_init(&ranges_[i].mutex, 0);
+        workers_.clear();
+        running_ = 0;
+        stop_ = false;
+    }
+
+    private:
+        struct worker_arg {
+            thread_pool* pool;
+            int id;
+            unsigned long generation;
+        };
+
+        static void* worker_main(void* varg) {
+            worker_arg* arg = static_cast<worker_arg*>(varg);
+            thread_pool* pool = arg->pool;
+            const int id = arg->id;
+            unsigned long seen = arg->generation;
+            delete arg;
+
+            pthread_mutex_lock(&pool->mutex_);
+            while (true) {
+                while (pool->generation_ == seen && !pool->stop_) {
+                    pthread_cond_wait(&pool->start_, &pool->mutex_);
+                }
+                if (pool->stop_) break;
+                seen = pool->generation_;
+                pthread_mutex_unlock(&pool->mutex_);
+
+                pool->work(id);
+
+                pthread_mutex_lock(&pool->mutex_);
+                if (--pool->running_ == 0) pthread_cond_signal(&pool->done_);
+            }
+            pthread_mutex_unlock(&pool->mutex_);
+            return 0;
+        }
+
+        void work(const int id) {
+            npy_intp start, end;
+            while (next(id, start, end)) {
+                PyObject* error_type;
+                const char* error_message;
+                if (task_(closure_, start, end, &error_type, &error_message)) {
+                    pthread_mutex_lock(&mutex_);
+                    if (!failed_) {
+                        failed_ = true;
+                        error_type_ = error_type;
+                        error_message_ = error_message;
+                    }
+                    pthread_mutex_unlock(&mutex_);
+                    // Drop all the remaining work
+                    for (int i = 0; i != nworkers_; ++i) {
+                        pthread_mutex_lock(&ranges_[i].mutex);
+                        ranges_[i].start = ranges_[i].end;
+                        pthread_mutex_unlock(&ranges_[i].mutex);
+                    }
+                }
+            }
+        }
+
+        bool next(const int id, npy_intp& start, npy_intp& end) {
+            work_range& own = ranges_[id];
+            pthread_mutex_lock(&own.mutex);
+            if (own.start != own.end) {
+                start = own.start;
+                end = std::min(own.start + grain_, own.end);
+                own.start = end;
+                pthread_mutex_unlock(&own.mutex);
+                return true;
+            }
+            pthread_mutex_unlock(&own.mutex);
+
+            for (int i = 1; i != nworkers_; ++i) {
+                work_range& victim = ranges_[(id + i) % nworkers_];
+                pthread_mutex_lock(&victim.mutex);
+                const npy_intp left = victim.end - victim.start;
+                if (left == 0) {
+                    pthread_mutex_unlock(&victim.mutex);
+                    continue;
+                }
+                npy_intp stolen_start = victim.start;
+                if (left > grain_) stolen_start += left/2;
+                const npy_intp stolen_end = victim.end;
+                victim.end = stolen_start;
+                pthread_mutex_unlock(&victim.mutex);
+
+                start = stolen_start;
+                end = std::min(stolen_start + grain_, stolen_end);
+                pthread_mutex_lock(&own.mutex);
+                own.start = end;
+                own.end = stolen_end;
+                pthread_mutex_unlock(&own.mutex);
+                return true;
+            }
+            return false;
+        }
+
+        void start_workers() {
+            while (int(workers_.size()) < nthreads_ - 1) {
+                worker_arg* arg = new worker_arg;
+                arg->pool = this;
+                arg->id = workers_.size() + 1;
+                arg->generation = generation_;
+                pthread_t thread;
+                if (pthread_create(&thread, 0, worker_main, arg) != 0) {
+                    // Just make do with the threads we have
+                    delete arg;
+                    break;
+                }
+                workers_.push_back(thread);
+            }
+        }
+
+        void stop_workers() {
+            pthread_mutex_lock(&mutex_);
+            stop_ = true;
+            pthread_cond_broadcast(&start_);
+            pthread_mutex_unlock(&mutex_);
+            for (unsigned i = 0; i != workers_.size(); ++i) {
+                pthread_join(workers_[i], 0);
+            }
+            workers_.clear();
+            stop_ = false;
+        }
+
+        void init_sync() {
+            pthread_mutex_init(&mutex_, 0);
+            pthread_cond_init(&start_, 0);
+            pthread_cond_init(&done_, 0);
+        }
+
+        void allocate_ranges() {
+            ranges_ = new work_range[nthreads_];
+            for (int i = 0; i != nthreads_; ++i) {
+                pthread_mutex_init(&ranges_[i].mutex, 0);
+                ranges_[i].start = ranges_[i].end = 0;
+            }
+        }
+
+        void delete_ranges() {
+            for (int i = 0; i != nthreads_; ++i) pthread_mutex_destroy(&ranges_[i].mutex);
+            delete [] ranges_;
+            ranges_ = 0;
+        }
+
+        // nthreads_ is only written with both job_mutex_ & nthreads_mutex_
+        // held, so that it can be read with either of them
+        int nthreads_;
+        pthread_mutex_t nthreads_mutex_;
+        std::vector<pthread_t> workers_;
+        work_range* ranges_;
+
+        // job_mutex_ is held for the whole duration of a run() call
+        pthread_mutex_t job_mutex_;
+
+        // The following are protected by mutex_
+        pthread_mutex_t mutex_;
+        pthread_cond_t start_;
+        pthread_cond_t done_;
+        unsigned long generation_;
+        int running_;
+        bool stop_;
+        bool failed_;
+        PyObject* error_type_;
+        const char* error_message_;
+
+        // These are only written while all workers are idle
+        parallel_task task_;
+        void* closure_;
+        npy_intp grain_;
+        int nworkers_;
+};
+
+#else // !MAHOTAS_HAVE_PTHREADS
+
+// Without pthreads, everything runs in the calling thread
+struct thread_pool {
+    int num_threads() const { return 1; }
+    void set_num_threads(const int) { }
+    int run(const npy_intp n, const npy_intp, parallel_task task, void* closure, PyObject** error_type, const char** error_message) {
+        return task(closure, 0, n, error_type, error_message);
+    }
+};
+
+#endif
+
+// The pool is never deleted: its threads may still be waiting for work when
+// the process exits.
+thread_pool* pool = 0;
+
+#ifdef MAHOTAS_HAVE_PTHREADS
+void pool_prepare_fork() { pool->prepare_fork(); }
+void pool_after_fork_parent() { pool->after_fork_parent(); }
+void pool_after_fork_child() { pool->after_fork_child(); }
+#endif
+
+thread_pool& get_pool() {
+    if (!pool) {
+        pool = new thread_pool;
+#ifdef MAHOTAS_HAVE_PTHREADS
+        pthread_atfork(pool_prepare_fork, pool_after_fork_parent, pool_after_fork_child);
+#endif
+    }
+    return *pool;
+}
+
+int api_num_threads() {
+    return pool->num_threads();
+}
+
+int api_run(npy_intp n, npy_intp grain, parallel_task task, void* closure, PyObject** error_type, const char** error_message) {
+    return pool->run(n, grain, task, closure, error_type, error_message);
+}
+
+parallel_api api = {
+    parallel_api_version,
+    api_num_threads,
+    api_run,
+};
+
+PyObject* py_api(PyObject* self, PyObject* args) {
+    get_pool();
+    return PyCapsule_New(&api, "mahotas._parallel._api", NULL);
+}
+
+PyObject* py_set_num_threads(PyObject* self, PyObject* args) {
+    int n;
+    if (!PyArg_ParseTuple(args, "i", &n)) return NULL;
+    if (n < 1) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    get_pool().set_num_threads(n);
+    Py_RETURN_NONE;
+}
+
+PyObject* py_get_num_threads(PyObject* self, PyObject* args) {
+    if (!PyArg_ParseTuple(args, "")) return NULL;
+    return PyLong_FromLong(get_pool().num_threads());
+}
+
+PyMethodDef methods[] = {
+  {"_api",(PyCFunction)py_api, METH_NOARGS, NULL},
+  {"set_num_threads",(PyCFunction)py_set_num_threads, METH_VARARGS, NULL},
+  {"get_num_threads",(PyCFunction)py_get_num_threads, METH_VARARGS, NULL},
+  {NULL, NULL,0,NULL},
+};
+
+} // namespace
+
+DECLARE_MODULE(_parallel)
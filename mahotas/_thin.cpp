@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <vector>
 #include "utils.hpp"
+#include "_bitpacked.h"
 
 extern "C" {
     #include <Python.h>
@@ -17,32 +20,48 @@ const char TypeErrorMsg[] =
 const int Element_Size = 6;
 struct structure_element {
     bool data[Element_Size];
-    npy_intp offset[Element_Size];
+    npy_intp delta0[Element_Size];
+    npy_intp delta1[Element_Size];
 };
 
-inline
-bool match(const bool* array, const structure_element& elem) {
-    if (!*array) return false;
-    for (int i = 0; i != Element_Size; ++i) {
-        if (elem.data[i] != *(array+elem.offset[i])) return false;
-    }
-    return true;
-}
-
-inline
-void fast_hitmiss(PyArrayObject* array, const structure_element& elem, PyArrayObject* outputa) {
-    const bool* first = reinterpret_cast<const bool*>(PyArray_DATA(array));
-    const bool* const last = first + PyArray_NBYTES(array)/sizeof(bool);
-    bool* output = reinterpret_cast<bool*>(PyArray_DATA(outputa));
-    for ( ; first != last; ++first) {
-        *output++ = match(first, elem);
+// Computes, on bit-packed arrays, which pixels of array match elem:
+// the pixel itself must be set and its neighbours at (delta0, delta1) must be
+// equal to data (pixels outside the array are taken to be 0).
+struct match_worker {
+    match_worker(const packed_array& array, const structure_element& elem, packed_array& matches)
+        :array_(array)
+        ,elem_(elem)
+        ,matches_(matches)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const npy_intp nrows = array_.nrows();
+        const npy_intp nwords = array_.row_words();
+        std::vector<bitword> buffer(nwords);
+        bitword* shifted = &buffer[0];
+        for (npy_intp r = start; r != end; ++r) {
+            bitword* out = matches_.row(r);
+            std::copy(array_.row(r), array_.row(r) + nwords, out);
+            for (int j = 0; j != Element_Size; ++j) {
+                const npy_intp sr = r + elem_.delta0[j];
+                if (sr < 0 || sr >= nrows) {
+                    std::fill(shifted, shifted + nwords, bitword(0));
+                } else {
+                    shift_bits(shifted, nwords, array_.row(sr), nwords, elem_.delta1[j]);
+                }
+                if (elem_.data[j]) {
+                    for (npy_intp w = 0; w != nwords; ++w) out[w] &= shifted[w];
+                } else {
+                    for (npy_intp w = 0; w != nwords; ++w) out[w] &= ~shifted[w];
+                }
+            }
+        }
     }
-}
 
-inline
-npy_intp coordinates_delta(PyArrayObject* array, npy_intp d0, npy_intp d1) {
-    return (d0*PyArray_STRIDE(array,0) + d1*PyArray_STRIDE(array,1))/sizeof(bool);
-}
+    const packed_array& array_;
+    const structure_element& elem_;
+    packed_array& matches_;
+};
 
 const bool boolvals[] =    { false, false, false, true, true, true };
 // edge
@@ -73,61 +92,61 @@ void show_data(const bool flip, const npy_intp* delta0, const npy_intp* delta1)
     std:: cout << '\n';
 }
 
-void fill_data(PyArrayObject* array, structure_element& elem, const bool flip, const npy_intp* delta0, const npy_intp* delta1) {
+void fill_data(structure_element& elem, const bool flip, const npy_intp* delta0, const npy_intp* delta1) {
     //show_data(flip, delta0, delta1);
     for (int j = 0; j != Element_Size; ++j) {
         elem.data[j] = (flip ? ! boolvals[j]: boolvals[j]);
-        elem.offset[j] = coordinates_delta(array, delta0[j], delta1[j]);
+        elem.delta0[j] = delta0[j];
+        elem.delta1[j] = delta1[j];
     }
 }
 
 
 PyObject* py_thin(PyObject* self, PyObject* args) {
     PyArrayObject* array;
-    PyArrayObject* buffer;
-    if (!PyArg_ParseTuple(args,"OO", &array, &buffer) ||
-        !PyArray_Check(array) || !PyArray_Check(buffer) ||
-        PyArray_TYPE(array) != NPY_BOOL || PyArray_TYPE(buffer) != NPY_BOOL ||
-        PyArray_NDIM(array) != 2 || PyArray_NDIM(buffer) != 2 ||
-        PyArray_DIM(array, 0) != PyArray_DIM(buffer,0) ||
-        PyArray_DIM(array, 1) != PyArray_DIM(buffer, 1) ||
-        !PyArray_ISCONTIGUOUS(array) || !PyArray_ISCONTIGUOUS(buffer)) {
+    if (!PyArg_ParseTuple(args,"O", &array) ||
+        !PyArray_Check(array) ||
+        PyArray_TYPE(array) != NPY_BOOL ||
+        PyArray_NDIM(array) != 2 ||
+        !PyArray_ISCONTIGUOUS(array)) {
             PyErr_SetString(PyExc_RuntimeError,TypeErrorMsg);
             return NULL;
     }
-    { // DROP THE GIL
+    if (PyArray_SIZE(array)) { // DROP THE GIL
         gil_release nogil;
         const int Nr_Elements = 8;
         structure_element elems[Nr_Elements];
-        fill_data(array, elems[0], false, edelta0, edelta1);
-        fill_data(array, elems[1], false, adelta0, adelta1);
-        fill_data(array, elems[2],  true, edelta1, edelta0);
-        fill_data(array, elems[3],  true, cdelta0, cdelta1);
-        fill_data(array, elems[4],  true, edelta0, edelta1);
-        fill_data(array, elems[5],  true, adelta0, adelta1);
-        fill_data(array, elems[6], false, cdelta0, cdelta1);
-        fill_data(array, elems[7], false, edelta1, edelta0);
-
-
-        const npy_int N = PyArray_SIZE(array);
+        fill_data(elems[0], false, edelta0, edelta1);
+        fill_data(elems[1], false, adelta0, adelta1);
+        fill_data(elems[2],  true, edelta1, edelta0);
+        fill_data(elems[3],  true, cdelta0, cdelta1);
+        fill_data(elems[4],  true, edelta0, edelta1);
+        fill_data(elems[5],  true, adelta0, adelta1);
+        fill_data(elems[6], false, cdelta0, cdelta1);
+        fill_data(elems[7], false, edelta1, edelta0);
+
+        // The image is processed as a bit-packed array (see _bitpacked.h)
+        packed_array image(2, PyArray_DIMS(array));
+        pack<bool>(image, array, true);
+        packed_array matches(2, PyArray_DIMS(array));
+        const npy_intp nwords = image.row_words();
+        const npy_intp grain = std::max<npy_intp>(1, 4096/nwords);
         bool any_change;
         do {
             any_change = false;
             for (int i = 0; i != Nr_Elements; ++i) {
-                fast_hitmiss(array, elems[i], buffer);
-                bool* pa = reinterpret_cast<bool*>(PyArray_DATA(array));
-                const bool* pb = reinterpret_cast<bool*>(PyArray_DATA(buffer));
-                for (int j = 0; j != N; ++j) {
-                    if (*pb && *pa) {
-                        *pa = false;
-                        any_change = true;
-                    }
-                    ++pa;
-                    ++pb;
+                match_worker worker(image, elems[i], matches);
+                parallel_for(image.nrows(), worker, grain);
+                if (!matches.any()) continue;
+                any_change = true;
+                for (npy_intp r = 0; r != image.nrows(); ++r) {
+                    bitword* pa = image.row(r);
+                    const bitword* pb = matches.row(r);
+                    for (npy_intp w = 0; w != nwords; ++w) pa[w] &= ~pb[w];
                 }
             }
         } while (any_change);
-
+        unpack<bool>(image, array);
     }
 
     Py_INCREF(array);
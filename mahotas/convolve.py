@@ -7,7 +7,7 @@
 import numpy as np
 from . import _convolve
 from . import morph
-from .internal import _get_output, _normalize_sequence, _verify_is_floatingpoint_type, _as_floating_point_array
+from .internal import _get_output, _get_axis, _normalize_sequence, _verify_is_floatingpoint_type, _as_floating_point_array
 from ._filters import mode2int, modes, _check_mode
 
 __all__ = [
@@ -26,6 +26,45 @@ __all__ = [
     'wavelet_decenter',
     ]
 
+def _fft_size(n):
+    '''
+    size = _fft_size(n)
+
+    Smallest integer not smaller than `n` with no prime factors other than 2,
+    3 & 5 (the sizes which the FFT in _convolve handles). Must match
+    fft_size() in _fft.cpp.
+    '''
+    best = 1
+    while best < n:
+        best *= 2
+    p5 = 1
+    while p5 < best:
+        p35 = p5
+        while p35 < best:
+            s = p35
+            while s < n:
+                s *= 2
+            best = min(best, s)
+            p35 *= 3
+        p5 *= 5
+    return best
+
+def _use_fft(f, weights, ntaps):
+    '''
+    use = _use_fft(f, weights, ntaps)
+
+    Whether filtering `f` with `weights` (which has `ntaps` taps which need to
+    be evaluated) is expected to be faster in the frequency domain.
+    '''
+    if f.dtype not in (np.float32, np.float64) or not f.size or not weights.size or not f.ndim:
+        return False
+    fft_size = 1
+    for n,k in zip(f.shape, weights.shape):
+        fft_size *= _fft_size(n + k - 1)
+    # Measured: the FFT method takes about 12 times as long per element & per
+    # factor of 2 in its size as the direct method takes per element & per tap
+    return f.size * ntaps > 12 * fft_size * np.log2(fft_size)
+
 def convolve(f, weights, mode='reflect', cval=0.0, out=None, output=None):
     '''
     convolved = convolve(f, weights, mode='reflect', cval=0.0, out={new array})
@@ -52,6 +91,12 @@ def convolve(f, weights, mode='reflect', cval=0.0, out=None, output=None):
     Returns
     -------
     convolved : ndarray of same dtype as `f`
+
+    Notes
+    -----
+    For floating point images & large filters, the result is computed with a
+    Fast Fourier Transform (this is done automatically when it is expected to
+    be faster). The results are the same up to rounding errors.
     '''
     if f.dtype != weights.dtype:
         weights = weights.astype(f.dtype)
@@ -59,6 +104,8 @@ def convolve(f, weights, mode='reflect', cval=0.0, out=None, output=None):
         raise ValueError('mahotas.convolve: `f` and `weights` must have the same dimensions')
     output = _get_output(f, out, 'convolve', output=output)
     _check_mode(mode, cval, 'convolve')
+    if _use_fft(f, weights, np.count_nonzero(weights)):
+        return _convolve.convolve_fft(f, weights, output, mode2int[mode])
     return _convolve.convolve(f, weights, output, mode2int[mode])
 
 def median_filter(f, Bc=None, mode='reflect', cval=0.0, out=None, output=None):
@@ -162,10 +209,18 @@ def template_match(f, template, mode='reflect', cval=0., out=None, output=None):
         match[i,j] is the squared euclidean distance between
         ``f[i-s0:i+s0,j-s1:j+s1]`` and ``template`` (for appropriately defined
         ``s0`` and ``s1``).
+
+    Notes
+    -----
+    For floating point images & large templates, the result is computed with a
+    Fast Fourier Transform (this is done automatically when it is expected to
+    be faster). The results are the same up to rounding errors.
     '''
     template = template.astype(f.dtype)
     output = _get_output(f, out, 'template_match', output=output)
     _check_mode(mode, cval, 'template_match')
+    if f.ndim == template.ndim and _use_fft(f, template, template.size):
+        return _convolve.template_match_fft(f, template, output, mode2int[mode])
     return _convolve.template_match(f, template, output, mode2int[mode])
 
 def convolve1d(f, weights, axis, mode='reflect', cval=0., out=None, output=None):
@@ -203,20 +258,20 @@ def convolve1d(f, weights, axis, mode='reflect', cval=0., out=None, output=None)
         generic convolution
     '''
 
-    from sys import maxsize
     weights = np.asanyarray(weights)
     weights = weights.squeeze()
     if weights.ndim != 1:
         raise ValueError('mahotas.convolve1d: only 1-D sequences allowed')
-    index = [None] * f.ndim
-    index[axis] = slice(0, None)
-    weights = weights[tuple(index)]
-    return convolve(f, weights, mode=mode, cval=cval, output=output)
+    axis = _get_axis(f, axis, 'convolve1d')
+    weights = np.ascontiguousarray(weights, dtype=f.dtype)
+    output = _get_output(f, out, 'convolve1d', output=output)
+    _check_mode(mode, cval, 'convolve1d')
+    return _convolve.convolve1d(f, weights, axis, output, mode2int[mode])
 
 
-def gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., out=None, output=None):
+def gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., out=None, output=None, method='fir'):
     """
-    filtered = gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., out={np.empty_like(array)})
+    filtered = gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., out={np.empty_like(array)}, method='fir')
 
     One-dimensional Gaussian filter.
 
@@ -241,6 +296,13 @@ def gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., o
     out : ndarray, optional
         Output array. Must have same shape and dtype as `array` as well as be
         C-contiguous.
+    method : {'fir' [default], 'recursive'}, optional
+        'fir' convolves with the (truncated) Gaussian kernel, whose cost grows
+        linearly with sigma. 'recursive' uses a recursive (IIR) approximation
+        (Deriche's), whose cost does not depend on sigma. Its results are
+        within about 0.1% of the 'fir' ones for ``order=0`` and 2% for the
+        derivatives, if sigma is at least 2 (for smaller sigmas, it is less
+        precise, but 'fir' is fast anyway).
 
     Returns
     -------
@@ -250,6 +312,17 @@ def gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., o
     """
     _verify_is_floatingpoint_type(array, 'gaussian_filter1d')
     sigma = float(sigma)
+    if method not in ('fir', 'recursive'):
+        raise ValueError('mahotas.convolve.gaussian_filter1d: `method` must be one of \'fir\' or \'recursive\'')
+    if method == 'recursive':
+        if order not in (0, 1, 2, 3):
+            raise ValueError('mahotas.convolve.gaussian_filter1d: Order outside 0..3 not implemented')
+        if sigma < .5:
+            raise ValueError('mahotas.convolve.gaussian_filter1d: recursive method requires sigma >= 0.5')
+        axis = _get_axis(array, axis, 'gaussian_filter1d')
+        output = _get_output(array, out, 'gaussian_filter1d', output=output)
+        _check_mode(mode, cval, 'gaussian_filter1d')
+        return _convolve.gaussian_iir1d(array, axis, output, sigma, order, mode2int[mode])
     s2 = sigma*sigma
     # make the length of the filter equal to 4 times the standard
     # deviations:
@@ -269,12 +342,12 @@ def gaussian_filter1d(array, sigma, axis=-1, order=0, mode='reflect', cval=0., o
         weights *= (3.0 - x*x/s2)*x/(s2*s2)
     else:
         raise ValueError('mahotas.convolve.gaussian_filter1d: Order outside 0..3 not implemented')
-    return convolve1d(array, weights, axis, mode, cval, out=output)
+    return convolve1d(array, weights, axis, mode, cval, out=out, output=output)
 
 
-def gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out=None, output=None):
+def gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out=None, output=None, method='fir'):
     """
-    filtered = gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out={np.empty_like(array)})
+    filtered = gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out={np.empty_like(array)}, method='fir')
 
     Multi-dimensional Gaussian filter.
 
@@ -303,6 +376,9 @@ def gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out=None, ou
         Output array. Must have same shape as `array` as well as be
         C-contiguous. If `array` is an integer array, this must be a double
         array; otherwise, it must have the same type as `array`.
+    method : {'fir' [default], 'recursive'}, optional
+        'recursive' uses a recursive approximation whose cost does not depend
+        on sigma (see ``gaussian_filter1d``)
 
     Returns
     -------
@@ -322,13 +398,19 @@ def gaussian_filter(array, sigma, order=0, mode='reflect', cval=0., out=None, ou
     output = _get_output(array, out, 'gaussian_filter', output=output)
     orders = _normalize_sequence(array, order, 'gaussian_filter')
     sigmas = _normalize_sequence(array, sigma, 'gaussian_filter')
-    output[...] = array[...]
-    noutput = None
+    if array.ndim == 0:
+        output[...] = array
+        return output
+    if np.may_share_memory(array, output):
+        array = array.copy()
+    # The passes alternate between `output` and a temporary array so that the
+    # last one writes to `output`
+    buffers = [output]
+    if array.ndim > 1:
+        buffers.append(np.empty_like(output))
     for axis in xrange(array.ndim):
-        sigma = sigmas[axis]
-        order = orders[axis]
-        noutput = gaussian_filter1d(output, sigma, axis, order, mode, cval, noutput)
-        output,noutput = noutput,output
+        target = buffers[(array.ndim - 1 - axis) % 2]
+        array = gaussian_filter1d(array, sigmas[axis], axis, orders[axis], mode, cval, out=target, method=method)
     return output
 
 def _wavelet_array(f, inline, func):
@@ -10,20 +10,44 @@ __all__ = [
     'distance',
     ]
 
-def distance(bw, metric='euclidean2'):
+def _get_sampling(bw, sampling, fname):
+    if sampling is None:
+        return np.ones(bw.ndim, np.double)
+    sampling = np.array(sampling, np.double).ravel()
+    if sampling.size == 1 and bw.ndim != 1:
+        sampling = np.repeat(sampling, bw.ndim)
+    if sampling.size != bw.ndim:
+        raise ValueError('mahotas.%s: `sampling` must have one value per dimension' % fname)
+    if np.any(sampling <= 0):
+        raise ValueError('mahotas.%s: `sampling` must be positive' % fname)
+    return sampling
+
+def _initial_distances(bw, sampling):
+    # larger than any distance in the array
+    f = np.zeros(bw.shape, np.double)
+    f[bw] = np.sum((np.array(bw.shape)*sampling)**2) + 1
+    return f
+
+def distance(bw, metric='euclidean2', sampling=None):
     '''
-    dmap = distance(bw, metric='euclidean2')
+    dmap = distance(bw, metric='euclidean2', sampling=None)
 
     Computes the distance transform of image `bw`::
 
-        dmap[i,j] = min_{i', j'} { (i-i')**2 + (j-j')**2 | bw[i', j'] }
+        dmap[i,j] = min_{i', j'} { (i-i')**2 + (j-j')**2 | !bw[i', j'] }
+
+    That is, at each point, the distance to the background. This works in any
+    number of dimensions.
 
     Parameters
     ----------
-    bw : 2d-ndarray
+    bw : ndarray
         Black & White image
     metric : str, optional
         one of 'euclidean2' (default) or 'euclidean'
+    sampling : float or sequence of floats, optional
+        spacing between elements along each axis (for anisotropic data, e.g.,
+        confocal stacks). By default, it is 1 along all the axes.
 
     Returns
     -------
@@ -38,12 +62,11 @@ def distance(bw, metric='euclidean2'):
     Available at:
     http://citeseerx.ist.psu.edu/viewdoc/download?doi=10.1.1.88.1647&rep=rep1&type=pdf.
     '''
-
-    f = np.zeros(bw.shape, np.double)
-    f[bw] = len(f.shape)*max(f.shape)**2+1
-    _distance.dt(f, None)
+    bw = np.asanyarray(bw, dtype=bool)
+    sampling = _get_sampling(bw, sampling, 'distance')
+    f = _initial_distances(bw, sampling)
+    _distance.dt(f, None, sampling)
     if metric == 'euclidean':
         np.sqrt(f,f)
     return f
 
-
@@ -0,0 +1,510 @@
+// Part of mahotas. See LICENSE file for License
+// Copyright 2012 Luis Pedro Coelho <luis@luispedro.org>
+
+// Nearest neighbour matching of descriptors
+//
+// For each query, the two nearest points of the gallery are found (the
+// caller applies the ratio test). Points are split into groups (e.g., by the
+// sign of the Laplacian) and queries are only compared to gallery points of
+// the same group.
+//
+// The search is either exhaustive or approximate, using a forest of
+// randomized kd-trees (as in FLANN): all the trees are searched together,
+// visiting the most promising branches first, until a given number of
+// gallery points has been checked.
+//
+// Distances are computed in single precision.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "../numpypp/array.hpp"
+#include "../utils.hpp"
+#include "../parallel.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+namespace {
+
+const char TypeErrorMsg[] =
+    "Type not understood. "
+    "This is caused by either a direct call to _match (which is dangerous: types are not checked!) or a bug in mahotas.\n";
+
+// The exhaustive search compares a tile of queries with a block of gallery
+// points at a time (so that the block stays in cache)
+const int block_size = 8;
+const int tile_size = 32;
+
+const int leaf_size = 8;
+// The split dimension is chosen at random among the ones with the highest
+// variance (estimated on a sample of the points)
+const int nr_split_candidates = 5;
+const int variance_sample = 128;
+
+struct neighbours {
+    neighbours()
+        :d0(std::numeric_limits<float>::infinity())
+        ,d1(std::numeric_limits<float>::infinity())
+        ,i0(-1)
+        ,i1(-1)
+        { }
+
+    void update(const float d, const npy_intp i) {
+        if (d < d1) {
+            if (d < d0) {
+                d1 = d0;
+                i1 = i0;
+                d0 = d;
+                i0 = i;
+            } else {
+                d1 = d;
+                i1 = i;
+            }
+        }
+    }
+
+    float d0, d1;
+    npy_intp i0, i1;
+};
+
+inline float distance2(const float* a, const float* b, const int dims) {
+    float d = 0.f;
+    for (int k = 0; k != dims; ++k) {
+        const float t = a[k] - b[k];
+        d += t*t;
+    }
+    return d;
+}
+
+// The gallery points of a group
+//
+// points holds the points (row by row). blocks holds them again, in blocks of
+// block_size points, transposed (element k of the points of a block is
+// stored contiguously), so that the distances from one query to all the
+// points of a block are independent (vectorizable) operations.
+struct gallery {
+    explicit gallery(const int dims)
+        :dims_(dims)
+        { }
+
+    npy_intp size() const { return index_.size(); }
+    npy_intp nr_blocks() const { return (size() + block_size - 1)/block_size; }
+    const float* point(const npy_intp p) const { return &points_[p*dims_]; }
+    const float* block(const npy_intp b) const { return &blocks_[b*dims_*block_size]; }
+    // position in the input
+    npy_intp index(const npy_intp p) const { return index_[p]; }
+
+    void push_back(const double* p, const npy_intp index) {
+        index_.push_back(index);
+        for (int k = 0; k != dims_; ++k) points_.push_back(p[k]);
+    }
+
+    void pack_blocks() {
+        blocks_.assign(nr_blocks()*dims_*block_size, 0.f);
+        for (npy_intp p = 0; p != size(); ++p) {
+            float* b = &blocks_[(p/block_size)*dims_*block_size] + p % block_size;
+            for (int k = 0; k != dims_; ++k) b[k*block_size] = points_[p*dims_ + k];
+        }
+    }
+
+    private:
+        int dims_;
+        std::vector<npy_intp> index_;
+        std::vector<float> points_;
+        std::vector<float> blocks_;
+};
+
+// dist[j] = |q - (point j of block)|^2
+inline void block_distances(const float* q, const float* block, const int dims, float* dist) {
+    for (int j = 0; j != block_size; ++j) dist[j] = 0.f;
+    for (int k = 0; k != dims; ++k) {
+        const float qk = q[k];
+        const float* b = block + k*block_size;
+        for (int j = 0; j != block_size; ++j) {
+            const float t = qk - b[j];
+            dist[j] += t*t;
+        }
+    }
+}
+
+// Small xorshift generator (so that the trees only depend on the seed)
+struct random_source {
+    explicit random_source(const unsigned seed)
+        :state_(0x9E3779B97F4A7C15ULL ^ (npy_uint64(seed) * 0xBF58476D1CE4E5B9ULL))
+        {
+            if (!state_) state_ = 1;
+        }
+
+    // uniform in [0, n)
+    int operator()(const int n) {
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        return int(((state_ * 0x2545F4914F6CDD1DULL) >> 33) % npy_uint64(n));
+    }
+
+    private:
+        npy_uint64 state_;
+};
+
+// Inner nodes split on point[dim] < value; leaves (dim == -1) hold the
+// points order[child[0]:child[1]]
+struct kd_node {
+    int dim;
+    float value;
+    npy_intp child[2];
+};
+
+struct kd_tree {
+    std::vector<kd_node> nodes;
+    std::vector<npy_intp> order;
+};
+
+struct compare_dim {
+    compare_dim(const gallery& g, const int dim)
+        :g_(g)
+        ,dim_(dim)
+        { }
+    bool operator()(const npy_intp a, const npy_intp b) const {
+        return g_.point(a)[dim_] < g_.point(b)[dim_];
+    }
+    const gallery& g_;
+    const int dim_;
+};
+
+struct compare_variance {
+    compare_variance(const std::vector<double>& var)
+        :var_(var)
+        { }
+    bool operator()(const int a, const int b) const { return var_[a] > var_[b]; }
+    const std::vector<double>& var_;
+};
+
+// Splits at the median of one of the dimensions of highest variance, so that
+// the trees are balanced
+npy_intp build_node(kd_tree& tree, const gallery& g, const int dims, const npy_intp begin, const npy_intp end, random_source& random) {
+    const npy_intp node = tree.nodes.size();
+    tree.nodes.push_back(kd_node());
+    if (end - begin <= leaf_size) {
+        tree.nodes[node].dim = -1;
+        tree.nodes[node].child[0] = begin;
+        tree.nodes[node].child[1] = end;
+        return node;
+    }
+    const npy_intp n = end - begin;
+    const npy_intp ns = std::min<npy_intp>(n, variance_sample);
+    std::vector<double> mean(dims), var(dims);
+    for (npy_intp i = 0; i != ns; ++i) {
+        const float* p = g.point(tree.order[begin + i*(n/ns)]);
+        for (int k = 0; k != dims; ++k) {
+            mean[k] += p[k];
+            var[k] += double(p[k])*p[k];
+        }
+    }
+    std::vector<int> candidates(dims);
+    for (int k = 0; k != dims; ++k) {
+        mean[k] /= ns;
+        var[k] = var[k]/ns - mean[k]*mean[k];
+        candidates[k] = k;
+    }
+    const int nr_candidates = std::min<int>(nr_split_candidates, dims);
+    std::partial_sort(candidates.begin(), candidates.begin() + nr_candidates, candidates.end(), compare_variance(var));
+    const int dim = candidates[random(nr_candidates)];
+
+    const npy_intp mid = begin + n/2;
+    npy_intp* order = &tree.order[0];
+    std::nth_element(order + begin, order + mid, order + end, compare_dim(g, dim));
+    tree.nodes[node].dim = dim;
+    tree.nodes[node].value = g.point(order[mid])[dim];
+    const npy_intp left = build_node(tree, g, dims, begin, mid, random);
+    const npy_intp right = build_node(tree, g, dims, mid, end, random);
+    tree.nodes[node].child[0] = left;
+    tree.nodes[node].child[1] = right;
+    return node;
+}
+
+void build_tree(kd_tree& tree, const gallery& g, const int dims, random_source& random) {
+    tree.order.resize(g.size());
+    for (npy_intp p = 0; p != g.size(); ++p) tree.order[p] = p;
+    tree.nodes.reserve(2*(g.size()/leaf_size + 1));
+    build_node(tree, g, dims, 0, g.size(), random);
+}
+
+// A branch still to be explored, with a lower bound of the distance of its
+// points to the query (as in FLANN, this is only approximately a bound: it
+// adds the distances to all the splits above the branch)
+struct branch {
+    branch(const float bound, const int tree, const npy_intp node)
+        :bound(bound)
+        ,tree(tree)
+        ,node(node)
+        { }
+    float bound;
+    int tree;
+    npy_intp node;
+};
+
+// Used with the std heap functions, puts the lowest bound at the top
+inline bool operator<(const branch& a, const branch& b) {
+    return a.bound > b.bound;
+}
+
+struct kd_search {
+    kd_search(const gallery& g, const std::vector<kd_tree>& forest, const int dims, const npy_intp max_checks)
+        :g_(g)
+        ,forest_(forest)
+        ,dims_(dims)
+        ,max_checks_(max_checks)
+        ,checked_(g.size(), false)
+        { }
+
+    neighbours operator()(const float* q) {
+        neighbours res;
+        checks_ = 0;
+        branches_.clear();
+        for (int t = 0; t != int(forest_.size()); ++t) descend(t, 0, 0.f, q, res);
+        while (!branches_.empty() && checks_ < max_checks_) {
+            std::pop_heap(branches_.begin(), branches_.end());
+            const branch b = branches_.back();
+            branches_.pop_back();
+            if (b.bound >= res.d1) break;
+            descend(b.tree, b.node, b.bound, q, res);
+        }
+        for (std::vector<npy_intp>::const_iterator p = touched_.begin(); p != touched_.end(); ++p) checked_[*p] = false;
+        touched_.clear();
+        return res;
+    }
+
+    private:
+        void descend(const int t, npy_intp n, const float bound, const float* q, neighbours& res) {
+            const kd_tree& tree = forest_[t];
+            while (tree.nodes[n].dim >= 0) {
+                const kd_node& node = tree.nodes[n];
+                const float diff = q[node.dim] - node.value;
+                const int side = (diff < 0 ? 0 : 1);
+                branches_.push_back(branch(bound + diff*diff, t, node.child[1 - side]));
+                std::push_heap(branches_.begin(), branches_.end());
+                n = node.child[side];
+            }
+            for (npy_intp i = tree.nodes[n].child[0]; i != tree.nodes[n].child[1]; ++i) {
+                const npy_intp p = tree.order[i];
+                if (checked_[p]) continue;
+                checked_[p] = true;
+                touched_.push_back(p);
+                res.update(distance2(q, g_.point(p), dims_), p);
+                ++checks_;
+            }
+        }
+
+        const gallery& g_;
+        const std::vector<kd_tree>& forest_;
+        const int dims_;
+        const npy_intp max_checks_;
+        npy_intp checks_;
+        std::vector<bool> checked_;
+        std::vector<npy_intp> touched_;
+        std::vector<branch> branches_;
+};
+
+// A set of (at most tile_size) queries of the same group
+struct tile {
+    tile(const int group, const npy_intp begin, const npy_intp end)
+        :group(group)
+        ,begin(begin)
+        ,end(end)
+        { }
+    int group;
+    npy_intp begin, end;
+};
+
+struct match_worker {
+    match_worker(const double* queries, const int dims, const std::vector<npy_intp>& order, const std::vector<tile>& tiles,
+                        const std::vector<gallery>& galleries, const std::vector<std::vector<kd_tree> >& forests, const npy_intp max_checks,
+                        npy_intp* neighbours_out, double* distances_out)
+        :queries_(queries)
+        ,dims_(dims)
+        ,order_(order)
+        ,tiles_(tiles)
+        ,galleries_(galleries)
+        ,forests_(forests)
+        ,max_checks_(max_checks)
+        ,neighbours_out_(neighbours_out)
+        ,distances_out_(distances_out)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        std::vector<float> q(tile_size*dims_);
+        std::vector<neighbours> best(tile_size);
+        float dist[block_size];
+        for (npy_intp t = start; t != end; ++t) {
+            const tile& cur = tiles_[t];
+            const gallery& g = galleries_[cur.group];
+            const npy_intp nq = cur.end - cur.begin;
+            for (npy_intp i = 0; i != nq; ++i) {
+                const double* src = queries_ + order_[cur.begin + i]*dims_;
+                std::copy(src, src + dims_, &q[i*dims_]);
+                best[i] = neighbours();
+            }
+            if (forests_.empty()) {
+                for (npy_intp b = 0; b != g.nr_blocks(); ++b) {
+                    const float* block = g.block(b);
+                    const int nvalid = std::min<npy_intp>(block_size, g.size() - b*block_size);
+                    for (npy_intp i = 0; i != nq; ++i) {
+                        block_distances(&q[i*dims_], block, dims_, dist);
+                        for (int j = 0; j != nvalid; ++j) best[i].update(dist[j], b*block_size + j);
+                    }
+                }
+            } else {
+                kd_search search(g, forests_[cur.group], dims_, max_checks_);
+                for (npy_intp i = 0; i != nq; ++i) best[i] = search(&q[i*dims_]);
+            }
+            for (npy_intp i = 0; i != nq; ++i) {
+                const npy_intp p = order_[cur.begin + i];
+                neighbours_out_[2*p] = (best[i].i0 >= 0 ? g.index(best[i].i0) : -1);
+                neighbours_out_[2*p + 1] = (best[i].i1 >= 0 ? g.index(best[i].i1) : -1);
+                distances_out_[2*p] = std::sqrt(double(best[i].d0));
+                distances_out_[2*p + 1] = std::sqrt(double(best[i].d1));
+            }
+        }
+    }
+
+    const double* const queries_;
+    const int dims_;
+    const std::vector<npy_intp>& order_;
+    const std::vector<tile>& tiles_;
+    const std::vector<gallery>& galleries_;
+    const std::vector<std::vector<kd_tree> >& forests_;
+    const npy_intp max_checks_;
+    npy_intp* const neighbours_out_;
+    double* const distances_out_;
+};
+
+// If nr_trees == 0, the search is exhaustive
+void match(const double* queries, const int* query_groups, const npy_intp nqueries,
+            const double* points, const int* point_groups, const npy_intp npoints, const int dims,
+            const int nr_trees, const npy_intp max_checks, const unsigned seed,
+            npy_intp* neighbours_out, double* distances_out) {
+    for (npy_intp i = 0; i != 2*nqueries; ++i) {
+        neighbours_out[i] = -1;
+        distances_out[i] = std::numeric_limits<double>::infinity();
+    }
+
+    std::map<int, int> group_index;
+    std::vector<gallery> galleries;
+    for (npy_intp p = 0; p != npoints; ++p) {
+        std::map<int, int>::iterator it = group_index.find(point_groups[p]);
+        if (it == group_index.end()) {
+            it = group_index.insert(std::make_pair(point_groups[p], int(galleries.size()))).first;
+            galleries.push_back(gallery(dims));
+        }
+        galleries[it->second].push_back(points + p*dims, p);
+    }
+
+    std::vector<std::vector<kd_tree> > forests;
+    if (nr_trees == 0) {
+        for (unsigned g = 0; g != galleries.size(); ++g) galleries[g].pack_blocks();
+    } else {
+        random_source random(seed);
+        forests.resize(galleries.size());
+        for (unsigned g = 0; g != galleries.size(); ++g) {
+            forests[g].resize(nr_trees);
+            for (int t = 0; t != nr_trees; ++t) build_tree(forests[g][t], galleries[g], dims, random);
+        }
+    }
+
+    // Queries are sorted by group (queries whose group is not in the gallery
+    // are left unmatched) and cut into tiles
+    std::vector<npy_intp> order;
+    std::vector<int> order_group;
+    for (std::map<int, int>::const_iterator it = group_index.begin(); it != group_index.end(); ++it) {
+        for (npy_intp i = 0; i != nqueries; ++i) {
+            if (query_groups[i] == it->first) {
+                order.push_back(i);
+                order_group.push_back(it->second);
+            }
+        }
+    }
+    std::vector<tile> tiles;
+    for (npy_intp begin = 0; begin != npy_intp(order.size()); ) {
+        npy_intp end = begin + 1;
+        while (end != npy_intp(order.size()) && end - begin != tile_size && order_group[end] == order_group[begin]) ++end;
+        tiles.push_back(tile(order_group[begin], begin, end));
+        begin = end;
+    }
+
+    match_worker worker(queries, dims, order, tiles, galleries, forests, max_checks, neighbours_out, distances_out);
+    parallel_for(tiles.size(), worker, 1);
+}
+
+PyObject* py_match(PyObject* self, PyObject* args) {
+    PyArrayObject* queries;
+    PyArrayObject* query_groups;
+    PyArrayObject* points;
+    PyArrayObject* point_groups;
+    int nr_trees;
+    Py_ssize_t max_checks;
+    unsigned int seed;
+    PyArrayObject* neighbours_out;
+    PyArrayObject* distances_out;
+    if (!PyArg_ParseTuple(args, "OOOOinIOO", &queries, &query_groups, &points, &point_groups, &nr_trees, &max_checks, &seed, &neighbours_out, &distances_out)) return NULL;
+    if (!numpy::are_arrays(queries, query_groups, points, point_groups) ||
+        !numpy::are_arrays(neighbours_out, distances_out) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(queries), NPY_DOUBLE) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(points), NPY_DOUBLE) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(query_groups), NPY_INT) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(point_groups), NPY_INT) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(neighbours_out), NPY_INTP) ||
+        !PyArray_EquivTypenums(PyArray_TYPE(distances_out), NPY_DOUBLE) ||
+        !PyArray_ISCARRAY_RO(queries) ||
+        !PyArray_ISCARRAY_RO(points) ||
+        !PyArray_ISCARRAY_RO(query_groups) ||
+        !PyArray_ISCARRAY_RO(point_groups) ||
+        !PyArray_ISCARRAY(neighbours_out) ||
+        !PyArray_ISCARRAY(distances_out) ||
+        PyArray_NDIM(queries) != 2 ||
+        PyArray_NDIM(points) != 2 ||
+        PyArray_DIM(queries, 1) != PyArray_DIM(points, 1) ||
+        PyArray_DIM(points, 1) < 1 ||
+        PyArray_SIZE(query_groups) != PyArray_DIM(queries, 0) ||
+        PyArray_SIZE(point_groups) != PyArray_DIM(points, 0) ||
+        PyArray_SIZE(neighbours_out) != 2*PyArray_DIM(queries, 0) ||
+        PyArray_SIZE(distances_out) != 2*PyArray_DIM(queries, 0) ||
+        nr_trees < 0 ||
+        max_checks < 1) {
+        PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
+        return NULL;
+    }
+    try {
+        gil_release nogil;
+        match(static_cast<const double*>(PyArray_DATA(queries)),
+                static_cast<const int*>(PyArray_DATA(query_groups)),
+                PyArray_DIM(queries, 0),
+                static_cast<const double*>(PyArray_DATA(points)),
+                static_cast<const int*>(PyArray_DATA(point_groups)),
+                PyArray_DIM(points, 0),
+                PyArray_DIM(points, 1),
+                nr_trees,
+                max_checks,
+                seed,
+                static_cast<npy_intp*>(PyArray_DATA(neighbours_out)),
+                static_cast<double*>(PyArray_DATA(distances_out)));
+    } catch (const std::bad_alloc&) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyMethodDef methods[] = {
+  {"match",(PyCFunction)py_match, METH_VARARGS, NULL},
+  {NULL, NULL,0,NULL},
+};
+
+} // namespace
+DECLARE_MODULE(_match)
@@ -12,12 +12,14 @@
 #include "../numpypp/array.hpp"
 #include "../numpypp/dispatch.hpp"
 #include "../utils.hpp"
+#include "../parallel.hpp"
 
 #include <vector>
 #include <algorithm>
 #include <cmath>
 #include <sstream>
 #include <limits>
+#include <cstring>
 
 extern "C" {
     #include <Python.h>
@@ -38,14 +40,44 @@ const char TypeErrorMsg[] =
  * by Christopher Evans.
  */
 
-typedef numpy::aligned_array<double> integral_image_type;
+// Read-only access to a 2-D integral image through precomputed row pointers.
+//
+// This does not hold a reference to the array (it can, therefore, be used
+// without the GIL and shared between threads): the array must outlive it.
+template <typename T>
+struct integral_view {
+    explicit integral_view(PyArrayObject* array)
+        :N0_(PyArray_DIM(array, 0))
+        ,N1_(PyArray_DIM(array, 1))
+        ,stride1_(PyArray_STRIDE(array, 1))
+        ,rows_(N0_)
+        {
+            const char* data = static_cast<const char*>(PyArray_DATA(array));
+            for (int y = 0; y != N0_; ++y) rows_[y] = data + y*PyArray_STRIDE(array, 0);
+        }
+
+    int dim(const int d) const { return (d == 0 ? N0_ : N1_); }
+    const char* row(const int y) const { return rows_[y]; }
+    // Distance (in bytes) between consecutive elements of a row
+    npy_intp stride() const { return stride1_; }
+    T at(const char* row, const int x) const { return *reinterpret_cast<const T*>(row + x*stride1_); }
+    T at(const int y, const int x) const { return at(rows_[y], x); }
+
+    private:
+        int N0_;
+        int N1_;
+        npy_intp stride1_;
+        std::vector<const char*> rows_;
+};
+
+typedef integral_view<double> integral_image_type;
 
 template <typename T>
-double sum_rect(numpy::aligned_array<T> integral, int y0, int x0, int y1, int x1) {
+double sum_rect(const integral_view<T>& integral, int y0, int x0, int y1, int x1) {
     y0 = std::max<int>(y0-1, 0);
     x0 = std::max<int>(x0-1, 0);
-    y1 = std::min<int>(y1-1, integral.dim(0));
-    x1 = std::min<int>(x1-1, integral.dim(1));
+    y1 = std::min<int>(y1-1, integral.dim(0)-1);
+    x1 = std::min<int>(x1-1, integral.dim(1)-1);
 
     const T A = integral.at(y0,x0);
     const T B = integral.at(y0,x1);
@@ -57,26 +89,6 @@ double sum_rect(numpy::aligned_array<T> integral, int y0, int x0, int y1, int x1
     return (D - B) - (C - A);
 }
 
-template <typename T>
-double csum_rect(numpy::aligned_array<T> integral, int y, int x, const int dy, const int dx, int h, int w) {
-    int y0 = y + dy - h/2;
-    int x0 = x + dx - w/2;
-    int y1 = y0 + h;
-    int x1 = x0 + w;
-    return sum_rect(integral, y0, x0, y1, x1);
-}
-
-double haar_x(const integral_image_type& integral, int y, int x, const int w) {
-    const double left  = sum_rect(integral, y - w/2,  x - w/2, (y - w/2) + w,             x);
-    const double right = sum_rect(integral, y - w/2,        x, (y - w/2) + w, (x - w/2) + w);
-    return left - right;
-}
-
-double haar_y(const integral_image_type& integral, int y, int x, const int w) {
-    const double top    = sum_rect(integral, y - w/2,  x - w/2,             y, (x - w/2) + w);
-    const double bottom = sum_rect(integral,       y,  x - w/2, (y - w/2) + w, (x - w/2) + w);
-    return top - bottom;
-}
 int round(double f) {
     if (f > 0) return int(f+.5);
     return int(f-.5);
@@ -93,24 +105,296 @@ int get_step_size(const int initial_step_size, const int octave) {
     return initial_step_size*static_cast<int>(std::pow(2.0, double(octave))+0.5);
 }
 
+// The box filters used for one (octave, interval) of the pyramid.
+//
+// Box b covers the rectangle whose corners (in the integral image) are at
+// offsets (y0[b], x0[b]) and (y1[b], x1[b]) from the centre, i.e., it is
+// sum_rect(..., y + y0[b] + 1, x + x0[b] + 1, y + y1[b] + 1, x + x1[b] + 1).
+// Boxes 0 & 1 give Dxx, 2 & 3 give Dyy, and 4..7 give Dxy.
+struct hessian_filter {
+    hessian_filter(const int o, const int i, const int step_size, const int border_size)
+        :step_size(step_size)
+        ,border_size(border_size)
+        {
+            const int lobe_size = static_cast<int>(std::pow(2.0, o+1.0)+0.5)*(i+1) + 1;
+            const int lobe_offset = lobe_size/2+1;
+            area_inv = 1.0/std::pow(3.0*lobe_size, 2.0);
+
+            set_box(0, 0, 0, 2*lobe_size-1, 3*lobe_size);
+            set_box(1, 0, 0, 2*lobe_size-1,   lobe_size);
+            set_box(2, 0, 0, 3*lobe_size, 2*lobe_size-1);
+            set_box(3, 0, 0,   lobe_size, 2*lobe_size-1);
+            set_box(4, -lobe_offset, +lobe_offset, lobe_size, lobe_size);
+            set_box(5, +lobe_offset, -lobe_offset, lobe_size, lobe_size);
+            set_box(6, +lobe_offset, +lobe_offset, lobe_size, lobe_size);
+            set_box(7, -lobe_offset, -lobe_offset, lobe_size, lobe_size);
+
+            top = *std::min_element(y0, y0 + 8);
+            left = *std::min_element(x0, x0 + 8);
+            bottom = *std::max_element(y1, y1 + 8);
+            right = *std::max_element(x1, x1 + 8);
+        }
+
+    // The h x w rectangle centred at (y + dy, x + dx)
+    void set_box(const int b, const int dy, const int dx, const int h, const int w) {
+        y0[b] = dy - h/2 - 1;
+        x0[b] = dx - w/2 - 1;
+        y1[b] = y0[b] + h;
+        x1[b] = x0[b] + w;
+    }
+
+    int step_size;
+    int border_size;
+    double area_inv;
+    int y0[8], x0[8], y1[8], x1[8];
+    // bounding box of all the corners
+    int top, left, bottom, right;
+};
+
+// Computes rows of the intervals of one octave. Piece k is row
+// first + k % nrows of interval k / nrows.
+template <typename T, typename F>
+struct hessian_worker {
+    hessian_worker(const integral_view<T>& integral, const hessian_filter* filters, F* const* data, const int ring, const int nc, const int first, const int nrows)
+        :integral_(integral)
+        ,filters_(filters)
+        ,data_(data)
+        ,ring_(ring)
+        ,nc_(nc)
+        ,first_(first)
+        ,nrows_(nrows)
+        { }
+
+    void operator()(const npy_intp start, const npy_intp end) {
+        const int N0 = integral_.dim(0);
+        const int N1 = integral_.dim(1);
+        const npy_intp stride = integral_.stride();
+        for (npy_intp k = start; k != end; ++k) {
+            const int i = k / nrows_;
+            const int q = first_ + k % nrows_;
+            const hessian_filter& f = filters_[i];
+            const int step_size = f.step_size;
+            const int border_size = f.border_size;
+            F* out = data_[i] + npy_intp(q % ring_)*nc_;
+            std::fill(out, out + nc_, F(0));
+
+            const int y = q*step_size;
+            if (y < border_size || y >= N0 - border_size) continue;
+
+            // Away from the border, the corners are read directly from their
+            // rows. Otherwise, they are clamped (as in sum_rect).
+            const bool inner_row = (y + f.top >= 0 && y + f.bottom < N0);
+            const char* row0[8];
+            const char* row1[8];
+            npy_intp col0[8], col1[8];
+            for (int b = 0; b != 8; ++b) {
+                row0[b] = integral_.row(std::max<int>(y + f.y0[b], 0));
+                row1[b] = integral_.row(std::min<int>(y + f.y1[b], N0-1));
+                col0[b] = f.x0[b]*stride;
+                col1[b] = f.x1[b]*stride;
+            }
+
+            for (int x = border_size; x < N1 - border_size; x += step_size) {
+                double sums[8];
+                if (inner_row && x + f.left >= 0 && x + f.right < N1) {
+                    const npy_intp offset = x*stride;
+                    for (int b = 0; b != 8; ++b) {
+                        const T A = *reinterpret_cast<const T*>(row0[b] + offset + col0[b]);
+                        const T B = *reinterpret_cast<const T*>(row0[b] + offset + col1[b]);
+                        const T C = *reinterpret_cast<const T*>(row1[b] + offset + col0[b]);
+                        const T D = *reinterpret_cast<const T*>(row1[b] + offset + col1[b]);
+                        sums[b] = (D - B) - (C - A);
+                    }
+                } else {
+                    for (int b = 0; b != 8; ++b) {
+                        sums[b] = sum_rect(integral_, y + f.y0[b] + 1, x + f.x0[b] + 1, y + f.y1[b] + 1, x + f.x1[b] + 1);
+                    }
+                }
+
+                double Dxx = sums[0] - 3.*sums[1];
+                double Dyy = sums[2] - 3.*sums[3];
+                double Dxy = sums[4] + sums[5] - sums[6] - sums[7];
+
+                // now we normalize the filter responses
+                Dxx *= f.area_inv;
+                Dyy *= f.area_inv;
+                Dxy *= f.area_inv;
+
+                const double sign_of_laplacian = (Dxx + Dyy < 0) ? -1 : +1;
+                // The constant below is the matter of some debate:
+                // In the original papers, the authors use 0.81 (.9^2).
+                // However, some have claimed that 0.36 (.6^2) is better
+                // and the review "Local Invariant Feature Detectors: A
+                // Survey."by Tuytelaars T and Mikolajczyk K.; Foundations
+                // and Trends® in Computer Graphics and Vision.
+                // 2007;3(3):177-280. Available at:
+                // http://www.nowpublishers.com/product.aspx?product=CGV&doi=0600000017.
+                //
+                // Also uses 0.6
+                double determinant = Dxx*Dyy - 0.36*Dxy*Dxy;
+
+                // If the determinant is negative then just blank it out by setting
+                // it to zero.
+                if (determinant < 0) determinant = 0;
+
+                // Save the determinant of the Hessian into our image pyramid.  Also
+                // pack the laplacian sign into the value so we can get it out later.
+                out[x/step_size] = F(sign_of_laplacian*determinant);
+            }
+        }
+    }
+
+    const integral_view<T>& integral_;
+    const hessian_filter* const filters_;
+    F* const* const data_;
+    const int ring_;
+    const int nc_;
+    const int first_;
+    const int nrows_;
+};
+
+// In streaming mode, rows are computed this many at a time
+const int stream_rows = 64;
+
+// The Hessian pyramid of an integral image (with elements of type T). Octave
+// o has nr_intervals intervals of nr(o) x nc(o) responses, stored as F. The
+// sign of the laplacian is packed into the sign of the value.
+//
+// If streaming, the rows are only computed when they are required (see
+// require()), and only the last few of them (in a single octave) are kept.
+// Memory use is then independent of the number of rows of the image.
+// Otherwise, the whole pyramid is computed in the constructor.
+//
+// This does not need the GIL. The rows are computed in parallel.
+template <typename T, typename F>
 struct hessian_pyramid {
-    typedef std::vector<numpy::aligned_array<double> > pyramid_type;
-    pyramid_type pyr;
+    hessian_pyramid(const integral_view<T>& integral,
+                const int nr_octaves,
+                const int nr_intervals,
+                const int initial_step_size,
+                const bool streaming)
+        :integral_(integral)
+        ,nr_octaves_(nr_octaves)
+        ,nr_intervals_(nr_intervals)
+        ,streaming_(streaming)
+        ,data_(nr_octaves*nr_intervals, static_cast<F*>(0))
+        ,octave_(-1)
+        ,first_(0)
+        ,last_(-1)
+        {
+            assert(nr_octaves > 0);
+            assert(nr_intervals > 0);
+            assert(initial_step_size > 0);
+            for (int o = 0; o < nr_octaves; ++o) {
+                const int step_size = get_step_size(initial_step_size, o);
+                const int border_size = get_border_size(o, nr_intervals)*step_size;
+                nr_.push_back(integral.dim(0)/step_size);
+                nc_.push_back(integral.dim(1)/step_size);
+                for (int i = 0; i < nr_intervals; ++i) {
+                    filters_.push_back(hessian_filter(o, i, step_size, border_size));
+                }
+            }
+
+            if (!streaming) {
+                npy_intp total = 0;
+                for (int o = 0; o < nr_octaves; ++o) total += npy_intp(nr_intervals)*nr_[o]*nc_[o];
+                storage_.resize(total + 1);
+                total = 0;
+                for (int o = 0; o < nr_octaves; ++o) {
+                    for (int i = 0; i < nr_intervals; ++i) {
+                        data_[o*nr_intervals + i] = &storage_[total];
+                        total += npy_intp(nr_[o])*nc_[o];
+                    }
+                    ring_.push_back(std::max<int>(nr_[o], 1));
+                    compute(o, 0, nr_[o] - 1);
+                }
+            } else {
+                ring_.resize(nr_octaves, stream_rows + 4);
+            }
+        }
+
+    // Makes sure that the rows [first, last] of all the intervals of octave o
+    // are available. In streaming mode, this may discard any other rows, and
+    // the calls for each octave must be made in order (i.e., first & last
+    // never decrease).
+    void require(const int o, const int first, int last) {
+        if (!streaming_) return;
+        last = std::min<int>(last, nr_[o] - 1);
+        if (o != octave_) {
+            if (octave_ >= 0) {
+                std::fill(data_.begin() + octave_*nr_intervals_, data_.begin() + (octave_+1)*nr_intervals_, static_cast<F*>(0));
+            }
+            const npy_intp size = npy_intp(ring_[o])*nc_[o];
+            storage_.resize(nr_intervals_*size + 1);
+            for (int i = 0; i < nr_intervals_; ++i) data_[o*nr_intervals_ + i] = &storage_[i*size];
+            octave_ = o;
+            first_ = first;
+            last_ = first - 1;
+        }
+        if (last > last_) {
+            const int next = std::min<int>(std::max<int>(last, last_ + stream_rows), nr_[o] - 1);
+            compute(o, last_ + 1, next);
+            last_ = next;
+            first_ = std::max<int>(first_, last_ - ring_[o] + 1);
+        }
+        assert(first >= first_);
+    }
+
     double get_laplacian(int o, int i, int r, int c) const {
-        return pyr[o].at(i,r,c) < 0 ? -1. : +1.;
+        return at(o,i,r,c) < 0 ? -1. : +1.;
     }
     double get_value(int o, int i, int r, int c) const {
-        return std::abs(pyr[o].at(i,r,c));
+        return std::abs(double(at(o,i,r,c)));
+    }
+    int nr_intervals() const { return nr_intervals_; }
+    int nr_octaves() const { return nr_octaves_; }
+    int nr(const int o) const { return nr_[o]; }
+    int nc(const int o) const { return nc_[o]; }
+
+    // The responses of interval i of octave o (nr(o) x nc(o), C order). This
+    // is not available in streaming mode.
+    const F* interval(const int o, const int i) const {
+        assert(!streaming_);
+        return data_[o*nr_intervals_ + i];
     }
-    int nr_intervals() const { return pyr[0].dim(0); }
-    int nr_octaves() const { return pyr.size(); }
-    int nr(const int o) const { return pyr[o].dim(1); }
-    int nc(const int o) const { return pyr[o].dim(2); }
+
+    private:
+        F at(int o, int i, int r, int c) const {
+            assert(data_[o*nr_intervals_ + i]);
+            return data_[o*nr_intervals_ + i][npy_intp(r % ring_[o])*nc_[o] + c];
+        }
+
+        // Computes the rows [first, last] of every interval of octave o
+        void compute(const int o, const int first, const int last) {
+            const int nrows = last - first + 1;
+            if (nrows <= 0) return;
+            hessian_worker<T, F> worker(integral_, &filters_[o*nr_intervals_], &data_[o*nr_intervals_], ring_[o], nc_[o], first, nrows);
+            parallel_for(npy_intp(nr_intervals_)*nrows, worker, std::max<npy_intp>(1, 16384/std::max<int>(1, nc_[o])));
+        }
+
+        const integral_view<T>& integral_;
+        const int nr_octaves_;
+        const int nr_intervals_;
+        const bool streaming_;
+        std::vector<int> nr_;
+        std::vector<int> nc_;
+        std::vector<hessian_filter> filters_;
+        // data_[o*nr_intervals + i] is interval i of octave o (or 0 if it is
+        // not available). Row r is stored at position r % ring_[o].
+        std::vector<F*> data_;
+        std::vector<int> ring_;
+        std::vector<F> storage_;
+        // In streaming mode, the rows [first_, last_] of octave octave_ are
+        // available
+        int octave_;
+        int first_;
+        int last_;
 };
 
 
+template <typename Pyramid>
 inline bool is_maximum_in_region(
-    const hessian_pyramid& pyr,
+    const Pyramid& pyr,
     const int o,
     const int i,
     const int r,
@@ -187,6 +471,39 @@ bool operator < (const double_v2& lhs, const double_v2& rhs) {
     return (lhs.y() == rhs.y()) ? (lhs.x() < rhs.x()) : (lhs.y() < rhs.y());
 }
 
+// The Haar wavelet responses (of size w) at (y, x):
+//
+//      y: top - bottom
+//      x: left - right
+//
+// where top, bottom, left & right are the halves of the w x w square centred
+// at (y, x). The four sums only need the 9 corners of a 3x3 grid in the
+// integral image, which are read once.
+double_v2 haar_yx(const integral_image_type& integral, const int y, const int x, const int w) {
+    const int N0 = integral.dim(0);
+    const int N1 = integral.dim(1);
+    const int r0 = std::max<int>(y - w/2 - 1, 0);
+    const int r1 = std::max<int>(std::min<int>(y - 1, N0-1), 0);
+    const int r2 = std::min<int>(y - w/2 + w - 1, N0-1);
+    const int c0 = std::max<int>(x - w/2 - 1, 0);
+    const int c1 = std::max<int>(std::min<int>(x - 1, N1-1), 0);
+    const int c2 = std::min<int>(x - w/2 + w - 1, N1-1);
+
+    const char* row0 = integral.row(r0);
+    const char* row1 = integral.row(r1);
+    const char* row2 = integral.row(r2);
+    const double I00 = integral.at(row0, c0), I01 = integral.at(row0, c1), I02 = integral.at(row0, c2);
+    const double I10 = integral.at(row1, c0),                              I12 = integral.at(row1, c2);
+    const double I20 = integral.at(row2, c0), I21 = integral.at(row2, c1), I22 = integral.at(row2, c2);
+
+    // Same expressions as in sum_rect
+    const double top    = (I12 - I02) - (I10 - I00);
+    const double bottom = (I22 - I12) - (I20 - I10);
+    const double left   = (I21 - I01) - (I20 - I00);
+    const double right  = (I22 - I02) - (I21 - I01);
+    return double_v2(top - bottom, left - right);
+}
+
 struct interest_point {
     interest_point()
         :scale(0)
@@ -232,8 +549,9 @@ struct interest_point {
 };
 
 
+template <typename Pyramid>
 inline const interest_point interpolate_point (
-    const hessian_pyramid& pyr,
+    const Pyramid& pyr,
     const int o,
     const int i,
     const int r,
@@ -323,8 +641,9 @@ inline const interest_point interpolate_point (
     return res;
 }
 
+template <typename Pyramid>
 void get_interest_points(
-    const hessian_pyramid& pyr,
+    Pyramid& pyr,
     double threshold,
     std::vector<interest_point>& result_points,
     const int initial_step_size) {
@@ -341,8 +660,15 @@ void get_interest_points(
 
         // do non-maximum suppression on all the intervals in the current octave and
         // accumulate the results in result_points
-        for (int i = 1; i < nr_intervals-1;  i += 3) {
-            for (int r = border_size+1; r < nr - border_size-1; r += 3) {
+        //
+        // The blocks of intervals are processed side by side, (3) rows at a
+        // time, so that the pyramid can be streamed. The points of each block
+        // are kept apart so that they are returned in the same order as if
+        // the blocks had been processed one after the other.
+        std::vector<std::vector<interest_point> > block_points(nr_intervals/3);
+        for (int r = border_size+1; r < nr - border_size-1; r += 3) {
+            pyr.require(o, r-1, r+3);
+            for (int i = 1; i < nr_intervals-1;  i += 3) {
                 for (int c = border_size+1; c < nc - border_size-1; c += 3) {
                     double max_val = pyr.get_value(o,i,r,c);
                     int max_i = i;
@@ -369,98 +695,21 @@ void get_interest_points(
                     if (max_val > threshold && is_maximum_in_region(pyr, o, max_i, max_r, max_c)) {
                         interest_point sp = interpolate_point(pyr, o, max_i, max_r, max_c, initial_step_size);
                         if (sp.score > threshold) {
-                            result_points.push_back(sp);
+                            block_points[i/3].push_back(sp);
                         }
                     }
                 }
             }
         }
+        for (unsigned b = 0; b != block_points.size(); ++b) {
+            result_points.insert(result_points.end(), block_points[b].begin(), block_points[b].end());
+        }
     }
     // sort all the points by how strong their score is
     // We want the highest scoring in front, so we sort on rbegin()/rend()
     std::sort(result_points.rbegin(), result_points.rend());
 }
 
-template <typename T>
-void build_pyramid(numpy::aligned_array<T> integral,
-                hessian_pyramid& hpyramid,
-                const int nr_octaves,
-                const int nr_intervals,
-                const int initial_step_size) {
-    assert(nr_octaves > 0);
-    assert(nr_intervals > 0);
-    assert(initial_step_size > 0);
-
-    hessian_pyramid::pyramid_type& pyramid = hpyramid.pyr;
-    const int N0 = integral.dim(0);
-    const int N1 = integral.dim(1);
-    // allocate space for the pyramid
-    pyramid.reserve(nr_octaves);
-    for (int o = 0; o < nr_octaves; ++o)
-    {
-        const int step_size = get_step_size(initial_step_size, o);
-        pyramid.push_back(numpy::new_array<double>(nr_intervals, N0/step_size, N1/step_size));
-        PyArray_FILLWBYTE(pyramid[o].raw_array(), 0);
-    }
-
-    // now fill out the pyramid with data
-    for (int o = 0; o < nr_octaves; ++o)
-    {
-        const int step_size = get_step_size(initial_step_size, o);
-        const int border_size = get_border_size(o, nr_intervals)*step_size;
-        numpy::aligned_array<double>& cur_data = pyramid[o];
-
-        for (int i = 0; i < nr_intervals; ++i) {
-            const int lobe_size = static_cast<int>(std::pow(2.0, o+1.0)+0.5)*(i+1) + 1;
-            const double area_inv = 1.0/std::pow(3.0*lobe_size, 2.0);
-            const int lobe_offset = lobe_size/2+1;
-
-            for (int y = border_size; y < N0 - border_size; y += step_size) {
-                for (int x = border_size; x < N1 - border_size; x += step_size) {
-
-                    double Dxx =     csum_rect(integral, y, x, 0, 0, 2*lobe_size-1, 3*lobe_size) -
-                                 3.* csum_rect(integral, y, x, 0, 0, 2*lobe_size-1,   lobe_size);
-
-                    double Dyy =     csum_rect(integral, y, x, 0, 0, 3*lobe_size, 2*lobe_size-1) -
-                                 3.* csum_rect(integral, y, x, 0, 0,   lobe_size, 2*lobe_size-1);
-
-                    double Dxy =    csum_rect(integral, y, x, -lobe_offset, +lobe_offset, lobe_size, lobe_size)
-                                  + csum_rect(integral, y, x, +lobe_offset, -lobe_offset, lobe_size, lobe_size)
-                                  - csum_rect(integral, y, x, +lobe_offset, +lobe_offset, lobe_size, lobe_size)
-                                  - csum_rect(integral, y, x, -lobe_offset, -lobe_offset, lobe_size, lobe_size);
-
-                    // now we normalize the filter responses
-                    Dxx *= area_inv;
-                    Dyy *= area_inv;
-                    Dxy *= area_inv;
-
-                    const double sign_of_laplacian = (Dxx + Dyy < 0) ? -1 : +1;
-                    // The constant below is the matter of some debate:
-                    // In the original papers, the authors use 0.81 (.9^2).
-                    // However, some have claimed that 0.36 (.6^2) is better
-                    // and the review "Local Invariant Feature Detectors: A
-                    // Survey."by Tuytelaars T and Mikolajczyk K.; Foundations
-                    // and Trends® in Computer Graphics and Vision.
-                    // 2007;3(3):177-280. Available at:
-                    // http://www.nowpublishers.com/product.aspx?product=CGV&doi=0600000017.
-                    //
-                    // Also uses 0.6
-                    double determinant = Dxx*Dyy - 0.36*Dxy*Dxy;
-
-                    // If the determinant is negative then just blank it out by setting
-                    // it to zero.
-                    if (determinant < 0) determinant = 0;
-
-                    // Save the determinant of the Hessian into our image pyramid.  Also
-                    // pack the laplacian sign into the value so we can get it out later.
-                    cur_data.at(i,y/step_size,x/step_size) = sign_of_laplacian*determinant;
-                }
-            }
-
-        }
-    }
-}
-
 template <typename T>
 void integral(numpy::aligned_array<T> array) {
     gil_release nogil;
@@ -496,70 +745,75 @@ inline
 double gaussian (const double x, const double y, const double sig) {
     return 1.0/(sig*sig*2*pi) * std::exp( -(x*x + y*y)/(2*sig*sig));
 }
-inline
-bool between_angles(const double a1, double a) {
-    const double two_pi = 2*pi;
-    const double window_size = pi/3;
-    const double a2 = a1 + window_size;
-    if ((a1 <= a) && (a < a2)) return true;
-    a += two_pi;
-    if ((a1 <= a) && (a < a2)) return true;
-    return false;
-}
 
-double compute_dominant_angle(
-        const integral_image_type& img,
-        const double_v2& center,
-        const double scale) {
-    std::vector<std::pair<double, double_v2> > samples;
-
-    // accumulate a bunch of angle and vector samples
-    double_v2 vect;
-    for (int r = -6; r <= 6; ++r) {
-        for (int c = -6; c <= 6; ++c) {
-            if (r*r + c*c < 36) {
-                // compute a Gaussian weighted gradient and the gradient's angle.
-                const double gauss = gaussian(c,r, 2.5);
-                vect.y() = gauss*haar_y(img, round(scale*r+center.y()), round(scale*c+center.x()), (~1)&static_cast<int>(4*scale+0.5));
-                vect.x() = gauss*haar_x(img, round(scale*r+center.y()), round(scale*c+center.x()), (~1)&static_cast<int>(4*scale+0.5));
-
-                samples.push_back(std::make_pair(vect.angle(), vect));
+// The sampling pattern of the orientation (the points (r, c) with r*r + c*c <
+// 36, Gaussian weighted with sigma = 2.5) and the Gaussian weights of the 20x20
+// grid of the descriptor (sigma = 3.3).
+//
+// These are the same for every point, so they are computed once (before
+// starting the threads).
+struct surf_weights {
+    surf_weights() {
+        for (int r = -6; r <= 6; ++r) {
+            for (int c = -6; c <= 6; ++c) {
+                if (r*r + c*c < 36) {
+                    orientation_r.push_back(r);
+                    orientation_c.push_back(c);
+                    orientation_w.push_back(gaussian(c,r, 2.5));
+                }
+            }
+        }
+        for (int y = -10; y < 10; ++y) {
+            for (int x = -10; x < 10; ++x) {
+                descriptor_w[y+10][x+10] = gaussian(x,y, 3.3);
             }
         }
     }
 
-    const int Nsamples = samples.size();
-    std::sort(samples.begin(), samples.end());
+    std::vector<int> orientation_r;
+    std::vector<int> orientation_c;
+    std::vector<double> orientation_w;
+    double descriptor_w[20][20];
+};
 
-    // Perform the following:
-    //
-    // Loop: for i \in 0..Nsamples
-    //          vect_i = \sum { a_j } | a_i <= a_j < a_i + pi/3
-    //
-    // where the angle comparison takes into account circularity (i.e., x == 2 pi + x)
-    //
-    // However, vect_{i+1} - vect_i = - a_i + ( \sum { a_j } |a_i + pi/3 <= a_j < a_{i+1} + pi/3 )
-    //
-    // So, we first compute vect_0 and then update it to get vect_i for i > 0
+// The orientation is the direction of the largest sum of the sample vectors
+// inside a window of pi/3. The samples are accumulated into
+// orientation_bins bins (by angle) and the window slides over the bins.
+const int orientation_bins = 72;
+const int orientation_window = orientation_bins/6;
 
-    int j;
-    vect = samples[0].second;
-    for (j = 1; j != Nsamples && between_angles(samples[0].first, samples[j].first); ++j) {
-        vect += samples[j].second;
+double compute_dominant_angle(
+        const integral_image_type& img,
+        const surf_weights& weights,
+        const double_v2& center,
+        const double scale) {
+    double_v2 bins[orientation_bins];
+
+    // accumulate the Gaussian weighted gradients by angle
+    const int w = (~1)&static_cast<int>(4*scale+0.5);
+    const int Nsamples = weights.orientation_w.size();
+    for (int s = 0; s != Nsamples; ++s) {
+        const double gauss = weights.orientation_w[s];
+        const int y = round(scale*weights.orientation_r[s]+center.y());
+        const int x = round(scale*weights.orientation_c[s]+center.x());
+        const double_v2 haar = haar_yx(img, y, x, w);
+        const double_v2 vect(gauss*haar.y(), gauss*haar.x());
+
+        int b = static_cast<int>((vect.angle() + pi) * (orientation_bins/(2*pi)));
+        if (b < 0) b = 0;
+        if (b >= orientation_bins) b = 0;
+        bins[b] += vect;
     }
-    // If we got all of the elements in our window, we are done:
-    if (j == Nsamples) return vect.angle();
+
+    // vect = sum of bins [b, b + orientation_window) (circularly)
+    double_v2 vect;
+    for (int b = 0; b != orientation_window; ++b) vect += bins[b];
 
     double max_length = vect.norm2();
     double best_ang = vect.angle();
-
-    for (int i = 1; i < Nsamples; ++i) {
-        vect -= samples[i].second;
-        while (j != i && between_angles(samples[i].first, samples[j].first)) {
-            vect += samples[j].second;
-            ++j;
-            if (j == Nsamples) j = 0;
-        }
+    for (int b = 1; b != orientation_bins; ++b) {
+        vect -= bins[b-1];
+        vect += bins[(b + orientation_window - 1) % orientation_bins];
 
         const double cur_length = vect.norm2();
         if (cur_length > max_length) {
@@ -580,8 +834,18 @@ double_v2 rotate_point(const double_v2& p, const double sin_angle, const double
 
 // ----------------------------------------------------------------------------------------
 
+void normalize_descriptor(double des[64]) {
+    // Return the length normalized descriptor.  Add a small number
+    // to guard against division by zero.
+    double len = 1e-7;
+    for (int i = 0; i != 64; ++i) len += des[i]*des[i];
+    len = std::sqrt(len);
+    for (int i = 0; i != 64; ++i) des[i] /= len;
+}
+
 void compute_surf_descriptor (
     const integral_image_type& img,
+    const surf_weights& weights,
     double_v2 center,
     const double scale,
     const double angle,
@@ -605,10 +869,9 @@ void compute_surf_descriptor (
                     double_v2 p = rotate_point(double_v2(x*scale, y*scale), sin_angle, cos_angle);
                     p += center;
 
-                    const double gauss = gaussian(x,y, 3.3);
-                    double_v2 temp(
-                            gauss*haar_x(img, int(p.y()), int(p.x()), static_cast<int>(2*scale+0.5)),
-                            gauss*haar_y(img, int(p.y()), int(p.x()), static_cast<int>(2*scale+0.5)));
+                    const double gauss = weights.descriptor_w[y+10][x+10];
+                    const double_v2 haar = haar_yx(img, int(p.y()), int(p.x()), static_cast<int>(2*scale+0.5));
+                    double_v2 temp(gauss*haar.x(), gauss*haar.y());
 
                     // rotate this vector into alignment with the surf descriptor box
                     // This is a reverse rotation (takes advantage of the fact that
@@ -628,22 +891,61 @@ void compute_surf_descriptor (
     }
 
     assert(count == 64);
+    normalize_descriptor(des);
+}
 
-    // Return the length normalized descriptor.  Add a small number
-    // to guard against division by zero.
-    double len = 1e-7;
-    for (int i = 0; i != 64; ++i) len += des[i]*des[i];
-    len = std::sqrt(len);
-    for (int i = 0; i != 64; ++i) des[i] /= len;
+// Upright SURF (U-SURF): the descriptor with the grid aligned to the image
+// axes. This is the same as compute_surf_descriptor(..., 0., des), but
+// without any of the rotations.
+void compute_upright_surf_descriptor (
+    const integral_image_type& img,
+    const surf_weights& weights,
+    const double_v2& center,
+    const double scale,
+    double des[64]) {
+    assert(scale > 0);
+
+    const int w = static_cast<int>(2*scale+0.5);
+    int ys[20];
+    int xs[20];
+    for (int i = 0; i != 20; ++i) {
+        ys[i] = int((i-10)*scale + center.y());
+        xs[i] = int((i-10)*scale + center.x());
+    }
+
+    int count = 0;
+    for (int r = 0; r < 20; r += 5) {
+        for (int c = 0; c < 20; c += 5) {
+            double_v2 vect, abs_vect;
+            for (int y = r; y < r+5; ++y) {
+                for (int x = c; x < c+5; ++x) {
+                    const double gauss = weights.descriptor_w[y][x];
+                    const double_v2 haar = haar_yx(img, ys[y], xs[x], w);
+                    const double_v2 temp(gauss*haar.y(), gauss*haar.x());
+                    vect += temp;
+                    abs_vect += temp.abs();
+                }
+            }
+
+            des[count++] = vect.y();
+            des[count++] = vect.x();
+            des[count++] = abs_vect.y();
+            des[count++] = abs_vect.x();
+        }
+    }
+
+    assert(count == 64);
+    normalize_descriptor(des);
 }
 
-std::vector<surf_point> compute_descriptors(
-            const integral_image_type& int_img,
+// Returns the first max_points points, except those too close to the edge of
+// the image (of size N0 x N1) to have a descriptor.
+std::vector<interest_point> select_points(
+            const int N0,
+            const int N1,
             const std::vector<interest_point>& points,
             const int max_points) {
-    std::vector<surf_point> spoints;
-    const int N0 = int_img.dim(0);
-    const int N1 = int_img.dim(1);
+    std::vector<interest_point> selected;
     for (unsigned i = 0; i < std::min(size_t(max_points), points.size()); ++i)
     {
         // ignore points that are close to the edge of the image
@@ -652,28 +954,81 @@ std::vector<surf_point> compute_descriptors(
         const unsigned long border_size = static_cast<unsigned long>(border*points[i].scale)/2;
         if (border_size <= p.y() && (p.y() + border_size) < N0 &&
             border_size <= p.x() && (p.x() + border_size) < N1) {
-            surf_point sp;
+            selected.push_back(p);
+        }
+    }
+    return selected;
+}
+
+struct descriptor_worker {
+    descriptor_worker(const integral_image_type& int_img, const surf_weights& weights, const std::vector<interest_point>& points, const bool upright, double* out)
+        :int_img_(int_img)
+        ,weights_(weights)
+        ,points_(points)
+        ,upright_(upright)
+        ,out_(out)
+        { }
 
-            sp.angle = compute_dominant_angle(int_img, p.center(), p.scale);
-            compute_surf_descriptor(int_img, p.center(), p.scale, sp.angle, sp.des);
+    void operator()(const npy_intp start, const npy_intp end) {
+        for (npy_intp i = start; i != end; ++i) {
+            const interest_point& p = points_[i];
+            surf_point sp;
             sp.p = p;
-            spoints.push_back(sp);
+            if (upright_) {
+                sp.angle = 0.;
+                compute_upright_surf_descriptor(int_img_, weights_, p.center(), p.scale, sp.des);
+            } else {
+                sp.angle = compute_dominant_angle(int_img_, weights_, p.center(), p.scale);
+                compute_surf_descriptor(int_img_, weights_, p.center(), p.scale, sp.angle, sp.des);
+            }
+            sp.dump(out_ + i*surf_point::ndoubles);
         }
     }
-    return spoints;
+
+    const integral_image_type& int_img_;
+    const surf_weights& weights_;
+    const std::vector<interest_point>& points_;
+    const bool upright_;
+    double* const out_;
+};
+
+// Writes the descriptors of points (see surf_point::dump) to out (which must
+// have room for points.size()*surf_point::ndoubles elements). If upright, the
+// orientation is not computed (it is set to 0). This does not need the GIL
+// and runs in parallel.
+void compute_descriptors(
+            const integral_image_type& int_img,
+            const std::vector<interest_point>& points,
+            const bool upright,
+            double* out) {
+    const surf_weights weights;
+    descriptor_worker worker(int_img, weights, points, upright, out);
+    parallel_for(points.size(), worker, 4);
+}
+
+template <typename T, typename F>
+void get_pyramid_points(const integral_view<T>& integral, const int nr_octaves, const int nr_intervals, const int initial_step_size, const float threshold, const bool streaming, std::vector<interest_point>& points) {
+    hessian_pyramid<T, F> pyramid(integral, nr_octaves, nr_intervals, initial_step_size, streaming);
+    get_interest_points(pyramid, threshold, points, initial_step_size);
+}
+
+// Detects the interest points (sorted by decreasing score). The pyramid is
+// stored in single precision if float32 (see hessian_pyramid for streaming).
+template <typename T>
+void detect_points(const integral_view<T>& integral, const int nr_octaves, const int nr_intervals, const int initial_step_size, const float threshold, const bool float32, const bool streaming, std::vector<interest_point>& points) {
+    if (float32) get_pyramid_points<T, float>(integral, nr_octaves, nr_intervals, initial_step_size, threshold, streaming, points);
+    else get_pyramid_points<T, double>(integral, nr_octaves, nr_intervals, initial_step_size, threshold, streaming, points);
 }
 
+// Detects the interest points which will get a descriptor
 template<typename T>
-std::vector<surf_point> get_surf_points(const numpy::aligned_array<T>& int_img, const int nr_octaves, const int nr_intervals, const int initial_step_size, const float threshold, const int max_points) {
+std::vector<interest_point> get_surf_points(PyArrayObject* array, const int nr_octaves, const int nr_intervals, const int initial_step_size, const float threshold, const int max_points, const bool float32, const bool streaming) {
     assert(max_points > 0);
-    hessian_pyramid pyramid;
-
     gil_release nogil;
+    const integral_view<T> int_img(array);
     std::vector<interest_point> points;
-    build_pyramid<T>(int_img, pyramid, nr_octaves, nr_intervals, initial_step_size);
-    get_interest_points(pyramid, threshold, points, initial_step_size);
-    // compute descriptors and return
-    return compute_descriptors(int_img, points, max_points);
+    detect_points<T>(int_img, nr_octaves, nr_intervals, initial_step_size, threshold, float32, streaming, points);
+    return select_points(int_img.dim(0), int_img.dim(1), points, max_points);
 }
 
 PyObject* py_surf(PyObject* self, PyObject* args) {
@@ -684,7 +1039,10 @@ PyObject* py_surf(PyObject* self, PyObject* args) {
     int initial_step_size;
     float threshold;
     int max_points;
-    if (!PyArg_ParseTuple(args,"Oiiifi", &array, &nr_octaves, &nr_intervals, &initial_step_size, &threshold, &max_points)) return NULL;
+    int upright;
+    int float32;
+    int streaming;
+    if (!PyArg_ParseTuple(args,"Oiiifiiii", &array, &nr_octaves, &nr_intervals, &initial_step_size, &threshold, &max_points, &upright, &float32, &streaming)) return NULL;
     if (!PyArray_Check(array) ||
         PyArray_NDIM(array) != 2 ||
         PyArray_TYPE(array) != NPY_DOUBLE) {
@@ -693,18 +1051,20 @@ PyObject* py_surf(PyObject* self, PyObject* args) {
     }
     holdref array_ref(array);
     try {
-        std::vector<surf_point> spoints;
-        spoints = get_surf_points<double>(
-                        numpy::aligned_array<double>(array),
+        const std::vector<interest_point> points = get_surf_points<double>(
+                        array,
                         nr_octaves,
                         nr_intervals,
                         initial_step_size,
                         threshold,
-                        max_points);
+                        max_points,
+                        float32,
+                        streaming);
 
-        numpy::aligned_array<double> arr = numpy::new_array<double>(spoints.size(), surf_point::ndoubles);
-        for (unsigned int i = 0; i != spoints.size(); ++i) {
-            spoints[i].dump(arr.data(i));
+        numpy::aligned_array<double> arr = numpy::new_array<double>(points.size(), surf_point::ndoubles);
+        {
+            gil_release nogil;
+            compute_descriptors(integral_image_type(array), points, upright, arr.data());
         }
         res = arr.raw_array();
         Py_INCREF(res);
@@ -722,7 +1082,8 @@ PyObject* py_descriptors(PyObject* self, PyObject* args) {
     PyArrayObject* array;
     PyArrayObject* points_arr;
     PyArrayObject* res;
-    if (!PyArg_ParseTuple(args,"OO", &array, &points_arr)) return NULL;
+    int upright;
+    if (!PyArg_ParseTuple(args,"OOi", &array, &points_arr, &upright)) return NULL;
     if (!numpy::are_arrays(array, points_arr) ||
         PyArray_NDIM(array) != 2 ||
         !PyArray_EquivTypenums(PyArray_TYPE(array), NPY_DOUBLE) ||
@@ -743,22 +1104,18 @@ PyObject* py_descriptors(PyObject* self, PyObject* args) {
     }
     holdref array_ref(array);
     try {
-
-        std::vector<surf_point> spoints;
-        { // no gil block
-            gil_release nogil;
-            numpy::aligned_array<double> points_raw(points_arr);
-            const unsigned npoints = points_raw.dim(0);
-            std::vector<interest_point> points;
-            for (unsigned int i = 0; i != npoints; ++i) {
-                points.push_back(interest_point::load(points_raw.data(i)));
-            }
-            spoints = compute_descriptors(integral_image_type(array), points, npoints);
+        numpy::aligned_array<double> points_raw(points_arr);
+        const unsigned npoints = points_raw.dim(0);
+        std::vector<interest_point> points;
+        for (unsigned int i = 0; i != npoints; ++i) {
+            points.push_back(interest_point::load(points_raw.data(i)));
         }
+        points = select_points(PyArray_DIM(array, 0), PyArray_DIM(array, 1), points, npoints);
 
-        numpy::aligned_array<double> arr = numpy::new_array<double>(spoints.size(), surf_point::ndoubles);
-        for (unsigned int i = 0; i != spoints.size(); ++i) {
-            spoints[i].dump(arr.data(i));
+        numpy::aligned_array<double> arr = numpy::new_array<double>(points.size(), surf_point::ndoubles);
+        {
+            gil_release nogil;
+            compute_descriptors(integral_image_type(array), points, upright, arr.data());
         }
         res = arr.raw_array();
         Py_INCREF(res);
@@ -781,20 +1138,20 @@ PyObject* py_interest_points(PyObject* self, PyObject* args) {
     int initial_step_size;
     int max_points;
     float threshold;
-    if (!PyArg_ParseTuple(args,"Oiiifi", &array, &nr_octaves, &nr_intervals, &initial_step_size, &threshold, &max_points)) return NULL;
+    int float32;
+    int streaming;
+    if (!PyArg_ParseTuple(args,"Oiiifiii", &array, &nr_octaves, &nr_intervals, &initial_step_size, &threshold, &max_points, &float32, &streaming)) return NULL;
     if (!PyArray_Check(array) || PyArray_NDIM(array) != 2) {
         PyErr_SetString(PyExc_RuntimeError, TypeErrorMsg);
         return NULL;
     }
     holdref array_ref(array);
-    hessian_pyramid pyramid;
     std::vector<interest_point> interest_points;
     try {
         switch(PyArray_TYPE(array)) {
         #define HANDLE(type) {\
             gil_release nogil; \
-            build_pyramid<type>(numpy::aligned_array<type>(array), pyramid, nr_octaves, nr_intervals, initial_step_size); \
-            get_interest_points(pyramid, threshold, interest_points, initial_step_size); \
+            detect_points<type>(integral_view<type>(array), nr_octaves, nr_intervals, initial_step_size, threshold, float32, streaming, interest_points); \
             if (max_points >= 0 && interest_points.size() > unsigned(max_points)) { \
                 interest_points.erase( \
                             interest_points.begin() + max_points, \
@@ -824,6 +1181,16 @@ PyObject* py_interest_points(PyObject* self, PyObject* args) {
     return PyArray_Return(res);
 }
 
+template <typename T>
+void copy_pyramid(const hessian_pyramid<T, double>& pyramid, std::vector<numpy::aligned_array<double> >& out) {
+    for (int o = 0; o != pyramid.nr_octaves(); ++o) {
+        const npy_intp size = npy_intp(pyramid.nr(o))*pyramid.nc(o);
+        for (int i = 0; i != pyramid.nr_intervals(); ++i) {
+            std::memcpy(out[o].data() + i*size, pyramid.interval(o, i), size*sizeof(double));
+        }
+    }
+}
+
 PyObject* py_pyramid(PyObject* self, PyObject* args) {
     PyArrayObject* array;
     int nr_octaves;
@@ -835,11 +1202,17 @@ PyObject* py_pyramid(PyObject* self, PyObject* args) {
         return NULL;
     }
     holdref array_ref(array);
-    hessian_pyramid pyramid;
+    std::vector<numpy::aligned_array<double> > pyramid;
     try {
+        for (int o = 0; o < nr_octaves; ++o) {
+            const int step_size = get_step_size(initial_step_size, o);
+            pyramid.push_back(numpy::new_array<double>(nr_intervals, PyArray_DIM(array, 0)/step_size, PyArray_DIM(array, 1)/step_size));
+        }
         switch(PyArray_TYPE(array)) {
-        #define HANDLE(type) \
-            build_pyramid<type>(numpy::aligned_array<type>(array), pyramid, nr_octaves, nr_intervals, initial_step_size);
+        #define HANDLE(type) { \
+            gil_release nogil; \
+            copy_pyramid(hessian_pyramid<type, double>(integral_view<type>(array), nr_octaves, nr_intervals, initial_step_size, false), pyramid); \
+        }
 
             HANDLE_TYPES();
         #undef HANDLE
@@ -857,7 +1230,7 @@ PyObject* py_pyramid(PyObject* self, PyObject* args) {
     PyObject* pyramid_list = PyList_New(nr_octaves);
     if (!pyramid_list) return NULL;
     for (int o = 0; o != nr_octaves; ++o) {
-        PyObject* arr = reinterpret_cast<PyObject*>(pyramid.pyr.at(o).raw_array());
+        PyObject* arr = reinterpret_cast<PyObject*>(pyramid.at(o).raw_array());
         Py_INCREF(arr);
         PyList_SET_ITEM(pyramid_list, o, arr);
     }
@@ -897,7 +1270,7 @@ PyObject* py_sum_rect(PyObject* self, PyObject* args) {
     double res;
     switch(PyArray_TYPE(array)) {
     #define HANDLE(type) \
-        res = sum_rect<type>(numpy::aligned_array<type>(array), y0, x0, y1, x1);
+        res = sum_rect<type>(integral_view<type>(array), y0, x0, y1, x1);
 
         HANDLE_TYPES();
     #undef HANDLE
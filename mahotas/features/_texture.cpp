@@ -30,12 +30,27 @@ void cooccurence(numpy::aligned_array<npy_int32> res, numpy::aligned_array<T> ar
     typename numpy::aligned_array<T>::iterator iter = array.begin();
     filter_iterator<T> filter(array.raw_array(), Bc.raw_array(), EXTEND_CONSTANT, true);
 
-    for (int i = 0; i != N; ++i, filter.iterate_both(iter)) {
+    for (int i = 0; i != N; ) {
+        const npy_intp run = filter.interior_run(iter);
+        if (run) {
+            const T* base = &*iter;
+            const npy_intp step = filter.row_step(iter);
+            const npy_intp offset = filter.interior_offsets()[0];
+            for (npy_intp r = 0; r != run; ++r) {
+                const T* p = base + r*step;
+                ++res.at(npy_intp(*p), npy_intp(p[offset]));
+            }
+            i += run;
+            filter.advance(iter, run);
+            continue;
+        }
         T val = *iter;
         T val2 = 0;
         if(filter.retrieve(iter, 0, val2)) {
             ++res.at(npy_intp(val), npy_intp(val2));
         }
+        ++i;
+        filter.iterate_both(iter);
     }
 }
 
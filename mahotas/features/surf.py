@@ -6,6 +6,7 @@
 from __future__ import division
 import numpy as np
 from . import _surf
+from . import _match
 from ..internal import _verify_is_integer_type
 
 __all__ = ['integral', 'surf']
@@ -39,9 +40,17 @@ def integral(f, in_place=False, dtype=np.double):
             f = f.copy()
     return _surf.integral(f)
 
-def surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=1024, descriptor_only=False):
+def _is_float32(pyramid_dtype):
+    pyramid_dtype = np.dtype(pyramid_dtype)
+    if pyramid_dtype == np.float32:
+        return True
+    if pyramid_dtype == np.double:
+        return False
+    raise ValueError('mahotas.surf: pyramid_dtype must be either np.double or np.float32 (got %s)' % pyramid_dtype)
+
+def surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=1024, descriptor_only=False, upright=False, pyramid_dtype=np.double, stream_pyramid=False):
     '''
-    points = surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=1024, descriptor_only=False):
+    points = surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=1024, descriptor_only=False, upright=False, pyramid_dtype=np.double, stream_pyramid=False):
 
     Run SURF detection and descriptor computations
 
@@ -65,6 +74,20 @@ def surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_p
         of those may be filtered out.
     descriptor_only : boolean, optional
         If ``descriptor_only``, then returns only the 64-element descriptors
+    upright : boolean, optional
+        If ``upright``, then compute upright SURF (U-SURF) descriptors: no
+        orientation is assigned (the angle is always 0) and the descriptors
+        are not rotation invariant, but are much faster to compute (default:
+        False)
+    pyramid_dtype : dtype, optional
+        dtype used to store the Hessian pyramid: either ``np.double`` (the
+        default) or ``np.float32``, which halves its memory usage (the point
+        scores are then only computed to single precision)
+    stream_pyramid : boolean, optional
+        If ``stream_pyramid``, then the pyramid is computed a band of rows at a
+        time, as the detector needs them, instead of being kept in memory in
+        its entirety. This returns the same points, but needs much less memory
+        for large images (default: False)
 
     Returns
     -------
@@ -77,15 +100,15 @@ def surf(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_p
         If ``descriptor_only``, then only the *D_i*s are returned and the array
         has shape (N, 64)!
     '''
-    surfs = _surf.surf(integral(f), nr_octaves, nr_scales, initial_step_size, threshold, max_points)
+    surfs = _surf.surf(integral(f), nr_octaves, nr_scales, initial_step_size, threshold, max_points, bool(upright), _is_float32(pyramid_dtype), bool(stream_pyramid))
     if descriptor_only:
         surfs = surfs[:,6:]
     return surfs
 
 
-def interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=None, is_integral=False):
+def interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points=None, is_integral=False, pyramid_dtype=np.double, stream_pyramid=False):
     '''
-    desc_array = interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points={all}, is_integral=False)
+    desc_array = interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold=0.1, max_points={all}, is_integral=False, pyramid_dtype=np.double, stream_pyramid=False)
 
     SURF Detector
 
@@ -105,6 +128,15 @@ def interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold
         Maximum number of points to return. By default, return all.
     is_integral : boolean, optional
         Whether `f` is an integral image
+    pyramid_dtype : dtype, optional
+        dtype used to store the Hessian pyramid: either ``np.double`` (the
+        default) or ``np.float32``, which halves its memory usage (the point
+        scores are then only computed to single precision)
+    stream_pyramid : boolean, optional
+        If ``stream_pyramid``, then the pyramid is computed a band of rows at a
+        time, as the detector needs them, instead of being kept in memory in
+        its entirety. This returns the same points, but needs much less memory
+        for large images (default: False)
 
     Returns
     -------
@@ -126,12 +158,12 @@ def interest_points(f, nr_octaves=4, nr_scales=6, initial_step_size=1, threshold
             raise TypeError('mahotas.surf: integral image must be of dtype double')
     if max_points is None:
         max_points = -1
-    return _surf.interest_points(f, nr_octaves, nr_scales, initial_step_size, threshold, max_points)
+    return _surf.interest_points(f, nr_octaves, nr_scales, initial_step_size, threshold, max_points, _is_float32(pyramid_dtype), bool(stream_pyramid))
 
 
-def descriptors(f, interest_points, is_integral=False, descriptor_only=False):
+def descriptors(f, interest_points, is_integral=False, descriptor_only=False, upright=False):
     '''
-    desc_array = descriptors(f, interest_points, is_integral=False)
+    desc_array = descriptors(f, interest_points, is_integral=False, descriptor_only=False, upright=False)
 
     Compute SURF descriptors
 
@@ -145,6 +177,9 @@ def descriptors(f, interest_points, is_integral=False, descriptor_only=False):
         Whether `f` is an integral image
     descriptor_only : boolean, optional
         If ``descriptor_only``, then returns only the 64-element descriptors
+    upright : boolean, optional
+        If ``upright``, then compute upright SURF (U-SURF) descriptors (see
+        ``surf``)
 
     Returns
     -------
@@ -161,12 +196,100 @@ def descriptors(f, interest_points, is_integral=False, descriptor_only=False):
         if f.dtype != np.double:
             raise TypeError('mahotas.surf: integral image must be of dtype double')
     interest_points = np.ascontiguousarray(interest_points, dtype=np.float64)
-    surfs = _surf.descriptors(f, interest_points)
+    surfs = _surf.descriptors(f, interest_points, bool(upright))
     if descriptor_only:
         surfs = surfs[:,6:]
     return surfs
 
 
+def match(points0, points1, ratio=0.8, method='exact', use_laplacian=True, nr_trees=4, max_checks=256, seed=0, return_distances=False):
+    '''
+    matches = match(points0, points1, ratio=0.8, method='exact', use_laplacian=True, nr_trees=4, max_checks=256, seed=0, return_distances=False)
+
+    Match SURF descriptors
+
+    For each point in ``points0``, finds its nearest neighbour in ``points1``
+    (in Euclidean distance between descriptors). The match is only accepted
+    if it passes the ratio test, i.e., if it is clearly closer than the second
+    nearest neighbour.
+
+    Parameters
+    ----------
+    points0 : ndarray, shape = (N0, D)
+        Either descriptors (as returned by ``surf(f, descriptor_only=True)``)
+        or full SURF points (as returned by ``surf(f)``)
+    points1 : ndarray, shape = (N1, D)
+        Points to search (in the same format as ``points0``)
+    ratio : float, optional
+        A match is only accepted if the distance to the nearest neighbour is
+        smaller than ``ratio`` times the distance to the second nearest
+        (default: 0.8), so points which have no second nearest neighbour (of
+        the same sign of the Laplacian) are never matched. Use ``ratio=None``
+        to accept all matches.
+    method : str, optional
+        Either 'exact' (compare to all points) or 'kdtree' (approximate search
+        in a forest of randomized kd-trees, which is much faster for large
+        ``points1``)
+    use_laplacian : boolean, optional
+        If full SURF points are given, then only points with the same sign of
+        the Laplacian are matched (default: True)
+    nr_trees : integer, optional
+        Nr of kd-trees (for the 'kdtree' method, default: 4)
+    max_checks : integer, optional
+        Nr of points to compare each query to (for the 'kdtree' method,
+        default: 256). Larger values give more accurate results.
+    seed : integer, optional
+        Seed for the construction of the kd-trees (default: 0)
+    return_distances : boolean, optional
+        Whether to return the distances as well
+
+    Returns
+    -------
+    matches : ndarray of int, shape = (N0,)
+        ``matches[i]`` is the index in ``points1`` of the match of
+        ``points0[i]`` (or -1 if there is none)
+    distances : ndarray of double, shape = (N0, 2)
+        Only returned if ``return_distances``: distances to the nearest and
+        second nearest neighbours (inf if there are not enough points)
+    '''
+    points0 = np.asanyarray(points0)
+    points1 = np.asanyarray(points1)
+    if points0.ndim != 2 or points1.ndim != 2 or points0.shape[1] != points1.shape[1]:
+        raise ValueError('mahotas.surf.match: points0 & points1 must be 2-D arrays with the same number of columns')
+    if method not in ('exact', 'kdtree'):
+        raise ValueError("mahotas.surf.match: method must be either 'exact' or 'kdtree' (got %s)" % method)
+    if method == 'kdtree' and (nr_trees < 1 or max_checks < 1):
+        raise ValueError('mahotas.surf.match: nr_trees & max_checks must be positive')
+    if points0.shape[1] == 6 + 64:
+        if use_laplacian:
+            groups0 = (points0[:,4] > 0)
+            groups1 = (points1[:,4] > 0)
+        points0 = points0[:,6:]
+        points1 = points1[:,6:]
+    else:
+        use_laplacian = False
+    if not use_laplacian:
+        groups0 = np.zeros(len(points0), np.intc)
+        groups1 = np.zeros(len(points1), np.intc)
+    points0 = np.ascontiguousarray(points0, dtype=np.double)
+    points1 = np.ascontiguousarray(points1, dtype=np.double)
+    groups0 = np.ascontiguousarray(groups0, dtype=np.intc)
+    groups1 = np.ascontiguousarray(groups1, dtype=np.intc)
+    neighbours = np.empty((len(points0), 2), np.intp)
+    distances = np.empty((len(points0), 2), np.double)
+    nr_trees = (int(nr_trees) if method == 'kdtree' else 0)
+    max_checks = (int(max_checks) if method == 'kdtree' else 1)
+    _match.match(points0, groups0, points1, groups1, nr_trees, max_checks, int(seed), neighbours, distances)
+    matches = neighbours[:,0].copy()
+    if ratio is not None:
+        # Without a second neighbour, the test cannot be applied (& the match
+        # is not accepted)
+        matches[~((distances[:,0] < ratio * distances[:,1]) & (neighbours[:,1] >= 0))] = -1
+    if return_distances:
+        return matches, distances
+    return matches
+
+
 def show_surf(f, spoints, values=None, colors=None):
     '''
     f2 = show_surf(f, spoints, values=None, colors={[(255,0,0)]}):
@@ -14,10 +14,13 @@ __all__ = [
     'border',
     'bwperim',
     'remove_bordering',
+    'relabel',
+    'filter_labels',
     'label',
     'labeled_sum',
     'labeled_max',
     'labeled_size',
+    'regionprops',
     ]
 
 def label(array, Bc=None, out=None, output=None):
@@ -48,6 +51,10 @@ def label(array, Bc=None, out=None, output=None):
     nr_objects = _labeled.label(output, Bc)
     return output, nr_objects
 
+def _verify_is_integer_labeled(labeled, fname):
+    if labeled.dtype.kind not in 'biu':
+        raise ValueError('mahotas.labeled.%s: labeled must be of an integer type (got %s)' % (fname, labeled.dtype))
+
 def remove_bordering(im, rsize=1, out=None, output=None):
     '''
     slabeled = remove_bordering(labeled, rsize=1, out={np.empty_like(im)})
@@ -71,9 +78,25 @@ def remove_bordering(im, rsize=1, out=None, output=None):
     slabeled : ndarray
         Subset of ``labeled``
     '''
+    out = _get_output(im, out, 'labeled.remove_bordering', output=output)
+    if im.ndim == 0:
+        out[...] = im
+        return out
+    # The lookup table only handles non-negative integer labels (which fit
+    # into an index). Anything else goes through the generic code below.
+    if im.dtype.kind in 'biu' and (im.dtype.kind != 'i' or not im.size or im.min() >= 0):
+        try:
+            invalid = _labeled.border_labels(np.ascontiguousarray(im), int(rsize))
+        except ValueError:
+            pass
+        else:
+            table = np.arange(invalid[-1] + 1 if len(invalid) else 0, dtype=np.intp)
+            table[invalid] = 0
+            return _labeled.apply_table(im, table, out)
+
     invalid = set()
-    index = [slice(None,None,None) for _ in xrange(im.ndim)]
-    for dim in xrange(im.ndim):
+    index = [slice(None,None,None) for _ in range(im.ndim)]
+    for dim in (range(im.ndim) if rsize > 0 else []):
         for bordering in (
                     slice(rsize),
                     slice(-rsize, None)
@@ -83,18 +106,108 @@ def remove_bordering(im, rsize=1, out=None, output=None):
                 if val != 0:
                     invalid.add(val)
         index[dim] = slice(None,None,None)
-    if out is None and output is not None:
-        import warnings
-        warnings.warn('Using deprecated `output` argument in function `%s`. Please use `out` in the future.' % fname, DeprecationWarning)
-        out = output 
-    if out is None:
-        out = im.copy()
-    elif out is not im:
-        out[:] = im
+    if out is not im:
+        out[...] = im
     for val in invalid:
         out *= (im != val)
     return out
 
+def relabel(labeled, inplace=False):
+    '''
+    relabeled, nr_labels = relabel(labeled, inplace=False)
+
+    Relabel the labels so that they are consecutive (1, 2, ..., nr_labels),
+    while keeping their order (the background, 0, is not changed).
+
+    Parameters
+    ----------
+    labeled : ndarray of integer type
+        Labeled array
+    inplace : bool, optional
+        Whether to operate in place (default: False)
+
+    Returns
+    -------
+    relabeled : ndarray
+        Relabeled array
+    nr_labels : int
+        Number of labels
+    '''
+    _verify_is_integer_labeled(labeled, 'relabel')
+    present = (_labeled.label_counts(labeled) > 0)
+    return _apply_keep(labeled, present, (labeled if inplace else None), 'relabel')
+
+def filter_labels(labeled, min_size=None, max_size=None, keep=None, remove_bordering=False, out=None):
+    '''
+    filtered, nr_labels = filter_labels(labeled, min_size=None, max_size=None, keep=None, remove_bordering=False, out={np.empty_like(labeled)})
+
+    Remove the objects which do not meet the given conditions & relabel the
+    remaining ones (so that they are numbered 1, 2, ..., nr_labels, in the
+    same order as before).
+
+    This takes two passes over the array, no matter how many objects are
+    removed.
+
+    Parameters
+    ----------
+    labeled : ndarray of integer type
+        Labeled array
+    min_size : int, optional
+        Remove objects with fewer than `min_size` pixels
+    max_size : int, optional
+        Remove objects with more than `max_size` pixels
+    keep : sequence of labels or boolean ndarray, optional
+        Only keep these objects. If it is a boolean array, object ``i`` is
+        kept if ``keep[i]`` (labels past the end of `keep` are removed).
+    remove_bordering : bool or int, optional
+        Remove objects touching the border (if an integer, it is the `rsize`
+        argument of ``remove_bordering``)
+    out : ndarray, optional
+        Output array (pass `labeled` to operate in place)
+
+    Returns
+    -------
+    filtered : ndarray
+        Filtered & relabeled array
+    nr_labels : int
+        Number of remaining objects
+    '''
+    _verify_is_integer_labeled(labeled, 'filter_labels')
+    out = _get_output(labeled, out, 'labeled.filter_labels')
+    sizes = _labeled.label_counts(labeled)
+    present = (sizes > 0)
+    if min_size is not None:
+        present &= (sizes >= min_size)
+    if max_size is not None:
+        present &= (sizes <= max_size)
+    if keep is not None:
+        keep = np.asanyarray(keep)
+        keeping = np.zeros(len(present), bool)
+        if keep.dtype == bool:
+            n = min(len(keep), len(keeping))
+            keeping[:n] = keep[:n]
+        else:
+            keep = np.asanyarray(keep, dtype=np.intp).ravel()
+            keep = keep[(keep >= 0) & (keep < len(keeping))]
+            keeping[keep] = True
+        present &= keeping
+    if remove_bordering and labeled.ndim > 0:
+        rsize = (1 if remove_bordering is True else int(remove_bordering))
+        invalid = _labeled.border_labels(np.ascontiguousarray(labeled), rsize)
+        present[invalid] = False
+    return _apply_keep(labeled, present, out, 'filter_labels')
+
+def _apply_keep(labeled, keep, out, fname):
+    # Labels i for which keep[i] is true are renumbered consecutively,
+    # the others are set to zero
+    if len(keep):
+        keep[0] = False
+    table = np.cumsum(keep, dtype=np.intp)
+    nr_labels = (int(table[-1]) if len(table) else 0)
+    table *= keep
+    out = _get_output(labeled, out, 'labeled.' + fname)
+    return _labeled.apply_table(labeled, table, out), nr_labels
+
 
 def border(labeled, i, j, Bc=None, out=None, always_return=True, output=None):
     '''
@@ -292,3 +405,76 @@ def labeled_size(labeled):
     from .histogram import fullhistogram
     return fullhistogram(labeled.astype(np.uint32))
 
+def _regionprops_dtype(ndim, has_intensity):
+    # This must match the column order in _labeled.cpp
+    fields = [
+        ('area', np.float64),
+        ('bbox', np.float64, (2*ndim,)),
+        ('centroid', np.float64, (ndim,)),
+        ('moments', np.float64, (4,)*ndim),
+        ]
+    if has_intensity:
+        fields += [
+            ('weighted_centroid', np.float64, (ndim,)),
+            ('sum', np.float64),
+            ('min', np.float64),
+            ('max', np.float64),
+            ('mean', np.float64),
+            ('var', np.float64),
+            ]
+    return np.dtype(fields)
+
+_regionprops_types = (np.bool_, np.uint8, np.int8, np.int16, np.uint16, np.intc, np.uintc, np.int_, np.uint, np.float32, np.float64)
+
+def regionprops(labeled, intensity=None):
+    '''
+    props = regionprops(labeled, intensity=None)
+
+    Region properties, computed in a single pass over the image.
+
+    ``props`` is a structured array of size ``labeled.max() + 1``, where
+    ``props[i]`` describes the region ``labeled == i``, with the fields:
+
+    area : float
+        number of pixels
+    bbox : float array of size ``2*labeled.ndim``
+        bounding box, in the same format as ``mahotas.bbox``: ``[min0, max0,
+        min1, max1, ...]`` (the max values are exclusive)
+    centroid : float array of size ``labeled.ndim``
+    moments : float array of shape ``(4,)*labeled.ndim``
+        raw moments up to order 3: ``moments[p,q] = sum(y**p * x**q)`` (in
+        2-D) for ``p + q <= 3`` (the remaining entries are zero)
+
+    If `intensity` is given, the following fields are also present:
+
+    weighted_centroid : float array of size ``labeled.ndim``
+        centroid weighted by `intensity`
+    sum, min, max, mean, var : float
+        statistics of `intensity` over the region
+
+    For labels which do not appear in `labeled`, area is zero and the
+    centroids & intensity statistics are NaN.
+
+    Parameters
+    ----------
+    labeled : int ndarray
+        Label map. This is the same type as returned from ``mahotas.label()``
+    intensity : ndarray, optional
+        Intensity image (of the same shape as `labeled`)
+
+    Returns
+    -------
+    props : structured ndarray
+    '''
+    labeled = np.ascontiguousarray(labeled, dtype=np.intc)
+    if intensity is not None:
+        intensity = np.ascontiguousarray(intensity)
+        if intensity.shape != labeled.shape:
+            raise ValueError('mahotas.labeled.regionprops: `intensity` is not the same size as `labeled`')
+        if intensity.dtype not in _regionprops_types:
+            intensity = intensity.astype(np.float64)
+    dtype = _regionprops_dtype(labeled.ndim, intensity is not None)
+    nlabels = (max(labeled.max(), 0) + 1 if labeled.size else 1)
+    output = np.empty((nlabels, dtype.itemsize // 8), np.float64)
+    _labeled.regionprops(labeled, intensity, output)
+    return output.view(dtype).reshape(nlabels)
@@ -10,20 +10,32 @@ from .internal import _get_output, _verify_is_integer_type
 from . import _morph
 
 __all__ = [
+        'area_close',
+        'area_open',
         'close',
         'close_holes',
         'cwatershed',
         'cerode',
         'dilate',
         'erode',
+        'fill_holes',
         'get_structuring_elem',
         'hitmiss',
+        'hmax',
+        'hmin',
         'locmax',
         'locmin',
-        'majority_filter'
+        'majority_filter',
+        'max_tree',
+        'min_tree',
         'open',
+        'open_reconstruct',
+        'reconstruct_dilate',
+        'reconstruct_erode',
         'regmax',
         'regmin',
+        'tree_attribute',
+        'tree_filter',
         ]
 
 def get_structuring_elem(A,Bc):
@@ -403,6 +415,464 @@ def close_holes(ref, Bc=None):
     return _morph.close_holes(ref, Bc)
 
 
+def _reconstruct(marker, mask, Bc, out, is_erosion, fname):
+    _verify_is_integer_type(mask, fname)
+    mask = np.ascontiguousarray(mask)
+    marker = np.asanyarray(marker)
+    if marker.shape != mask.shape:
+        raise ValueError('mahotas.%s: `marker` and `mask` must have the same shape' % fname)
+    Bc = get_structuring_elem(mask, Bc)
+    out = _get_output(mask, out, fname)
+    if out is not marker:
+        out[...] = marker
+    return _morph.reconstruct(out, mask, Bc, is_erosion)
+
+
+def reconstruct_dilate(marker, mask, Bc=None, out=None):
+    '''
+    rec = reconstruct_dilate(marker, mask, Bc={3x3 cross}, out={np.empty_like(mask)})
+
+    Morphological reconstruction by dilation
+
+    `marker` is dilated (by `Bc`) under `mask` until stability. This is
+    computed with a couple of scans of the image followed by propagation with
+    a queue (Vincent, 1993), not by iterating dilations.
+
+    Parameters
+    ----------
+    marker : ndarray
+        Marker image (values larger than `mask` are replaced by those of
+        `mask`)
+    mask : ndarray
+        Mask image (of the same shape as `marker`)
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+        Output array (may be `marker`)
+
+    Returns
+    -------
+    rec : ndarray
+        Reconstruction of `marker` under `mask`
+
+    See Also
+    --------
+    reconstruct_erode : function
+        dual operation
+    '''
+    return _reconstruct(marker, mask, Bc, out, False, 'reconstruct_dilate')
+
+
+def reconstruct_erode(marker, mask, Bc=None, out=None):
+    '''
+    rec = reconstruct_erode(marker, mask, Bc={3x3 cross}, out={np.empty_like(mask)})
+
+    Morphological reconstruction by erosion
+
+    `marker` is eroded (by `Bc`) over `mask` until stability.
+
+    Parameters
+    ----------
+    marker : ndarray
+        Marker image (values smaller than `mask` are replaced by those of
+        `mask`)
+    mask : ndarray
+        Mask image (of the same shape as `marker`)
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+        Output array (may be `marker`)
+
+    Returns
+    -------
+    rec : ndarray
+        Reconstruction of `marker` over `mask`
+
+    See Also
+    --------
+    reconstruct_dilate : function
+        dual operation
+    '''
+    return _reconstruct(marker, mask, Bc, out, True, 'reconstruct_erode')
+
+
+def _shift_saturate(f, h):
+    '''f + h, saturated to the range of f.dtype'''
+    if f.dtype == np.bool_:
+        if h > 0: return np.ones_like(f)
+        if h < 0: return np.zeros_like(f)
+        return f.copy()
+    info = np.iinfo(f.dtype)
+    res = f.astype(np.int64) + int(h)
+    return np.clip(res, info.min, info.max).astype(f.dtype)
+
+
+def hmax(f, h, Bc=None, out=None):
+    '''
+    hmaxed = hmax(f, h, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    h-maxima transform
+
+    Removes the regional maxima of `f` whose height (relative to their
+    surroundings) is not larger than `h` (i.e., the reconstruction by
+    dilation of ``f - h`` under `f`).
+
+    Parameters
+    ----------
+    f : ndarray
+    h : int
+        height (must be positive)
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    hmaxed : ndarray
+
+    See Also
+    --------
+    hmin : function
+        dual operation
+    '''
+    _verify_is_integer_type(f, 'hmax')
+    if h < 0:
+        raise ValueError('mahotas.hmax: `h` must be positive')
+    f = np.ascontiguousarray(f)
+    return reconstruct_dilate(_shift_saturate(f, -h), f, Bc, out=out)
+
+
+def hmin(f, h, Bc=None, out=None):
+    '''
+    hmined = hmin(f, h, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    h-minima transform
+
+    Removes the regional minima of `f` whose depth is not larger than `h`
+    (i.e., the reconstruction by erosion of ``f + h`` over `f`).
+
+    Parameters
+    ----------
+    f : ndarray
+    h : int
+        depth (must be positive)
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    hmined : ndarray
+
+    See Also
+    --------
+    hmax : function
+        dual operation
+    '''
+    _verify_is_integer_type(f, 'hmin')
+    if h < 0:
+        raise ValueError('mahotas.hmin: `h` must be positive')
+    f = np.ascontiguousarray(f)
+    return reconstruct_erode(_shift_saturate(f, h), f, Bc, out=out)
+
+
+def fill_holes(f, Bc=None, out=None):
+    '''
+    filled = fill_holes(f, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    Fill holes (greyscale)
+
+    Fills the regional minima of `f` which are not connected to the border
+    of the image (for binary images, this is the same as ``close_holes``).
+
+    Parameters
+    ----------
+    f : ndarray
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    filled : ndarray
+
+    See Also
+    --------
+    close_holes : function
+        binary version
+    '''
+    _verify_is_integer_type(f, 'fill_holes')
+    f = np.ascontiguousarray(f)
+    marker = np.empty_like(f)
+    marker.fill(np.iinfo(f.dtype).max if f.dtype != np.bool_ else True)
+    for ax in xrange(f.ndim):
+        index = [slice(None)] * f.ndim
+        for border in (0, -1):
+            index[ax] = border
+            marker[tuple(index)] = f[tuple(index)]
+    return reconstruct_erode(marker, f, Bc, out=out)
+
+
+def open_reconstruct(f, Bc_open=None, Bc=None, out=None):
+    '''
+    opened = open_reconstruct(f, Bc_open={3x3 cross}, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    Opening by reconstruction
+
+    `f` is eroded by `Bc_open` and then reconstructed (by dilation) under
+    `f`. Unlike the plain opening, this removes the objects (or peaks) in
+    which `Bc_open` does not fit, but leaves the shape of the others
+    untouched.
+
+    Parameters
+    ----------
+    f : ndarray
+    Bc_open : ndarray, optional
+        Structuring element for the erosion. By default, use a cross.
+    Bc : ndarray, optional
+        Structuring element for the reconstruction (connectivity). By
+        default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    opened : ndarray
+
+    See Also
+    --------
+    open : function
+        Plain opening
+    '''
+    _verify_is_integer_type(f, 'open_reconstruct')
+    f = np.ascontiguousarray(f)
+    out = _get_output(f, out, 'open_reconstruct')
+    erode(f, Bc_open, out=out)
+    return reconstruct_dilate(out, f, Bc, out=out)
+
+
+def _build_tree(f, Bc, is_min, fname):
+    _verify_is_integer_type(f, fname)
+    f = np.ascontiguousarray(f)
+    Bc = get_structuring_elem(f, Bc)
+    parent = np.empty(f.shape, np.intp)
+    order = np.empty(f.size, np.intp)
+    _morph.build_tree(f, Bc, parent, order, is_min)
+    return parent, order
+
+
+def max_tree(f, Bc=None):
+    '''
+    parent,order = max_tree(f, Bc={3x3 cross})
+
+    Max-tree (component tree of the upper level sets)
+
+    The tree is represented by two arrays: ``parent.flat[p]`` is the (flat)
+    index of the parent of pixel `p` and `order` lists all the pixels from
+    the root to the leaves (each pixel comes after its parent). Each node of
+    the tree is represented by one of its pixels (the canonical pixel, which
+    is the only one whose parent has a different value); the other pixels in
+    the node point to it.
+
+    Building the tree once makes it possible to run many attribute filters
+    on the same image (see ``tree_attribute`` & ``tree_filter``).
+
+    Parameters
+    ----------
+    f : ndarray of integer type
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+
+    Returns
+    -------
+    parent : ndarray of np.intp
+        same shape as `f`
+    order : 1-D ndarray of np.intp
+
+    See Also
+    --------
+    min_tree : function
+    '''
+    return _build_tree(f, Bc, False, 'max_tree')
+
+
+def min_tree(f, Bc=None):
+    '''
+    parent,order = min_tree(f, Bc={3x3 cross})
+
+    Min-tree (component tree of the lower level sets)
+
+    See ``max_tree`` for a description of the return values.
+
+    Parameters
+    ----------
+    f : ndarray of integer type
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+
+    Returns
+    -------
+    parent : ndarray of np.intp
+    order : 1-D ndarray of np.intp
+
+    See Also
+    --------
+    max_tree : function
+    '''
+    return _build_tree(f, Bc, True, 'min_tree')
+
+
+_tree_attributes = {
+    'area' : 0,
+    'extent' : 1,
+    'height' : 2,
+}
+
+def _verify_tree(f, tree, fname):
+    parent,order = tree
+    if parent.shape != f.shape or order.size != f.size or \
+            parent.dtype != np.intp or order.dtype != np.intp:
+        raise ValueError('mahotas.%s: `tree` does not match the image' % fname)
+    return np.ascontiguousarray(parent), np.ascontiguousarray(order)
+
+
+def tree_attribute(f, tree, attribute='area'):
+    '''
+    attr = tree_attribute(f, tree, attribute='area')
+
+    Computes an attribute of every node of a component tree
+
+    Parameters
+    ----------
+    f : ndarray
+        The image used to build `tree`
+    tree : (parent, order)
+        As returned by ``max_tree`` or ``min_tree``
+    attribute : str, optional
+        One of:
+
+        'area'
+            number of pixels in the node (and its descendants)
+        'extent'
+            largest side of the bounding box of the node
+        'height'
+            difference between the most extreme value in the node and the
+            level of its parent node
+
+    Returns
+    -------
+    attr : ndarray of np.intp
+        ``attr[p]`` is the attribute of the node which contains pixel `p` (at
+        the level of `p`)
+    '''
+    if attribute not in _tree_attributes:
+        raise ValueError('mahotas.tree_attribute: unknown attribute `%s`' % attribute)
+    _verify_is_integer_type(f, 'tree_attribute')
+    f = np.ascontiguousarray(f)
+    parent,order = _verify_tree(f, tree, 'tree_attribute')
+    attr = np.empty(f.shape, np.intp)
+    return _morph.tree_attribute(f, parent, order, _tree_attributes[attribute], attr)
+
+
+def tree_filter(f, tree, attr, threshold, out=None):
+    '''
+    filtered = tree_filter(f, tree, attr, threshold, out={np.empty_like(f)})
+
+    Attribute filter on a component tree
+
+    Removes the nodes whose attribute is smaller than `threshold` (their
+    pixels take the level of the closest ancestor which is kept). With a
+    max-tree, this is an attribute opening and, with a min-tree, an attribute
+    closing. This takes linear time, so the same tree & attributes can be
+    reused for many thresholds.
+
+    Parameters
+    ----------
+    f : ndarray
+        The image used to build `tree`
+    tree : (parent, order)
+        As returned by ``max_tree`` or ``min_tree``
+    attr : ndarray
+        As returned by ``tree_attribute``
+    threshold : int
+    out : ndarray, optional
+        Output array (must not be `f`)
+
+    Returns
+    -------
+    filtered : ndarray
+    '''
+    _verify_is_integer_type(f, 'tree_filter')
+    f = np.ascontiguousarray(f)
+    parent,order = _verify_tree(f, tree, 'tree_filter')
+    attr = np.ascontiguousarray(attr, np.intp)
+    if attr.shape != f.shape:
+        raise ValueError('mahotas.tree_filter: `attr` does not match the image')
+    out = _get_output(f, out, 'tree_filter')
+    if out is f:
+        f = f.copy()
+    return _morph.tree_filter(f, parent, order, attr, int(threshold), out)
+
+
+def area_open(f, area, Bc=None, out=None):
+    '''
+    opened = area_open(f, area, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    Area opening
+
+    Removes the bright structures (connected components of the upper level
+    sets) with fewer than `area` pixels.
+
+    Parameters
+    ----------
+    f : ndarray of integer type
+    area : int
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    opened : ndarray
+
+    See Also
+    --------
+    max_tree : function
+        to run the opening at several areas, build the tree once and use
+        ``tree_attribute`` & ``tree_filter``
+    '''
+    tree = max_tree(f, Bc)
+    return tree_filter(f, tree, tree_attribute(f, tree, 'area'), area, out=out)
+
+
+def area_close(f, area, Bc=None, out=None):
+    '''
+    closed = area_close(f, area, Bc={3x3 cross}, out={np.empty_like(f)})
+
+    Area closing
+
+    Fills the dark structures (connected components of the lower level sets)
+    with fewer than `area` pixels.
+
+    Parameters
+    ----------
+    f : ndarray of integer type
+    area : int
+    Bc : ndarray, optional
+        Structuring element (connectivity). By default, use a cross.
+    out : ndarray, optional
+
+    Returns
+    -------
+    closed : ndarray
+
+    See Also
+    --------
+    min_tree : function
+    '''
+    tree = min_tree(f, Bc)
+    return tree_filter(f, tree, tree_attribute(f, tree, 'area'), area, out=out)
+
+
 def majority_filter(img, N=3, out=None, output=None):
     '''
     filtered = majority_filter(img, N=3, out={np.empty(img.shape, np.bool)})
@@ -529,6 +999,7 @@ def regmin(f, Bc=None, out=None, output=None):
         Local minima
     '''
     _verify_is_integer_type(f, 'regmin')
+    f = np.ascontiguousarray(f)
     Bc = get_structuring_elem(f, Bc)
     Bc = _remove_centre(Bc.copy())
     output = _get_output(f, out, 'regmin', np.bool_, output=output)
@@ -560,6 +1031,7 @@ def regmax(f, Bc=None, out=None, output=None):
         Local maxima
     '''
     _verify_is_integer_type(f, 'regmax')
+    f = np.ascontiguousarray(f)
     Bc = get_structuring_elem(f, Bc)
     Bc = _remove_centre(Bc.copy())
     output = _get_output(f, out, 'regmax', np.bool_, output=output)
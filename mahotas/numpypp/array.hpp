@@ -568,6 +568,8 @@ inline
 bool are_arrays(PyArrayObject* a, PyArrayObject* b) { return PyArray_Check(a) && PyArray_Check(b); }
 inline
 bool are_arrays(PyArrayObject* a, PyArrayObject* b, PyArrayObject* c) { return PyArray_Check(a) && PyArray_Check(b) && PyArray_Check(c); }
+inline
+bool are_arrays(PyArrayObject* a, PyArrayObject* b, PyArrayObject* c, PyArrayObject* d) { return are_arrays(a, b, c) && PyArray_Check(d); }
 
 
 inline
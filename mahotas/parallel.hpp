@@ -0,0 +1,120 @@
+#ifndef MAHOTAS_PARALLEL_HPP_INCLUDE_GUARD_LPC_
+#define MAHOTAS_PARALLEL_HPP_INCLUDE_GUARD_LPC_
+// Part of mahotas. See LICENSE file for License
+// Copyright 2012 Luis Pedro Coelho <luis@luispedro.org>
+
+// Access to the shared thread pool
+//
+// The pool itself lives in the mahotas._parallel module so that there is a
+// single pool for the whole process (its size is set with
+// mahotas.set_num_threads). The other modules get a table of function
+// pointers to it when they are initialised (see DECLARE_MODULE in utils.hpp).
+// If this fails for any reason, everything runs in the calling thread.
+//
+// Usage:
+//
+//     struct worker {
+//         void operator()(const npy_intp start, const npy_intp end) {
+//             // process [start, end)
+//         }
+//     };
+//     worker w;
+//     parallel_for(N, w, grain);
+//
+// This calls w(start, end) on disjoint ranges covering [0, N), possibly from
+// several threads at once. `grain` is the size of the pieces in which the
+// work is handed out (some ranges may be shorter). The same object is used by
+// all threads, so anything that is written to must be local to operator().
+// It must not call any Python function (the GIL is normally released by the
+// caller). It may throw a PythonException, which is re-thrown in the calling
+// thread (once all the other threads have stopped). std::bad_alloc becomes a
+// MemoryError and any other exception a RuntimeError.
+
+#include <exception>
+#include <new>
+#include "utils.hpp"
+
+extern "C" {
+    #include <Python.h>
+    #include <numpy/ndarrayobject.h>
+}
+
+typedef int (*parallel_task)(void* closure, npy_intp start, npy_intp end, PyObject** error_type, const char** error_message);
+
+const int parallel_api_version = 1;
+
+struct parallel_api {
+    int version;
+    int (*num_threads)();
+    int (*run)(npy_intp n, npy_intp grain, parallel_task task, void* closure, PyObject** error_type, const char** error_message);
+};
+
+inline const parallel_api*& parallel_api_ptr() {
+    static const parallel_api* api = 0;
+    return api;
+}
+
+inline void import_parallel() {
+    PyObject* module = PyImport_ImportModule("mahotas._parallel");
+    if (!module) {
+        PyErr_Clear();
+        return;
+    }
+    PyObject* capsule = PyObject_CallMethod(module, const_cast<char*>("_api"), NULL);
+    Py_DECREF(module);
+    if (!capsule) {
+        PyErr_Clear();
+        return;
+    }
+    const parallel_api* api = static_cast<const parallel_api*>(PyCapsule_GetPointer(capsule, "mahotas._parallel._api"));
+    if (!api) PyErr_Clear();
+    else if (api->version == parallel_api_version) parallel_api_ptr() = api;
+    Py_DECREF(capsule);
+}
+
+#ifndef MAHOTAS_PARALLEL_IMPLEMENTATION
+#undef MAHOTAS_MODULE_INIT_HOOK
+#define MAHOTAS_MODULE_INIT_HOOK() import_parallel()
+#endif
+
+namespace parallel_detail {
+
+template <typename F>
+int call(void* closure, npy_intp start, npy_intp end, PyObject** error_type, const char** error_message) {
+    try {
+        (*static_cast<F*>(closure))(start, end);
+        return 0;
+    } catch (const PythonException& pe) {
+        *error_type = pe.type();
+        *error_message = pe.message();
+    } catch (const std::bad_alloc&) {
+        *error_type = PyExc_MemoryError;
+        *error_message = "Out of memory";
+    } catch (const std::exception&) {
+        *error_type = PyExc_RuntimeError;
+        *error_message = "mahotas: unexpected C++ exception (this is a bug in mahotas)";
+    } catch (...) {
+        *error_type = PyExc_RuntimeError;
+        *error_message = "mahotas: unexpected exception (this is a bug in mahotas)";
+    }
+    return 1;
+}
+
+}
+
+template <typename F>
+void parallel_for(const npy_intp n, F& f, const npy_intp grain = 1) {
+    if (n <= 0) return;
+    const parallel_api* api = parallel_api_ptr();
+    PyObject* error_type = 0;
+    const char* error_message = 0;
+    int failed;
+    if (!api || n <= grain || api->num_threads() <= 1) {
+        failed = parallel_detail::call<F>(&f, 0, n, &error_type, &error_message);
+    } else {
+        failed = api->run(n, grain, parallel_detail::call<F>, &f, &error_type, &error_message);
+    }
+    if (failed) throw PythonException(error_type, error_message);
+}
+
+#endif // MAHOTAS_PARALLEL_HPP_INCLUDE_GUARD_LPC_
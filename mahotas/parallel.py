@@ -0,0 +1,55 @@
+# Copyright (C) 2012, Luis Pedro Coelho <luis@luispedro.org>
+# vim: set ts=4 sts=4 sw=4 expandtab smartindent:
+# 
+# License: MIT (see COPYING file)
+
+from __future__ import division
+from . import _parallel
+
+__all__ = [
+    'get_num_threads',
+    'set_num_threads',
+    ]
+
+def set_num_threads(nr_threads):
+    '''
+    set_num_threads(nr_threads)
+
+    Set the number of threads used by mahotas functions
+
+    All mahotas functions which run in parallel share the same pool of
+    threads. By default, its size is the number of processors (or the value
+    of the ``MAHOTAS_NUM_THREADS`` environment variable, if it is set).
+
+    Setting ``nr_threads`` to 1 makes all functions run in the calling
+    thread.
+
+    Parameters
+    ----------
+    nr_threads : int
+        Number of threads (including the calling thread)
+
+    See Also
+    --------
+    get_num_threads
+    '''
+    nr_threads = int(nr_threads)
+    if nr_threads < 1:
+        raise ValueError('mahotas.set_num_threads: `nr_threads` must be at least 1 (got %s)' % nr_threads)
+    _parallel.set_num_threads(nr_threads)
+
+def get_num_threads():
+    '''
+    nr_threads = get_num_threads()
+
+    Returns
+    -------
+    nr_threads : int
+        Number of threads used by mahotas functions (on platforms without
+        support for threads, this is always 1)
+
+    See Also
+    --------
+    set_num_threads
+    '''
+    return _parallel.get_num_threads()
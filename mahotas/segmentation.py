@@ -1,5 +1,5 @@
 # -*- coding: utf-8 -*-
-# Copyright (C) 2008-2011 Luis Pedro Coelho <luis@luispedro.org>
+# Copyright (C) 2008-2012 Luis Pedro Coelho <luis@luispedro.org>
 # vim: set ts=4 sts=4 sw=4 expandtab smartindent:
 # Carnegie Mellon University
 # 
@@ -13,9 +13,10 @@ __all__ = [
     'gvoronoi',
     ]
 
-def gvoronoi(labeled):
+def gvoronoi(labeled, sampling=None, return_distances=False):
     '''
-    segmented = gvoronoi(labeled)
+    segmented = gvoronoi(labeled, sampling=None, return_distances=False)
+    segmented,dmap = gvoronoi(labeled, sampling=None, return_distances=True)
 
     Generalised Voronoi Transform.
 
@@ -27,16 +28,29 @@ def gvoronoi(labeled):
     labeled : ndarray
         a labeled array, of a form similar to one returned by
         ``mahotas.label()``
+    sampling : float or sequence of floats, optional
+        spacing between elements along each axis (see ``mahotas.distance``)
+    return_distances : bool, optional
+        whether to also return the (euclidean) distance to the nearest object
+        (default: False)
 
     Returns
     -------
     segmented : is of the same size and type as labeled and
                 `segmented[y,x]` is the label of the object at position `y,x`.
+    dmap : ndarray of float32
+        distance from each pixel to the nearest object (only returned if
+        `return_distances`). In this case, the distances are computed in
+        single precision, so that ties between objects which are far away
+        from a pixel may be broken arbitrarily.
     '''
-    labeled = np.ascontiguousarray(labeled)
-    bw = (labeled == 0)
-    f = np.zeros(bw.shape, np.double)
-    f[bw] = len(f.shape)*max(f.shape)**2+1
-    orig = np.arange(f.size, dtype=np.intc).reshape(f.shape)
-    _distance.dt(f, orig)
-    return labeled.flat[orig]
+    from .distance import _get_sampling
+    labeled = np.asanyarray(labeled)
+    sampling = _get_sampling(labeled, sampling, 'gvoronoi')
+    segmented = np.empty(labeled.shape, labeled.dtype)
+    if return_distances:
+        dmap = np.empty(labeled.shape, np.float32)
+        _distance.gvoronoi(labeled, segmented, dmap, sampling)
+        np.sqrt(dmap, dmap)
+        return segmented, dmap
+    return _distance.gvoronoi(labeled, segmented, None, sampling)
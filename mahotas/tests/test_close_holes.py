@@ -11,3 +11,25 @@ def test_close_holes_simple():
     img[12,12] = True
     assert np.all( mahotas.close_holes(holed) == img)
     assert sys.getrefcount(holed) == 2
+
+def test_close_holes_3d():
+    from scipy import ndimage
+    np.random.seed(132)
+    for i in range(4):
+        img = np.random.random_sample((24,20,16)) > .3
+        assert np.all(mahotas.close_holes(img) == ndimage.binary_fill_holes(img))
+
+def test_close_holes_bc():
+    img = np.zeros((16,16), bool)
+    img[4:12,4:12] = True
+    img[6:10,6:10] = False
+    # diagonal gap in the wall: a hole for the cross, not for the full box
+    img[4,4] = False
+    img[5,5] = False
+    img[6,6] = False
+    closed4 = mahotas.close_holes(img)
+    closed8 = mahotas.close_holes(img, np.ones((3,3), bool))
+    assert np.all(closed4[6:10,6:10])
+    assert closed4[5,5]
+    assert not closed4[4,4]
+    assert not np.any(closed8[6:10,6:10])
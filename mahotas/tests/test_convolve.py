@@ -13,6 +13,37 @@ def test_compare_w_ndimage():
     for mode in mahotas._filters.modes:
         assert np.all(mahotas.convolve(A, B, mode=mode) == ndimage.convolve(A, B, mode=mode))
 
+def test_compare_w_ndimage_3d():
+    from scipy import ndimage
+    np.random.seed(22)
+    A = np.random.randint(0, 8, size=(12,16,37)).astype(np.float64)
+    B = np.random.randint(-2, 3, size=(3,5,3)).astype(np.float64)
+    for mode in mahotas._filters.modes:
+        assert np.all(mahotas.convolve(A, B, mode=mode) == ndimage.correlate(A, B, mode=mode))
+
+def test_convolve_fft():
+    from scipy import ndimage
+    np.random.seed(23)
+    for A,B in [
+                (np.random.random((64,70)), np.random.random((21,25))-.5),
+                (np.random.random((1000,)), np.random.random((301,))),
+                (np.random.random((20,22,18)).astype(np.float32), np.random.random((11,9,11)).astype(np.float32)),
+                ]:
+        assert mahotas.convolve._use_fft(A, B, B.size)
+        for mode in mahotas._filters.modes:
+            assert np.allclose(mahotas.convolve(A, B, mode=mode), ndimage.correlate(A, B, mode=mode), atol=1e-4)
+
+def test_fft_size():
+    from mahotas.convolve import _fft_size
+    for n in range(1, 300):
+        s = _fft_size(n)
+        assert s >= n
+        for p in (2,3,5):
+            while s % p == 0:
+                s //= p
+        assert s == 1
+    assert _fft_size(1025) == 1080
+
 def test_22():
     A = np.arange(1024).reshape((32,32))
     B = np.array([
@@ -46,6 +77,30 @@ def test_convolve1d():
         g = convolve1d(f, n, axis)
         assert g.shape == f.shape
 
+def test_convolve1d_compare_convolve():
+    np.random.seed(123)
+    f = np.random.random((12,17,9))
+    for w in ([.25,.5,.25], [-1.,0.,1.], [1.,2.,0.,3.], [2.]):
+        w = np.array(w)
+        for axis in (0,1,2,-1):
+            index = [None] * f.ndim
+            index[axis] = slice(0, None)
+            for mode in mahotas._filters.modes:
+                g = convolve1d(f, w, axis, mode=mode)
+                expected = mahotas.convolve(f, w[tuple(index)], mode=mode)
+                assert np.allclose(g, expected)
+
+def test_convolve1d_out():
+    f = np.arange(64*4).reshape((16,-1)).astype(float)
+    out = np.empty_like(f)
+    g = convolve1d(f, [1.,2.,1.], 1, out=out)
+    assert g is out
+    assert np.allclose(out, mahotas.convolve(f, np.array([[1.,2.,1.]])))
+
+@raises(ValueError)
+def test_convolve1d_axis():
+    convolve1d(np.zeros((4,4)), [1.,2.,1.], 2)
+
 @raises(ValueError)
 def test_convolve1d_2d():
     f = np.arange(64*4).reshape((16,-1))
@@ -68,6 +123,19 @@ def test_gaussian_filter():
         n = ndimage.gaussian_filter(f, s)
         assert np.max(np.abs(n - g)) < 1.e-5
 
+def test_gaussian_filter_out():
+    from scipy import ndimage
+    np.random.seed(12)
+    for shape in ((64,), (32,48), (8,12,10)):
+        f = np.random.random(shape)
+        out = np.empty_like(f)
+        g = gaussian_filter(f, 2., out=out)
+        assert g is out
+        assert np.allclose(g, ndimage.gaussian_filter(f, 2.))
+        g1 = mahotas.gaussian_filter1d(f, 2., axis=0, out=out)
+        assert g1 is out
+        assert np.allclose(g1, ndimage.gaussian_filter1d(f, 2., axis=0))
+
 def test_gaussian_order():
     im = np.arange(64*64).reshape((64,64))
     for order in (1,2,3):
@@ -84,6 +152,35 @@ def test_gaussian_order_high():
     yield gaussian_order, -1
     yield gaussian_order, 1.5
 
+def test_gaussian_recursive():
+    np.random.seed(23)
+    y,x = np.mgrid[:80,:120]
+    f = 100*np.sin(x/17.)*np.cos(y/11.) + np.random.random((80,120))
+    for sigma in (2., 5., 12.):
+        for order in (0,1,2,3):
+            for mode in ('reflect', 'nearest', 'wrap', 'mirror', 'constant'):
+                fir = mahotas.gaussian_filter1d(f, sigma, axis=1, order=order, mode=mode)
+                iir = mahotas.gaussian_filter1d(f, sigma, axis=1, order=order, mode=mode, method='recursive')
+                assert np.abs(fir - iir).max() < .03*np.abs(fir).max()
+
+def test_gaussian_recursive_nd():
+    np.random.seed(24)
+    f = np.random.random((40,30,20))
+    fir = mahotas.gaussian_filter(f, [3., 4., 2.], order=[0,1,0])
+    out = np.empty_like(f)
+    iir = mahotas.gaussian_filter(f, [3., 4., 2.], order=[0,1,0], out=out, method='recursive')
+    assert iir is out
+    assert np.abs(fir - iir).max() < .03*np.abs(fir).max()
+
+    f32 = f.astype(np.float32)
+    iir32 = mahotas.gaussian_filter(f32, 3., method='recursive')
+    assert iir32.dtype == np.float32
+    assert np.allclose(iir32, mahotas.gaussian_filter(f, 3., method='recursive'), atol=1e-5)
+
+@raises(ValueError)
+def test_gaussian_bad_method():
+    mahotas.gaussian_filter(np.zeros((8,8)), 2., method='fft')
+
 def test_haar():
     image = luispedro_jpg()
     image = image[:256,:256]
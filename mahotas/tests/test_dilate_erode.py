@@ -76,3 +76,89 @@ def test_dilate_slice():
     for i in range(16):
         f = (np.random.random_sample((256,256))*255).astype(np.uint8)
         assert np.all(mahotas.dilate(f[:3,:3]) == mahotas.dilate(f[:3,:3].copy()))
+
+def _slow_grey(f, B, dilation):
+    # Reference implementation of the generic code (nearest border
+    # convention, saturating arithmetic) for unsigned types
+    r,c = f.shape
+    h0,h1 = B.shape[0]//2, B.shape[1]//2
+    maxval = np.iinfo(f.dtype).max
+    res = np.zeros_like(f) if dilation else np.zeros_like(f) + maxval
+    for dy,dx in zip(*np.where(B)):
+        ys = np.clip(np.arange(r) + dy - h0, 0, r - 1)
+        xs = np.clip(np.arange(c) + dx - h1, 0, c - 1)
+        b = int(B[dy,dx])
+        if dilation:
+            v = np.where(f > 0, np.minimum(f.astype(np.int64) + b, maxval), 0)
+            np.maximum.at(res, (ys[:,None], xs[None,:]), v.astype(f.dtype))
+        else:
+            v = np.maximum(f[ys][:,xs].astype(np.int64) - b, 0)
+            res = np.minimum(res, v.astype(f.dtype))
+    return res
+
+def test_box():
+    np.random.seed(36)
+    for dtype in (np.uint8, np.uint16):
+        f = (np.random.random_sample((24,30))*255).astype(dtype)
+        f[f < 20] = 0
+        f[3,4] = 254
+        for shape in [(5,5), (7,9), (4,6), (1,11), (11,1), (31,3), (24,30), (40,50)]:
+            for value in (1,2):
+                B = value*np.ones(shape, dtype)
+                assert np.all(mahotas.erode(f,B) == _slow_grey(f, B, False))
+                assert np.all(mahotas.dilate(f,B) == _slow_grey(f, B, True))
+        # box not containing the centre
+        B = np.zeros((9,9), dtype)
+        B[5:,6:] = 2
+        assert np.all(mahotas.erode(f,B) == _slow_grey(f, B, False))
+        assert np.all(mahotas.dilate(f,B) == _slow_grey(f, B, True))
+
+    f = np.random.random_sample((24,30)) > .3
+    for shape in [(5,5), (7,9), (4,6), (1,11), (31,3), (40,50)]:
+        B = np.ones(shape, bool)
+        assert np.all(mahotas.erode(f,B) == _slow_binary(f, B, False))
+        assert np.all(mahotas.dilate(~f,B) == _slow_binary(~f, B, True))
+
+def test_box_separable():
+    np.random.seed(37)
+    f = np.random.random_sample((64,80)) > .3
+    B = np.ones((5,5), bool)
+    B0 = np.ones((5,1), bool)
+    B1 = np.ones((1,5), bool)
+    assert np.all(mahotas.erode(f, B) == mahotas.erode(mahotas.erode(f, B0), B1))
+    assert np.all(mahotas.dilate(~f, B) == mahotas.dilate(mahotas.dilate(~f, B0), B1))
+
+    f = (np.random.random_sample((64,80))*1000).astype(np.int16)
+    B = np.zeros((5,5), np.int16)
+    B0 = np.zeros((5,1), np.int16)
+    B1 = np.zeros((1,5), np.int16)
+    assert np.all(mahotas.erode(f, B) == mahotas.erode(mahotas.erode(f, B0), B1))
+
+def _slow_binary(A, Bc, dilation):
+    # Reference implementation (nearest border convention)
+    r,c = A.shape
+    h0,h1 = Bc.shape[0]//2, Bc.shape[1]//2
+    res = np.zeros_like(A) if dilation else np.ones_like(A)
+    for dy,dx in zip(*np.where(Bc)):
+        ys = np.clip(np.arange(r) + dy - h0, 0, r - 1)
+        xs = np.clip(np.arange(c) + dx - h1, 0, c - 1)
+        if dilation:
+            for y in range(r):
+                for x in range(c):
+                    if A[y,x]:
+                        res[ys[y],xs[x]] = True
+        else:
+            res &= A[ys][:,xs]
+    return res
+
+def test_binary_against_slow():
+    np.random.seed(42)
+    for i in range(6):
+        A = np.random.random_sample((23,151)) > .4
+        if i % 2:
+            Bc = np.random.random_sample((5,4)) > .5
+            Bc[0,0] = True
+        else:
+            Bc = np.ones((3,7), bool)
+        assert np.all(mahotas.erode(A, Bc) == _slow_binary(A, Bc, False))
+        assert np.all(mahotas.dilate(A, Bc) == _slow_binary(A, Bc, True))
@@ -27,3 +27,22 @@ def test_distance():
 
     bw[200:210, 200:210] = 0
     yield compare_slow, bw
+
+def test_3d():
+    from scipy import ndimage
+    np.random.seed(41)
+    bw = np.random.random((12,20,16)) > .05
+    assert np.allclose(distance(bw, 'euclidean'), ndimage.distance_transform_edt(bw))
+
+def test_sampling():
+    from scipy import ndimage
+    np.random.seed(42)
+    for shape,sampling in (((40,30), (2.,.5)), ((8,20,16), (3.,1.,1.)), ((64,), 2.5)):
+        bw = np.random.random(shape) > .1
+        expected = ndimage.distance_transform_edt(bw, sampling=sampling)
+        assert np.allclose(distance(bw, 'euclidean', sampling=sampling), expected)
+
+def test_sampling_scalar():
+    bw = np.ones((16,16), bool)
+    bw[3,4] = 0
+    assert np.allclose(distance(bw, sampling=2.), 4*distance(bw))
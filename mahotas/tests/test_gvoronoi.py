@@ -27,3 +27,64 @@ def test_gvoronoi():
     Y,X = np.where(regions == 1)
     assert np.all(Y+X < 128)
 
+
+def test_gvoronoi_3d():
+    from scipy import ndimage
+    np.random.seed(2323)
+    labeled = np.zeros((12,16,20), np.intc)
+    for p in range(10):
+        labeled[tuple(np.random.randint(s) for s in labeled.shape)] = p+1
+    I = ndimage.distance_transform_edt(labeled == 0, return_distances=False, return_indices=True)
+    D = ndimage.distance_transform_edt(labeled == 0)
+    mh = gvoronoi(labeled)
+    # ties may be broken differently: check that the assigned seed is a nearest one
+    Z,Y,X = np.indices(labeled.shape)
+    for p in range(1, 11):
+        z,y,x = [c[0] for c in np.where(labeled == p)]
+        region = (mh == p)
+        dist = np.sqrt((Z-z)**2 + (Y-y)**2 + (X-x)**2)
+        assert np.allclose(dist[region], D[region])
+
+def test_return_distances():
+    from scipy import ndimage
+    np.random.seed(2324)
+    labeled = np.zeros((64,48), np.intc)
+    for p in range(12):
+        labeled[np.random.randint(64), np.random.randint(48)] = p+1
+    regions,dmap = gvoronoi(labeled, return_distances=True)
+    assert dmap.dtype == np.float32
+    assert np.all(regions == gvoronoi(labeled))
+    assert np.allclose(dmap, ndimage.distance_transform_edt(labeled == 0), atol=1e-4)
+
+def test_gvoronoi_sampling():
+    labeled = np.zeros((32,32), np.uint8)
+    labeled[0,16] = 1
+    labeled[16,0] = 2
+    regions,dmap = gvoronoi(labeled, sampling=[1., 3.], return_distances=True)
+    # moving along the 2nd axis is more expensive: (4,6) is closer to the
+    # 1st object in pixels, but not in physical units
+    assert gvoronoi(labeled)[4,6] == 1
+    assert regions[4,6] == 2
+    assert regions[4,12] == 1
+    assert np.abs(dmap[0,0] - 16.) < 1e-4
+    assert np.abs(dmap[0,12] - 12.) < 1e-4
+
+def test_gvoronoi_non_contiguous():
+    labeled = np.zeros((40,30), float)
+    labeled[3,4] = 1
+    labeled[30,20] = 2.5
+    assert np.all(gvoronoi(labeled.T) == gvoronoi(labeled.T.copy()))
+    assert gvoronoi(labeled.T).dtype == labeled.dtype
+
+def test_gvoronoi_far_ties():
+    # At (0,x), the squared distances to the two objects are x**2 and
+    # x**2 + 1, which are the same in single precision for large x
+    labeled = np.zeros((2,6000), np.intc)
+    labeled[0,0] = 1
+    labeled[1,0] = 2
+    regions = gvoronoi(labeled)
+    assert np.all(regions[0] == 1)
+    assert np.all(regions[1] == 2)
+
+def test_gvoronoi_0d():
+    assert gvoronoi(np.array(3)) == 3
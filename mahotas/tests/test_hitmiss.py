@@ -3,18 +3,21 @@ import numpy as np
 
 
 def slow_hitmiss(A, Bc):
-    res = np.zeros_like(A)
-    for y in range(1,A.shape[0]-1):
-        for x in range(1,A.shape[1]-1):
-            value = 1
-            for dy in (-1,0,1):
-                for dx in (-1,0,1):
-                    ny = y + dy
-                    nx = x + dx
-                    if Bc[dy+1, dx + 1] != 2 and Bc[dy+1, dx+1] != A[ny, nx]:
-                        value = 0
-            res[y,x] = value
-    return res
+    # Reference implementation (the previous, byte-wise, code): positions
+    # where Bc does not fit are 0. For even-sized templates, this includes the
+    # last row, but not the last column.
+    r,c = A.shape
+    h0,h1 = Bc.shape[0]//2, Bc.shape[1]//2
+    res = np.zeros(A.shape, bool)
+    y0,y1 = h0, r - h0
+    x0,x1 = h1, c - Bc.shape[1] + h1 + 1
+    if y1 <= y0 or x1 <= x0 or c <= 2*h1:
+        return res.astype(A.dtype)
+    match = np.ones((y1-y0, x1-x0), bool)
+    for dy,dx in zip(*np.where(Bc != 2)):
+        match &= (A[y0-h0+dy:y1-h0+dy, x0-h1+dx:x1-h1+dx] == Bc[dy,dx])
+    res[y0:y1,x0:x1] = match
+    return res.astype(A.dtype)
 
 def test_hitmiss():
     A = np.zeros((100,100), np.bool_)
@@ -54,3 +57,27 @@ def test_hitmiss_types():
     Bc = np.array([[1, 1, 2],[1,1,2],[0,0,0]], dtype=np.int64)
     assert np.sum(mahotas.morph.hitmiss(f,Bc))
 
+
+
+def test_hitmiss_widths():
+    np.random.seed(223)
+    for w in (1, 2, 3, 63, 64, 65, 127, 130):
+        A = np.random.rand(21, w) > .4
+        for shape in [(3,3), (4,4), (2,5), (5,2), (1,3)]:
+            Bc = np.random.randint(0, 3, size=shape)
+            assert np.all(mahotas.morph.hitmiss(A,Bc) == slow_hitmiss(A, Bc))
+            A8 = np.random.randint(0, 3, size=A.shape).astype(np.uint8)
+            assert np.all(mahotas.morph.hitmiss(A8,Bc) == slow_hitmiss(A8, Bc))
+
+
+def test_hitmiss_noncontiguous():
+    np.random.seed(224)
+    A = np.random.rand(60, 150) > .3
+    Bc = np.array([
+        [0,1,2],
+        [0,1,1],
+        [2,1,1]])
+    for V in (A[::2], A[:,::3], A[3:-4,1:-2], A.T, A[::-1,::-1]):
+        assert not V.flags.c_contiguous
+        assert np.all(mahotas.morph.hitmiss(V,Bc) == slow_hitmiss(V, Bc))
+        assert np.all(mahotas.morph.hitmiss(V.view(np.uint8),Bc) == slow_hitmiss(V.view(np.uint8), Bc))
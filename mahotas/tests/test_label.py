@@ -27,3 +27,62 @@ def test_random():
     labeled,nr = label(A)
     assert len(set(labeled.ravel())) == (nr+1)
     assert labeled.max() == nr
+
+def _same_partition(a, b):
+    pairs = set(zip(a.ravel(), b.ravel()))
+    return len(pairs) == len(set(a.ravel())) == len(set(b.ravel()))
+
+def test_compare_ndimage():
+    from scipy import ndimage
+    np.random.seed(34)
+    for shape, Bc in [
+                ((64,64), None),
+                ((64,64), np.ones((3,3))),
+                ((16,20,24), None),
+                ((16,20,24), np.ones((3,3,3))),
+                ((200,), np.ones(3)),
+            ]:
+        A = np.random.rand(*shape) > .6
+        labeled, nr = label(A, Bc)
+        expected, nr_expected = ndimage.label(A, Bc)
+        assert nr == nr_expected
+        assert _same_partition(labeled, expected)
+
+def test_first_appearance_order():
+    np.random.seed(35)
+    A = np.random.rand(64,64) > .5
+    labeled, nr = label(A, np.ones((3,3)))
+    values = labeled.ravel()
+    values = values[values > 0]
+    _, first = np.unique(values, return_index=True)
+    assert np.all(np.diff(first) > 0)
+
+def test_asymmetric_Bc():
+    A = np.zeros((8,8), bool)
+    A[2,2] = 1
+    A[3,3] = 1
+    # only the (1,1) offset: the two pixels are still connected
+    Bc = np.zeros((3,3), bool)
+    Bc[2,2] = 1
+    Bc[1,1] = 1
+    labeled, nr = label(A, Bc)
+    assert nr == 1
+    assert labeled[2,2] == labeled[3,3] == 1
+
+def test_large_strips():
+    # large enough to be cut into several strips (which are then merged)
+    from scipy import ndimage
+    np.random.seed(36)
+    for shape in ((1200,700), (70,80,90)):
+        A = np.random.rand(*shape) > .45
+        for Bc in (None, np.ones((3,)*len(shape))):
+            labeled, nr = label(A, Bc)
+            expected, nr_expected = ndimage.label(A, Bc)
+            assert nr == nr_expected
+            assert _same_partition(labeled, expected)
+    # a single object spanning all the strips
+    A = np.zeros((2000,300), bool)
+    A[:,3] = 1
+    A[5,:] = 1
+    labeled, nr = label(A)
+    assert nr == 1
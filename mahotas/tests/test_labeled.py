@@ -1,5 +1,6 @@
 import numpy as np
 import mahotas.labeled
+from nose.tools import raises
 def test_border():
     labeled = np.zeros((32,32), np.uint8)
     labeled[8:11] = 1
@@ -119,3 +120,137 @@ def test_remove_bordering():
         assert np.all(removed[:,0] == 0)
         assert np.all(removed[:,-1] == 0)
 
+
+def test_regionprops():
+    np.random.seed(335)
+    f = np.random.random_sample((64,128))
+    labeled = np.zeros(f.shape, dtype=np.intc)
+    labeled += (8 * np.random.random_sample(labeled.shape)).astype(np.intc)
+    labeled[labeled == 5] = 0
+    props = mahotas.labeled.regionprops(labeled, f)
+    assert len(props) == labeled.max() + 1
+    assert np.allclose(props['sum'], mahotas.labeled.labeled_sum(f, labeled))
+    assert np.all(props['area'] == mahotas.labeled.labeled_size(labeled))
+    assert props['area'][5] == 0
+    assert np.isnan(props['mean'][5])
+    y,x = np.mgrid[:64,:128]
+    for i in (0,1,7):
+        region = (labeled == i)
+        assert np.any(region)
+        assert np.allclose(props['min'][i], f[region].min())
+        assert np.allclose(props['max'][i], f[region].max())
+        assert np.allclose(props['mean'][i], f[region].mean())
+        assert np.allclose(props['var'][i], f[region].var())
+        assert np.allclose(props['centroid'][i], mahotas.center_of_mass(region))
+        assert np.allclose(props['weighted_centroid'][i], mahotas.center_of_mass(f*region))
+        assert np.all(props['bbox'][i] == mahotas.bbox(region))
+        for p in range(4):
+            for q in range(4-p):
+                assert np.allclose(props['moments'][i][p,q], np.sum((y**p * x**q)[region]))
+        assert props['moments'][i][2,2] == 0
+
+def test_regionprops_no_intensity():
+    labeled = np.zeros((6,8,10), np.intc)
+    labeled[1:3,2:5,4:9] = 1
+    labeled[4,4,4] = 3
+    props = mahotas.labeled.regionprops(labeled)
+    assert 'mean' not in props.dtype.names
+    assert props['moments'].shape == (4,4,4,4)
+    assert props['area'][1] == 2*3*5
+    assert np.all(props['bbox'][1] == [1,3,2,5,4,9])
+    assert np.allclose(props['centroid'][1], [1.5,3,6])
+    assert np.all(props['bbox'][3] == [4,5,4,5,4,5])
+    assert props['moments'][3][1,1,1] == 64
+    assert props['area'][2] == 0
+
+def test_remove_bordering_rsize():
+    labeled = np.zeros((16,16), np.intc)
+    labeled[0,4] = 1
+    labeled[2:4,8:10] = 2
+    labeled[6:9,6:9] = 3
+    labeled[14,2] = 4
+    removed = mahotas.labeled.remove_bordering(labeled, 3)
+    assert set(removed.ravel()) == set([0,3])
+    assert np.all(removed[labeled == 3] == 3)
+    removed = mahotas.labeled.remove_bordering(labeled.astype(np.uint8))
+    assert removed.dtype == np.uint8
+    assert set(removed.ravel()) == set([0,2,3,4])
+    mahotas.labeled.remove_bordering(labeled, out=labeled)
+    assert set(labeled.ravel()) == set([0,2,3,4])
+
+def test_remove_bordering_generic():
+    labeled = np.zeros((16,16), np.intc)
+    labeled[0,4] = -1
+    labeled[6:9,6:9] = 3
+    labeled[10,10] = -2
+    labeled[14,2] = 4
+    labeled[15,15] = 5
+    removed = mahotas.labeled.remove_bordering(labeled)
+    assert set(removed.ravel()) == set([0,3,4,-2])
+    assert np.all(removed[labeled == 3] == 3)
+
+    removed = mahotas.labeled.remove_bordering(labeled.astype(np.float64))
+    assert removed.dtype == np.float64
+    assert set(removed.ravel()) == set([0.,3.,4.,-2.])
+
+    big = np.zeros((16,16), np.uint64)
+    big[0,4] = 2**63 + 1
+    big[6:9,6:9] = 3
+    removed = mahotas.labeled.remove_bordering(big)
+    assert set(removed.ravel()) == set([0,3])
+
+def test_relabel():
+    labeled = np.zeros((8,8), np.intc)
+    labeled[1,1] = 7
+    labeled[3,3] = 3
+    labeled[5,5] = 12
+    relabeled, nr = mahotas.labeled.relabel(labeled)
+    assert nr == 3
+    assert relabeled[3,3] == 1
+    assert relabeled[1,1] == 2
+    assert relabeled[5,5] == 3
+    assert labeled[5,5] == 12
+    relabeled, nr = mahotas.labeled.relabel(labeled, inplace=True)
+    assert relabeled is labeled
+    assert labeled.max() == 3
+
+def test_filter_labels():
+    np.random.seed(336)
+    labeled,nr = mahotas.label(np.random.random_sample((128,64)) > .6)
+    sizes = mahotas.labeled.labeled_size(labeled)
+    filtered, nr_filtered = mahotas.labeled.filter_labels(labeled, min_size=3, max_size=20)
+    expected = [i for i in range(1, nr+1) if 3 <= sizes[i] <= 20]
+    assert nr_filtered == len(expected)
+    assert filtered.max() == nr_filtered
+    for new,old in enumerate(expected):
+        assert np.all((filtered == (new+1)) == (labeled == old))
+
+    filtered, nr_filtered = mahotas.labeled.filter_labels(labeled, keep=[2,5,nr+10])
+    assert nr_filtered == 2
+    assert np.all((filtered == 2) == (labeled == 5))
+
+    filtered, nr_filtered = mahotas.labeled.filter_labels(labeled, remove_bordering=True)
+    bordering = mahotas.labeled.remove_bordering(labeled)
+    assert np.all((filtered > 0) == (bordering > 0))
+    assert nr_filtered == len(set(bordering.ravel())) - 1
+
+    for keep in ([], ()):
+        filtered, nr_filtered = mahotas.labeled.filter_labels(labeled, keep=keep)
+        assert nr_filtered == 0
+        assert not np.any(filtered)
+
+def test_relabel_types():
+    labeled = np.zeros((8,8), np.intc)
+    labeled[1,1] = 7
+    labeled[5,5] = 12
+    for dtype in (np.longlong, np.ulonglong, np.uint64):
+        relabeled, nr = mahotas.labeled.relabel(labeled.astype(dtype))
+        assert relabeled.dtype == dtype
+        assert nr == 2
+        assert relabeled[5,5] == 2
+
+@raises(ValueError)
+def test_relabel_too_large():
+    labeled = np.zeros((8,8), np.uint64)
+    labeled[1,1] = 2**63 + 1
+    mahotas.labeled.relabel(labeled)
@@ -31,3 +31,14 @@ def test_uint8():
     f = np.arange(64*4).reshape((16,-1))
     median_filter(f.astype(np.uint8), np.ones((5,5)))
 
+
+def test_histogram_rank_filter():
+    # uint8 & uint16 images with rectangular windows use sliding histograms
+    np.random.seed(23)
+    A = np.random.random_integers(0, 255, (40,70))
+    Bc = np.ones((7,5))
+    for mode in ('reflect', 'nearest', 'wrap', 'mirror'):
+        for r in (0, 3, 17, 34):
+            expected = rank_filter(A.astype(np.int32), Bc, r, mode=mode)
+            assert np.all(rank_filter(A.astype(np.uint8), Bc, r, mode=mode) == expected)
+            assert np.all(rank_filter(A.astype(np.uint16)*200, Bc, r, mode=mode) == expected*200)
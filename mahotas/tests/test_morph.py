@@ -89,3 +89,187 @@ def test_dilate_crash():
     small = large[128:256,128:256]
     dilate(small)
 
+
+def slow_reconstruct_dilate(marker, mask, Bc=None):
+    from scipy import ndimage
+    if Bc is None:
+        Bc = ndimage.generate_binary_structure(mask.ndim, 1)
+    marker = np.minimum(marker, mask)
+    while True:
+        next = np.minimum(ndimage.grey_dilation(marker, footprint=Bc.astype(bool)), mask)
+        if np.all(next == marker):
+            return marker
+        marker = next
+
+def test_reconstruct_dilate():
+    from mahotas.morph import reconstruct_dilate
+    np.random.seed(124)
+    for Bc in (None, np.ones((3,3), np.uint8)):
+        for i in range(4):
+            mask = (np.random.random_sample((48,64))*64).astype(np.uint8)
+            marker = mask.copy()
+            marker[np.random.random_sample(mask.shape) > .01] = 0
+            assert np.all(reconstruct_dilate(marker, mask, Bc) == slow_reconstruct_dilate(marker, mask, Bc))
+
+def test_reconstruct_erode():
+    from mahotas.morph import reconstruct_erode, reconstruct_dilate
+    np.random.seed(125)
+    mask = (np.random.random_sample((32,32,8))*64).astype(np.int32)
+    marker = mask + (np.random.random_sample(mask.shape)*8).astype(np.int32)
+    # duality
+    assert np.all(reconstruct_erode(marker, mask) == -reconstruct_dilate(-marker, -mask))
+
+def test_reconstruct_binary():
+    from mahotas.morph import reconstruct_dilate
+    mask = np.zeros((32,32), bool)
+    mask[4:10,4:10] = True
+    mask[20:30,20:30] = True
+    marker = np.zeros_like(mask)
+    marker[6,6] = True
+    rec = reconstruct_dilate(marker, mask)
+    assert np.all(rec[4:10,4:10])
+    assert not np.any(rec[20:30,20:30])
+
+def test_hmax_hmin():
+    from mahotas.morph import hmax, hmin
+    f = np.zeros((32,32), np.uint8)
+    f[4:8,4:8] = 3
+    f[20:24,20:24] = 10
+    h = hmax(f, 4)
+    assert not np.any(h[4:8,4:8])
+    assert np.all(h[20:24,20:24] == 6)
+    assert np.all(hmax(f, 0) == f)
+    g = 20 - f
+    h = hmin(g, 4)
+    assert np.all(h[4:8,4:8] == 20)
+    assert np.all(h[20:24,20:24] == 14)
+
+def test_fill_holes():
+    from scipy import ndimage
+    from mahotas.morph import fill_holes
+    f = np.zeros((32,32), np.uint8)
+    f[4:16,4:16] = 10
+    f[8:12,8:12] = 2
+    f[20:24,0:4] = 5
+    filled = fill_holes(f)
+    assert np.all(filled[4:16,4:16] == 10)
+    assert np.all(filled[20:24,0:4] == 5)
+    assert np.all(filled[20:,4:] == 0)
+
+    np.random.seed(126)
+    A = np.random.random_sample((32,32)) > .4
+    assert np.all(fill_holes(A) == ndimage.binary_fill_holes(A))
+
+def test_open_reconstruct():
+    from mahotas.morph import open_reconstruct, open, erode
+    f = np.zeros((32,32), bool)
+    f[4:12,4:12] = True
+    f[7,12:16] = True
+    f[20,20] = True
+    opened = open_reconstruct(f, np.ones((3,3), bool))
+    assert np.all(opened[4:12,4:12])
+    assert np.all(opened[7,12:16])
+    assert not opened[20,20]
+    assert np.all(opened[f == 0] == 0)
+    # unlike the plain opening, the thin line is kept
+    assert not np.any(open(f, np.ones((3,3), bool))[7,13:16])
+
+    np.random.seed(127)
+    g = (np.random.random_sample((32,32))*32).astype(np.uint8)
+    opened = open_reconstruct(g)
+    assert np.all(opened <= g)
+    assert np.all(opened == slow_reconstruct_dilate(erode(g), g))
+
+def slow_area_open(f, area, Bc=None):
+    from scipy import ndimage
+    if Bc is None:
+        Bc = ndimage.generate_binary_structure(f.ndim, 1)
+    res = np.zeros_like(f)
+    res[...] = f.min()
+    for t in np.unique(f):
+        labeled,n = ndimage.label(f >= t, Bc)
+        sizes = ndimage.sum(np.ones_like(labeled), labeled, np.arange(n+1))
+        keep = (sizes >= area)[labeled]
+        keep[labeled == 0] = False
+        res[keep] = t
+    return res
+
+def test_area_open():
+    from mahotas.morph import area_open
+    np.random.seed(128)
+    for i in range(4):
+        f = (np.random.random_sample((32,24))*8).astype(np.uint8)
+        for area in (1, 3, 8, 40):
+            assert np.all(area_open(f, area) == slow_area_open(f, area))
+
+def test_area_close():
+    from mahotas.morph import area_close, area_open
+    np.random.seed(129)
+    f = (np.random.random_sample((16,16,8))*64).astype(np.int32)
+    for area in (1, 4, 16):
+        assert np.all(area_close(f, area) == -area_open(-f, area))
+
+def test_tree_reuse():
+    from mahotas.morph import max_tree, tree_attribute, tree_filter, area_open
+    np.random.seed(130)
+    f = (np.random.random_sample((32,32))*255).astype(np.uint8)
+    tree = max_tree(f)
+    parent,order = tree
+    assert parent.shape == f.shape
+    assert np.all(np.sort(order) == np.arange(f.size))
+    area = tree_attribute(f, tree, 'area')
+    assert area.max() == f.size
+    for t in (2, 5, 20):
+        assert np.all(tree_filter(f, tree, area, t) == area_open(f, t))
+
+def test_tree_attributes():
+    from mahotas.morph import max_tree, tree_attribute, tree_filter
+    f = np.zeros((16,16), np.uint8)
+    f[2:4,2:12] = 4
+    f[8,8] = 9
+    tree = max_tree(f)
+    area = tree_attribute(f, tree, 'area')
+    extent = tree_attribute(f, tree, 'extent')
+    height = tree_attribute(f, tree, 'height')
+    assert area[2,2] == 20
+    assert extent[2,2] == 10
+    assert height[2,2] == 4
+    assert area[8,8] == 1
+    assert height[8,8] == 9
+    assert area[0,0] == f.size
+    filtered = tree_filter(f, tree, extent, 5)
+    assert np.all(filtered[2:4,2:12] == 4)
+    assert filtered[8,8] == 0
+    filtered = tree_filter(f, tree, height, 5)
+    assert np.all(filtered[2:4,2:12] == 0)
+    assert filtered[8,8] == 9
+
+@raises(ValueError)
+def test_tree_attribute_bad():
+    from mahotas.morph import max_tree, tree_attribute
+    f = np.zeros((16,16), np.uint8)
+    tree_attribute(f, max_tree(f), 'perimeter')
+
+def test_regmax_plateaus():
+    from mahotas.morph import regmax, regmin
+    f = np.zeros((64,64), np.uint8)
+    f[8:40,8:40] = 5
+    # the plateau touches a higher pixel in its last row only
+    f[40,39] = 6
+    f[50:52,50:52] = 3
+    reg = regmax(f)
+    assert not np.any(reg[8:40,8:40])
+    assert reg[40,39]
+    assert np.all(reg[50:52,50:52])
+    assert reg.sum() == 5
+    reg = regmin(f)
+    assert not np.any(reg[8:40,8:40])
+    assert not np.any(reg[50:52,50:52])
+    assert reg[0,0]
+
+def test_regmax_non_contiguous():
+    from mahotas.morph import regmax
+    np.random.seed(131)
+    f = (np.random.random_sample((32,48))*8).astype(np.uint8)
+    assert np.all(regmax(f.T) == regmax(f.T.copy()))
+    assert np.all(regmax(f[::2]) == regmax(f[::2].copy()))
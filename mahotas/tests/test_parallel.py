@@ -0,0 +1,64 @@
+import numpy as np
+import mahotas
+from nose.tools import raises
+
+def test_set_get():
+    n = mahotas.get_num_threads()
+    try:
+        mahotas.set_num_threads(3)
+        assert mahotas.get_num_threads() in (1, 3)
+        mahotas.set_num_threads(1)
+        assert mahotas.get_num_threads() == 1
+    finally:
+        mahotas.set_num_threads(n)
+
+@raises(ValueError)
+def test_set_zero():
+    mahotas.set_num_threads(0)
+
+def test_same_result():
+    np.random.seed(123)
+    f = np.random.randint(0, 255, size=(512,256)).astype(np.uint8)
+    w = np.random.random_sample((5,5))
+    Bc = np.ones((3,3), np.uint8)
+    n = mahotas.get_num_threads()
+    try:
+        mahotas.set_num_threads(1)
+        convolved = mahotas.convolve(f.astype(float), w)
+        eroded = mahotas.erode(f, Bc)
+        median = mahotas.median_filter(f)
+        mahotas.set_num_threads(4)
+        assert np.all(convolved == mahotas.convolve(f.astype(float), w))
+        assert np.all(eroded == mahotas.erode(f, Bc))
+        assert np.all(median == mahotas.median_filter(f))
+    finally:
+        mahotas.set_num_threads(n)
+
+def test_same_result_distance():
+    np.random.seed(124)
+    bw = np.random.random_sample((300,200)) > .01
+    labeled,_ = mahotas.label(~bw)
+    n = mahotas.get_num_threads()
+    try:
+        mahotas.set_num_threads(1)
+        dmap = mahotas.distance(bw)
+        voronoi = mahotas.segmentation.gvoronoi(labeled)
+        mahotas.set_num_threads(4)
+        assert np.all(dmap == mahotas.distance(bw))
+        assert np.all(voronoi == mahotas.segmentation.gvoronoi(labeled))
+    finally:
+        mahotas.set_num_threads(n)
+
+def test_same_result_surf():
+    from mahotas.features import surf
+    np.random.seed(125)
+    f = np.random.random_sample((256,256))
+    f = mahotas.gaussian_filter(f, 4.)
+    n = mahotas.get_num_threads()
+    try:
+        mahotas.set_num_threads(1)
+        spoints = surf.surf(f)
+        mahotas.set_num_threads(4)
+        assert np.all(spoints == surf.surf(f))
+    finally:
+        mahotas.set_num_threads(n)
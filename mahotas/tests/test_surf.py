@@ -65,6 +65,148 @@ def test_interest_points_descriptors():
         assert np.all(descs[:len(spoints)] == spoints)
 
 
+def test_descriptors_orientation():
+    # On a ramp, the gradient is the same everywhere: the orientation must be
+    # its direction and the descriptor must not depend on it
+    Y,X = np.indices((256,256))
+    points = np.array([
+                [128, 128, 2., 1., 1.],
+                [100, 140, 3.5, 1., -1.]])
+    descs = []
+    for t in np.linspace(-3, 3, 13):
+        f = 100 + np.cos(t)*Y + np.sin(t)*X
+        spoints = surf.descriptors(f, points)
+        assert len(spoints) == 2
+        assert np.all(np.abs(np.angle(np.exp(1j*(spoints[:,5] - t + np.pi)))) < 1e-6)
+        descs.append(spoints[:,6:])
+    for d in descs:
+        assert np.allclose(d, descs[0])
+
+
+def test_upright():
+    np.random.seed(22)
+    f = np.random.rand(256,256)*230
+    f = f.astype(np.uint8)
+    full = surf.surf(f, 6, 24, 1)
+    upright = surf.surf(f, 6, 24, 1, upright=True)
+    assert full.shape == upright.shape
+    assert np.all(full[:,:5] == upright[:,:5])
+    assert np.all(upright[:,5] == 0)
+    assert np.allclose(np.sum(upright[:,6:]**2, 1), 1.)
+
+    points = upright[:,:5]
+    assert np.all(surf.descriptors(f, points, upright=True) == upright)
+
+def test_upright_ramp():
+    # On this ramp, the orientation is 0, so both descriptors are the same
+    Y,X = np.indices((256,256))
+    f = 100 - Y + 1e-3*X
+    points = np.array([[128, 128, 2., 1., 1.]])
+    full = surf.descriptors(f, points)
+    upright = surf.descriptors(f, points, upright=True)
+    assert np.abs(full[0,5]) < 1e-2
+    assert np.allclose(full[:,6:], upright[:,6:], atol=1e-3)
+
+
+def test_stream_pyramid():
+    np.random.seed(22)
+    f = np.random.rand(256,256)*230
+    f = f.astype(np.uint8)
+    for nr_scales in (3, 4, 6, 8):
+        full = surf.interest_points(f, 4, nr_scales, 1)
+        streamed = surf.interest_points(f, 4, nr_scales, 1, stream_pyramid=True)
+        assert np.all(full == streamed)
+    assert np.all(surf.surf(f, 6, 24, 1) == surf.surf(f, 6, 24, 1, stream_pyramid=True))
+
+def test_pyramid_float32():
+    np.random.seed(22)
+    f = np.random.rand(256,256)*230
+    f = f.astype(np.uint8)
+    full = surf.interest_points(f, 4, 6, 1)
+    single = surf.interest_points(f, 4, 6, 1, pyramid_dtype=np.float32)
+    streamed = surf.interest_points(f, 4, 6, 1, pyramid_dtype=np.float32, stream_pyramid=True)
+    assert np.all(single == streamed)
+    full = set(map(tuple, full[:,:3]))
+    single = set(map(tuple, single[:,:3]))
+    assert len(full & single) > .9 * len(full)
+
+@raises(ValueError)
+def test_pyramid_dtype():
+    f = np.random.rand(64,64)*230
+    surf.interest_points(f, pyramid_dtype=np.int32)
+
+
+def _brute_force_distances(d0, d1):
+    return np.sqrt(((d0[:,None,:] - d1[None,:,:])**2).sum(2))
+
+def test_match():
+    np.random.seed(3)
+    d0 = np.random.rand(50, 64)
+    d1 = np.random.rand(300, 64)
+    dists = _brute_force_distances(d0, d1)
+    matches, distances = surf.match(d0, d1, ratio=None, return_distances=True)
+    assert np.all(matches == dists.argmin(1))
+    dists.sort(1)
+    assert np.allclose(distances, dists[:,:2], atol=1e-4)
+
+    matches = surf.match(d0, d1, ratio=.95)
+    assert np.all(matches[dists[:,0] < .94*dists[:,1]] >= 0)
+    assert np.all(matches[dists[:,0] > .96*dists[:,1]] == -1)
+
+def test_match_kdtree():
+    np.random.seed(4)
+    d0 = np.random.rand(50, 64)
+    d1 = np.random.rand(1000, 64)
+    exact = surf.match(d0, d1, ratio=None)
+    approx = surf.match(d0, d1, ratio=None, method='kdtree', max_checks=1000)
+    assert np.mean(exact == approx) > .9
+    assert np.all(approx == surf.match(d0, d1, ratio=None, method='kdtree', max_checks=1000))
+    assert np.all(surf.match(d0[:10], d0, method='kdtree') == np.arange(10))
+
+def test_match_laplacian():
+    np.random.seed(22)
+    f = np.random.rand(256,256)*230
+    f = f.astype(np.uint8)
+    spoints = surf.surf(f, 6, 24, 1)
+    assert np.all(surf.match(spoints, spoints) == np.arange(len(spoints)))
+
+    other = spoints.copy()
+    other[:,6:] += np.random.rand(len(spoints), 64)*.1
+    for method in ('exact', 'kdtree'):
+        matches = surf.match(spoints, other, ratio=None, method=method)
+        assert np.all(spoints[:,4] == other[matches,4])
+    unfiltered = surf.match(spoints, other, ratio=None, use_laplacian=False)
+    assert np.all(unfiltered == surf.match(spoints[:,6:], other[:,6:], ratio=None))
+
+def test_match_single_neighbour():
+    np.random.seed(5)
+    points0 = np.random.rand(6, 6 + 64)
+    points1 = np.random.rand(4, 6 + 64)
+    points0[:,4] = 1
+    points1[:,4] = -1
+    points1[0,4] = 1
+    # Only one point of points1 has a positive Laplacian
+    for method in ('exact', 'kdtree'):
+        assert np.all(surf.match(points0, points1, method=method) == -1)
+        assert np.all(surf.match(points0, points1, ratio=None, method=method) == 0)
+        assert np.all(surf.match(points0, points1[:1], use_laplacian=False, method=method) == -1)
+
+@raises(ValueError)
+def test_match_method():
+    d = np.random.rand(8, 64)
+    surf.match(d, d, method='lsh')
+
+def test_match_exact_ignores_kdtree_args():
+    np.random.seed(6)
+    d = np.random.rand(8, 64)
+    assert np.all(surf.match(d, d, max_checks=0, nr_trees=0) == np.arange(8))
+
+@raises(ValueError)
+def test_match_kdtree_max_checks():
+    d = np.random.rand(8, 64)
+    surf.match(d, d, method='kdtree', max_checks=0)
+
+
 def test_show_surf():
     np.random.seed(22)
     f = np.random.rand(256,256)*230
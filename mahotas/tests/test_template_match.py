@@ -14,3 +14,14 @@ def test_template_match():
         y = np.random.randint(m.shape[0]-4)
         x = np.random.randint(m.shape[1]-4)
         assert np.allclose(m[y+2,x+2], np.sum( (A[y:y+4, x:x+4] - t) ** 2))
+
+def test_template_match_fft():
+    # Large templates are matched with an FFT
+    np.random.seed(34)
+    A = 255*np.random.random((96, 80))
+    t = 255*np.random.random((31, 27))
+    assert mahotas.convolve._use_fft(A, t, t.size)
+    for mode in ('reflect', 'nearest', 'wrap', 'mirror', 'constant'):
+        m = template_match(A, t, mode=mode)
+        direct = mahotas._convolve.template_match(A, t, np.empty_like(A), mahotas._filters.mode2int[mode])
+        assert np.allclose(m, direct)
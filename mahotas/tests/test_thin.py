@@ -6,7 +6,7 @@ def slow_thin(binimg):
     This was the old implementation
     """
     from mahotas.bbox import bbox
-    from mahotas._morph import hitmiss
+    from mahotas.tests.test_hitmiss import slow_hitmiss
 
     _struct_elems = []
     _struct_elems.append([
@@ -49,13 +49,12 @@ def slow_thin(binimg):
     r,c = (max0-min0,max1-min1)
 
     image_exp = np.zeros((r+2, c+2), np.uint8)
-    imagebuf = np.zeros((r+2,c+2), np.uint8)
     prev = np.zeros((r+2,c+2), np.uint8)
     image_exp[1:r+1, 1:c+1] = binimg[min0:max0,min1:max1]
     while True:
         prev[:] = image_exp[:]
         for elem in _struct_elems:
-            newimg = hitmiss(image_exp, elem, imagebuf)
+            newimg = slow_hitmiss(image_exp, elem)
             image_exp -= newimg
         if np.all(prev == image_exp):
             break
@@ -85,3 +84,17 @@ def test_compare():
     A[60:80,60:80] = 1
     yield compare, A
 
+
+def test_compare_widths():
+    np.random.seed(45)
+    # the thinned image is padded by one pixel on each side
+    for w in (61, 62, 63, 64, 126, 127):
+        A = np.random.random_sample((30, w)) > .3
+        assert np.all(mahotas.thin(A) == slow_thin(A))
+
+def test_compare_noncontiguous():
+    np.random.seed(46)
+    A = np.random.random_sample((80, 150)) > .3
+    for V in (A[::2], A[:,::3], A[5:-7,2:-1], A.T):
+        assert not V.flags.c_contiguous
+        assert np.all(mahotas.thin(V) == slow_thin(V))
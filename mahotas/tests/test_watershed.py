@@ -56,3 +56,17 @@ def test_mix_types():
     a,b = mahotas.cwatershed(f, markers, return_lines=1)
 
 
+
+
+def test_buckets_same_as_heap():
+    # uint8 & uint16 surfaces use a bucket queue, int32 surfaces a heap
+    np.random.seed(77)
+    f = np.random.randint(0, 12, size=(64,80))
+    markers = np.zeros(f.shape, int)
+    for i in range(1,9):
+        markers[np.random.randint(64), np.random.randint(80)] = i
+    W,WL = mahotas.cwatershed(f.astype(np.int32), markers.astype(np.int32), return_lines=True)
+    for dtype in (np.uint8, np.uint16):
+        W2,WL2 = mahotas.cwatershed(f.astype(dtype), markers.astype(dtype), return_lines=True)
+        assert np.all(W == W2)
+        assert np.all(WL == WL2)
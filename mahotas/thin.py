@@ -32,9 +32,7 @@ def thin(binimg):
 
     image_exp = np.zeros((r+2, c+2), bool)
     image_exp[1:r+1, 1:c+1] = binimg[min0:max0,min1:max1]
-    imagebuf = np.empty((r+2,c+2), bool)
-
-    _thin(image_exp, imagebuf)
+    _thin(image_exp)
     res[min0:max0,min1:max1] = image_exp[1:r+1, 1:c+1]
     return res
 
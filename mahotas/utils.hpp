@@ -1,3 +1,5 @@
+#ifndef MAHOTAS_UTILS_HPP_INCLUDE_GUARD_LPC_
+#define MAHOTAS_UTILS_HPP_INCLUDE_GUARD_LPC_
 // Part of mahotas. See LICENSE file for License
 // Copyright 2008-2012 Luis Pedro Coelho <luis@luispedro.org>
 
@@ -57,11 +59,17 @@ struct PythonException {
 };
 
 
+// Modules which need extra initialisation redefine this (see parallel.hpp)
+#ifndef MAHOTAS_MODULE_INIT_HOOK
+#define MAHOTAS_MODULE_INIT_HOOK()
+#endif
+
 #if PY_MAJOR_VERSION < 3
 #define DECLARE_MODULE(name) \
 extern "C" \
 void init##name () { \
     import_array(); \
+    MAHOTAS_MODULE_INIT_HOOK(); \
     (void)Py_InitModule(#name, methods); \
 }
 
@@ -84,10 +92,11 @@ namespace { \
 PyMODINIT_FUNC \
 PyInit_##name () { \
     import_array(); \
+    MAHOTAS_MODULE_INIT_HOOK(); \
     return PyModule_Create(&moduledef); \
 }
 
 
 #endif
 
-
+#endif // MAHOTAS_UTILS_HPP_INCLUDE_GUARD_LPC_
@@ -51,15 +51,17 @@ extensions = {
     'mahotas._bbox': ['mahotas/_bbox.cpp'],
     'mahotas._center_of_mass': ['mahotas/_center_of_mass.cpp'],
     'mahotas._convex': ['mahotas/_convex.cpp'],
-    'mahotas._convolve': ['mahotas/_convolve.cpp', 'mahotas/_filters.cpp'],
+    'mahotas._convolve': ['mahotas/_convolve.cpp', 'mahotas/_filters.cpp', 'mahotas/_fft.cpp'],
     'mahotas._distance': ['mahotas/_distance.cpp'],
     'mahotas._histogram': ['mahotas/_histogram.cpp'],
     'mahotas._interpolate': ['mahotas/_interpolate.cpp', 'mahotas/_filters.cpp'],
     'mahotas._labeled': ['mahotas/_labeled.cpp', 'mahotas/_filters.cpp'],
-    'mahotas._morph': ['mahotas/_morph.cpp', 'mahotas/_filters.cpp'],
-    'mahotas._thin': ['mahotas/_thin.cpp'],
+    'mahotas._morph': ['mahotas/_morph.cpp', 'mahotas/_filters.cpp', 'mahotas/_bitpacked.cpp'],
+    'mahotas._parallel': ['mahotas/_parallel.cpp'],
+    'mahotas._thin': ['mahotas/_thin.cpp', 'mahotas/_bitpacked.cpp'],
 
     'mahotas.features._lbp': ['mahotas/features/_lbp.cpp'],
+    'mahotas.features._match': ['mahotas/features/_match.cpp'],
     'mahotas.features._surf': ['mahotas/features/_surf.cpp'],
     'mahotas.features._texture': ['mahotas/features/_texture.cpp', 'mahotas/_filters.cpp'],
     'mahotas.features._zernike': ['mahotas/features/_zernike.cpp'],